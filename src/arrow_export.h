@@ -0,0 +1,383 @@
+#ifndef ARROW_EXPORT_H
+#define ARROW_EXPORT_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h> // snprintf
+#include <stdlib.h> // atof, strtoll
+#include <any>
+#include <memory>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include "asts_interface.h"
+#include "generic_engine.h"
+
+//----- Arrow C data interface (https://arrow.apache.org/docs/format/CDataInterface.html) -----------------
+// ABI-stable structures, defined here so that export does not depend on Arrow libraries
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+  void (*release)(struct ArrowSchema*);
+  void* private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+  void (*release)(struct ArrowArray*);
+  void* private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream {
+  int (*get_schema)(struct ArrowArrayStream*, struct ArrowSchema* out);
+  int (*get_next)(struct ArrowArrayStream*, struct ArrowArray* out);
+  const char* (*get_last_error)(struct ArrowArrayStream*);
+  void (*release)(struct ArrowArrayStream*);
+  void* private_data;
+};
+
+#endif // ARROW_C_STREAM_INTERFACE
+
+namespace ad::asts {
+
+// exports query cursor as Arrow stream of record batches, one batch per cursor fetch of batch_rows rows
+//
+// column types: ftInteger -> int64, ftFixed/ftFloatPoint -> float64, ftDate -> date32, ftTime -> time32[s],
+// everything else -> utf8
+class ArrowExport {
+  //----- schema -----------------
+
+  struct SchemaData {
+    std::string format;
+    std::string name;
+    std::vector<ArrowSchema> children;
+    std::vector<ArrowSchema*> child_ptrs;
+  };
+
+  static void ReleaseSchema(ArrowSchema* schema) {
+    SchemaData* data = (SchemaData*)schema->private_data;
+    for(auto& child : data->children)
+      if(child.release)
+        child.release(&child);
+    delete data;
+    schema->release = nullptr;
+  }
+
+  static void InitSchema(ArrowSchema* schema, SchemaData* data, int64_t flags) {
+    schema->format = data->format.c_str();
+    schema->name = data->name.c_str();
+    schema->metadata = nullptr;
+    schema->flags = flags;
+    schema->n_children = data->children.size();
+    schema->children = data->child_ptrs.empty() ? nullptr : data->child_ptrs.data();
+    schema->dictionary = nullptr;
+    schema->release = ReleaseSchema;
+    schema->private_data = data;
+  }
+
+  static const char* FormatOf(AstsFieldType type) {
+    switch(type) {
+      case AstsFieldType::kInteger:    return "l";
+      case AstsFieldType::kFixed:
+      case AstsFieldType::kFloatPoint: return "g";
+      case AstsFieldType::kDate:       return "tdD";
+      case AstsFieldType::kTime:       return "tts";
+      default:                         return "u";
+    }
+  }
+
+  static void ExportSchema(const std::vector<SqlOutField>& fields, ArrowSchema* out) {
+    SchemaData* data = new SchemaData();
+    data->format = "+s";
+    data->children.resize(fields.size());
+    for(size_t i=0; i<fields.size(); ++i) {
+      SchemaData* child = new SchemaData();
+      child->format = FormatOf(fields[i].type);
+      child->name = fields[i].name;
+      InitSchema(&data->children[i], child, ARROW_FLAG_NULLABLE);
+      data->child_ptrs.push_back(&data->children[i]);
+    }
+    InitSchema(out, data, 0);
+  }
+
+  //----- arrays -----------------
+
+  struct ArrayData {
+    std::vector<uint8_t> validity;
+    std::vector<uint8_t> values;   // fixed-width values or utf8 offsets
+    std::vector<uint8_t> text;     // utf8 data
+    std::vector<const void*> buffers;
+    std::vector<ArrowArray> children;
+    std::vector<ArrowArray*> child_ptrs;
+  };
+
+  static void ReleaseArray(ArrowArray* array) {
+    ArrayData* data = (ArrayData*)array->private_data;
+    for(auto& child : data->children)
+      if(child.release)
+        child.release(&child);
+    delete data;
+    array->release = nullptr;
+  }
+
+  static void InitArray(ArrowArray* array, ArrayData* data, int64_t length, int64_t null_count) {
+    array->length = length;
+    array->null_count = null_count;
+    array->offset = 0;
+    array->n_buffers = data->buffers.size();
+    array->n_children = data->children.size();
+    array->buffers = data->buffers.data();
+    array->children = data->child_ptrs.empty() ? nullptr : data->child_ptrs.data();
+    array->dictionary = nullptr;
+    array->release = ReleaseArray;
+    array->private_data = data;
+  }
+
+  // days since 1970-01-01 of proleptic Gregorian date
+  static int32_t DaysFromCivil(int y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = (unsigned)(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int32_t)doe - 719468;
+  }
+
+  // digits of YYYYMMDD / HHMMSS text, false if there are not exactly n of them
+  static bool Digits(const std::string& s, int* out, size_t n) {
+    size_t k = 0;
+    for(char c : s) {
+      if(c >= '0' && c <= '9') {
+        if(k == n)
+          return false;
+        out[k++] = c - '0';
+      }
+      else if(c != ':' && c != '-' && c != ' ')
+        return false;
+    }
+    return k == n;
+  }
+
+  static bool ToDate(const std::any& v, int32_t& days) {
+    int d[8];
+    if(v.type() != typeid(std::string) || !Digits(std::any_cast<const std::string&>(v), d, 8))
+      return false;
+    int year = d[0]*1000 + d[1]*100 + d[2]*10 + d[3], month = d[4]*10 + d[5], day = d[6]*10 + d[7];
+    if(month < 1 || month > 12 || day < 1 || day > 31)
+      return false;
+    days = DaysFromCivil(year, month, day);
+    return true;
+  }
+
+  static bool ToTime(const std::any& v, int32_t& seconds) {
+    int d[6];
+    if(v.type() != typeid(std::string) || !Digits(std::any_cast<const std::string&>(v), d, 6))
+      return false;
+    seconds = (d[0]*10 + d[1]) * 3600 + (d[2]*10 + d[3]) * 60 + d[4]*10 + d[5];
+    return true;
+  }
+
+  // values are converted by their actual type: type of expression columns may be refined after the schema is exported
+  static bool ToInt64(const std::any& v, int64_t& out) {
+    if(v.type() == typeid(int64_t))
+      out = std::any_cast<int64_t>(v);
+    else if(v.type() == typeid(double))
+      out = (int64_t)std::any_cast<double>(v);
+    else if(v.type() == typeid(std::string))
+      out = strtoll(std::any_cast<const std::string&>(v).c_str(), nullptr, 10);
+    else
+      return false;
+    return true;
+  }
+
+  static bool ToDouble(const std::any& v, double& out) {
+    if(v.type() == typeid(double))
+      out = std::any_cast<double>(v);
+    else if(v.type() == typeid(int64_t))
+      out = (double)std::any_cast<int64_t>(v);
+    else if(v.type() == typeid(std::string))
+      out = atof(std::any_cast<const std::string&>(v).c_str());
+    else
+      return false;
+    return true;
+  }
+
+  static bool ToText(const std::any& v, std::string& out) {
+    if(v.type() == typeid(std::string))
+      out = std::any_cast<const std::string&>(v);
+    else if(v.type() == typeid(int64_t))
+      out = std::to_string(std::any_cast<int64_t>(v));
+    else if(v.type() == typeid(double)) {
+      char tmp[32];
+      snprintf(tmp, sizeof(tmp), "%.15g", std::any_cast<double>(v));
+      out = tmp;
+    }
+    else
+      return false;
+    return true;
+  }
+
+  template<typename T, typename F>
+  static void FillFixed(ArrayData* data, const std::vector<std::vector<std::any> >& rows, size_t column, int64_t& nulls, F convert) {
+    data->values.resize(rows.size() * sizeof(T));
+    T* values = (T*)data->values.data();
+    for(size_t r=0; r<rows.size(); ++r) {
+      T value = 0;
+      if(convert(rows[r][column], value))
+        data->validity[r / 8] |= 1 << (r % 8);
+      else
+        ++nulls;
+      values[r] = value;
+    }
+  }
+
+  static void ExportColumn(AstsFieldType type, const std::vector<std::vector<std::any> >& rows, size_t column, ArrowArray* out) {
+    ArrayData* data = new ArrayData();
+    int64_t nulls = 0;
+    data->validity.assign((rows.size() + 7) / 8, 0);
+    switch(type) {
+      case AstsFieldType::kInteger:
+        FillFixed<int64_t>(data, rows, column, nulls, ToInt64);
+        break;
+      case AstsFieldType::kFixed:
+      case AstsFieldType::kFloatPoint:
+        FillFixed<double>(data, rows, column, nulls, ToDouble);
+        break;
+      case AstsFieldType::kDate:
+        FillFixed<int32_t>(data, rows, column, nulls, ToDate);
+        break;
+      case AstsFieldType::kTime:
+        FillFixed<int32_t>(data, rows, column, nulls, ToTime);
+        break;
+      default: {
+        data->values.resize((rows.size() + 1) * sizeof(int32_t));
+        int32_t* offsets = (int32_t*)data->values.data();
+        std::string text;
+        offsets[0] = 0;
+        for(size_t r=0; r<rows.size(); ++r) {
+          if(ToText(rows[r][column], text)) {
+            data->validity[r / 8] |= 1 << (r % 8);
+            data->text.insert(data->text.end(), text.begin(), text.end());
+          }
+          else
+            ++nulls;
+          offsets[r+1] = (int32_t)data->text.size();
+        }
+        break;
+      }
+    }
+    data->buffers.push_back(nulls ? data->validity.data() : nullptr);
+    data->buffers.push_back(data->values.data());
+    if(FormatOf(type)[0] == 'u') {
+      data->text.reserve(1); // data buffer must not be null even if all strings are empty
+      data->buffers.push_back(data->text.data());
+    }
+    InitArray(out, data, rows.size(), nulls);
+  }
+
+  static void ExportBatch(const SqlResult& batch, ArrowArray* out) {
+    ArrayData* data = new ArrayData();
+    data->buffers.push_back(nullptr); // struct has validity buffer only, all rows are valid
+    data->children.resize(batch.fields.size());
+    for(size_t i=0; i<batch.fields.size(); ++i) {
+      ExportColumn(batch.fields[i].type, batch.data, i, &data->children[i]);
+      data->child_ptrs.push_back(&data->children[i]);
+    }
+    InitArray(out, data, batch.data.size(), 0);
+  }
+
+  //----- stream -----------------
+
+  struct StreamData {
+    std::unique_ptr<QueryCursor> cursor;
+    size_t batch_rows;
+    std::vector<SqlOutField> fields; // schema, types of the first batch
+    SqlResult batch;
+    bool has_batch = false;          // batch is fetched but not returned yet
+    std::string error;
+  };
+
+  static int GetSchema(ArrowArrayStream* stream, ArrowSchema* out) {
+    StreamData* data = (StreamData*)stream->private_data;
+    ExportSchema(data->fields, out);
+    return 0;
+  }
+
+  static int GetNext(ArrowArrayStream* stream, ArrowArray* out) {
+    StreamData* data = (StreamData*)stream->private_data;
+    try {
+      if(!data->has_batch && data->cursor)
+        data->has_batch = data->cursor->Next(data->batch, data->batch_rows);
+      if(!data->has_batch) {
+        // end of stream, reader connection is returned to pool
+        data->cursor.reset();
+        out->release = nullptr;
+        return 0;
+      }
+      // types are fixed by schema
+      for(size_t i=0; i<data->fields.size(); ++i)
+        data->batch.fields[i].type = data->fields[i].type;
+      ExportBatch(data->batch, out);
+      data->has_batch = false;
+      return 0;
+    }
+    catch(std::exception& e) {
+      data->error = e.what();
+      return EIO;
+    }
+  }
+
+  static const char* GetLastError(ArrowArrayStream* stream) {
+    StreamData* data = (StreamData*)stream->private_data;
+    return data->error.empty() ? nullptr : data->error.c_str();
+  }
+
+  static void ReleaseStream(ArrowArrayStream* stream) {
+    delete (StreamData*)stream->private_data;
+    stream->release = nullptr;
+  }
+
+public:
+  // first batch is fetched here to learn column types, errors in query are thrown
+  static void ExportStream(std::unique_ptr<QueryCursor> cursor, size_t batch_rows, ArrowArrayStream* out) {
+    std::unique_ptr<StreamData> data(new StreamData());
+    data->batch_rows = batch_rows ? batch_rows : 1;
+    data->has_batch = cursor->Next(data->batch, data->batch_rows);
+    data->fields = data->batch.fields;
+    data->cursor = std::move(cursor);
+    out->get_schema = GetSchema;
+    out->get_next = GetNext;
+    out->get_last_error = GetLastError;
+    out->release = ReleaseStream;
+    out->private_data = data.release();
+  }
+};
+
+} // ad::asts
+#endif // ARROW_EXPORT_H
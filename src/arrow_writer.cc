@@ -0,0 +1,84 @@
+#include "arrow_writer.h"
+
+#include <stdio.h> // rename, remove
+#include <stdexcept>
+
+#include <arrow/c/bridge.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/writer.h>
+#include <arrow/record_batch.h>
+#include <arrow/util/compression.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+
+namespace ad::asts {
+
+static void CheckStatus(const arrow::Status& status, const std::string& path) {
+  if(!status.ok())
+    throw std::runtime_error("Unable to write "+path+": "+status.ToString());
+}
+
+template<typename T>
+static T CheckResult(arrow::Result<T> result, const std::string& path) {
+  CheckStatus(result.status(), path);
+  return std::move(result).ValueUnsafe();
+}
+
+// batches are written as they are read from the stream, file appears under its name when complete
+template<typename Open, typename Write, typename Close>
+static void WriteBatches(ArrowArrayStream* stream, const std::string& path, Open open, Write write, Close close) {
+  auto reader = CheckResult(arrow::ImportRecordBatchReader(stream), path);
+  std::string tmp_path = path + ".tmp";
+  auto file = CheckResult(arrow::io::FileOutputStream::Open(tmp_path), tmp_path);
+  try {
+    auto writer = open(reader->schema(), file);
+    std::shared_ptr<arrow::RecordBatch> batch;
+    while(true) {
+      CheckStatus(reader->ReadNext(&batch), path);
+      if(!batch)
+        break;
+      CheckStatus(write(writer, *batch), path);
+    }
+    CheckStatus(close(writer), path);
+    CheckStatus(file->Close(), tmp_path);
+  }
+  catch(...) {
+    (void)file->Close();
+    remove(tmp_path.c_str());
+    throw;
+  }
+  if(rename(tmp_path.c_str(), path.c_str()) != 0)
+    throw std::runtime_error("Unable to rename "+tmp_path+" to "+path);
+}
+
+void WriteParquet(ArrowArrayStream* stream, const std::string& path) {
+  parquet::WriterProperties::Builder properties;
+  if(arrow::util::Codec::IsAvailable(arrow::Compression::ZSTD))
+    properties.compression(arrow::Compression::ZSTD);
+  auto props = properties.build();
+  WriteBatches(stream, path,
+    [&](const std::shared_ptr<arrow::Schema>& schema, std::shared_ptr<arrow::io::FileOutputStream> file) {
+      return CheckResult(parquet::arrow::FileWriter::Open(*schema, arrow::default_memory_pool(), file, props), path);
+    },
+    [](std::unique_ptr<parquet::arrow::FileWriter>& writer, const arrow::RecordBatch& batch) {
+      return writer->WriteRecordBatch(batch);
+    },
+    [](std::unique_ptr<parquet::arrow::FileWriter>& writer) {
+      return writer->Close();
+    });
+}
+
+void WriteArrowFile(ArrowArrayStream* stream, const std::string& path) {
+  WriteBatches(stream, path,
+    [&](const std::shared_ptr<arrow::Schema>& schema, std::shared_ptr<arrow::io::FileOutputStream> file) {
+      return CheckResult(arrow::ipc::MakeFileWriter(file, schema), path);
+    },
+    [](std::shared_ptr<arrow::ipc::RecordBatchWriter>& writer, const arrow::RecordBatch& batch) {
+      return writer->WriteRecordBatch(batch);
+    },
+    [](std::shared_ptr<arrow::ipc::RecordBatchWriter>& writer) {
+      return writer->Close();
+    });
+}
+
+} // ad::asts
@@ -0,0 +1,17 @@
+#ifndef ARROW_WRITER_H
+#define ARROW_WRITER_H
+
+#include <string>
+
+#include "arrow_export.h"
+
+// file writers need Arrow and Parquet libraries, they are built with ASTSSQLPY_ARROW option
+namespace ad::asts {
+
+// write all batches of stream to Parquet file, stream is consumed
+void WriteParquet(ArrowArrayStream* stream, const std::string& path);
+// write all batches of stream to Arrow IPC file (Feather v2), stream is consumed
+void WriteArrowFile(ArrowArrayStream* stream, const std::string& path);
+
+} // ad::asts
+#endif // ARROW_WRITER_H
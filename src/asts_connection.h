@@ -1,29 +1,807 @@
 #ifndef ASTS_CONNECTION_H
 #define ASTS_CONNECTION_H
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <sstream>
 #include <string>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <string.h> // memset
 #include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
 
 #include "mtesrl.h"
 #include "mteerr.h"
 
+#include "arrow_export.h"
 #include "asts_interface.h"
+#include "asts_transaction.h"
+#include "feed_merger.h"
+#include "generic_engine.h"
+#include "spsc_ring.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
+#ifdef ASTSSQLPY_ARROW
+#include "arrow_writer.h"
+#endif
 
 namespace ad::asts {
 
 using inparams_t = std::map<std::string, std::string>;
 
+struct LinkStats {
+  std::string system;
+  bool primary = false;
+  bool failed = false;
+  bool busy = false;
+  uint64_t refreshes = 0;
+  uint64_t first_arrivals = 0; // replies which brought rows no other link delivered before
+  uint64_t rows_applied = 0;
+  uint64_t duplicates = 0;     // rows already delivered by other links
+  uint64_t stalls = 0;         // refresh rounds skipped because the link still waited for a reply
+  uint64_t reloads = 0;        // tables reloaded from this link after failover
+  std::string last_error;
+};
+
+struct PipelineStats {
+  size_t queue_depth = 0;     // batches received but not applied yet
+  size_t max_queue_depth = 0;
+  size_t capacity = 0;
+  uint64_t batches_received = 0;
+  uint64_t batches_applied = 0;
+  uint64_t bytes_received = 0;
+  uint64_t producer_stalls = 0; // receive had to wait because queue was full
+};
+
 template<typename storage_engine_t> class AstsConnection {
 private:
   std::map<std::string, int> handles_ { {"TE", -1}, {"RE", -1}, {"RFS", -1}, {"ALGO", -1} };
+  // MTESRL calls on one handle must not overlap, transactions may be sent from other threads than refresh
+  std::map<std::string, std::mutex> api_mutexes_;
   std::map<std::string, std::shared_ptr<AstsInterface> > interfaces_;
+  std::shared_mutex interfaces_mutex_; // queries may run concurrently with Connect/Disconnect
   std::map<std::string, AstsOpenedTable*> tables_;
+  std::mutex tables_mutex_; // changes of tables_ list, taken by stats readers
   storage_engine_t engine_;
 
+  // pipelined ingest: RefreshTable copies MTERefresh payload into a pooled buffer,
+  // apply thread loads it into storage in the order batches were received
+  struct RefreshBatch {
+    AstsOpenedTable* table = nullptr;
+    std::vector<int32_t> data;
+    size_t len = 0; // bytes of data
+  };
+  std::unique_ptr<ad::util::SpscRing<RefreshBatch*> > pipeline_queue_; // receive -> apply
+  std::unique_ptr<ad::util::SpscRing<RefreshBatch*> > pipeline_free_;  // apply -> receive, empty buffers
+  std::vector<std::unique_ptr<RefreshBatch> > pipeline_buffers_;
+  std::thread apply_thread_;
+  std::atomic<bool> pipeline_running_ {false};
+  std::atomic<uint64_t> batches_applied_ {0};
+  std::exception_ptr apply_error_;
+  std::mutex apply_error_mutex_;
+  // written by receiving thread, read by apply thread and GetPipelineStats
+  struct PipelineCounters {
+    std::atomic<size_t> max_queue_depth {0};
+    std::atomic<size_t> capacity {0};
+    std::atomic<uint64_t> batches_received {0};
+    std::atomic<uint64_t> bytes_received {0};
+    std::atomic<uint64_t> producer_stalls {0};
+  } pipeline_stats_;
+  std::atomic<bool> flush_before_query_ {false};
+  bool attached_ = false; // storage of another process is queried, no gateway connections
+  std::string interface_cache_dir_;
+
+  // adaptive refresh: interval of a table doubles after empty refreshes up to max_interval and halves
+  // back to target interval when data arrives; due tables of one system share a single MTERefresh
+  struct RefreshSchedule {
+    AstsOpenedTable* table = nullptr;
+    std::string system;
+    std::chrono::milliseconds target {0}, max {0}, interval {0};
+    int priority = 0; // higher priority tables are fetched and applied first
+    std::chrono::steady_clock::time_point due;
+  };
+  std::map<std::string, RefreshSchedule> schedules_;
+  std::mutex schedules_mutex_;
+  std::mutex refresh_mutex_; // manual and scheduled refreshes run one at a time
+  std::thread scheduler_thread_;
+  std::mutex scheduler_mutex_;
+  std::condition_variable scheduler_cv_;
+  bool scheduler_running_ = false;
+  bool schedules_changed_ = false;
+  std::exception_ptr scheduler_error_;
+
+  // redundant links: tables of a system are refreshed over several gateway connections at once, every
+  // row is applied from the link which delivered it first. Each link has a thread waiting for its replies
+  struct FeedLink {
+    std::string system;
+    size_t index = 0;        // link number in FeedMerger, primary connection is 0
+    int handle = -1;
+    std::mutex own_mutex;
+    std::mutex* api_mutex = nullptr; // MTESRL calls on handle, primary link shares it with transactions
+    std::map<int, AstsOpenedTable*> tables; // tables opened on this link by handle
+    // guarded by links_mutex_
+    std::vector<std::pair<AstsOpenedTable*, int> > request;
+    bool busy = false;
+    bool stop = false;
+    uint64_t round = 0;
+    std::chrono::steady_clock::time_point request_time;
+    LinkStats stats;
+    std::thread worker;
+  };
+  struct LinkReply {
+    FeedLink* link = nullptr;
+    uint64_t round = 0;
+    std::vector<int32_t> data;
+    std::exception_ptr error;
+  };
+  std::map<std::string, std::vector<std::unique_ptr<FeedLink> > > links_;
+  std::map<std::string, ad::util::FeedMerger> mergers_; // by table name
+  std::mutex links_mutex_;
+  std::condition_variable links_cv_;
+  std::deque<LinkReply> link_replies_;
+  uint64_t link_round_ = 0;
+  std::chrono::milliseconds stall_timeout_ {500};
+  size_t merge_window_ = 65536;
+
+  // called with table name and row count after every batch applied to storage, by the thread applying it
+  std::function<void(const std::string&, size_t)> refresh_listener_;
+  std::mutex refresh_listener_mutex_;
+
+  // periodic export of stats in Prometheus text format
+  std::thread stats_thread_;
+  std::mutex stats_export_mutex_;
+  std::condition_variable stats_export_cv_;
+  bool stats_export_running_ = false;
+
+  void StatsExportLoop(std::string path, std::chrono::milliseconds interval) {
+    std::unique_lock<std::mutex> lock(stats_export_mutex_);
+    while(stats_export_running_) {
+      lock.unlock();
+      // write under temporary name, so scraper never reads a partial file
+      std::string tmp_path = path+".tmp";
+      {
+        std::ofstream out(tmp_path, std::ios::out | std::ios::trunc);
+        out << PrometheusStats();
+      }
+      rename(tmp_path.c_str(), path.c_str());
+      lock.lock();
+      stats_export_cv_.wait_for(lock, interval, [this]{ return !stats_export_running_; });
+    }
+  }
+
+  void ApplyLoop() {
+    if(ad::util::Tracer::Enabled())
+      ad::util::Tracer::Instance().SetThreadName("apply");
+    ad::util::Backoff backoff;
+    RefreshBatch* batch;
+    while(true) {
+      if(!pipeline_queue_->TryPop(batch)) {
+        if(!pipeline_running_)
+          break;
+        // nothing to apply: do not keep coalesced batches waiting longer than configured
+        try {
+          engine_.CommitIfDue();
+        }
+        catch(...) {
+          std::lock_guard<std::mutex> lock(apply_error_mutex_);
+          if(!apply_error_)
+            apply_error_ = std::current_exception();
+        }
+        backoff.Wait();
+        continue;
+      }
+      backoff.Reset();
+      try {
+        LoadTableData(batch->table, batch->data.data(), batch->len);
+      }
+      catch(...) {
+        std::lock_guard<std::mutex> lock(apply_error_mutex_);
+        if(!apply_error_)
+          apply_error_ = std::current_exception();
+      }
+      ++batches_applied_;
+      // free ring has room for every buffer ever allocated
+      pipeline_free_->TryPush(batch);
+    }
+  }
+
+  // rethrow error from apply thread in the thread that drives ingest
+  void CheckApplyError() {
+    std::lock_guard<std::mutex> lock(apply_error_mutex_);
+    if(apply_error_) {
+      std::exception_ptr e = apply_error_;
+      apply_error_ = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+
+  void EnqueueBatch(AstsOpenedTable* tbl, const int32_t* ptr, size_t len) {
+    RefreshBatch* batch = nullptr;
+    if(!pipeline_free_->TryPop(batch)) {
+      if(pipeline_buffers_.size() < pipeline_free_->Capacity()) {
+        pipeline_buffers_.push_back(std::make_unique<RefreshBatch>());
+        batch = pipeline_buffers_.back().get();
+      }
+      else {
+        // all buffers are in flight: wait until apply thread returns one
+        ++pipeline_stats_.producer_stalls;
+        ad::util::Backoff backoff;
+        while(!pipeline_free_->TryPop(batch))
+          backoff.Wait();
+      }
+    }
+    batch->table = tbl;
+    batch->data.resize((len + sizeof(int32_t) - 1) / sizeof(int32_t));
+    memcpy(batch->data.data(), ptr, len);
+    batch->len = len;
+    // ref must be known before next MTEAddTable, apply thread may be far behind
+    tbl->ref = ptr[0];
+    ad::util::Backoff backoff;
+    while(!pipeline_queue_->TryPush(batch))
+      backoff.Wait();
+    ++pipeline_stats_.batches_received;
+    pipeline_stats_.bytes_received += len;
+    // only this thread raises the maximum
+    size_t depth = pipeline_queue_->Size();
+    if(depth > pipeline_stats_.max_queue_depth)
+      pipeline_stats_.max_queue_depth = depth;
+  }
+
+  // open table already present in storage, new copy replaces current contents in one transaction
+  void ReopenTable(AstsOpenedTable* tbl, const std::string& system) {
+    ad::util::TraceSpan span("OpenTable", tbl->tablename_);
+    MTEMSG *TableData;
+    std::string params = tbl->ParamsToStr();
+    std::lock_guard<std::mutex> api_lock(api_mutexes_[system]);
+    tbl->Table = MTEOpenTable(handles_[system], (char *)tbl->thistable_->name.c_str(), (char *)params.c_str(), 1, &TableData);
+    if(tbl->Table < 0)
+      throw std::runtime_error("Unable to load table "+tbl->tablename_+": "+std::string(TableData->Data, TableData->DataLen));
+    LoadTableData(tbl, (int32_t*)(TableData->Data), TableData->DataLen, true);
+  }
+
+  // end of one table in MTERefresh data: Ref, RowCount, then rows of FieldCount, DataLength, field numbers and data
+  static const char* SkipTableData(const char* ptr, const char* end) {
+    ad::util::BufferReader buffer(ptr, end - ptr);
+    buffer.SkipInt();
+    size_t row_count = buffer.ReadCount(1 + sizeof(int32_t));
+    for(size_t i=0; i<row_count; i++) {
+      fld_count_t fldcount = buffer.ReadChar();
+      size_t datalen = buffer.ReadSize();
+      buffer.Skip(fldcount + datalen);
+    }
+    return buffer.Data();
+  }
+
+  void LinkLoop(FeedLink* link) {
+    if(ad::util::Tracer::Enabled())
+      ad::util::Tracer::Instance().SetThreadName("link "+link->system+" "+std::to_string(link->index));
+    std::unique_lock<std::mutex> lock(links_mutex_);
+    while(true) {
+      links_cv_.wait(lock, [&]{ return link->stop || !link->request.empty(); });
+      if(link->stop)
+        break;
+      auto request = std::move(link->request);
+      link->request.clear();
+      LinkReply reply;
+      reply.link = link;
+      reply.round = link->round;
+      lock.unlock();
+      try {
+        ad::util::TraceSpan span("MTERefresh", link->system);
+        std::lock_guard<std::mutex> api_lock(*link->api_mutex);
+        for(auto& t : request) {
+          int res = MTEAddTable(link->handle, t.second, t.second);
+          if(res != MTE_OK)
+            throw std::runtime_error(std::string("MTEAddTable returned an error: ")+MTEErrorMsg(res));
+        }
+        MTEMSG *TableData;
+        int res = MTERefresh(link->handle, &TableData);
+        if(res != MTE_OK)
+          throw std::runtime_error(std::string("MTERefresh returned an error: ")+MTEErrorMsg(res));
+        reply.data.resize((TableData->DataLen + sizeof(int32_t) - 1) / sizeof(int32_t) + 1);
+        reply.data[0] = TableData->DataLen;
+        memcpy(reply.data.data() + 1, TableData->Data, TableData->DataLen);
+        span.SetCount(TableData->DataLen);
+      }
+      catch(...) {
+        reply.error = std::current_exception();
+      }
+      lock.lock();
+      link_replies_.push_back(std::move(reply));
+      link->busy = false;
+      links_cv_.notify_all();
+    }
+  }
+
+  // link is healthy if it has not failed and is not waiting for a reply longer than stall timeout
+  bool LinkHealthy(FeedLink* link, std::chrono::steady_clock::time_point now) {
+    return !link->stats.failed && link->handle >= 0 && (!link->busy || now - link->request_time < stall_timeout_);
+  }
+
+  // table is loaded anew from link which could not be aligned with others when no other link is healthy
+  void ReloadFromLink(FeedLink* link, AstsOpenedTable* tbl, int handle) {
+    ad::util::TraceSpan span("OpenTable", tbl->tablename_);
+    FlushPipeline();
+    std::string params = tbl->ParamsToStr();
+    std::lock_guard<std::mutex> api_lock(*link->api_mutex);
+    MTECloseTable(link->handle, handle);
+    MTEMSG *TableData;
+    int table = MTEOpenTable(link->handle, (char *)tbl->thistable_->name.c_str(), (char *)params.c_str(), 1, &TableData);
+    {
+      std::lock_guard<std::mutex> lock(links_mutex_);
+      link->tables.erase(handle);
+      if(table >= 0)
+        link->tables[table] = tbl;
+      if(link->index == 0)
+        tbl->Table = table;
+    }
+    if(table < 0)
+      throw std::runtime_error("Unable to load table "+tbl->tablename_+": "+std::string(TableData->Data, TableData->DataLen));
+    LoadTableData(tbl, (int32_t*)(TableData->Data), TableData->DataLen, true);
+    mergers_.at(tbl->tablename_).Reset(link->index);
+  }
+
+  // apply rows of a link reply which no other link delivered before
+  void ApplyLinkReply(LinkReply& reply, std::map<AstsOpenedTable*, int>& rows) {
+    FeedLink* link = reply.link;
+    ad::util::BufferReader data((const char*)(reply.data.data() + 1), reply.data[0]);
+    int32_t tablecount = data.ReadInt();
+    const char* part = data.Data();
+    const char* end = part + data.Remaining();
+    if(!tablecount && !pipeline_running_)
+      engine_.CommitIfDue();
+    std::vector<uint64_t> hashes;
+    std::vector<bool> apply;
+    std::vector<int32_t> filtered;
+    LinkStats delta;
+    for(int32_t t=0; t<tablecount; ++t) {
+      const char* next = SkipTableData(part, end);
+      int32_t ref, row_count;
+      memcpy(&ref, part, sizeof(ref));
+      memcpy(&row_count, part + sizeof(ref), sizeof(row_count));
+      AstsOpenedTable* tbl = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(links_mutex_);
+        auto it = link->tables.find(ref);
+        if(it != link->tables.end())
+          tbl = it->second;
+      }
+      auto merger = tbl ? mergers_.find(tbl->tablename_) : mergers_.end();
+      if(merger == mergers_.end()) {
+        // table was closed while reply was on its way
+        part = next;
+        continue;
+      }
+      // row offsets and hashes; tables cleared on update are replaced by each batch, so a batch is one row for them
+      std::vector<std::pair<const char*, const char*> > spans;
+      const char* row = part + 2*sizeof(int32_t);
+      bool whole = (tbl->thistable_->attr & mmfClearOnUpdate);
+      for(int32_t i=0; i<row_count; ++i) {
+        int32_t datalen;
+        memcpy(&datalen, row + 1, sizeof(datalen));
+        const char* row_end = row + 1 + sizeof(int32_t) + (unsigned char)row[0] + datalen;
+        spans.push_back({row, row_end});
+        row = row_end;
+      }
+      hashes.clear();
+      if(whole)
+        hashes.push_back(std::hash<std::string_view>()(std::string_view(part + 2*sizeof(int32_t), next - part - 2*sizeof(int32_t))));
+      else
+        for(auto& sp : spans)
+          hashes.push_back(std::hash<std::string_view>()(std::string_view(sp.first, sp.second - sp.first)));
+      bool aligned = merger->second.Merge(link->index, hashes, apply);
+      if(!aligned) {
+        auto now = std::chrono::steady_clock::now();
+        bool others = false;
+        {
+          std::lock_guard<std::mutex> lock(links_mutex_);
+          for(auto& l : links_[link->system])
+            if(l.get() != link && LinkHealthy(l.get(), now) && merger->second.Aligned(l->index))
+              others = true;
+        }
+        if(!others) {
+          // failover to a link which never caught up with the others: its own snapshot is the only consistent state
+          ReloadFromLink(link, tbl, ref);
+          ++delta.reloads;
+          rows[tbl] += 1;
+          part = next;
+          continue;
+        }
+      }
+      // copy rows to apply into a part of the same layout
+      filtered.assign(2, 0);
+      filtered[0] = ref;
+      size_t len = 2*sizeof(int32_t);
+      int32_t count = 0;
+      for(size_t i=0; i<spans.size(); ++i) {
+        if(!apply[whole ? 0 : i]) {
+          ++delta.duplicates;
+          continue;
+        }
+        size_t size = spans[i].second - spans[i].first;
+        filtered.resize((len + size + sizeof(int32_t) - 1) / sizeof(int32_t));
+        memcpy((char*)filtered.data() + len, spans[i].first, size);
+        len += size;
+        ++count;
+      }
+      filtered[1] = count;
+      if(count) {
+        ++delta.first_arrivals;
+        delta.rows_applied += count;
+        rows[tbl] += count;
+        if(pipeline_running_)
+          EnqueueBatch(tbl, filtered.data(), len);
+        else
+          LoadTableData(tbl, filtered.data(), len);
+      }
+      part = next;
+    }
+    std::lock_guard<std::mutex> lock(links_mutex_);
+    link->stats.first_arrivals += delta.first_arrivals;
+    link->stats.rows_applied += delta.rows_applied;
+    link->stats.duplicates += delta.duplicates;
+    link->stats.reloads += delta.reloads;
+  }
+
+  // refresh over all links of system: request goes to every link not waiting for a previous reply,
+  // returns after the first reply to this request is applied. Late replies are merged on the next call
+  std::vector<int> RefreshRedundant(const std::string& system, const std::vector<AstsOpenedTable*>& tbls) {
+    std::map<AstsOpenedTable*, int> rows;
+    std::unique_lock<std::mutex> lock(links_mutex_);
+    auto& links = links_[system];
+    uint64_t round = ++link_round_;
+    auto now = std::chrono::steady_clock::now();
+    size_t dispatched = 0;
+    for(auto& l : links) {
+      if(l->stats.failed || l->handle < 0)
+        continue;
+      if(l->busy) {
+        ++l->stats.stalls;
+        continue;
+      }
+      for(auto tbl : tbls)
+        for(auto& t : l->tables)
+          if(t.second == tbl)
+            l->request.push_back({tbl, t.first});
+      if(l->request.empty())
+        continue;
+      l->busy = true;
+      l->round = round;
+      l->request_time = now;
+      ++l->stats.refreshes;
+      ++dispatched;
+    }
+    links_cv_.notify_all();
+    auto any_busy = [&]{
+      for(auto& l : links)
+        if(l->busy)
+          return true;
+      return false;
+    };
+    ad::util::Stopwatch timer;
+    std::exception_ptr error;
+    bool done = false;
+    while(!done) {
+      links_cv_.wait(lock, [&]{ return !link_replies_.empty() || !any_busy(); });
+      if(link_replies_.empty())
+        break;
+      while(!link_replies_.empty()) {
+        LinkReply reply = std::move(link_replies_.front());
+        link_replies_.pop_front();
+        if(reply.error) {
+          reply.link->stats.failed = true;
+          try {
+            std::rethrow_exception(reply.error);
+          }
+          catch(std::exception& e) {
+            reply.link->stats.last_error = e.what();
+          }
+          if(!error)
+            error = reply.error;
+          continue;
+        }
+        // links stalled on earlier rounds: any reply is the freshest data there is
+        if(reply.round == round || !dispatched)
+          done = true;
+        lock.unlock();
+        try {
+          ApplyLinkReply(reply, rows);
+        }
+        catch(...) {
+          lock.lock();
+          throw;
+        }
+        lock.lock();
+      }
+    }
+    lock.unlock();
+    if(!done)
+      std::rethrow_exception(error ? error : std::make_exception_ptr(std::runtime_error("All links of system "+system+" have failed")));
+    auto elapsed = timer.Elapsed();
+    std::vector<int> result;
+    for(auto tbl : tbls) {
+      tbl->stats.refresh_latency.Record(elapsed);
+      ad::util::TableStats::Add(tbl->stats.refreshes);
+      result.push_back(rows[tbl]);
+    }
+    return result;
+  }
+
+  // open table on backup links of its system, snapshots from them are not loaded
+  void OpenOnLinks(AstsOpenedTable* tbl, const std::string& system) {
+    if(links_.find(system) == links_.end() || !(tbl->thistable_->attr & mmfUpdateable))
+      return;
+    std::string params = tbl->ParamsToStr();
+    for(auto& l : links_[system]) {
+      if(l->index == 0) {
+        std::lock_guard<std::mutex> lock(links_mutex_);
+        l->tables[tbl->Table] = tbl;
+        continue;
+      }
+      if(l->stats.failed)
+        continue;
+      MTEMSG *TableData;
+      int table;
+      {
+        std::lock_guard<std::mutex> api_lock(*l->api_mutex);
+        table = MTEOpenTable(l->handle, (char *)tbl->thistable_->name.c_str(), (char *)params.c_str(), 1, &TableData);
+      }
+      std::lock_guard<std::mutex> lock(links_mutex_);
+      if(table < 0) {
+        l->stats.last_error = "Unable to load table "+tbl->tablename_+": "+std::string(TableData->Data, TableData->DataLen);
+        continue;
+      }
+      l->tables[table] = tbl;
+    }
+    mergers_.erase(tbl->tablename_);
+    mergers_.emplace(tbl->tablename_, ad::util::FeedMerger(links_[system].size(), merge_window_));
+  }
+
+  // close table on all links, replies on their way are dropped
+  void CloseOnLinks(AstsOpenedTable* tbl, const std::string& system) {
+    mergers_.erase(tbl->tablename_);
+    if(links_.find(system) == links_.end())
+      return;
+    for(auto& l : links_[system]) {
+      std::vector<int> handles;
+      {
+        std::lock_guard<std::mutex> lock(links_mutex_);
+        for(auto it = l->tables.begin(); it != l->tables.end(); )
+          if(it->second == tbl) {
+            handles.push_back(it->first);
+            it = l->tables.erase(it);
+          }
+          else
+            ++it;
+      }
+      if(l->index == 0)
+        continue; // primary handle is closed by caller
+      std::lock_guard<std::mutex> api_lock(*l->api_mutex);
+      for(int h : handles)
+        MTECloseTable(l->handle, h);
+    }
+  }
+
+  void StopLinks(const std::string& system) {
+    auto it = links_.find(system);
+    if(it == links_.end())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(links_mutex_);
+      for(auto& l : it->second)
+        l->stop = true;
+    }
+    links_cv_.notify_all();
+    for(auto& l : it->second) {
+      l->worker.join();
+      if(l->index != 0 && l->handle >= 0)
+        MTEDisconnect(l->handle);
+    }
+    {
+      std::lock_guard<std::mutex> lock(links_mutex_);
+      for(auto r = link_replies_.begin(); r != link_replies_.end(); )
+        if(r->link->system == system)
+          r = link_replies_.erase(r);
+        else
+          ++r;
+    }
+    links_.erase(it);
+    for(auto& t : tables_)
+      if(GetSystemFromTableName(t.first) == system)
+        mergers_.erase(t.first);
+  }
+
+  // refresh updatable tables of one system in one MTERefresh round trip, returns row count received by each table.
+  // Table handle is passed as reference to MTEAddTable, so data of each table in reply is matched by it
+  std::vector<int> RefreshTables(const std::string& system, const std::vector<AstsOpenedTable*>& tbls) {
+    if(links_.find(system) != links_.end())
+      return RefreshRedundant(system, tbls);
+    std::vector<int> rows(tbls.size(), 0);
+    MTEMSG *TableData;
+    ad::util::Stopwatch timer;
+    int res;
+    // TableData stays valid until the next call on this handle
+    std::lock_guard<std::mutex> api_lock(api_mutexes_[system]);
+    {
+      ad::util::TraceSpan span("MTERefresh", tbls.size() == 1 ? tbls[0]->tablename_ : system);
+      for(auto tbl : tbls) {
+        if(tbl->Table < 0)
+          throw std::runtime_error("Table handle is invalid");
+        res = MTEAddTable(handles_[system], tbl->Table, tbl->Table);
+        if(res != MTE_OK)
+          throw std::runtime_error(std::string("MTEAddTable returned an error: ")+MTEErrorMsg(res));
+      }
+      res = MTERefresh(handles_[system], &TableData);
+      if(res != MTE_OK)
+        throw std::runtime_error(std::string("MTERefresh returned an error: ")+MTEErrorMsg(res));
+      span.SetCount(TableData->DataLen);
+    }
+    auto elapsed = timer.Elapsed();
+    for(auto tbl : tbls) {
+      tbl->stats.refresh_latency.Record(elapsed);
+      ad::util::TableStats::Add(tbl->stats.refreshes);
+    }
+    ad::util::BufferReader data(TableData->Data, TableData->DataLen);
+    int32_t tablecount = data.ReadInt();
+    if(!tablecount && !pipeline_running_)
+      engine_.CommitIfDue();
+    const char* part = data.Data();
+    const char* end = part + data.Remaining();
+    for(int32_t t=0; t<tablecount; ++t) {
+      const char* next = SkipTableData(part, end);
+      int32_t ref, row_count;
+      memcpy(&ref, part, sizeof(ref));
+      memcpy(&row_count, part + sizeof(ref), sizeof(row_count));
+      size_t i = 0;
+      // a single table is matched whatever reference gateway returns
+      while(tbls.size() > 1 && i < tbls.size() && tbls[i]->Table != ref)
+        ++i;
+      if(i == tbls.size())
+        throw std::runtime_error("MTERefresh returned data of unknown table reference "+std::to_string(ref));
+      rows[i] = row_count;
+      if(pipeline_running_)
+        EnqueueBatch(tbls[i], (const int32_t*)part, next - part);
+      else
+        LoadTableData(tbls[i], (const int32_t*)part, next - part);
+      part = next;
+    }
+    return rows;
+  }
+
+  void RefreshTableInternal(const std::string& tablename) {
+    CheckApplyError();
+    std::string system = GetSystemFromTableName(tablename);
+    if(tables_.find(tablename) == tables_.end())
+        throw std::runtime_error("Table "+tablename+" has not been opened");
+    AstsOpenedTable * tbl = tables_[tablename];
+    if((tbl->thistable_->attr & mmfUpdateable) == 0) {
+      // get new copy of the table, storage applies only the difference to current contents
+      FlushPipeline();
+      if(tbl->Table >= 0) {
+        std::lock_guard<std::mutex> api_lock(api_mutexes_[system]);
+        MTECloseTable(handles_[system], tbl->Table);
+      }
+      tbl->Table = -1;
+      ReopenTable(tbl, system);
+    }
+    else {
+      // send refresh request and update data
+      RefreshTables(system, {tbl});
+    }
+  }
+
+  // refresh tables due now along with tables of the same systems due soon, returns when the next table is due
+  std::chrono::steady_clock::time_point RefreshDueTables(size_t* refreshed = nullptr) {
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+    CheckApplyError();
+    auto now = std::chrono::steady_clock::now();
+    std::vector<RefreshSchedule> due;
+    {
+      std::lock_guard<std::mutex> lock(schedules_mutex_);
+      std::set<std::string> systems;
+      for(auto& s : schedules_)
+        if(s.second.due <= now && handles_[s.second.system] >= 0)
+          systems.insert(s.second.system);
+      // tables due within a quarter of their interval join the round trip instead of making their own
+      for(auto& s : schedules_)
+        if(systems.count(s.second.system) && s.second.due <= now + s.second.interval / 4)
+          due.push_back(s.second);
+    }
+    std::stable_sort(due.begin(), due.end(), [](const RefreshSchedule& a, const RefreshSchedule& b) { return a.priority > b.priority; });
+    std::vector<std::string> systems;
+    for(auto& s : due)
+      if(std::find(systems.begin(), systems.end(), s.system) == systems.end())
+        systems.push_back(s.system);
+    std::map<AstsOpenedTable*, int> rows;
+    for(auto& system : systems) {
+      std::vector<AstsOpenedTable*> updatable;
+      for(auto& s : due)
+        if(s.system == system && (s.table->thistable_->attr & mmfUpdateable))
+          updatable.push_back(s.table);
+      if(!updatable.empty()) {
+        auto counts = RefreshTables(system, updatable);
+        for(size_t i=0; i<updatable.size(); ++i)
+          rows[updatable[i]] = counts[i];
+      }
+      // tables without updates are reopened, their interval does not adapt
+      for(auto& s : due)
+        if(s.system == system && !(s.table->thistable_->attr & mmfUpdateable))
+          RefreshTableInternal(s.table->tablename_);
+    }
+    if(refreshed)
+      *refreshed = due.size();
+    now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(schedules_mutex_);
+    for(auto& d : due) {
+      auto it = schedules_.find(d.table->tablename_);
+      if(it == schedules_.end())
+        continue;
+      RefreshSchedule& s = it->second;
+      auto count = rows.find(s.table);
+      if(count != rows.end()) {
+        if(count->second > 0)
+          s.interval = std::max(s.target, s.interval / 2);
+        else
+          s.interval = std::min(s.max, s.interval * 2);
+      }
+      s.due = now + s.interval;
+    }
+    auto next = now + std::chrono::seconds(1);
+    for(auto& s : schedules_)
+      next = std::min(next, s.second.due);
+    return next;
+  }
+
+  void SchedulerLoop() {
+    if(ad::util::Tracer::Enabled())
+      ad::util::Tracer::Instance().SetThreadName("scheduler");
+    std::unique_lock<std::mutex> lock(scheduler_mutex_);
+    while(scheduler_running_) {
+      schedules_changed_ = false;
+      lock.unlock();
+      std::chrono::steady_clock::time_point next;
+      try {
+        next = RefreshDueTables();
+      }
+      catch(...) {
+        lock.lock();
+        scheduler_error_ = std::current_exception();
+        scheduler_running_ = false;
+        break;
+      }
+      lock.lock();
+      scheduler_cv_.wait_until(lock, next, [this]{ return !scheduler_running_ || schedules_changed_; });
+    }
+  }
+
+  // value of NAME=value line in MTEConnect parameters
+  static std::string GetConnectParam(const std::string& params, const std::string& name) {
+    size_t pos = 0;
+    while(pos < params.size()) {
+      size_t end = params.find_first_of("\r\n", pos);
+      if(end == std::string::npos)
+        end = params.size();
+      if(params.compare(pos, name.size()+1, name+"=") == 0)
+        return params.substr(pos+name.size()+1, end-pos-name.size()-1);
+      pos = end+1;
+    }
+    return "";
+  }
+
   std::string GetSystemFromTableName(const std::string& tablename)
   {
       size_t idx = tablename.find('$');
@@ -36,164 +814,943 @@ private:
   }
 
   void NewTableInternal(const std::string& system, const std::string& tablename) {
+    if(interfaces_.find(system) == interfaces_.end())
+        throw std::runtime_error("System "+system+" is not connected");
     if(interfaces_[system]->tables.find(tablename) == interfaces_[system]->tables.end())
         throw std::runtime_error("Table "+tablename+" does not exist in interface "+interfaces_[system]->name_);
     // only one copy of each table may be opened
     if (tables_.find(tablename) != tables_.end())
         throw std::runtime_error("Table "+tablename+" has been already opened");
     engine_.CreateTable(interfaces_[system], tablename);
+    std::lock_guard<std::mutex> lock(tables_mutex_);
     tables_[tablename] = new AstsOpenedTable(interfaces_[system], tablename);
   }
 
-  void LoadTableData(AstsOpenedTable* tbl, int32_t* ptr) {
+  // replace: data is a full copy of the table replacing current contents. Data of len bytes is checked once
+  // per row, so truncated or corrupt data is rejected before storage reads fields without checks
+  void LoadTableData(AstsOpenedTable* tbl, const int32_t* ptr, size_t len, bool replace = false) {
     if(tbl->Table < 0)
       return;
-    engine_.StartReadingRows(tbl);
-    ad::util::PointerHelper buffer(ptr);
+    ad::util::BufferReader buffer((const char*)ptr, len);
     tbl->ref = buffer.ReadInt();
-    int row_count = buffer.ReadInt();
-    if(!row_count)
+    size_t row_count = buffer.ReadCount(1 + sizeof(int32_t));
+    if(!row_count && !replace)
       return;
-    int datalen = 0;
-    fld_count_t fldcount = 0;
-    fld_count_t fldnums[MTE_SQL_MAX_FIELDS] = {0};
-    fld_count_t fldnums_prev[MTE_SQL_MAX_FIELDS] = {0};
-    bool is_orderbook = (tbl->thistable_->attr & mmfOrderBook);
-    for(int i=0; i<row_count; i++) {
-      // FieldCount Byte
-      fldcount = buffer.ReadChar();
-      // DataLength Integer
-      datalen = buffer.ReadInt();
-      if(tbl->thistable_->attr & mmfClearOnUpdate) {
-          // mmfClearOnUpdate: row with datalen==0 means table is now empty
-          if(!datalen) {
-            engine_.EraseData(tbl->tablename_);
-            continue;
-          }
-          // mmfClearOnUpdate: we must erase old contents first and then replace it with new data
-          // but not for orderbooks, orderbooks are tricky
-          if(!is_orderbook && (i == 0))
-            engine_.EraseData(tbl->tablename_);
+    ad::util::Stopwatch timer;
+    ad::util::TraceSpan span("LoadTableData", tbl->tablename_);
+    span.SetCount(row_count);
+    try {
+      // storage releases its write lock itself when start fails, AbortReadingRows is a no-op then
+      engine_.StartReadingRows(tbl, row_count, replace);
+      auto& outfields = tbl->thistable_->outfields;
+      if(outfields.size() > MTE_SQL_MAX_FIELDS)
+        throw std::runtime_error("Table "+tbl->tablename_+" has more than "+std::to_string(MTE_SQL_MAX_FIELDS)+" fields");
+      size_t datalen = 0;
+      fld_count_t fldcount = 0;
+      fld_count_t fldnums[MTE_SQL_MAX_FIELDS] = {0};
+      // all fields: consecutive numbers up to outfield_count for this table
+      fld_count_t all_fldnums[MTE_SQL_MAX_FIELDS] = {0};
+      size_t all_len = 0;
+      for(size_t f=0; f<outfields.size(); f++) {
+        all_fldnums[f] = f;
+        all_len += outfields[f].size;
       }
+      bool is_orderbook = (tbl->thistable_->attr & mmfOrderBook);
+      for(size_t i=0; i<row_count; i++) {
+        // FieldCount Byte
+        fldcount = buffer.ReadChar();
+        // DataLength Integer
+        datalen = buffer.ReadSize();
+        buffer.Require(fldcount + datalen);
+        if(tbl->thistable_->attr & mmfClearOnUpdate) {
+            // mmfClearOnUpdate: row with datalen==0 means table is now empty
+            if(!datalen) {
+              buffer.Take(fldcount);
+              engine_.EraseData(tbl->tablename_);
+              continue;
+            }
+            // mmfClearOnUpdate: we must erase old contents first and then replace it with new data
+            // but not for orderbooks, orderbooks are tricky
+            if(!is_orderbook && (i == 0))
+              engine_.EraseData(tbl->tablename_);
+        }
 
-      // determine list of fields in table
-      // WARNING: field order in interface and real data may differ!
-      memset(fldnums, 0x00, sizeof(fldnums));
-      if(fldcount != 0) {
-        // explicit list of fields - copy it to our own buffer from MTESRL-managed one
-        memcpy(fldnums, (fld_count_t*)buffer._ptr, fldcount);
-        buffer.RewindString(fldcount);
-      }
-      else {
-        // all fields - fill our buffer with consecutive numbers up to outfield_count for this table
-        for (size_t f=0; f<tbl->thistable_->outfield_count; f++)
-          fldnums[f] = f;
+        // determine list of fields in table
+        // WARNING: field order in interface and real data may differ!
+        fld_count_t* rowfields = all_fldnums;
+        size_t fields_len = all_len;
+        if(fldcount != 0) {
+          // explicit list of fields - copy it to our own buffer from MTESRL-managed one
+          memcpy(fldnums, buffer.Take(fldcount), fldcount);
+          rowfields = fldnums;
+          fields_len = 0;
+          for(fld_count_t c=0; c<fldcount; ++c) {
+            if(fldnums[c] >= outfields.size())
+              throw std::runtime_error("Row of "+tbl->tablename_+" has unknown field number "+std::to_string(fldnums[c]));
+            fields_len += outfields[fldnums[c]].size;
+          }
+        }
+        if(fields_len > datalen)
+          throw std::runtime_error("Row of "+tbl->tablename_+" is shorter than its fields");
+        ad::util::BufferReader row(buffer.Take(datalen), datalen);
+        engine_.ReadRowFromBuffer(tbl, row, rowfields, fldcount ? fldcount : outfields.size());
       }
-      engine_.ReadRowFromBuffer(tbl, buffer, fldnums, fldnums_prev, fldcount ? fldcount : tbl->thistable_->outfield_count);
-      memcpy(fldnums_prev, fldnums, sizeof(fldnums_prev));
+    }
+    catch(...) {
+      // do not leave half-applied refresh in storage
+      engine_.AbortReadingRows();
+      ad::util::TableStats::Add(tbl->stats.errors);
+      throw;
     }
     engine_.StopReadingRows();
+    ad::util::TableStats::Add(tbl->stats.batches);
+    ad::util::TableStats::Add(tbl->stats.rows, row_count);
+    ad::util::TableStats::Add(tbl->stats.bytes, buffer.Data() - (const char*)ptr);
+    tbl->stats.apply_latency.Record(timer.Elapsed());
+    std::lock_guard<std::mutex> lock(refresh_listener_mutex_);
+    if(refresh_listener_)
+      refresh_listener_(tbl->tablename_, row_count);
   }
 public:
   bool debug = false;
 
+  AstsConnection() {
+    // all mutexes are created here, later lookups do not modify the map
+    for(auto& h : handles_)
+      api_mutexes_[h.first];
+  }
+
+  ~AstsConnection() {
+    StopStatsExport();
+    try {
+      StopScheduler();
+    }
+    catch(...) {
+    }
+    while(!links_.empty())
+      StopLinks(links_.begin()->first);
+    StopPipeline();
+    for(auto& t : tables_)
+      delete t.second;
+  }
+
+  // RefreshTable only receives data, storage is updated by a separate apply thread.
+  // RefreshTable must then be called from one thread at a time.
+  void StartPipeline(size_t queue_depth = 64) {
+    if(pipeline_running_)
+      return;
+    if(queue_depth == 0)
+      throw std::runtime_error("Pipeline queue depth must be positive");
+    pipeline_queue_ = std::make_unique<ad::util::SpscRing<RefreshBatch*> >(queue_depth);
+    pipeline_free_ = std::make_unique<ad::util::SpscRing<RefreshBatch*> >(queue_depth);
+    pipeline_buffers_.clear();
+    pipeline_stats_.max_queue_depth = 0;
+    pipeline_stats_.capacity = pipeline_queue_->Capacity();
+    pipeline_stats_.batches_received = 0;
+    pipeline_stats_.bytes_received = 0;
+    pipeline_stats_.producer_stalls = 0;
+    batches_applied_ = 0;
+    pipeline_running_ = true;
+    apply_thread_ = std::thread(&AstsConnection::ApplyLoop, this);
+  }
+
+  // apply everything received so far and stop apply thread
+  void StopPipeline() {
+    if(!pipeline_running_)
+      return;
+    pipeline_running_ = false;
+    apply_thread_.join();
+    CheckApplyError();
+    // batches coalesced by apply thread are not committed yet
+    engine_.Flush();
+  }
+
+  // wait until everything received so far is applied to storage
+  void FlushPipeline() {
+    if(!pipeline_running_)
+      return;
+    ad::util::Backoff backoff;
+    while(batches_applied_ < pipeline_stats_.batches_received)
+      backoff.Wait();
+    CheckApplyError();
+  }
+
+  // record spans of ingest and query paths into per-thread buffers, events_per_thread newest events are kept
+  void EnableTracing(bool enable, size_t events_per_thread = 65536) {
+    ad::util::Tracer::Instance().Enable(enable, events_per_thread);
+  }
+
+  // write recorded spans as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+  void WriteTrace(const std::string& path) {
+    if(!ad::util::Tracer::Instance().Write(path))
+      throw std::runtime_error("Unable to write trace to "+path);
+  }
+
+  // calls f(tablename, stats) for every opened table
+  template<typename F> void ForEachTableStats(F f) {
+    std::lock_guard<std::mutex> lock(tables_mutex_);
+    for(auto& t : tables_)
+      f(t.first, static_cast<const ad::util::TableStats&>(t.second->stats));
+  }
+
+  const ad::util::StorageStats& GetStorageStats() {
+    return engine_.GetStats();
+  }
+
+  // all stats in Prometheus text exposition format
+  std::string PrometheusStats() {
+    std::ostringstream os;
+    std::vector<std::pair<std::string, std::function<uint64_t(const ad::util::TableStats&)> > > counters = {
+      {"refreshes", [](auto& s) { return s.refreshes.load(); }},
+      {"batches", [](auto& s) { return s.batches.load(); }},
+      {"rows", [](auto& s) { return s.rows.load(); }},
+      {"bytes", [](auto& s) { return s.bytes.load(); }},
+      {"inserts", [](auto& s) { return s.inserts.load(); }},
+      {"updates", [](auto& s) { return s.updates.load(); }},
+      {"prepares", [](auto& s) { return s.prepares.load(); }},
+      {"errors", [](auto& s) { return s.errors.load(); }},
+    };
+    std::lock_guard<std::mutex> lock(tables_mutex_);
+    for(auto& c : counters) {
+      os << "# TYPE asts_" << c.first << "_total counter\n";
+      for(auto& t : tables_)
+        ad::util::PrometheusCounter(os, "asts_"+c.first+"_total", "table=\""+t.first+"\"", c.second(t.second->stats));
+    }
+    os << "# TYPE asts_refresh_seconds histogram\n";
+    for(auto& t : tables_)
+      ad::util::PrometheusHistogram(os, "asts_refresh_seconds", "table=\""+t.first+"\"", t.second->stats.refresh_latency);
+    os << "# TYPE asts_apply_seconds histogram\n";
+    for(auto& t : tables_)
+      ad::util::PrometheusHistogram(os, "asts_apply_seconds", "table=\""+t.first+"\"", t.second->stats.apply_latency);
+    auto& storage = engine_.GetStats();
+    os << "# TYPE asts_commits_total counter\n";
+    ad::util::PrometheusCounter(os, "asts_commits_total", "", storage.commits.load());
+    os << "# TYPE asts_commit_seconds histogram\n";
+    ad::util::PrometheusHistogram(os, "asts_commit_seconds", "", storage.commit_latency);
+    return os.str();
+  }
+
+  // write PrometheusStats to path every interval_ms milliseconds
+  void StartStatsExport(const std::string& path, size_t interval_ms) {
+    StopStatsExport();
+    stats_export_running_ = true;
+    stats_thread_ = std::thread(&AstsConnection::StatsExportLoop, this, path, std::chrono::milliseconds(interval_ms));
+  }
+
+  void StopStatsExport() {
+    {
+      std::lock_guard<std::mutex> lock(stats_export_mutex_);
+      stats_export_running_ = false;
+    }
+    stats_export_cv_.notify_all();
+    if(stats_thread_.joinable())
+      stats_thread_.join();
+  }
+
+  PipelineStats GetPipelineStats() {
+    PipelineStats stats;
+    // applied first: a batch counted as applied is already counted as received
+    stats.batches_applied = batches_applied_;
+    stats.max_queue_depth = pipeline_stats_.max_queue_depth;
+    stats.capacity = pipeline_stats_.capacity;
+    stats.batches_received = pipeline_stats_.batches_received;
+    stats.bytes_received = pipeline_stats_.bytes_received;
+    stats.producer_stalls = pipeline_stats_.producer_stalls;
+    stats.queue_depth = stats.batches_received - stats.batches_applied;
+    return stats;
+  }
+
   void Connect(const std::string & system, const std::string & params){
     if(handles_.find(system) == handles_.end())
       throw std::runtime_error("Invalid system "+system);
+    if(attached_)
+      throw std::runtime_error("Connection attached to published storage can not connect to gateway");
     if(handles_[system] >= 0)
       throw std::runtime_error("System "+system+" is already connected!");
 
+    ad::util::TraceSpan span("Connect", system);
     char ErrMsg[256];
-    handles_[system] = MTEConnect((char*)params.c_str(), ErrMsg);
+    {
+      std::lock_guard<std::mutex> api_lock(api_mutexes_[system]);
+      handles_[system] = MTEConnect((char*)params.c_str(), ErrMsg);
+    }
 
     if(handles_[system] < 0)
       throw std::runtime_error("MTEConnect returned an error: "+std::to_string(handles_[system])+" "+std::string(ErrMsg));
 
-    interfaces_[system] = std::make_shared<AstsInterface>();
+    // interface description is cached on disk by its name and gateway address from connection parameters
+    std::string cache_path;
+    std::string iface_name = GetConnectParam(params, "INTERFACE");
+    if(!interface_cache_dir_.empty() && !iface_name.empty()) {
+      std::string gateway = GetConnectParam(params, "HOST")+"\n"+GetConnectParam(params, "SERVER")+"\n"+GetConnectParam(params, "SERVICE");
+      char suffix[18];
+      snprintf(suffix, sizeof(suffix), "-%016llx", (unsigned long long)ad::util::fnv1a(gateway.data(), gateway.size()));
+      cache_path = interface_cache_dir_+"/"+iface_name+suffix+".ifc";
+    }
     std::string errmsg;
-    if(!interfaces_[system]->LoadInterface(handles_[system], errmsg, debug))
+    auto iface = AstsInterface::Load(handles_[system], cache_path, iface_name, errmsg, debug);
+    if(!iface)
       throw std::runtime_error("Unable to load interface! "+errmsg);
-    engine_.AddInterface(interfaces_[system]);
+    auto restored = interfaces_.find(system);
+    if(restored != interfaces_.end()) {
+      // interface restored from snapshot: keep it if gateway still has the same one
+      if(restored->second->raw_ == iface->raw_)
+        return;
+      // otherwise tables restored with old layout can not be resumed
+      std::lock_guard<std::mutex> lock(tables_mutex_);
+      for(auto it = tables_.begin(); it != tables_.end(); )
+        if(it->second->iface_ == restored->second) {
+          engine_.CloseTable(it->first);
+          delete it->second;
+          it = tables_.erase(it);
+        }
+        else
+          ++it;
+      engine_.RemoveInterface(restored->second);
+    }
+    {
+      std::unique_lock<std::shared_mutex> lock(interfaces_mutex_);
+      interfaces_[system] = iface;
+    }
+    engine_.AddInterface(iface);
   }
 
   void Disconnect(const std::string & system){
     if(handles_.find(system) == handles_.end())
       return;
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+    StopLinks(system);
     if(handles_[system] >= 0) {
+      std::lock_guard<std::mutex> api_lock(api_mutexes_[system]);
       MTEDisconnect(handles_[system]);
       handles_[system] = -1;
     }
+    std::unique_lock<std::shared_mutex> lock(interfaces_mutex_);
+    if(interfaces_.find(system) == interfaces_.end())
+      return;
     engine_.RemoveInterface(interfaces_[system]);
     interfaces_.erase(system);
   }
 
+  // connect one more gateway link to a connected system: updatable tables are refreshed over all links
+  // at once and every row is applied from the link delivering it first; a stalled or failed link is
+  // bypassed. The gateway must serve the same interface
+  void AddRedundantLink(const std::string& system, const std::string& params) {
+    if(handles_.find(system) == handles_.end())
+      throw std::runtime_error("Invalid system "+system);
+    if(handles_[system] < 0 || interfaces_.find(system) == interfaces_.end())
+      throw std::runtime_error("System "+system+" is not connected");
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+    ad::util::TraceSpan span("Connect", system);
+    char ErrMsg[256];
+    int handle = MTEConnect((char*)params.c_str(), ErrMsg);
+    if(handle < 0)
+      throw std::runtime_error("MTEConnect returned an error: "+std::to_string(handle)+" "+std::string(ErrMsg));
+    std::string errmsg;
+    auto iface = AstsInterface::Load(handle, "", "", errmsg, debug);
+    if(!iface || iface->raw_ != interfaces_[system]->raw_) {
+      MTEDisconnect(handle);
+      throw std::runtime_error(iface ? "Gateway link of "+system+" serves another interface" : "Unable to load interface! "+errmsg);
+    }
+    auto& links = links_[system];
+    auto start = [&](int h, std::mutex* api_mutex) {
+      auto link = std::make_unique<FeedLink>();
+      link->system = system;
+      link->index = links.size();
+      link->handle = h;
+      link->api_mutex = api_mutex ? api_mutex : &link->own_mutex;
+      link->stats.system = system;
+      link->stats.primary = link->index == 0;
+      links.push_back(std::move(link));
+      return links.back().get();
+    };
+    if(links.empty()) {
+      // primary connection becomes link 0
+      FeedLink* primary = start(handles_[system], &api_mutexes_[system]);
+      for(auto& t : tables_)
+        if(GetSystemFromTableName(t.first) == system && (t.second->thistable_->attr & mmfUpdateable) && t.second->Table >= 0) {
+          primary->tables[t.second->Table] = t.second;
+          mergers_.emplace(t.first, ad::util::FeedMerger(1, merge_window_));
+        }
+    }
+    FeedLink* link = start(handle, nullptr);
+    for(auto& t : tables_) {
+      auto merger = mergers_.find(t.first);
+      if(merger == mergers_.end())
+        continue;
+      merger->second.AddLink();
+      std::string tparams = t.second->ParamsToStr();
+      MTEMSG *TableData;
+      int table = MTEOpenTable(handle, (char *)t.second->thistable_->name.c_str(), (char *)tparams.c_str(), 1, &TableData);
+      if(table >= 0)
+        link->tables[table] = t.second;
+      else
+        link->stats.last_error = "Unable to load table "+t.first+": "+std::string(TableData->Data, TableData->DataLen);
+    }
+    for(auto& l : links)
+      if(!l->worker.joinable())
+        l->worker = std::thread(&AstsConnection::LinkLoop, this, l.get());
+  }
+
+  // link waiting for a reply longer than stall_timeout_ms no longer counts as healthy, so a link which
+  // is not aligned may take over; window_rows recent rows of each table are kept to match links against
+  void SetRedundancy(size_t stall_timeout_ms, size_t window_rows = 65536) {
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+    stall_timeout_ = std::chrono::milliseconds(stall_timeout_ms);
+    merge_window_ = window_rows;
+  }
+
+  std::vector<LinkStats> GetLinkStats() {
+    std::lock_guard<std::mutex> lock(links_mutex_);
+    std::vector<LinkStats> result;
+    for(auto& s : links_)
+      for(auto& l : s.second) {
+        result.push_back(l->stats);
+        result.back().busy = l->busy;
+      }
+    return result;
+  }
+
   void OpenTable(const std::string tablename, inparams_t inparams={}) {
     std::string system = GetSystemFromTableName(tablename);
+    ad::util::TraceSpan span("OpenTable", tablename);
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
     NewTableInternal(system, tablename);
     auto tbl = tables_[tablename];
     if(!inparams.empty())
         tbl->inparams = inparams;
     MTEMSG *TableData;
     std::string params = tbl->ParamsToStr();
+    std::lock_guard<std::mutex> api_lock(api_mutexes_[system]);
     tbl->Table = MTEOpenTable(handles_[system], (char *)tbl->thistable_->name.c_str(), (char *)params.c_str(), 1, &TableData);
     if(tbl->Table < 0)
       throw std::runtime_error("Unable to load table "+tbl->tablename_+": "+std::string(TableData->Data, TableData->DataLen));
-    LoadTableData(tbl, (int32_t*)(TableData->Data));
+    LoadTableData(tbl, (int32_t*)(TableData->Data), TableData->DataLen);
+    OpenOnLinks(tbl, system);
   }
 
-  void RefreshTable(const std::string tablename) {
-    std::string system = GetSystemFromTableName(tablename);
-    if(tables_.find(tablename) == tables_.end())
-        throw std::runtime_error("Table "+tablename+" has not been opened");
-    AstsOpenedTable * tbl = tables_[tablename];
-    if((tbl->thistable_->attr & mmfUpdateable) == 0) {
-      // delete table data and reload it
-      inparams_t temp_inparams = tbl->inparams;
-      CloseTable(tablename);
-      OpenTable(tablename, temp_inparams);
+  // open several tables at once: tables of each system are downloaded by a thread of their own, while
+  // the caller applies downloaded ones to storage. Startup takes about as long as the largest table
+  void OpenTables(const std::vector<std::pair<std::string, inparams_t> >& tablelist) {
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+    // storage is written by this thread only
+    FlushPipeline();
+    std::set<std::string> names;
+    for(auto& t : tablelist) {
+      // check the whole list first, so a bad name does not leave other tables half-opened
+      std::string system = GetSystemFromTableName(t.first);
+      if(interfaces_.find(system) == interfaces_.end())
+        throw std::runtime_error("System "+system+" is not connected");
+      if(interfaces_[system]->tables.find(t.first) == interfaces_[system]->tables.end())
+        throw std::runtime_error("Table "+t.first+" does not exist in interface "+interfaces_[system]->name_);
+      if(tables_.find(t.first) != tables_.end() || !names.insert(t.first).second)
+        throw std::runtime_error("Table "+t.first+" has been already opened");
     }
-    else {
-      // send refresh request and update data
-      if(tbl->Table < 0)
-        throw std::runtime_error("Table handle is invalid");
-      MTEMSG *TableData;
-      int res = MTEAddTable(handles_[system], tbl->Table, tbl->ref);
-      if(res != MTE_OK)
-        throw std::runtime_error(std::string("MTEAddTable returned an error: ")+MTEErrorMsg(res));
-      res = MTERefresh(handles_[system], &TableData);
-      if(res != MTE_OK)
-        throw std::runtime_error(std::string("MTERefresh returned an error: ")+MTEErrorMsg(res));
-      int32_t * ptr=(int32_t *)(TableData->Data);
-      switch(*ptr) { // tablecount
-      case 0:
-          break;
-      case 1:
-          LoadTableData(tbl, ptr+1);
+    std::map<std::string, std::vector<AstsOpenedTable*> > systems;
+    for(auto& t : tablelist) {
+      std::string system = GetSystemFromTableName(t.first);
+      NewTableInternal(system, t.first);
+      auto tbl = tables_[t.first];
+      if(!t.second.empty())
+        tbl->inparams = t.second;
+      tbl->Table = -1; // not opened by gateway yet, see cleanup below
+      systems[system].push_back(tbl);
+    }
+
+    struct Downloaded {
+      AstsOpenedTable* table = nullptr;
+      std::string system;
+      std::vector<int32_t> data;
+      size_t len = 0;
+    };
+    std::deque<Downloaded> ready;
+    std::map<std::string, size_t> waiting; // downloaded tables of each system not applied yet
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t running = systems.size();
+    std::exception_ptr error;
+
+    auto download = [&](const std::string& system, const std::vector<AstsOpenedTable*>& tbls) {
+      if(ad::util::Tracer::Enabled())
+        ad::util::Tracer::Instance().SetThreadName("open "+system);
+      try {
+        for(auto tbl : tbls) {
+          {
+            // next table is downloaded while the previous one is applied, at most one more waits in memory
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]{ return waiting[system] <= 1 || error; });
+            if(error)
+              break;
+          }
+          Downloaded d;
+          d.table = tbl;
+          d.system = system;
+          {
+            ad::util::TraceSpan span("OpenTable", tbl->tablename_);
+            MTEMSG *TableData;
+            std::string params = tbl->ParamsToStr();
+            // TableData is valid until the next call on this handle, so it is copied
+            std::lock_guard<std::mutex> api_lock(api_mutexes_[system]);
+            tbl->Table = MTEOpenTable(handles_[system], (char *)tbl->thistable_->name.c_str(), (char *)params.c_str(), 1, &TableData);
+            if(tbl->Table < 0)
+              throw std::runtime_error("Unable to load table "+tbl->tablename_+": "+std::string(TableData->Data, TableData->DataLen));
+            d.data.resize((TableData->DataLen + sizeof(int32_t) - 1) / sizeof(int32_t));
+            memcpy(d.data.data(), TableData->Data, TableData->DataLen);
+            d.len = TableData->DataLen;
+            span.SetCount(TableData->DataLen);
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          ready.push_back(std::move(d));
+          ++waiting[system];
+          cv.notify_all();
+        }
+      }
+      catch(...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!error)
+          error = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      --running;
+      cv.notify_all();
+    };
+    std::vector<std::thread> threads;
+    for(auto& s : systems)
+      threads.emplace_back(download, s.first, s.second);
+
+    while(true) {
+      Downloaded d;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]{ return !ready.empty() || !running; });
+        if(ready.empty())
           break;
-      default:
-          // TODO: add support for multiple tables in refresh
-          throw std::runtime_error("Too many tables in MTERefresh()!");
+        d = std::move(ready.front());
+        ready.pop_front();
+        if(error)
+          d.table = nullptr; // discard the rest after an error
+      }
+      if(d.table) {
+        try {
+          LoadTableData(d.table, d.data.data(), d.len);
+        }
+        catch(...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if(!error)
+            error = std::current_exception();
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      --waiting[d.system];
+      cv.notify_all();
+    }
+    for(auto& t : threads)
+      t.join();
+    if(error) {
+      // forget all tables of the list, so the call may be retried
+      for(auto& s : systems)
+        for(auto tbl : s.second) {
+          if(handles_[s.first] >= 0 && tbl->Table >= 0) {
+            std::lock_guard<std::mutex> api_lock(api_mutexes_[s.first]);
+            MTECloseTable(handles_[s.first], tbl->Table);
+          }
+          engine_.CloseTable(tbl->tablename_);
+          std::lock_guard<std::mutex> lock(tables_mutex_);
+          tables_.erase(tbl->tablename_);
+          delete tbl;
+        }
+      std::rethrow_exception(error);
+    }
+    for(auto& s : systems)
+      for(auto tbl : s.second)
+        OpenOnLinks(tbl, s.first);
+  }
+
+  void RefreshTable(const std::string tablename) {
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+    RefreshTableInternal(tablename);
+  }
+
+  // refresh table every interval_ms by scheduler; the interval grows up to max_interval_ms (16 intervals
+  // by default) while refreshes bring no rows and goes back when data arrives. Zero interval removes the schedule
+  void SetRefreshSchedule(const std::string& tablename, size_t interval_ms, int priority = 0, size_t max_interval_ms = 0) {
+    {
+      std::lock_guard<std::mutex> lock(schedules_mutex_);
+      if(!interval_ms) {
+        schedules_.erase(tablename);
+        return;
       }
+      if(tables_.find(tablename) == tables_.end())
+        throw std::runtime_error("Table "+tablename+" has not been opened");
+      RefreshSchedule& s = schedules_[tablename];
+      s.table = tables_[tablename];
+      s.system = GetSystemFromTableName(tablename);
+      s.target = std::chrono::milliseconds(interval_ms);
+      s.max = std::chrono::milliseconds(std::max(interval_ms, max_interval_ms ? max_interval_ms : 16*interval_ms));
+      s.interval = s.target;
+      s.priority = priority;
+      s.due = std::chrono::steady_clock::now();
+    }
+    std::lock_guard<std::mutex> lock(scheduler_mutex_);
+    schedules_changed_ = true;
+    scheduler_cv_.notify_all();
+  }
+
+  // refresh scheduled tables which are due now, for callers driving refresh loop themselves;
+  // returns number of tables refreshed and milliseconds until the next table is due
+  std::pair<size_t, size_t> RefreshDue() {
+    size_t refreshed = 0;
+    auto next = RefreshDueTables(&refreshed);
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now());
+    return {refreshed, wait.count() > 0 ? wait.count() : 0};
+  }
+
+  // refresh scheduled tables by a background thread. RefreshTable may still be called, refreshes do not overlap
+  void StartScheduler() {
+    std::lock_guard<std::mutex> lock(scheduler_mutex_);
+    if(scheduler_running_)
       return;
+    if(scheduler_thread_.joinable())
+      scheduler_thread_.join(); // stopped by an error
+    scheduler_error_ = nullptr;
+    scheduler_running_ = true;
+    scheduler_thread_ = std::thread(&AstsConnection::SchedulerLoop, this);
+  }
 
+  // stop scheduler thread, rethrow the error which stopped it
+  void StopScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(scheduler_mutex_);
+      scheduler_running_ = false;
+    }
+    scheduler_cv_.notify_all();
+    if(scheduler_thread_.joinable())
+      scheduler_thread_.join();
+    if(scheduler_error_) {
+      std::exception_ptr e = scheduler_error_;
+      scheduler_error_ = nullptr;
+      std::rethrow_exception(e);
     }
   }
 
+  bool SchedulerRunning() {
+    std::lock_guard<std::mutex> lock(scheduler_mutex_);
+    return scheduler_running_;
+  }
+
+  // calls f(tablename, current interval, priority, time until due) for every scheduled table
+  template<typename F> void ForEachRefreshSchedule(F f) {
+    std::lock_guard<std::mutex> lock(schedules_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    for(auto& s : schedules_)
+      f(s.first, s.second.interval, s.second.priority, std::chrono::duration_cast<std::chrono::milliseconds>(s.second.due - now));
+  }
+
+  // parameters of transaction formatted once, values not given are defaults from interface description
+  std::shared_ptr<TransactionTemplate> PrepareTransaction(const std::string& system, const std::string& name, const inparams_t& values = {}) {
+    std::shared_lock<std::shared_mutex> lock(interfaces_mutex_);
+    auto iface = interfaces_.find(system);
+    if(iface == interfaces_.end())
+      throw std::runtime_error("System "+system+" is not connected");
+    auto trans = iface->second->transactions.find(name);
+    if(trans == iface->second->transactions.end())
+      throw std::runtime_error("Transaction "+name+" is not found in "+system+" interface");
+    return std::make_shared<TransactionTemplate>(system, trans->second, values);
+  }
+
+  // send transaction with parameters made from template, returns gateway message
+  std::string ExecTransaction(const TransactionTemplate& tmpl, std::string& params) {
+    int handle = handles_[tmpl.System()];
+    if(handle < 0)
+      throw std::runtime_error("System "+tmpl.System()+" is not connected");
+    ad::util::TraceSpan span("ExecTrans", tmpl.Name());
+    char result[256] = {0};
+    int res;
+    {
+      std::lock_guard<std::mutex> api_lock(api_mutexes_[tmpl.System()]);
+      res = MTEExecTrans(handle, (char*)tmpl.Name().c_str(), params.data(), result);
+    }
+    if(res != MTE_OK)
+      throw std::runtime_error("MTEExecTrans returned an error: "+std::to_string(res)+" "+(result[0] ? std::string(result) : std::string(MTEErrorMsg(res))));
+    return result;
+  }
+
   void CloseTable(const std::string tablename) {
     std::string system = GetSystemFromTableName(tablename);
     if (tables_.find(tablename) == tables_.end())
       throw std::runtime_error("Table "+tablename+" has not been opened");
-    if(handles_[system] >= 0)
-      MTECloseTable(handles_[system], tables_[tablename]->ref);
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(schedules_mutex_);
+      schedules_.erase(tablename);
+    }
+    // apply thread must not see this table anymore
+    FlushPipeline();
+    CloseOnLinks(tables_[tablename], system);
+    if(handles_[system] >= 0 && tables_[tablename]->Table >= 0) {
+      std::lock_guard<std::mutex> api_lock(api_mutexes_[system]);
+      MTECloseTable(handles_[system], tables_[tablename]->Table);
+    }
     engine_.CloseTable(tablename);
+    std::lock_guard<std::mutex> lock(tables_mutex_);
     delete tables_[tablename];
     tables_.erase(tablename);
   }
 
+  // declare secondary index on a table, it is created at once if table is opened
+  void AddIndex(const std::string& tablename, const IndexSpec& spec) {
+    engine_.AddIndex(tablename, spec);
+  }
+
+  // index fields flagged ffSecCode (instrument code) in tables opened after this call
+  void SetSecCodeIndex(bool enable) {
+    engine_.SetSecCodeIndex(enable);
+  }
+
+  // read index declarations from INI file:
+  //   seccode_index = 1             ; optional, same as SetSecCodeIndex
+  //   [orders_by_client]            ; index name
+  //   table = TE$ORDERS
+  //   columns = CLIENTCODE, SECCODE
+  //   include = PRICE, QUANTITY     ; optional covering columns
+  //   where = STATUS = 'O'          ; optional partial index condition
+  //   unique = 0                    ; optional
+  void LoadIndexConfig(const std::string& path) {
+    namespace pt = boost::property_tree;
+    pt::ptree config;
+    pt::read_ini(path, config);
+    auto split = [](const std::string& list) {
+      std::vector<std::string> result;
+      boost::split(result, list, boost::is_any_of(","));
+      for(auto& item : result)
+        boost::trim(item);
+      result.erase(std::remove(result.begin(), result.end(), ""), result.end());
+      return result;
+    };
+    for(auto& section : config) {
+      if(section.second.empty()) {
+        if(section.first == "seccode_index")
+          SetSecCodeIndex(section.second.get_value<bool>());
+        continue;
+      }
+      IndexSpec spec;
+      spec.name = section.first;
+      std::string tablename = section.second.get<std::string>("table", "");
+      if(tablename.empty())
+        throw std::runtime_error("Index "+spec.name+" in "+path+" has no table");
+      spec.columns = split(section.second.get<std::string>("columns", ""));
+      spec.include = split(section.second.get<std::string>("include", ""));
+      spec.where = section.second.get<std::string>("where", "");
+      spec.unique = section.second.get<bool>("unique", false);
+      AddIndex(tablename, spec);
+    }
+  }
+
+  // keep interface descriptions in dir, keyed by INTERFACE and gateway address connection parameters, and skip
+  // MTEStructureEx round-trip on later connects; descriptions are still parsed. Files are checksummed but never
+  // expire, remove them when the gateway changes an interface without changing its name
+  void SetInterfaceCacheDir(const std::string& dir) {
+    interface_cache_dir_ = dir;
+  }
+
+  // save interfaces, opened tables and their contents to a snapshot file
+  void SaveSnapshot(const std::string& path) {
+    FlushPipeline();
+    SnapshotState state;
+    for(auto& iface : interfaces_)
+      state.interfaces[iface.first] = iface.second->raw_;
+    for(auto& t : tables_)
+      state.tables.push_back({t.first, t.second->ParamsToStr(), t.second->ref});
+    engine_.SaveSnapshot(path, state);
+  }
+
+  // keep storage in a database file at path (e.g. on /dev/shm) which processes on the same host query
+  // with AttachPublished instead of opening their own gateway connections; must be called before Connect.
+  // Queries of this process then read WAL snapshots and no longer hold up commits of the in-memory database
+  void Publish(const std::string& path) {
+    if(!tables_.empty() || !interfaces_.empty())
+      throw std::runtime_error("Storage must be published before connecting");
+    engine_.Publish(path);
+  }
+
+  // query storage published by another process, read-only. Calling it again picks up interfaces
+  // the publisher connected since
+  void AttachPublished(const std::string& path) {
+    if(!tables_.empty() || (!attached_ && !interfaces_.empty()))
+      throw std::runtime_error("Storage must be attached before connecting");
+    SnapshotState state;
+    engine_.AttachPublished(path, state);
+    std::unique_lock<std::shared_mutex> lock(interfaces_mutex_);
+    interfaces_.clear();
+    for(auto& rec : state.interfaces)
+      interfaces_[rec.first] = AstsInterface::FromRaw(rec.second);
+    attached_ = true;
+  }
+
+  // restore state saved by SaveSnapshot before connecting: queries are served from snapshot
+  // at once, tables are refreshed by ResumeTables after Connect
+  void LoadSnapshot(const std::string& path) {
+    if(!tables_.empty() || !interfaces_.empty())
+      throw std::runtime_error("Snapshot must be loaded before connecting");
+    SnapshotState state;
+    engine_.LoadSnapshot(path, state);
+    {
+      std::unique_lock<std::shared_mutex> lock(interfaces_mutex_);
+      for(auto& rec : state.interfaces)
+        interfaces_[rec.first] = AstsInterface::FromRaw(rec.second);
+    }
+    for(auto& rec : state.tables) {
+      std::string system = GetSystemFromTableName(rec.tablename);
+      if(interfaces_.find(system) == interfaces_.end())
+        throw std::runtime_error("Snapshot has no interface for table "+rec.tablename);
+      NewTableInternal(system, rec.tablename);
+      auto tbl = tables_[rec.tablename];
+      // table handle is valid only within MTESRL session, table waits for ResumeTables
+      tbl->Table = -1;
+      tbl->ref = rec.ref;
+      size_t pos = 0;
+      for(auto& fld : tbl->thistable_->infields) {
+        std::string value = rec.params.substr(pos, fld.size);
+        pos += fld.size;
+        size_t len = value.find_last_not_of(' ');
+        if(len != std::string::npos)
+          tbl->inparams[fld.name] = value.substr(0, len+1);
+      }
+    }
+  }
+
+  // open tables restored from snapshot on connected systems; new copy of each table replaces
+  // the restored one in a single transaction, so queries never see a partially loaded table
+  void ResumeTables() {
+    std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+    for(auto& t : tables_) {
+      AstsOpenedTable* tbl = t.second;
+      std::string system = GetSystemFromTableName(t.first);
+      if(tbl->Table >= 0 || handles_[system] < 0)
+        continue;
+      ReopenTable(tbl, system);
+      OpenOnLinks(tbl, system);
+    }
+  }
+
   void Query(const std::string& query, SqlResult& result) {
     if(query.empty())
       return;
+    ad::util::TraceSpan span("Query", query);
+    if(flush_before_query_)
+      engine_.Flush();
+    std::shared_lock<std::shared_mutex> lock(interfaces_mutex_);
     engine_.Query(query, result, interfaces_);
+    span.SetCount(result.data.size());
+  }
+
+  // read-only query results as Arrow C stream of record batches of up to batch_rows rows;
+  // rows are fetched from storage as consumer asks for next batch, all batches see the same data.
+  // In-memory SQLite storage reads all rows when the stream is opened, so an unread stream holds up nothing
+  void QueryArrow(const std::string& query, ArrowArrayStream* out, size_t batch_rows = 65536) {
+    ad::util::TraceSpan span("QueryArrow", query);
+    if(flush_before_query_)
+      engine_.Flush();
+    std::unique_ptr<QueryCursor> cursor;
+    {
+      std::shared_lock<std::shared_mutex> lock(interfaces_mutex_);
+      cursor = engine_.OpenCursor(query, interfaces_);
+    }
+    ArrowExport::ExportStream(std::move(cursor), batch_rows, out);
+  }
+
+#ifdef ASTSSQLPY_ARROW
+  void ExportParquet(const std::string& query, const std::string& path, size_t batch_rows = 65536) {
+    ArrowArrayStream stream;
+    QueryArrow(query, &stream, batch_rows);
+    WriteParquet(&stream, path);
+  }
+
+  void ExportArrowFile(const std::string& query, const std::string& path, size_t batch_rows = 65536) {
+    ArrowArrayStream stream;
+    QueryArrow(query, &stream, batch_rows);
+    WriteArrowFile(&stream, path);
+  }
+#endif
+
+  // Refresh batches are committed together when max_rows rows are pending or max_delay_ms passed
+  // since first of them; readers see only committed data. Zero for both commits every batch.
+  // Threshold is checked when a batch is applied and on empty refreshes, CommitPending commits at once.
+  // In-memory SQLite storage commits pending batches before every query, published storage keeps them pending
+  void SetTransactionCoalescing(size_t max_rows, size_t max_delay_ms, bool flush_before_query = false) {
+    engine_.SetTransactionCoalescing(max_rows, max_delay_ms);
+    flush_before_query_ = flush_before_query;
+  }
+
+  void CommitPending() {
+    engine_.Flush();
+  }
+
+  // refreshes of at least this many rows into an empty table (initial snapshots, reloads)
+  // are inserted without indexes, which are built after the load; 0 disables this
+  void SetBulkLoadThreshold(size_t rows) {
+    engine_.SetBulkLoadThreshold(rows);
+  }
+
+  // point lookup by primary key, key values are given in order of table's key fields
+  bool Get(const std::string& tablename, const std::vector<std::string>& key, SqlResult& result) {
+    return engine_.Get(tablename, key, result);
+  }
+
+  void GetMany(const std::string& tablename, const std::vector<std::vector<std::string> >& keys, SqlResult& result) {
+    engine_.GetMany(tablename, keys, result);
+  }
+
+  uint64_t TableVersion(const std::string& tablename) {
+    return engine_.GetTableVersion(tablename);
+  }
+
+  // listener is called after every refresh batch applied, from the refresh, scheduler or apply thread;
+  // empty listener removes it, no calls are made after return
+  void SetRefreshListener(std::function<void(const std::string&, size_t)> listener) {
+    std::lock_guard<std::mutex> lock(refresh_listener_mutex_);
+    refresh_listener_ = std::move(listener);
+  }
+
+  void SetQueryCacheSize(size_t size) {
+    engine_.SetQueryCacheSize(size);
+  }
+
+  // log queries running at least threshold_ms to MTE$SLOWLOG table: plan, scan counters and suggested indexes
+  void SetSlowQueryLog(size_t threshold_ms, size_t max_entries = 1000) {
+    engine_.SetSlowQueryLog(threshold_ms, max_entries);
+  }
+
+  // Query and Get may be called from several threads concurrently with one ingest thread
+  void SetReaderCount(size_t count) {
+    engine_.SetReaderCount(count);
+  }
+
+  // keep only the last max_rows rows of a table and rows received within max_age_ms (0 is no limit),
+  // older rows are deleted on commit; meant for append-only tables like trades
+  void SetRetention(const std::string& tablename, size_t max_rows, size_t max_age_ms = 0) {
+    RetentionPolicy policy;
+    policy.max_rows = max_rows;
+    policy.max_age = std::chrono::milliseconds(max_age_ms);
+    engine_.SetRetention(tablename, policy);
+  }
+
+  // record changed fields of every row applied to table, with receive time, in a log of max_bytes bytes
+  // (0 disables it): intraday history of quotes or order states. SQL reads it as asts_history('<table>')
+  void SetHistory(const std::string& tablename, size_t max_bytes) {
+    engine_.SetHistory(tablename, max_bytes);
+  }
+
+  // changes of table received within [from_us, to_us], microseconds since epoch
+  void GetHistory(const std::string& tablename, int64_t from_us, int64_t to_us, SqlResult& result) {
+    engine_.GetHistory(tablename, from_us, to_us, result);
+  }
+
+  // rows, bytes and index bytes of every table, size of storage and memory allocated by it
+  MemoryUsage GetMemoryUsage() {
+    MemoryUsage usage;
+    engine_.GetMemoryUsage(usage);
+    return usage;
   }
 
 };
@@ -1,111 +1,208 @@
 #include "asts_interface.h"
 
 #include <fstream>
+#include <iterator>
+#include <stdio.h> // rename, snprintf
+#include <unistd.h> // unlink
 
 #include "mtesrl.h"
 #include "mteerr.h"
 
 namespace ad::asts {
 
-void AstsGenericField::ReadFromBuf(ut::PointerHelper& pointer) {
+// smallest sizes of interface items, counts read from buffer are checked against them;
+// an empty string is its length only, so every item takes at least 4 bytes per string or integer
+static const size_t kMinFieldSize = (4+4)*sizeof(int32_t);       // 4 strings, 4 integers
+static const size_t kMinInFieldSize = (5+4)*sizeof(int32_t);     // and default value
+static const size_t kMinTableSize = (3+4)*sizeof(int32_t);       // 3 strings, 4 integers
+static const size_t kMinTransactionSize = (3+2)*sizeof(int32_t); // 3 strings, 2 integers
+static const size_t kMinEnumTypeSize = (3+3)*sizeof(int32_t);    // 3 strings, 3 integers
+static const size_t kMinEnumSize = 3*sizeof(int32_t);            // 3 strings
+
+void AstsGenericField::ReadFromBuf(ut::BufferReader& pointer) {
   name = pointer.ReadString();
-  pointer.RewindString(); // caption
-  pointer.RewindString(); // description
-  size = (fld_size_t)pointer.ReadInt();
+  pointer.SkipString(); // caption
+  pointer.SkipString(); // description
+  size = (fld_size_t)pointer.ReadSize();
   type = (AstsFieldType)pointer.ReadInt();
   decimals = pointer.ReadInt();
   attr = (fld_attr_t)pointer.ReadInt();
-  pointer.RewindString(); // enumname
+  pointer.SkipString(); // enumname
+  // decimal point is inserted at size-decimals when value is decoded
+  if(type == AstsFieldType::kFixed && (decimals < 0 || (fld_size_t)decimals > size))
+    throw std::runtime_error("Field "+name+" has "+std::to_string(decimals)+" decimals in "+std::to_string(size)+" characters");
 }
 
-void AstsInField::ReadFromBuf(ut::PointerHelper& pointer) {
+void AstsInField::ReadFromBuf(ut::BufferReader& pointer) {
   AstsGenericField::ReadFromBuf(pointer);
   defaultvalue = pointer.ReadString();
 }
 
 //----------------------------------------------------------------------------
 
-void AstsTable::ReadFromBuf(ut::PointerHelper& pointer) {
+void AstsTable::ReadFromBuf(ut::BufferReader& pointer) {
   name = pointer.ReadString();
-  pointer.RewindString(); // caption
-  pointer.RewindString(); // description
+  pointer.SkipString(); // caption
+  pointer.SkipString(); // description
   systemidx = pointer.ReadInt();
   attr = (fld_attr_t)pointer.ReadInt();
-  size_t infieldnum = (size_t)pointer.ReadInt();
-  infields.reserve(infieldnum);
-  for(size_t c=0; c<infieldnum; c++) {
-    AstsInField tmp;
-    tmp.ReadFromBuf(pointer);
-    infields.push_back(tmp);
-  }
-  outfield_count = pointer.ReadInt();
-  outfields.reserve(outfield_count);
-  AstsOutField tmp;
+  size_t infieldnum = pointer.ReadCount(kMinInFieldSize);
+  infields.resize(infieldnum);
+  for(size_t c=0; c<infieldnum; c++)
+    infields[c].ReadFromBuf(pointer);
+  outfield_count = pointer.ReadCount(kMinFieldSize);
+  outfields.resize(outfield_count);
   for(size_t c=0; c<outfield_count; c++) {
-    tmp.ReadFromBuf(pointer);
-    max_fld_len = max_fld_len < tmp.size ? tmp.size : max_fld_len;
-    outfields.push_back(tmp);
-    if((tmp.attr & mffKey) == mffKey) {
-      keyfields.push_back({(int)c, tmp.name});
+    AstsOutField& fld = outfields[c];
+    fld.ReadFromBuf(pointer);
+    max_fld_len = max_fld_len < fld.size ? fld.size : max_fld_len;
+    if((fld.attr & mffKey) == mffKey) {
+      keyfields.push_back({(int)c, fld.name});
     }
   }
 }
 
 //----------------------------------------------------------------------------
 
-bool AstsInterface::LoadInterface(int handle, std::string & errmsg, bool debug) {
-  MTEMSG *ifacedata = nullptr;
-  int interface=0;
-  interface = MTEStructureEx(handle, 3, &ifacedata);
-  if (interface < 0) {
-    errmsg = std::string("MTEStructureEx returned an error: ")+MTEErrorMsg(interface);
-    return false;
+void AstsTransaction::ReadFromBuf(ut::BufferReader& pointer) {
+  name = pointer.ReadString();
+  pointer.SkipString(); // caption
+  pointer.SkipString(); // description
+  systemidx = pointer.ReadInt();
+  size_t infieldnum = pointer.ReadCount(kMinInFieldSize);
+  infields.resize(infieldnum);
+  for(size_t c=0; c<infieldnum; c++)
+    infields[c].ReadFromBuf(pointer);
+}
+
+//----------------------------------------------------------------------------
+
+std::shared_ptr<AstsInterface> AstsInterface::FromRaw(const std::string& raw) {
+  auto iface = std::make_shared<AstsInterface>();
+  iface->raw_ = raw;
+  iface->ReadFromBuf(iface->raw_.data(), iface->raw_.size());
+  return iface;
+}
+
+// cache file: header line with checksum of the buffer, then MTEStructureEx buffer itself
+static const char kCacheMagic[] = "ASTSIFC1 ";
+
+static std::string CacheHeader(const std::string& raw) {
+  char checksum[17];
+  snprintf(checksum, sizeof(checksum), "%016llx", (unsigned long long)ut::fnv1a(raw.data(), raw.size()));
+  return kCacheMagic+std::string(checksum)+"\n";
+}
+
+// buffer from cache file, empty if file is missing or damaged
+static std::string ReadCache(const std::string& cache_path) {
+  std::ifstream cached(cache_path, std::ios::in | std::ios::binary);
+  if(!cached)
+    return "";
+  std::string contents((std::istreambuf_iterator<char>(cached)), std::istreambuf_iterator<char>());
+  size_t eol = contents.find('\n');
+  if(eol == std::string::npos)
+    return "";
+  std::string raw = contents.substr(eol+1);
+  if(contents.compare(0, eol+1, CacheHeader(raw)) != 0)
+    return "";
+  return raw;
+}
+
+std::shared_ptr<AstsInterface> AstsInterface::Load(int handle, const std::string& cache_path, const std::string& name,
+                                                   std::string & errmsg, bool debug) {
+  std::shared_ptr<AstsInterface> iface;
+  if(!cache_path.empty()) {
+    std::string raw = ReadCache(cache_path);
+    try {
+      if(!raw.empty())
+        iface = FromRaw(raw);
+    }
+    catch(const std::exception&) {
+    }
+    // gateway may serve another interface under the name now
+    if(iface && !name.empty() && iface->name_ != name)
+      iface = nullptr;
+  }
+  if(!iface) {
+    MTEMSG *ifacedata = nullptr;
+    int interface = MTEStructureEx(handle, 3, &ifacedata);
+    if (interface < 0) {
+      errmsg = std::string("MTEStructureEx returned an error: ")+MTEErrorMsg(interface);
+      return nullptr;
+    }
+    std::string raw(ifacedata->Data, ifacedata->DataLen);
+    try {
+      iface = FromRaw(raw);
+    }
+    catch(const std::exception& e) {
+      errmsg = std::string("Interface description is invalid: ")+e.what();
+      return nullptr;
+    }
+    if(!cache_path.empty()) {
+      // write under temporary name, concurrent readers never see a partial file
+      std::string tmp_path = cache_path+".tmp";
+      std::ofstream out(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+      std::string header = CacheHeader(raw);
+      out.write(header.data(), header.size());
+      out.write(raw.data(), raw.size());
+      out.close();
+      if(!out || rename(tmp_path.c_str(), cache_path.c_str()) != 0)
+        unlink(tmp_path.c_str());
+    }
   }
-  int * pointer = (int *)ifacedata->Data;
-  ReadFromBuf(pointer);
   if(debug)
-    Dump();
-  return true;
+    iface->Dump();
+  return iface;
 }
 
-void AstsInterface::ReadFromBuf(int* raw_ptr) {
-  ut::PointerHelper pointer(raw_ptr);
+void AstsInterface::ReadFromBuf(const char* data, size_t len) {
+  ut::BufferReader pointer(data, len);
   name_ = pointer.ReadString();
-  pointer.RewindString(); // caption
-  pointer.RewindString(); // description
+  pointer.SkipString(); // caption
+  pointer.SkipString(); // description
   // enums are useless at the moment, so not loaded
   size_t enumtypenum, enumcount;
-  enumtypenum = (size_t)pointer.ReadInt();
+  enumtypenum = pointer.ReadCount(kMinEnumTypeSize);
   for (size_t c=0; c<enumtypenum; c++) {
-    pointer.RewindString(); // name
-    pointer.RewindString(); // caption
-    pointer.RewindString(); // description
-    pointer.RewindInt(); // size
-    pointer.RewindInt(); // enum kind
-    enumcount = (size_t)pointer.ReadInt();
+    pointer.SkipString(); // name
+    pointer.SkipString(); // caption
+    pointer.SkipString(); // description
+    pointer.SkipInt(); // size
+    pointer.SkipInt(); // enum kind
+    enumcount = pointer.ReadCount(kMinEnumSize);
     for (size_t i=0; i<enumcount; i++) {
-      pointer.RewindString(); // value
-      pointer.RewindString(); // long description
-      pointer.RewindString(); // short description
+      pointer.SkipString(); // value
+      pointer.SkipString(); // long description
+      pointer.SkipString(); // short description
     }
   }
   // load tables
-  int tablenum = pointer.ReadInt();
+  size_t tablenum = pointer.ReadCount(kMinTableSize);
   bool got_prefix = false;
-  std::unordered_map<std::string, std::shared_ptr<AstsTable> > tables_temp;
+  std::vector<std::shared_ptr<AstsTable> > tables_temp;
+  tables_temp.reserve(tablenum);
   prefix_ = "RE$";
-  for (int c=0; c<tablenum; c++) {
+  for (size_t c=0; c<tablenum; c++) {
     std::shared_ptr<AstsTable> tmp = std::make_shared<AstsTable>();
     tmp->ReadFromBuf(pointer);
-    tables_temp[tmp->name] = tmp;
+    tables_temp.push_back(tmp);
     if(!got_prefix && tmp->name == "TESYSTIME") {
       prefix_ = "TE$";
       got_prefix = true;
     }
   }
   // add prefix to table name for each table
+  tables.reserve(tables_temp.size());
   for(auto & t_data: tables_temp)
-    tables.insert({ prefix_+t_data.second->name, t_data.second});
+    tables.insert({ prefix_+t_data->name, t_data});
+  // load transactions, they are named without prefix
+  size_t transnum = pointer.ReadCount(kMinTransactionSize);
+  transactions.reserve(transnum);
+  for (size_t c=0; c<transnum; c++) {
+    std::shared_ptr<AstsTransaction> tmp = std::make_shared<AstsTransaction>();
+    tmp->ReadFromBuf(pointer);
+    transactions.insert({tmp->name, tmp});
+  }
 }
 
 void AstsInterface::Dump(void) {
@@ -117,6 +214,10 @@ void AstsInterface::Dump(void) {
   for(auto & rec : tables)
     fl << *rec.second << std::endl;
   fl << std::endl;
+  fl << "Transactions:" << std::endl << std::endl;
+  for(auto & rec : transactions)
+    fl << *rec.second << std::endl;
+  fl << std::endl;
   fl.close();
 }
 
@@ -147,4 +248,12 @@ std::ostream& operator<< (std::ostream& os, const AstsTable& tbl) {
     os << i << std::endl;
   return os;
 }
+
+std::ostream& operator<< (std::ostream& os, const AstsTransaction& trans) {
+  os << "TRANSACTION " << trans.name << std::endl;
+  os << " * IN FIELDS:" <<std::endl;
+  for (AstsInField i : trans.infields)
+    os << i << std::endl;
+  return os;
+}
 }
@@ -6,8 +6,10 @@
 #include <unordered_map>
 #include <vector>
 #include <any>
+#include <atomic>
 #include <memory>
 
+#include "stats.h"
 #include "util.h"
 
 #ifndef MTE_SQL_MAX_FIELDS
@@ -50,13 +52,13 @@ struct AstsGenericField {
   fld_attr_t attr; 
   int decimals;
 
-  void ReadFromBuf(ut::PointerHelper& pointer); 
+  void ReadFromBuf(ut::BufferReader& pointer); 
 };
 
 struct AstsOutField : AstsGenericField {};
 struct AstsInField : AstsGenericField {
   std::string defaultvalue;
-  void ReadFromBuf(ut::PointerHelper& pointer); 
+  void ReadFromBuf(ut::BufferReader& pointer); 
 };
 
 struct AstsTable {
@@ -69,7 +71,16 @@ struct AstsTable {
   std::vector<std::pair<size_t, std::string> > keyfields;
   int systemidx;
 
-  void ReadFromBuf(ut::PointerHelper& pointer);
+  void ReadFromBuf(ut::BufferReader& pointer);
+};
+
+// transaction (order entry, withdrawal etc.) sent by MTEExecTrans, parameters are input fields
+struct AstsTransaction {
+  std::string name;
+  std::vector<AstsInField> infields;
+  int systemidx;
+
+  void ReadFromBuf(ut::BufferReader& pointer);
 };
 
 struct AstsInterface {
@@ -78,9 +89,19 @@ struct AstsInterface {
     std::string caption_="";
     std::string description_="";
     std::unordered_map<std::string, std::shared_ptr<AstsTable> > tables;
-
-    void ReadFromBuf(int * pointer);
-    bool LoadInterface(int handle, std::string & errmsg, bool debug = false);
+    std::unordered_map<std::string, std::shared_ptr<AstsTransaction> > transactions;
+    std::string raw_; // MTEStructureEx buffer the interface was parsed from, kept for snapshots
+
+    // throws if data is truncated or corrupt
+    void ReadFromBuf(const char* data, size_t len);
+    // parsed interface for raw MTEStructureEx buffer
+    static std::shared_ptr<AstsInterface> FromRaw(const std::string& raw);
+    // interface of connection handle, returns nullptr on error. Raw buffer is taken from cache_path file when
+    // its checksum matches and it describes interface name (if given), and saved there otherwise. Only the
+    // MTEStructureEx round-trip is saved, the buffer is parsed every time. Gateway reports no interface
+    // version, so the file never expires: it is valid while the gateway serves the same layout under the name
+    static std::shared_ptr<AstsInterface> Load(int handle, const std::string& cache_path, const std::string& name,
+                                               std::string & errmsg, bool debug = false);
     void Dump(void);
 
     std::string GetSystemType();
@@ -89,12 +110,13 @@ struct AstsInterface {
 struct AstsOpenedTable {
   // MTESRL API parameters
   MTEHandle Table = 0;
-  int ref = 0;
+  std::atomic<int> ref = 0; // set by receiving thread, may be read by apply thread in pipelined mode
 
   std::shared_ptr<AstsInterface> iface_;
   std::shared_ptr<AstsTable> thistable_ = nullptr;
   std::string tablename_;
   std::map<std::string, std::string> inparams;
+  ad::util::TableStats stats;
 
   AstsOpenedTable(std::shared_ptr<AstsInterface> iface, std::string table) noexcept {
     thistable_ = iface->tables[table];
@@ -128,6 +150,7 @@ struct SqlResult {
 std::ostream & operator<< (std::ostream & os, const AstsGenericField & fld);
 std::ostream & operator<< (std::ostream & os, const AstsInField & fld);
 std::ostream & operator<< (std::ostream & os, const AstsTable & tbl);
+std::ostream & operator<< (std::ostream & os, const AstsTransaction & trans);
 
 }
 #endif // ASTS_INTERFACE_H
@@ -0,0 +1,161 @@
+#ifndef ASTS_TRANSACTION_H
+#define ASTS_TRANSACTION_H
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string_view>
+#include <stdio.h> // snprintf
+#include <string.h> // memcpy, memset
+#include <stdlib.h> // strtoll, strtod
+
+#include "asts_interface.h"
+
+namespace ad::asts {
+
+// parameters of MTEExecTrans for one transaction: values of input fields concatenated, each of field size.
+// Text is left-aligned and padded with spaces, numbers are right-aligned and padded with zeros, ftFixed
+// values are sent without decimal point. The string is formatted once from default values, sending a
+// transaction copies it and writes only changing fields (price, quantity) in place.
+class TransactionTemplate {
+  std::string system_;
+  std::shared_ptr<AstsTransaction> trans_;
+  std::string params_;
+  std::vector<size_t> offsets_;
+  std::unordered_map<std::string, size_t> index_;
+
+  void CheckLength(size_t field, size_t len) const {
+    const AstsInField& fld = trans_->infields[field];
+    if(len > fld.size)
+      throw std::runtime_error("Value of field "+fld.name+" of transaction "+trans_->name+" is longer than "+std::to_string(fld.size));
+  }
+
+  void Write(std::string& params, size_t field, const char* value, size_t len, bool right) const {
+    const AstsInField& fld = trans_->infields[field];
+    CheckLength(field, len);
+    char* dest = params.data() + offsets_[field];
+    size_t pad = fld.size - len;
+    memset(right ? dest : dest + len, right ? '0' : ' ', pad);
+    memcpy(right ? dest + pad : dest, value, len);
+  }
+
+  // digits of absolute value right-aligned, sign goes before zero padding
+  void WriteSigned(std::string& params, size_t field, const char* digits, size_t len, bool negative) const {
+    CheckLength(field, negative ? len+1 : len);
+    Write(params, field, digits, len, true);
+    if(negative)
+      params[offsets_[field]] = '-';
+  }
+
+  [[noreturn]] void OutOfRange(size_t field) const {
+    throw std::overflow_error("Value of field "+trans_->infields[field].name+" of transaction "+trans_->name+" is out of range");
+  }
+
+  // value rounded half away from zero like llround, which is undefined for values out of long long range,
+  // NaN and infinity; those and values with more digits than the field are rejected first
+  long long RoundToField(size_t field, double value) const {
+    double rounded = std::round(value);
+    if(!(std::fabs(rounded) < std::pow(10.0, std::min<int>(trans_->infields[field].size, 18))))
+      OutOfRange(field);
+    return (long long)rounded;
+  }
+
+  // text of value with decimals, checked to fit in buffer
+  size_t Format(size_t field, char* buf, size_t size, double value) const {
+    int len = snprintf(buf, size, "%.*f", trans_->infields[field].decimals, value);
+    if(len < 0 || (size_t)len >= size)
+      OutOfRange(field);
+    return len;
+  }
+
+  void WriteNumber(std::string& params, size_t field, long long value) const {
+    char tmp[32];
+    int len = snprintf(tmp, sizeof(tmp), "%llu", value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value);
+    WriteSigned(params, field, tmp, len, value < 0);
+  }
+
+public:
+  TransactionTemplate(const std::string& system, std::shared_ptr<AstsTransaction> trans, const std::map<std::string, std::string>& values)
+      : system_(system), trans_(trans) {
+    size_t size = 0;
+    for(size_t i=0; i<trans_->infields.size(); ++i) {
+      offsets_.push_back(size);
+      size += trans_->infields[i].size;
+      index_[trans_->infields[i].name] = i;
+    }
+    params_.assign(size, ' ');
+    for(size_t i=0; i<trans_->infields.size(); ++i)
+      if(!trans_->infields[i].defaultvalue.empty())
+        SetText(params_, i, trans_->infields[i].defaultvalue);
+    for(auto& v : values)
+      SetText(params_, FieldIndex(v.first), v.second);
+  }
+
+  const std::string& System() const { return system_; }
+  const std::string& Name() const { return trans_->name; }
+  // parameters with default values, copied by every transaction sent
+  const std::string& Params() const { return params_; }
+
+  size_t FieldIndex(const std::string& name) const {
+    auto it = index_.find(name);
+    if(it == index_.end())
+      throw std::runtime_error("Transaction "+trans_->name+" has no field "+name);
+    return it->second;
+  }
+
+  // value given as text is converted to field type, empty text is NULL
+  void SetText(std::string& params, size_t field, std::string_view value) const {
+    const AstsInField& fld = trans_->infields[field];
+    if(value.empty()) {
+      memset(params.data() + offsets_[field], ' ', fld.size);
+      return;
+    }
+    std::string text(value);
+    switch(fld.type) {
+      case AstsFieldType::kInteger:
+        SetInteger(params, field, strtoll(text.c_str(), nullptr, 10));
+        break;
+      case AstsFieldType::kFixed:
+      case AstsFieldType::kFloatPoint:
+        SetDouble(params, field, strtod(text.c_str(), nullptr));
+        break;
+      default:
+        Write(params, field, value.data(), value.size(), false);
+        break;
+    }
+  }
+
+  void SetInteger(std::string& params, size_t field, int64_t value) const {
+    const AstsInField& fld = trans_->infields[field];
+    if(fld.type == AstsFieldType::kFixed)
+      SetDouble(params, field, value);
+    else if(fld.type == AstsFieldType::kInteger)
+      WriteNumber(params, field, value);
+    else
+      SetText(params, field, std::to_string(value));
+  }
+
+  void SetDouble(std::string& params, size_t field, double value) const {
+    const AstsInField& fld = trans_->infields[field];
+    if(!std::isfinite(value))
+      OutOfRange(field);
+    char tmp[64];
+    switch(fld.type) {
+      case AstsFieldType::kFixed:
+        // 10^decimals units; noise below 1e-6 of a unit is removed first, so 2.675 is 268 hundredths
+        WriteNumber(params, field, RoundToField(field, std::nearbyint(value * std::pow(10.0, fld.decimals) * 1e6) / 1e6));
+        break;
+      case AstsFieldType::kInteger:
+        WriteNumber(params, field, RoundToField(field, value));
+        break;
+      case AstsFieldType::kFloatPoint:
+        WriteSigned(params, field, tmp, Format(field, tmp, sizeof(tmp), std::fabs(value)), value < 0);
+        break;
+      default:
+        Write(params, field, tmp, Format(field, tmp, sizeof(tmp), value), false);
+        break;
+    }
+  }
+};
+
+} // ad::asts
+#endif // ASTS_TRANSACTION_H
@@ -0,0 +1,140 @@
+#ifndef ASYNC_DISPATCHER_H
+#define ASYNC_DISPATCHER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <sys/eventfd.h>
+#include <unistd.h> // read, write, close
+
+namespace ad::util {
+
+// runs blocking calls on a pool of worker threads and hands their results over to an event loop thread.
+// The loop watches Fd(), which becomes readable when results are waiting, and takes them with TakeCompleted.
+// Result is produced by a worker and consumed by the loop, it must not need loop thread state to be destroyed
+template<typename Result> class AsyncDispatcher {
+public:
+  typedef std::function<Result()> Task;
+  struct Completion {
+    uint64_t id = 0;
+    Result result;
+    std::exception_ptr error;
+  };
+
+private:
+  int fd_ = -1;
+  size_t worker_count_ = 4;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::pair<uint64_t, Task> > tasks_;
+  std::vector<Completion> completed_;
+  uint64_t next_id_ = 1;
+  size_t running_ = 0;
+  bool stop_ = false;
+
+  void WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(true) {
+      cv_.wait(lock, [this]{ return stop_ || !tasks_.empty(); });
+      if(stop_)
+        break;
+      auto task = std::move(tasks_.front());
+      tasks_.pop_front();
+      ++running_;
+      lock.unlock();
+      Completion c;
+      c.id = task.first;
+      try {
+        c.result = task.second();
+      }
+      catch(...) {
+        c.error = std::current_exception();
+      }
+      lock.lock();
+      --running_;
+      completed_.push_back(std::move(c));
+      Wake();
+    }
+  }
+
+public:
+  AsyncDispatcher() {
+    fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd_ < 0)
+      throw std::runtime_error("Unable to create eventfd for async calls");
+  }
+
+  ~AsyncDispatcher() {
+    Stop();
+    close(fd_);
+  }
+
+  AsyncDispatcher(const AsyncDispatcher&) = delete;
+  AsyncDispatcher& operator=(const AsyncDispatcher&) = delete;
+
+  int Fd() const { return fd_; }
+
+  // number of worker threads, workers already started are kept
+  void SetWorkerCount(size_t count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    worker_count_ = std::max<size_t>(count, 1);
+  }
+
+  // queue task, workers are started by the first call; returns id given to its completion
+  uint64_t Submit(Task task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = false;
+    while(workers_.size() < worker_count_)
+      workers_.emplace_back(&AsyncDispatcher::WorkerLoop, this);
+    uint64_t id = next_id_++;
+    tasks_.emplace_back(id, std::move(task));
+    cv_.notify_one();
+    return id;
+  }
+
+  // make Fd() readable, e.g. when other events for the loop are waiting; safe to call from any thread
+  void Wake() {
+    uint64_t one = 1;
+    ssize_t res = write(fd_, &one, sizeof(one));
+    (void)res; // counter overflow is the only failure, fd stays readable then
+  }
+
+  // clear wake-up and move results of finished tasks to out, called by the loop thread
+  void TakeCompleted(std::vector<Completion>& out) {
+    uint64_t count;
+    ssize_t res = read(fd_, &count, sizeof(count));
+    (void)res;
+    std::lock_guard<std::mutex> lock(mutex_);
+    out.swap(completed_);
+    completed_.clear();
+  }
+
+  // tasks queued or running
+  size_t Pending() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tasks_.size() + running_;
+  }
+
+  // wait for running tasks, queued tasks are dropped and never complete
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      tasks_.clear();
+    }
+    cv_.notify_all();
+    for(auto& w : workers_)
+      w.join();
+    workers_.clear();
+  }
+};
+
+} // ad::util
+#endif // ASYNC_DISPATCHER_H
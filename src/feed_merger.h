@@ -0,0 +1,121 @@
+#ifndef FEED_MERGER_H
+#define FEED_MERGER_H
+
+#include <algorithm>
+#include <deque>
+#include <stdint.h>
+#include <vector>
+
+namespace ad::util {
+
+// merges streams of rows of one table received over redundant links. Every link delivers the same rows
+// in the same order, but with its own batch boundaries and delays; each row is applied once, from the link
+// which delivered it first. Rows are identified by hashes and by their position in the stream, so equal
+// rows sent twice are not mistaken for duplicates.
+class FeedMerger {
+private:
+  std::deque<uint64_t> log_; // hashes of rows applied recently
+  uint64_t log_start_ = 0;   // stream position of log_.front()
+  size_t window_;
+  struct Link {
+    int64_t pos = -1;               // stream position of the next row, -1 until link is aligned with the log
+    std::vector<uint64_t> pending;  // last batch of a link not aligned yet
+  };
+  std::vector<Link> links_;
+
+  // stream position of rows[0]: rows overlapping the log must match it; -1 if there is no such place
+  int64_t Align(const std::vector<uint64_t>& rows, bool whole) const {
+    for(size_t j=0; j<log_.size(); ++j) {
+      if(log_[j] != rows[0])
+        continue;
+      size_t overlap = std::min(rows.size(), log_.size() - j);
+      if(whole && overlap < rows.size())
+        break;
+      size_t i = 1;
+      while(i < overlap && log_[j+i] == rows[i])
+        ++i;
+      if(i == overlap)
+        return log_start_ + j;
+    }
+    return -1;
+  }
+
+  // links whose last batch was not in the log may find it there after other links delivered it
+  void AlignPending() {
+    for(auto& l : links_)
+      if(l.pos < 0 && !l.pending.empty()) {
+        int64_t pos = Align(l.pending, true);
+        if(pos >= 0) {
+          l.pos = pos + l.pending.size();
+          l.pending.clear();
+        }
+      }
+  }
+
+public:
+  // link 0 is aligned at the start: its snapshot is the one loaded into storage
+  FeedMerger(size_t links, size_t window = 65536) : window_(window), links_(links) {
+    if(!links_.empty())
+      links_[0].pos = 0;
+  }
+
+  void AddLink() {
+    links_.emplace_back();
+  }
+
+  // table was reloaded from link: stream starts anew, other links must be aligned again
+  void Reset(size_t link) {
+    log_.clear();
+    log_start_ = 0;
+    for(auto& l : links_) {
+      l.pos = -1;
+      l.pending.clear();
+    }
+    links_[link].pos = 0;
+  }
+
+  bool Aligned(size_t link) const { return links_[link].pos >= 0; }
+
+  // link delivered rows with given hashes: apply[i] is set for rows no link delivered before.
+  // Returns false if the link could not be aligned, rows from the misaligned part are not applied
+  bool Merge(size_t link, const std::vector<uint64_t>& rows, std::vector<bool>& apply, size_t from = 0) {
+    Link& l = links_[link];
+    if(!from)
+      apply.assign(rows.size(), false);
+    if(from == rows.size())
+      return true;
+    if(l.pos < 0) {
+      std::vector<uint64_t> rest(rows.begin() + from, rows.end());
+      l.pos = Align(rest, false);
+      if(l.pos < 0) {
+        l.pending.swap(rest);
+        return false;
+      }
+      l.pending.clear();
+    }
+    for(size_t i=from; i<rows.size(); ++i, ++l.pos) {
+      if((uint64_t)l.pos < log_start_)
+        continue; // delivered by other links long ago
+      size_t idx = l.pos - log_start_;
+      if(idx < log_.size()) {
+        if(log_[idx] != rows[i]) {
+          // link lost rows or was restarted by gateway: align the rest of batch again
+          l.pos = -1;
+          return Merge(link, rows, apply, i);
+        }
+        continue;
+      }
+      log_.push_back(rows[i]);
+      apply[i] = true;
+    }
+    while(log_.size() > window_) {
+      log_.pop_front();
+      ++log_start_;
+    }
+    AlignPending();
+    return true;
+  }
+};
+
+} // ad::util
+#endif // FEED_MERGER_H
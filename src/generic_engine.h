@@ -1,12 +1,211 @@
 #ifndef GENERIC_ENGINE_H
 #define GENERIC_ENGINE_H
 #include <string_view>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string.h> // memcpy
+#include <stdlib.h> // atof, strtoll
+#include <stdio.h> // snprintf
 
 #include "asts_interface.h"
 #include "util.h"
 
 namespace ad::asts {
 
+// value of one field decoded from MTESRL buffer
+struct FieldValue {
+  AstsFieldType type = AstsFieldType::kNull; // kNull, kInteger, kFixed (double value) or kChar (text value)
+  int64_t int_value = 0;
+  double double_value = 0.0;
+  std::string_view text;
+};
+
+// decode one field value, tmp_buf must be at least fld.size+2 bytes long
+inline FieldValue DecodeField(const AstsOutField& fld, const char* ptr, char* tmp_buf) {
+  FieldValue v;
+  // ASTSConnectivty API Guide says NULL is a value consisting only of spaces
+  fld_size_t i = 0;
+  while(i < fld.size && ptr[i] == ' ')
+    ++i;
+  if(i == fld.size)
+    return v;
+  switch(fld.type) {
+    case AstsFieldType::kFixed:
+      // value is sent without decimal point: copy integer part, set the dot, copy decimal part
+      memcpy(tmp_buf, ptr, fld.size - fld.decimals);
+      tmp_buf[fld.size - fld.decimals] = '.';
+      memcpy(tmp_buf + fld.size - fld.decimals + 1, ptr + fld.size - fld.decimals, fld.decimals);
+      tmp_buf[fld.size + 1] = 0;
+      v.type = AstsFieldType::kFixed;
+      v.double_value = atof(tmp_buf);
+      break;
+    case AstsFieldType::kFloatPoint:
+      memcpy(tmp_buf, ptr, fld.size);
+      tmp_buf[fld.size] = 0;
+      v.type = AstsFieldType::kFixed;
+      v.double_value = atof(tmp_buf);
+      break;
+    case AstsFieldType::kInteger:
+      memcpy(tmp_buf, ptr, fld.size);
+      tmp_buf[fld.size] = 0;
+      v.type = AstsFieldType::kInteger;
+      v.int_value = strtoll(tmp_buf, nullptr, 10);
+      break;
+    case AstsFieldType::kFloat: // we don't know how to format this
+    case AstsFieldType::kChar:
+    case AstsFieldType::kDate: // leave date and time as strings, let upper-level code deal with this
+    case AstsFieldType::kTime:
+    default:
+      v.type = AstsFieldType::kChar;
+      v.text = std::string_view(ptr, fld.size);
+      break;
+  }
+  return v;
+}
+
+// canonical text form of a key field value, used by primary key lookups
+inline std::string KeyPart(const FieldValue& v, int decimals) {
+  char tmp[64];
+  switch(v.type) {
+    case AstsFieldType::kInteger:
+      return std::to_string(v.int_value);
+    case AstsFieldType::kFixed:
+      snprintf(tmp, sizeof(tmp), "%.*f", decimals, v.double_value);
+      return tmp;
+    case AstsFieldType::kChar: {
+      size_t len = v.text.find_last_not_of(' ');
+      return std::string(v.text.substr(0, len == std::string_view::npos ? 0 : len+1));
+    }
+    default:
+      return "";
+  }
+}
+
+// canonical key from user-supplied text values of key fields
+inline std::string KeyFromStrings(const AstsTable& table, const std::vector<std::string>& values) {
+  if(values.size() != table.keyfields.size())
+    throw std::runtime_error("Table "+table.name+" has "+std::to_string(table.keyfields.size())+" key fields, "
+      +std::to_string(values.size())+" values given");
+  std::string key;
+  for(size_t i=0; i<values.size(); ++i) {
+    const AstsOutField& fld = table.outfields[table.keyfields[i].first];
+    FieldValue v;
+    switch(fld.type) {
+      case AstsFieldType::kInteger:
+        v.type = AstsFieldType::kInteger;
+        v.int_value = strtoll(values[i].c_str(), nullptr, 10);
+        break;
+      case AstsFieldType::kFixed:
+      case AstsFieldType::kFloatPoint:
+        v.type = AstsFieldType::kFixed;
+        v.double_value = atof(values[i].c_str());
+        break;
+      default:
+        v.type = AstsFieldType::kChar;
+        v.text = values[i];
+        break;
+    }
+    if(i)
+      key.push_back('\x1f');
+    key.append(KeyPart(v, fld.decimals));
+  }
+  return key;
+}
+
+// secondary index on a storage table
+struct IndexSpec {
+  std::string name;                 // unique within table, generated from columns when empty
+  std::vector<std::string> columns; // indexed columns
+  std::vector<std::string> include; // extra columns stored in index, so queries reading only them skip the table
+  std::string where;                // condition of partial index, empty for full index
+  bool unique = false;
+};
+
+// connection state saved along with storage contents, enough to serve queries after restart
+struct SnapshotTable {
+  std::string tablename;
+  std::string params; // input parameters as passed to MTEOpenTable
+  int ref = 0;
+};
+struct SnapshotState {
+  std::map<std::string, std::string> interfaces; // system -> raw MTEStructureEx buffer
+  std::vector<SnapshotTable> tables;
+};
+
+// rows of a table kept by ingest order: the last max_rows rows and rows ingested within max_age (0 is no limit)
+struct RetentionPolicy {
+  size_t max_rows = 0;
+  std::chrono::milliseconds max_age {0};
+};
+
+// eviction state of one table. Storage rows are identified by rowids growing with every insert, rows older
+// than max_age are found by the largest rowid remembered at ingest times.
+class RetentionState {
+  std::deque<std::pair<std::chrono::steady_clock::time_point, int64_t> > marks_;
+public:
+  RetentionPolicy policy;
+  uint64_t evicted_rows = 0;
+
+  explicit RetentionState(const RetentionPolicy& p) : policy(p) {}
+
+  // rows with rowid up to the returned one are to be evicted, 0 if none; table has rows min_rowid..max_rowid
+  int64_t Cutoff(int64_t min_rowid, int64_t max_rowid, std::chrono::steady_clock::time_point now) {
+    int64_t cutoff = 0;
+    if(policy.max_age.count()) {
+      auto step = std::min<std::chrono::steady_clock::duration>(std::chrono::seconds(1), policy.max_age / 16);
+      if(marks_.empty() || now - marks_.back().first >= step)
+        marks_.push_back({now, max_rowid});
+      while(!marks_.empty() && now - marks_.front().first > policy.max_age) {
+        cutoff = marks_.front().second;
+        marks_.pop_front();
+      }
+    }
+    if(policy.max_rows) {
+      // rows are evicted in chunks of 1/16 of the limit, not after every batch
+      int64_t slack = std::max<int64_t>(policy.max_rows / 16, 1);
+      if(max_rowid - min_rowid + 1 > (int64_t)policy.max_rows + slack)
+        cutoff = std::max(cutoff, max_rowid - (int64_t)policy.max_rows);
+    }
+    if(cutoff < min_rowid)
+      return 0;
+    // emptied table may number rows anew
+    if(cutoff >= max_rowid)
+      Reset();
+    return cutoff;
+  }
+
+  // table was erased
+  void Reset() {
+    marks_.clear();
+  }
+};
+
+// memory used by one table
+struct TableMemory {
+  std::string tablename;
+  uint64_t rows = 0;
+  uint64_t bytes = 0;        // table data
+  uint64_t index_bytes = 0;  // secondary indexes and primary key index
+  uint64_t evicted_rows = 0; // rows removed by retention policy
+  uint64_t history_bytes = 0; // change log of the table
+};
+struct MemoryUsage {
+  std::vector<TableMemory> tables;
+  uint64_t storage_bytes = 0; // database contents, including free space kept for reuse
+  uint64_t heap_bytes = 0;    // all memory allocated by storage engine
+};
+
+// incremental reader of query results, sees the same snapshot of data until destroyed
+class QueryCursor {
+public:
+  virtual ~QueryCursor() {}
+  // replaces batch rows with up to max_rows next rows, fields are filled by the first call;
+  // returns false when there are no rows left
+  virtual bool Next(SqlResult& batch, size_t max_rows) =0;
+};
+
 class GenericStorage {
 public:
   // add reflection data to MTE$STRUCTURE table on Connect
@@ -14,17 +213,67 @@ public:
   // remove reflection data on Disconnect
   virtual void RemoveInterface(std::shared_ptr<AstsInterface> iface)=0;
   // prepare to read row data from MTESRL-managed buffer (e.g. start SQL transaction)
-  virtual void StartReadingRows(AstsOpenedTable* table) =0;
+  // replace: erase table contents first, readers see either old or new contents
+  virtual void StartReadingRows(AstsOpenedTable* table, size_t row_count, bool replace = false) =0;
+  // discard rows read since StartReadingRows (e.g. rollback SQL transaction) after an error
+  virtual void AbortReadingRows() =0;
   // read one data row from MTESRL-managed buffer
-  virtual void ReadRowFromBuffer(AstsOpenedTable* table, ad::util::PointerHelper& buffer, fld_count_t* fldnums, fld_count_t* fldnums_prev, fld_count_t fldcount) =0;
+  virtual void ReadRowFromBuffer(AstsOpenedTable* table, ad::util::BufferReader& buffer, fld_count_t* fldnums, fld_count_t fldcount) =0;
   // erase data from table (e.g. if clear on update flag is set)
   virtual void EraseData(const std::string& tablename, const std::string& secboard="", const std::string& seccode="")=0;
   // finish reading row data (e.g. commit SQL transaction)
   virtual void StopReadingRows()=0;
+  // group several batches into one transaction, committed when max_rows rows are pending or max_delay_ms elapsed (0, 0 commits every batch)
+  virtual void SetTransactionCoalescing(size_t max_rows, size_t max_delay_ms)=0;
+  // commit pending batches now
+  virtual void Flush()=0;
+  // commit pending batches if threshold is reached
+  virtual void CommitIfDue()=0;
+  // large batches into empty tables (initial snapshots) may be loaded by a faster path
+  virtual void SetBulkLoadThreshold(size_t rows)=0;
+  // commit counters and latency
+  virtual const ad::util::StorageStats& GetStats()=0;
+  // declare secondary index, it is created with the table (or at once, if table exists) and kept during ingest
+  virtual void AddIndex(const std::string& tablename, const IndexSpec& spec)=0;
+  // index fields flagged ffSecCode in every table created after this call
+  virtual void SetSecCodeIndex(bool enable)=0;
+  // write storage contents and connection state to a file
+  virtual void SaveSnapshot(const std::string& path, const SnapshotState& state)=0;
+  // replace storage contents with a snapshot file, connection state is returned in state
+  virtual void LoadSnapshot(const std::string& path, SnapshotState& state)=0;
+  // move storage to a database file other processes attach to, before any table is created
+  virtual void Publish(const std::string& path)=0;
+  // serve queries from storage published by another process, read-only; interfaces are returned in state
+  virtual void AttachPublished(const std::string& path, SnapshotState& state)=0;
 
   virtual void CreateTable(std::shared_ptr<AstsInterface> iface, const std::string& tablename) =0;
   virtual void CloseTable(const std::string& tablename) =0;
   virtual void Query(std::string_view query, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) =0;
+  // read-only query whose results are fetched in batches, so memory use does not depend on result size
+  virtual std::unique_ptr<QueryCursor> OpenCursor(std::string_view query, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) =0;
+
+  // monotonically increasing version of table contents, bumped after every committed change
+  virtual uint64_t GetTableVersion(const std::string& tablename) =0;
+  // number of connections serving concurrent queries
+  virtual void SetReaderCount(size_t count) =0;
+  // maximum number of cached query results (0 disables cache)
+  virtual void SetQueryCacheSize(size_t size) =0;
+  // queries running at least threshold_ms are logged to MTE$SLOWLOG with their plans (0 disables log)
+  virtual void SetSlowQueryLog(size_t threshold_ms, size_t max_entries) =0;
+  // evict old rows of table during ingest, policy with no limits removes retention
+  virtual void SetRetention(const std::string& tablename, const RetentionPolicy& policy) =0;
+  // rows and bytes of every table and totals of storage
+  virtual void GetMemoryUsage(MemoryUsage& usage) =0;
+  // log changed fields of every row applied to table in max_bytes of memory (0 disables log); log is
+  // queried by SQL as asts_history('<table>')
+  virtual void SetHistory(const std::string& tablename, size_t max_bytes) =0;
+  // changes of table received within [from_us, to_us] (microseconds since epoch), one row per changed field
+  virtual void GetHistory(const std::string& tablename, int64_t from_us, int64_t to_us, SqlResult& result) =0;
+
+  // fetch row by primary key without SQL parsing, returns false if there is no such row
+  virtual bool Get(const std::string& tablename, const std::vector<std::string>& key, SqlResult& result) =0;
+  // fetch rows by primary keys, rows not found are returned empty
+  virtual void GetMany(const std::string& tablename, const std::vector<std::vector<std::string> >& keys, SqlResult& result) =0;
 };
 
 } // ad::asts
@@ -0,0 +1,277 @@
+#ifndef HISTORY_LOG_H
+#define HISTORY_LOG_H
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <string.h> // memcpy, memcmp
+#include <mtesrl.h>
+
+#include "generic_engine.h"
+
+namespace ad::asts {
+
+// change log of one table: every row applied to the table is recorded as the fields which differ from the
+// previous row with the same key, with receive time. Field values are kept as the gateway sent them and
+// decoded only when log is read. Records are packed into blocks, the oldest block is dropped when the log
+// grows over its size limit.
+class HistoryLog {
+  static constexpr size_t kBlockSize = 64*1024;
+  // record: time (int64, microseconds since epoch), key length (uint16), field count, key, field numbers, values
+  static constexpr size_t kHeaderSize = sizeof(int64_t) + sizeof(uint16_t) + sizeof(fld_count_t);
+  struct Block {
+    std::string data;
+    uint64_t first_seq = 0; // sequence number of the first record
+    size_t records = 0;
+    int64_t first_us = 0;
+    int64_t last_us = 0;
+  };
+
+  std::shared_ptr<AstsTable> table_;
+  size_t max_bytes_;
+  std::vector<size_t> offsets_; // field offsets in row image
+  size_t row_size_ = 0;
+  // key -> last values of all fields, '\0' for fields not received yet
+  std::unordered_map<std::string, std::string> images_;
+  std::atomic<size_t> image_bytes_ = 0;
+
+  mutable std::mutex mutex_; // blocks are read by query threads
+  std::deque<Block> blocks_;
+  size_t bytes_ = 0;
+  uint64_t next_seq_ = 0;
+  uint64_t visible_seq_ = 0; // records of the batch being applied are not visible until Publish
+  int64_t last_us_ = 0;
+
+  // buffers reused by every row
+  std::string key_;
+  std::basic_string<fld_count_t> changed_;
+  std::vector<const char*> values_;
+  std::vector<const char*> row_;
+
+  template<class T> static void Put(std::string& data, T value) {
+    data.append((const char*)&value, sizeof(value));
+  }
+  template<class T> static T Get(const char*& ptr) {
+    T value;
+    memcpy(&value, ptr, sizeof(value));
+    ptr += sizeof(value);
+    return value;
+  }
+
+  // size of the record at ptr
+  size_t RecordSize(const char* ptr) const {
+    ptr += sizeof(int64_t);
+    uint16_t key_len = Get<uint16_t>(ptr);
+    fld_count_t count = Get<fld_count_t>(ptr);
+    size_t size = kHeaderSize + key_len + count;
+    const fld_count_t* fldnums = (const fld_count_t*)(ptr + key_len);
+    for(fld_count_t c=0; c<count; ++c)
+      size += table_->outfields[fldnums[c]].size;
+    return size;
+  }
+
+public:
+  HistoryLog(std::shared_ptr<AstsTable> table, size_t max_bytes) : table_(table), max_bytes_(max_bytes) {
+    for(auto& fld : table_->outfields) {
+      offsets_.push_back(row_size_);
+      row_size_ += fld.size;
+    }
+  }
+
+  const AstsTable& Table() const { return *table_; }
+
+  void SetMaxBytes(size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_bytes_ = max_bytes;
+  }
+
+  // bytes of records and of last row images
+  size_t Bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_ + image_bytes_;
+  }
+
+  // record row at data with fields fldnums, called by ingest thread for every row it applies
+  void Append(const char* data, const fld_count_t* fldnums, fld_count_t fldcount) {
+    auto& outfields = table_->outfields;
+    row_.assign(outfields.size(), nullptr);
+    for(fld_count_t c=0; c<fldcount; ++c) {
+      row_[fldnums[c]] = data;
+      data += outfields[fldnums[c]].size;
+    }
+    // rows without all key fields are recorded in full
+    key_.clear();
+    for(auto& k : table_->keyfields) {
+      if(!row_[k.first]) {
+        key_.clear();
+        break;
+      }
+      key_.append(row_[k.first], outfields[k.first].size);
+    }
+    std::string* image = nullptr;
+    if(!key_.empty()) {
+      auto it = images_.find(key_);
+      if(it == images_.end()) {
+        it = images_.emplace(key_, std::string(row_size_, '\0')).first;
+        image_bytes_ += key_.size() + row_size_ + 2*sizeof(void*);
+      }
+      image = &it->second;
+    }
+    changed_.clear();
+    values_.clear();
+    size_t size = kHeaderSize + key_.size();
+    for(fld_count_t c=0; c<fldcount; ++c) {
+      fld_count_t f = fldnums[c];
+      const AstsOutField& fld = outfields[f];
+      if(image) {
+        if((fld.attr & mffKey) == mffKey)
+          continue;
+        char* last = image->data() + offsets_[f];
+        if(memcmp(last, row_[f], fld.size) == 0)
+          continue;
+        memcpy(last, row_[f], fld.size);
+      }
+      changed_.push_back(f);
+      values_.push_back(row_[f]);
+      size += 1 + fld.size;
+    }
+    if(changed_.empty())
+      return;
+
+    int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::lock_guard<std::mutex> lock(mutex_);
+    // times never go back, so blocks stay ordered by time
+    last_us_ = std::max(last_us_, now);
+    if(blocks_.empty() || (blocks_.back().records && blocks_.back().data.size() + size > kBlockSize)) {
+      blocks_.emplace_back();
+      blocks_.back().data.reserve(std::max(kBlockSize, size));
+      blocks_.back().first_seq = next_seq_;
+      blocks_.back().first_us = last_us_;
+      bytes_ += blocks_.back().data.capacity();
+    }
+    Block& block = blocks_.back();
+    size_t old_capacity = block.data.capacity();
+    Put<int64_t>(block.data, last_us_);
+    Put<uint16_t>(block.data, key_.size());
+    Put<fld_count_t>(block.data, changed_.size());
+    block.data.append(key_);
+    block.data.append((const char*)changed_.data(), changed_.size());
+    for(size_t i=0; i<changed_.size(); ++i)
+      block.data.append(values_[i], outfields[changed_[i]].size);
+    bytes_ += block.data.capacity() - old_capacity;
+    block.last_us = last_us_;
+    ++block.records;
+    ++next_seq_;
+    while(blocks_.size() > 1 && bytes_ > max_bytes_) {
+      bytes_ -= blocks_.front().data.capacity();
+      blocks_.pop_front();
+    }
+  }
+
+  // records appended since the last call become visible to readers
+  void Publish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    visible_seq_ = next_seq_;
+  }
+
+  // batch was rolled back: its records are removed, images may hold values which never reached
+  // the table, so the next row of every key is recorded in full
+  void Discard() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while(!blocks_.empty() && blocks_.back().first_seq >= visible_seq_) {
+      bytes_ -= blocks_.back().data.capacity();
+      blocks_.pop_back();
+    }
+    if(!blocks_.empty() && blocks_.back().first_seq + blocks_.back().records > visible_seq_) {
+      Block& block = blocks_.back();
+      size_t offset = 0;
+      for(uint64_t seq = block.first_seq; seq < visible_seq_; ++seq)
+        offset += RecordSize(block.data.data() + offset);
+      block.data.resize(offset);
+      block.records = visible_seq_ - block.first_seq;
+    }
+    next_seq_ = visible_seq_;
+    images_.clear();
+    image_bytes_ = 0;
+  }
+
+  // table was erased: next row of every key is recorded in full
+  void Reset() {
+    images_.clear();
+    image_bytes_ = 0;
+  }
+
+  // calls f(seq, time_us, key fields, field, value) for every field of records received within [from_us, to_us]
+  template<class F> void ForEach(int64_t from_us, int64_t to_us, F f) const {
+    auto& outfields = table_->outfields;
+    std::vector<char> tmp_buf(table_->max_fld_len+2);
+    std::vector<FieldValue> key;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto block = std::lower_bound(blocks_.begin(), blocks_.end(), from_us,
+                                  [](const Block& b, int64_t us) { return b.last_us < us; });
+    for(; block != blocks_.end() && block->first_us <= to_us; ++block) {
+      const char* ptr = block->data.data();
+      for(size_t r=0; r<block->records && block->first_seq + r < visible_seq_; ++r) {
+        int64_t us = Get<int64_t>(ptr);
+        uint16_t key_len = Get<uint16_t>(ptr);
+        fld_count_t count = Get<fld_count_t>(ptr);
+        const char* key_ptr = ptr;
+        const fld_count_t* fldnums = (const fld_count_t*)(ptr + key_len);
+        ptr += key_len + count;
+        if(us < from_us || us > to_us) {
+          for(fld_count_t c=0; c<count; ++c)
+            ptr += outfields[fldnums[c]].size;
+          continue;
+        }
+        key.clear();
+        for(size_t k=0; key_len && k<table_->keyfields.size(); ++k) {
+          const AstsOutField& fld = outfields[table_->keyfields[k].first];
+          key.push_back(DecodeField(fld, key_ptr, tmp_buf.data()));
+          key_ptr += fld.size;
+        }
+        for(fld_count_t c=0; c<count; ++c) {
+          const AstsOutField& fld = outfields[fldnums[c]];
+          f(block->first_seq + r, us, key, fld, DecodeField(fld, ptr, tmp_buf.data()));
+          ptr += fld.size;
+        }
+      }
+    }
+  }
+
+  // one row per changed field: SEQ, TS (microseconds since epoch), KEY (key field values joined by '|'), FIELD,
+  // VALUE; fields of different types share VALUE column, so numbers are given as text
+  void Read(int64_t from_us, int64_t to_us, SqlResult& result) const {
+    result.fields = {{"SEQ", AstsFieldType::kInteger, 0}, {"TS", AstsFieldType::kInteger, 0},
+                     {"KEY", AstsFieldType::kChar, 0}, {"FIELD", AstsFieldType::kChar, 0}, {"VALUE", AstsFieldType::kChar, 0}};
+    result.data.clear();
+    uint64_t last_seq = std::numeric_limits<uint64_t>::max();
+    std::string key;
+    ForEach(from_us, to_us, [&](uint64_t seq, int64_t us, const std::vector<FieldValue>& key_values, const AstsOutField& fld, const FieldValue& v) {
+      if(seq != last_seq) {
+        key = JoinKey(key_values);
+        last_seq = seq;
+      }
+      std::vector<std::any> row = {(int64_t)seq, us, key, fld.name, std::any()};
+      if(v.type == AstsFieldType::kChar)
+        row[4] = std::string(v.text);
+      else if(v.type != AstsFieldType::kNull)
+        row[4] = KeyPart(v, fld.decimals);
+      result.data.push_back(std::move(row));
+    });
+  }
+
+  std::string JoinKey(const std::vector<FieldValue>& key_values) const {
+    std::string key;
+    for(size_t k=0; k<key_values.size(); ++k) {
+      if(k)
+        key.push_back('|');
+      key.append(KeyPart(key_values[k], table_->outfields[table_->keyfields[k].first].decimals));
+    }
+    return key;
+  }
+};
+
+} // ad::asts
+#endif // HISTORY_LOG_H
@@ -1,71 +1,886 @@
 #include <boost/python.hpp>
 
+#include "async_dispatcher.h"
 #include "asts_connection.h"
+#ifdef ASTSSQLPY_DUCKDB
+#include "storage/duckdb.h"
+typedef ad::asts::DuckDBStorage StorageEngine;
+#else
 #include "storage/sqlite.h"
+typedef ad::asts::SQLiteStorage StorageEngine;
+#endif
 
 namespace bpy = boost::python;
 
-class AstsConnectionProxy: public ad::asts::AstsConnection<ad::asts::SQLiteStorage> {
+// lets other python threads run while we are busy with network or storage
+class ReleaseGIL {
+  PyThreadState* state_;
 public:
+  ReleaseGIL() : state_(PyEval_SaveThread()) {}
+  ~ReleaseGIL() { PyEval_RestoreThread(state_); }
+};
+
+// result of QueryArrow: one-shot Arrow C stream exposed through __arrow_c_stream__ protocol,
+// so pyarrow.RecordBatchReader.from_stream, polars and duckdb read it without copying to python objects
+class ArrowStreamProxy: boost::noncopyable {
+  ArrowArrayStream stream_;
+
+  static void ReleaseCapsule(PyObject* capsule) {
+    ArrowArrayStream* stream = (ArrowArrayStream*)PyCapsule_GetPointer(capsule, "arrow_array_stream");
+    if(stream && stream->release)
+      stream->release(stream);
+    delete stream;
+  }
+
+public:
+  ArrowStreamProxy() {
+    stream_.release = nullptr;
+  }
+  ~ArrowStreamProxy() {
+    if(stream_.release)
+      stream_.release(&stream_);
+  }
+  ArrowArrayStream* Stream() { return &stream_; }
+
+  // requested_schema is not supported, consumer casts if it needs other types
+  bpy::object ArrowCStream(bpy::object requested_schema = bpy::object()) {
+    (void)requested_schema;
+    if(!stream_.release)
+      throw std::runtime_error("Arrow stream has already been consumed");
+    ArrowArrayStream* stream = new ArrowArrayStream(stream_);
+    stream_.release = nullptr;
+    PyObject* capsule = PyCapsule_New(stream, "arrow_array_stream", ReleaseCapsule);
+    if(!capsule) {
+      stream->release(stream);
+      delete stream;
+      bpy::throw_error_already_set();
+    }
+    return bpy::object(bpy::handle<>(capsule));
+  }
+};
+
+struct RefreshEvent {
+  std::string table;
+  size_t rows = 0;
+  uint64_t version = 0;
+  uint64_t dropped = 0; // events lost before this one because consumer fell behind
+};
+
+// refresh events of one RefreshNotifications consumer, pushed by threads applying refreshes
+class RefreshSubscription {
+  std::mutex mutex_;
+  std::deque<RefreshEvent> events_;
+  std::set<std::string> tables_; // empty for all tables
+  size_t max_pending_;
+  uint64_t dropped_ = 0;
+  bool waiting_ = false;
+
+public:
+  RefreshSubscription(std::set<std::string> tables, size_t max_pending) : tables_(std::move(tables)), max_pending_(std::max<size_t>(max_pending, 1)) {}
+
+  bool Wants(const std::string& table) const { return tables_.empty() || tables_.count(table); }
+
+  // oldest event is dropped when consumer is max_pending events behind; returns true if consumer waits for it
+  bool Push(const RefreshEvent& event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(events_.size() >= max_pending_) {
+      events_.pop_front();
+      ++dropped_;
+    }
+    events_.push_back(event);
+    bool wake = waiting_;
+    waiting_ = false;
+    return wake;
+  }
+
+  // takes the next event; when there is none, consumer is marked as waiting so the next Push wakes the loop
+  bool Pop(RefreshEvent& event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(events_.empty()) {
+      waiting_ = true;
+      return false;
+    }
+    event = std::move(events_.front());
+    events_.pop_front();
+    event.dropped = dropped_;
+    dropped_ = 0;
+    return true;
+  }
+};
+
+class RefreshIterator;
+
+class AstsConnectionProxy: public ad::asts::AstsConnection<StorageEngine> {
+private:
+  // async calls run on worker threads, their results are converted to python objects and given to futures
+  // by the event loop thread, which is woken up through eventfd watched by loop.add_reader
+  typedef std::function<bpy::object()> AsyncResult;
+  typedef ad::util::AsyncDispatcher<AsyncResult> Dispatcher;
+  Dispatcher async_;
+  bpy::object loop_; // loop watching async_.Fd()
+  std::map<uint64_t, bpy::object> futures_; // by task id
+  std::map<std::shared_ptr<RefreshSubscription>, bpy::object> waiting_; // futures returned by __anext__
+  std::mutex subscriptions_mutex_;
+  std::vector<std::weak_ptr<RefreshSubscription> > subscriptions_;
+  bool refresh_listener_set_ = false;
+
+  // python objects are touched by the loop thread only, refresh threads just wake it up
+  void OnRefresh(const std::string& tablename, size_t rows) {
+    RefreshEvent event;
+    event.table = tablename;
+    event.rows = rows;
+    event.version = TableVersion(tablename);
+    bool wake = false;
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    for(auto it = subscriptions_.begin(); it != subscriptions_.end();) {
+      auto sub = it->lock();
+      if(!sub) {
+        it = subscriptions_.erase(it);
+        continue;
+      }
+      if(sub->Wants(tablename))
+        wake |= sub->Push(event);
+      ++it;
+    }
+    if(wake)
+      async_.Wake();
+  }
+
+  // future of the running loop; the first call from a loop makes it watch completions of async calls
+  bpy::object CreateFuture() {
+    bpy::object loop = bpy::import("asyncio").attr("get_running_loop")();
+    if(loop.ptr() != loop_.ptr()) {
+      DetachLoop();
+      bpy::object drain = bpy::object(bpy::ptr(this)).attr("_DrainAsync");
+      loop.attr("add_reader")(async_.Fd(), drain);
+      loop_ = loop;
+    }
+    return loop.attr("create_future")();
+  }
+
+  // futures of the previous loop are dropped, results of their calls are discarded
+  void DetachLoop() {
+    if(loop_.is_none())
+      return;
+    if(!bpy::extract<bool>(loop_.attr("is_closed")()))
+      loop_.attr("remove_reader")(async_.Fd());
+    loop_ = bpy::object();
+    futures_.clear();
+    waiting_.clear();
+  }
+
+  bpy::object SubmitAsync(Dispatcher::Task task) {
+    bpy::object future = CreateFuture();
+    futures_[async_.Submit(std::move(task))] = future;
+    return future;
+  }
+
+  // python error which is set goes to future
+  static void FailFuture(bpy::object& future) {
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+    if(traceback)
+      PyException_SetTraceback(value, traceback);
+    bpy::object error = bpy::object(bpy::handle<>(value));
+    Py_XDECREF(type);
+    Py_XDECREF(traceback);
+    future.attr("set_exception")(error);
+  }
+
+  static bpy::dict EventToDict(const RefreshEvent& event) {
+    bpy::dict result;
+    result["table"] = event.table;
+    result["rows"] = event.rows;
+    result["version"] = event.version;
+    result["dropped"] = event.dropped;
+    return result;
+  }
+
+  static std::map<std::string, std::string> ParamsFromDict(bpy::dict in_dict) {
+    std::map<std::string, std::string> params;
+    bpy::list keys = in_dict.keys();
+    for(bpy::ssize_t i=0; i<bpy::len(keys); ++i)
+      params[bpy::extract<std::string>(bpy::str(keys[i]))] = bpy::extract<std::string>(bpy::str(in_dict[keys[i]]));
+    return params;
+  }
+
+  static bpy::dict RowToDict(const std::vector<ad::asts::SqlOutField>& fields, const std::vector<std::any>& row) {
+    bpy::dict line;
+    for(size_t i=0; i<fields.size(); ++i) {
+      if(!row[i].has_value())
+        line[fields[i].name] = bpy::object();
+      else
+        switch(fields[i].type) {
+          case ad::asts::AstsFieldType::kInteger:
+            line[fields[i].name] = bpy::long_(std::any_cast<int64_t>(row[i]));
+            break;
+          case ad::asts::AstsFieldType::kChar:
+          case ad::asts::AstsFieldType::kFloat:
+          case ad::asts::AstsFieldType::kDate:
+          case ad::asts::AstsFieldType::kTime:
+            line[fields[i].name] = bpy::str(std::any_cast<std::string>(row[i]));
+            break;
+          case ad::asts::AstsFieldType::kFixed:
+          case ad::asts::AstsFieldType::kFloatPoint:
+            line[fields[i].name] = bpy::object(std::any_cast<double>(row[i]));
+            break;
+          default:
+            break;
+        }
+    }
+    return line;
+  }
+
+  // key may be passed as a single value or as a tuple/list of values
+  static bpy::dict HistogramToDict(const ad::util::Histogram& h) {
+    bpy::dict result;
+    result["count"] = h.Count();
+    result["sum_us"] = h.SumMicros();
+    result["p50_us"] = h.Percentile(0.5);
+    result["p99_us"] = h.Percentile(0.99);
+    result["max_us"] = h.Percentile(1.0);
+    return result;
+  }
+
+  static std::vector<std::string> KeyFromObject(bpy::object key) {
+    std::vector<std::string> result;
+    if(PyTuple_Check(key.ptr()) || PyList_Check(key.ptr()))
+      for(bpy::ssize_t i=0; i<bpy::len(key); ++i)
+        result.push_back(bpy::extract<std::string>(bpy::str(key[i])));
+    else
+      result.push_back(bpy::extract<std::string>(bpy::str(key)));
+    return result;
+  }
+
+public:
+  ~AstsConnectionProxy() {
+    SetRefreshListener(nullptr);
+    try {
+      DetachLoop();
+    }
+    catch(const bpy::error_already_set&) {
+      PyErr_Clear();
+    }
+    ReleaseGIL nogil;
+    async_.Stop();
+  }
+
+  void Connect(const std::string& system, const std::string& params) {
+    ReleaseGIL nogil;
+    AstsConnection::Connect(system, params);
+  }
+
+  void AddRedundantLink(const std::string& system, const std::string& params) {
+    ReleaseGIL nogil;
+    AstsConnection::AddRedundantLink(system, params);
+  }
+
+  void SetRedundancy(size_t stall_timeout_ms, size_t window_rows = 65536) {
+    ReleaseGIL nogil;
+    AstsConnection::SetRedundancy(stall_timeout_ms, window_rows);
+  }
+
+  void RefreshTable(const std::string tablename) {
+    ReleaseGIL nogil;
+    AstsConnection::RefreshTable(tablename);
+  }
+
+  void CloseTable(const std::string tablename) {
+    ReleaseGIL nogil;
+    AstsConnection::CloseTable(tablename);
+  }
+
+  void StartPipeline(size_t queue_depth = 64) {
+    AstsConnection::StartPipeline(queue_depth);
+  }
+
+  void StopPipeline() {
+    ReleaseGIL nogil;
+    AstsConnection::StopPipeline();
+  }
+
+  void FlushPipeline() {
+    ReleaseGIL nogil;
+    AstsConnection::FlushPipeline();
+  }
+
+  void SetTransactionCoalescing(size_t max_rows, size_t max_delay_ms, bool flush_before_query = false) {
+    ReleaseGIL nogil;
+    AstsConnection::SetTransactionCoalescing(max_rows, max_delay_ms, flush_before_query);
+  }
+
+  void CommitPending() {
+    ReleaseGIL nogil;
+    AstsConnection::CommitPending();
+  }
+
+  void AddIndex(const std::string& tablename, bpy::list columns, bpy::list include = bpy::list(),
+                const std::string& where = "", bool unique = false, const std::string& name = "") {
+    ad::asts::IndexSpec spec;
+    for(bpy::ssize_t i=0; i<bpy::len(columns); ++i)
+      spec.columns.push_back(bpy::extract<std::string>(columns[i]));
+    for(bpy::ssize_t i=0; i<bpy::len(include); ++i)
+      spec.include.push_back(bpy::extract<std::string>(include[i]));
+    spec.where = where;
+    spec.unique = unique;
+    spec.name = name;
+    ReleaseGIL nogil;
+    AstsConnection::AddIndex(tablename, spec);
+  }
+
+  void LoadIndexConfig(const std::string& path) {
+    ReleaseGIL nogil;
+    AstsConnection::LoadIndexConfig(path);
+  }
+
+  void SaveSnapshot(const std::string& path) {
+    ReleaseGIL nogil;
+    AstsConnection::SaveSnapshot(path);
+  }
+
+  void LoadSnapshot(const std::string& path) {
+    ReleaseGIL nogil;
+    AstsConnection::LoadSnapshot(path);
+  }
+
+  void ResumeTables() {
+    ReleaseGIL nogil;
+    AstsConnection::ResumeTables();
+  }
+
+  void Publish(const std::string& path) {
+    ReleaseGIL nogil;
+    AstsConnection::Publish(path);
+  }
+
+  void AttachPublished(const std::string& path) {
+    ReleaseGIL nogil;
+    AstsConnection::AttachPublished(path);
+  }
+
+  void SetRefreshSchedule(const std::string& tablename, size_t interval_ms, int priority = 0, size_t max_interval_ms = 0) {
+    ReleaseGIL nogil;
+    AstsConnection::SetRefreshSchedule(tablename, interval_ms, priority, max_interval_ms);
+  }
+
+  // (tables refreshed, milliseconds until next refresh is due)
+  bpy::tuple RefreshDue() {
+    std::pair<size_t, size_t> result;
+    {
+      ReleaseGIL nogil;
+      result = AstsConnection::RefreshDue();
+    }
+    return bpy::make_tuple(result.first, result.second);
+  }
+
+  void StopScheduler() {
+    ReleaseGIL nogil;
+    AstsConnection::StopScheduler();
+  }
+
+  // current interval, priority and time until due of scheduled tables, in milliseconds
+  bpy::dict RefreshSchedules() {
+    bpy::dict result;
+    ForEachRefreshSchedule([&](const std::string& name, std::chrono::milliseconds interval, int priority, std::chrono::milliseconds due_in) {
+      bpy::dict t;
+      t["interval_ms"] = interval.count();
+      t["priority"] = priority;
+      t["due_in_ms"] = due_in.count();
+      result[name] = t;
+    });
+    return result;
+  }
+
+  // per-table ingest counters and latencies (microseconds, power-of-two bucket bounds), commit stats
+  bpy::dict Stats() {
+    bpy::dict tables;
+    ForEachTableStats([&](const std::string& name, const ad::util::TableStats& s) {
+      bpy::dict t;
+      t["refreshes"] = s.refreshes.load();
+      t["batches"] = s.batches.load();
+      t["rows"] = s.rows.load();
+      t["bytes"] = s.bytes.load();
+      t["inserts"] = s.inserts.load();
+      t["updates"] = s.updates.load();
+      t["prepares"] = s.prepares.load();
+      t["errors"] = s.errors.load();
+      t["refresh_latency"] = HistogramToDict(s.refresh_latency);
+      t["apply_latency"] = HistogramToDict(s.apply_latency);
+      tables[name] = t;
+    });
+    auto& storage = GetStorageStats();
+    bpy::dict commit = HistogramToDict(storage.commit_latency);
+    commit["commits"] = storage.commits.load();
+    bpy::dict result;
+    result["tables"] = tables;
+    result["commit"] = commit;
+    result["pipeline"] = PipelineStats();
+    return result;
+  }
+
+  void SetSlowQueryLog(size_t threshold_ms, size_t max_entries = 1000) {
+    AstsConnection::SetSlowQueryLog(threshold_ms, max_entries);
+  }
+
+  void EnableTracing(bool enable, size_t events_per_thread = 65536) {
+    AstsConnection::EnableTracing(enable, events_per_thread);
+  }
+
+  void WriteTrace(const std::string& path) {
+    ReleaseGIL nogil;
+    AstsConnection::WriteTrace(path);
+  }
+
+  void StartStatsExport(const std::string& path, size_t interval_ms) {
+    AstsConnection::StartStatsExport(path, interval_ms);
+  }
+
+  void StopStatsExport() {
+    ReleaseGIL nogil;
+    AstsConnection::StopStatsExport();
+  }
+
+  bpy::dict PipelineStats() {
+    ad::asts::PipelineStats stats = GetPipelineStats();
+    bpy::dict result;
+    result["queue_depth"] = stats.queue_depth;
+    result["max_queue_depth"] = stats.max_queue_depth;
+    result["capacity"] = stats.capacity;
+    result["batches_received"] = stats.batches_received;
+    result["batches_applied"] = stats.batches_applied;
+    result["bytes_received"] = stats.bytes_received;
+    result["producer_stalls"] = stats.producer_stalls;
+    return result;
+  }
+
+  void SetRetention(const std::string& tablename, size_t max_rows, size_t max_age_ms = 0) {
+    ReleaseGIL nogil;
+    AstsConnection::SetRetention(tablename, max_rows, max_age_ms);
+  }
+
+  void SetHistory(const std::string& tablename, size_t max_bytes) {
+    ReleaseGIL nogil;
+    AstsConnection::SetHistory(tablename, max_bytes);
+  }
+
+  // changed fields of table rows received within [from_us, to_us] (microseconds since epoch)
+  bpy::list History(const std::string& tablename, int64_t from_us = 0, int64_t to_us = std::numeric_limits<int64_t>::max()) {
+    ad::asts::SqlResult result;
+    {
+      ReleaseGIL nogil;
+      GetHistory(tablename, from_us, to_us, result);
+    }
+    bpy::list rows;
+    for(auto& row : result.data)
+      rows.append(RowToDict(result.fields, row));
+    return rows;
+  }
+
+  // per-table rows, bytes, index bytes, evicted rows and history bytes, storage and heap bytes
+  bpy::dict MemoryUsage() {
+    ad::asts::MemoryUsage usage;
+    {
+      ReleaseGIL nogil;
+      usage = GetMemoryUsage();
+    }
+    bpy::dict tables;
+    for(auto& t : usage.tables) {
+      bpy::dict table;
+      table["rows"] = t.rows;
+      table["bytes"] = t.bytes;
+      table["index_bytes"] = t.index_bytes;
+      table["evicted_rows"] = t.evicted_rows;
+      table["history_bytes"] = t.history_bytes;
+      tables[t.tablename] = table;
+    }
+    bpy::dict result;
+    result["tables"] = tables;
+    result["storage_bytes"] = usage.storage_bytes;
+    result["heap_bytes"] = usage.heap_bytes;
+    return result;
+  }
+
+  bpy::list LinkStats() {
+    bpy::list result;
+    for(auto& stats : GetLinkStats()) {
+      bpy::dict link;
+      link["system"] = stats.system;
+      link["primary"] = stats.primary;
+      link["failed"] = stats.failed;
+      link["busy"] = stats.busy;
+      link["refreshes"] = stats.refreshes;
+      link["first_arrivals"] = stats.first_arrivals;
+      link["rows_applied"] = stats.rows_applied;
+      link["duplicates"] = stats.duplicates;
+      link["stalls"] = stats.stalls;
+      link["reloads"] = stats.reloads;
+      link["last_error"] = stats.last_error;
+      result.append(link);
+    }
+    return result;
+  }
+
   bpy::list Query(const std::string& query) {
-    bpy::list tmp;
     ad::asts::SqlResult result;
-    AstsConnection::Query(query, result);
-    size_t fldcount = result.fields.size();
-    for(auto & row : result.data) {
-      bpy::dict line;
-      for(size_t i=0; i<fldcount; ++i) {
-        line[result.fields[i].name] ;
-        if(!row[i].has_value())
-          line[result.fields[i].name] = bpy::object();
-        else
-          switch(result.fields[i].type) {
-            case ad::asts::AstsFieldType::kInteger:
-              line[result.fields[i].name] = bpy::long_(std::any_cast<int64_t>(row[i]));
-              break;
-            case ad::asts::AstsFieldType::kChar:
-            case ad::asts::AstsFieldType::kFloat:
-            case ad::asts::AstsFieldType::kDate:
-            case ad::asts::AstsFieldType::kTime:
-              line[result.fields[i].name] = bpy::str(std::any_cast<std::string>(row[i]));
-              break;
-            case ad::asts::AstsFieldType::kFixed:
-            case ad::asts::AstsFieldType::kFloatPoint:
-              line[result.fields[i].name] = bpy::long_(std::any_cast<double>(row[i]));
-              break;
-            default:
-              break;
-          }
+    {
+      ReleaseGIL nogil;
+      AstsConnection::Query(query, result);
+    }
+    return ResultToList(query, result);
+  }
+
+  static bpy::list ResultToList(const std::string& query, const ad::asts::SqlResult& result) {
+    bpy::list tmp;
+    // time spent building python objects, GIL is held
+    ad::util::TraceSpan span("Query.convert", query);
+    span.SetCount(result.data.size());
+    for(auto & row : result.data)
+      tmp.append(RowToDict(result.fields, row));
+    return tmp;
+  }
+
+  // asyncio variants: calls run on a pool of native threads, each returns a future of the running loop
+  void SetAsyncWorkers(size_t count) {
+    async_.SetWorkerCount(count);
+  }
+
+  bpy::object ConnectAsync(const std::string& system, const std::string& params) {
+    return SubmitAsync([this, system, params]() {
+      AstsConnection::Connect(system, params);
+      return AsyncResult();
+    });
+  }
+
+  bpy::object OpenTableAsync(const std::string& tablename, bpy::dict in_dict = bpy::dict()) {
+    auto inparams = ParamsFromDict(in_dict);
+    return SubmitAsync([this, tablename, inparams]() {
+      AstsConnection::OpenTable(tablename, inparams);
+      return AsyncResult();
+    });
+  }
+
+  bpy::object RefreshTableAsync(const std::string& tablename) {
+    return SubmitAsync([this, tablename]() {
+      AstsConnection::RefreshTable(tablename);
+      return AsyncResult();
+    });
+  }
+
+  bpy::object QueryAsync(const std::string& query) {
+    return SubmitAsync([this, query]() {
+      auto result = std::make_shared<ad::asts::SqlResult>();
+      AstsConnection::Query(query, *result);
+      return AsyncResult([query, result]() -> bpy::object { return ResultToList(query, *result); });
+    });
+  }
+
+  // called by the loop when eventfd is readable: completes futures of finished calls and waiting iterators
+  void DrainAsync() {
+    std::vector<Dispatcher::Completion> done;
+    async_.TakeCompleted(done);
+    for(auto& c : done) {
+      auto it = futures_.find(c.id);
+      if(it == futures_.end())
+        continue;
+      bpy::object future = it->second;
+      futures_.erase(it);
+      if(bpy::extract<bool>(future.attr("done")()))
+        continue; // cancelled by caller
+      try {
+        if(c.error)
+          std::rethrow_exception(c.error);
+        future.attr("set_result")(c.result ? c.result() : bpy::object());
+      }
+      catch(...) {
+        bpy::handle_exception();
+        FailFuture(future);
       }
-      tmp.append(line);
     }
+    for(auto it = waiting_.begin(); it != waiting_.end();) {
+      RefreshEvent event;
+      if(bpy::extract<bool>(it->second.attr("done")()))
+        it = waiting_.erase(it);
+      else if(it->first->Pop(event)) {
+        it->second.attr("set_result")(EventToDict(event));
+        it = waiting_.erase(it);
+      }
+      else
+        ++it;
+    }
+  }
+
+  std::shared_ptr<RefreshIterator> RefreshNotifications(bpy::list tables = bpy::list(), size_t max_pending = 1024);
+
+  bpy::object NextRefresh(const std::shared_ptr<RefreshSubscription>& sub) {
+    bpy::object future = CreateFuture();
+    RefreshEvent event;
+    if(sub->Pop(event))
+      future.attr("set_result")(EventToDict(event));
+    else
+      waiting_[sub] = future;
+    return future;
+  }
+
+  void StopWaiting(const std::shared_ptr<RefreshSubscription>& sub) {
+    waiting_.erase(sub);
+  }
+
+  std::shared_ptr<ArrowStreamProxy> QueryArrow(const std::string& query, size_t batch_rows = 65536) {
+    auto result = std::make_shared<ArrowStreamProxy>();
+    ReleaseGIL nogil;
+    AstsConnection::QueryArrow(query, result->Stream(), batch_rows);
+    return result;
+  }
+
+#ifdef ASTSSQLPY_ARROW
+  void ExportParquet(const std::string& query, const std::string& path, size_t batch_rows = 65536) {
+    ReleaseGIL nogil;
+    AstsConnection::ExportParquet(query, path, batch_rows);
+  }
+
+  void ExportArrowFile(const std::string& query, const std::string& path, size_t batch_rows = 65536) {
+    ReleaseGIL nogil;
+    AstsConnection::ExportArrowFile(query, path, batch_rows);
+  }
+#endif
+
+  bpy::object Get(const std::string& tablename, bpy::object key) {
+    ad::asts::SqlResult result;
+    std::vector<std::string> keyvalues = KeyFromObject(key);
+    bool found;
+    {
+      ReleaseGIL nogil;
+      found = AstsConnection::Get(tablename, keyvalues, result);
+    }
+    if(!found)
+      return bpy::object();
+    return RowToDict(result.fields, result.data[0]);
+  }
+
+  bpy::list GetMany(const std::string& tablename, bpy::list keys) {
+    std::vector<std::vector<std::string> > keyvalues;
+    for(bpy::ssize_t i=0; i<bpy::len(keys); ++i)
+      keyvalues.push_back(KeyFromObject(keys[i]));
+    ad::asts::SqlResult result;
+    {
+      ReleaseGIL nogil;
+      AstsConnection::GetMany(tablename, keyvalues, result);
+    }
+    bpy::list tmp;
+    for(auto & row : result.data)
+      if(row.empty())
+        tmp.append(bpy::object());
+      else
+        tmp.append(RowToDict(result.fields, row));
     return tmp;
   }
 
   void OpenTable(const std::string tablename, bpy::dict in_dict = bpy::dict()) {
-     std::map<std::string, std::string> inparams;
-     bpy::list keys = in_dict.keys();
-     for(bpy::ssize_t i=0; i<bpy::len(keys); ++i) {
-       bpy::str k, v;
-       k = bpy::str(keys[i]);
-       v = bpy::str(in_dict[k]);
-       inparams[std::string(bpy::extract<char const*>(k))] = std::string(bpy::extract<char const*>(v));
-     }
+     std::map<std::string, std::string> inparams = ParamsFromDict(in_dict);
+     ReleaseGIL nogil;
      AstsConnection::OpenTable(tablename, inparams);
   }
+
+  // list items are table names or (table name, input parameters) pairs
+  void OpenTables(bpy::list tablelist) {
+    std::vector<std::pair<std::string, std::map<std::string, std::string> > > tables;
+    for(bpy::ssize_t i=0; i<bpy::len(tablelist); ++i) {
+      bpy::object item = tablelist[i];
+      if(PyTuple_Check(item.ptr()) || PyList_Check(item.ptr())) {
+        tables.push_back({bpy::extract<std::string>(item[0]), {}});
+        bpy::dict in_dict = bpy::extract<bpy::dict>(item[1]);
+        bpy::list keys = in_dict.keys();
+        for(bpy::ssize_t k=0; k<bpy::len(keys); ++k)
+          tables.back().second[bpy::extract<std::string>(bpy::str(keys[k]))] = bpy::extract<std::string>(bpy::str(in_dict[keys[k]]));
+      }
+      else
+        tables.push_back({bpy::extract<std::string>(item), {}});
+    }
+    ReleaseGIL nogil;
+    AstsConnection::OpenTables(tables);
+  }
+
+  std::shared_ptr<ad::asts::TransactionTemplate> PrepareTransaction(const std::string& system, const std::string& name, bpy::dict in_dict = bpy::dict()) {
+    std::map<std::string, std::string> values;
+    bpy::list keys = in_dict.keys();
+    for(bpy::ssize_t i=0; i<bpy::len(keys); ++i) {
+      bpy::str k, v;
+      k = bpy::str(keys[i]);
+      v = bpy::str(in_dict[k]);
+      values[std::string(bpy::extract<char const*>(k))] = std::string(bpy::extract<char const*>(v));
+    }
+    return AstsConnection::PrepareTransaction(system, name, values);
+  }
+
+  // values of changing fields are written into a copy of template parameters, numbers without text conversion in python
+  std::string ExecTransaction(std::shared_ptr<ad::asts::TransactionTemplate> tmpl, bpy::dict values = bpy::dict()) {
+    std::string params = tmpl->Params();
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while(PyDict_Next(values.ptr(), &pos, &key, &value)) {
+      size_t field = tmpl->FieldIndex(bpy::extract<std::string>(bpy::str(bpy::object(bpy::borrowed(key)))));
+      if(value == Py_None)
+        tmpl->SetText(params, field, "");
+      else if(PyLong_Check(value)) {
+        long long number = PyLong_AsLongLong(value);
+        // OverflowError for numbers out of 64-bit range
+        if(number == -1 && PyErr_Occurred())
+          bpy::throw_error_already_set();
+        tmpl->SetInteger(params, field, number);
+      }
+      else if(PyFloat_Check(value))
+        tmpl->SetDouble(params, field, PyFloat_AS_DOUBLE(value));
+      else
+        tmpl->SetText(params, field, bpy::extract<std::string>(bpy::str(bpy::object(bpy::borrowed(value))))());
+    }
+    ReleaseGIL nogil;
+    return AstsConnection::ExecTransaction(*tmpl, params);
+  }
+};
+
+// async iterator of refresh events: async for event in conn.RefreshNotifications(): ...
+class RefreshIterator: boost::noncopyable {
+  AstsConnectionProxy* proxy_; // kept alive by python while iterator exists
+  std::shared_ptr<RefreshSubscription> sub_;
+
+public:
+  RefreshIterator(AstsConnectionProxy* proxy, std::shared_ptr<RefreshSubscription> sub) : proxy_(proxy), sub_(sub) {}
+  ~RefreshIterator() {
+    proxy_->StopWaiting(sub_);
+  }
+
+  static bpy::object Iter(bpy::object self) {
+    return self;
+  }
+
+  bpy::object Next() {
+    return proxy_->NextRefresh(sub_);
+  }
 };
 
+// events of given tables (all tables if list is empty): table, rows, version and number of events dropped before
+// this one because more than max_pending were waiting
+std::shared_ptr<RefreshIterator> AstsConnectionProxy::RefreshNotifications(bpy::list tables, size_t max_pending) {
+  std::set<std::string> names;
+  for(bpy::ssize_t i=0; i<bpy::len(tables); ++i)
+    names.insert(bpy::extract<std::string>(tables[i]));
+  auto sub = std::make_shared<RefreshSubscription>(names, max_pending);
+  {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    subscriptions_.push_back(sub);
+  }
+  if(!refresh_listener_set_) {
+    SetRefreshListener([this](const std::string& tablename, size_t rows) { OnRefresh(tablename, rows); });
+    refresh_listener_set_ = true;
+  }
+  return std::make_shared<RefreshIterator>(this, sub);
+}
+
 BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(AstsConnectionProxy_overloads, OpenTable, 1, 2)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(OpenTableAsync_overloads, OpenTableAsync, 1, 2)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(RefreshNotifications_overloads, RefreshNotifications, 0, 2)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(PrepareTransaction_overloads, PrepareTransaction, 2, 3)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(ExecTransaction_overloads, ExecTransaction, 1, 2)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(SetRefreshSchedule_overloads, SetRefreshSchedule, 2, 4)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(SetRedundancy_overloads, SetRedundancy, 1, 2)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(StartPipeline_overloads, StartPipeline, 0, 1)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(QueryArrow_overloads, QueryArrow, 1, 2)
+#ifdef ASTSSQLPY_ARROW
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(ExportParquet_overloads, ExportParquet, 2, 3)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(ExportArrowFile_overloads, ExportArrowFile, 2, 3)
+#endif
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(ArrowCStream_overloads, ArrowCStream, 0, 1)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(SetSlowQueryLog_overloads, SetSlowQueryLog, 1, 2)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(SetRetention_overloads, SetRetention, 2, 3)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(History_overloads, History, 1, 3)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(EnableTracing_overloads, EnableTracing, 1, 2)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(AddIndex_overloads, AddIndex, 2, 6)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(SetTransactionCoalescing_overloads, SetTransactionCoalescing, 2, 3)
 
 BOOST_PYTHON_MODULE(astslib)
 {
-    bpy::class_<AstsConnectionProxy>("AstsConnectionProxy")
+    // numbers out of range of transaction fields, boost.python would turn them into RuntimeError
+    bpy::register_exception_translator<std::overflow_error>([](const std::overflow_error& e) {
+      PyErr_SetString(PyExc_OverflowError, e.what());
+    });
+
+    bpy::class_<ArrowStreamProxy, std::shared_ptr<ArrowStreamProxy>, boost::noncopyable>("ArrowStream", bpy::no_init)
+        .def("__arrow_c_stream__", &ArrowStreamProxy::ArrowCStream, ArrowCStream_overloads());
+
+    bpy::class_<ad::asts::TransactionTemplate, std::shared_ptr<ad::asts::TransactionTemplate>, boost::noncopyable>("TransactionTemplate", bpy::no_init)
+        .def("Name", &ad::asts::TransactionTemplate::Name, bpy::return_value_policy<bpy::copy_const_reference>())
+        .def("System", &ad::asts::TransactionTemplate::System, bpy::return_value_policy<bpy::copy_const_reference>())
+        .def("Params", &ad::asts::TransactionTemplate::Params, bpy::return_value_policy<bpy::copy_const_reference>());
+
+    bpy::class_<RefreshIterator, std::shared_ptr<RefreshIterator>, boost::noncopyable>("RefreshIterator", bpy::no_init)
+        .def("__aiter__", &RefreshIterator::Iter)
+        .def("__anext__", &RefreshIterator::Next);
+
+    bpy::class_<AstsConnectionProxy, boost::noncopyable>("AstsConnectionProxy")
         .def("Connect", &AstsConnectionProxy::Connect)
         .def("Disconnect", &AstsConnectionProxy::Disconnect)
+        .def("AddRedundantLink", &AstsConnectionProxy::AddRedundantLink)
+        .def("SetRedundancy", &AstsConnectionProxy::SetRedundancy, SetRedundancy_overloads())
+        .def("LinkStats", &AstsConnectionProxy::LinkStats)
         .def("OpenTable", &AstsConnectionProxy::OpenTable, AstsConnectionProxy_overloads())
+        .def("OpenTables", &AstsConnectionProxy::OpenTables)
         .def("CloseTable", &AstsConnectionProxy::CloseTable)
+        .def("PrepareTransaction", &AstsConnectionProxy::PrepareTransaction, PrepareTransaction_overloads())
+        .def("ExecTransaction", &AstsConnectionProxy::ExecTransaction, ExecTransaction_overloads())
         .def("RefreshTable", &AstsConnectionProxy::RefreshTable)
+        .def("SetRefreshSchedule", &AstsConnectionProxy::SetRefreshSchedule, SetRefreshSchedule_overloads())
+        .def("RefreshDue", &AstsConnectionProxy::RefreshDue)
+        .def("RefreshSchedules", &AstsConnectionProxy::RefreshSchedules)
+        .def("StartScheduler", &AstsConnectionProxy::StartScheduler)
+        .def("StopScheduler", &AstsConnectionProxy::StopScheduler)
+        .def("SchedulerRunning", &AstsConnectionProxy::SchedulerRunning)
         .def("Query", &AstsConnectionProxy::Query)
+        .def("SetAsyncWorkers", &AstsConnectionProxy::SetAsyncWorkers)
+        .def("ConnectAsync", &AstsConnectionProxy::ConnectAsync)
+        .def("OpenTableAsync", &AstsConnectionProxy::OpenTableAsync, OpenTableAsync_overloads())
+        .def("RefreshTableAsync", &AstsConnectionProxy::RefreshTableAsync)
+        .def("QueryAsync", &AstsConnectionProxy::QueryAsync)
+        .def("RefreshNotifications", &AstsConnectionProxy::RefreshNotifications,
+             RefreshNotifications_overloads()[bpy::with_custodian_and_ward_postcall<0, 1>()])
+        .def("_DrainAsync", &AstsConnectionProxy::DrainAsync)
+        .def("Get", &AstsConnectionProxy::Get)
+        .def("GetMany", &AstsConnectionProxy::GetMany)
+        .def("TableVersion", &AstsConnectionProxy::TableVersion)
+        .def("SetQueryCacheSize", &AstsConnectionProxy::SetQueryCacheSize)
+        .def("SetReaderCount", &AstsConnectionProxy::SetReaderCount)
+        .def("QueryArrow", &AstsConnectionProxy::QueryArrow, QueryArrow_overloads())
+#ifdef ASTSSQLPY_ARROW
+        .def("ExportParquet", &AstsConnectionProxy::ExportParquet, ExportParquet_overloads())
+        .def("ExportArrowFile", &AstsConnectionProxy::ExportArrowFile, ExportArrowFile_overloads())
+#endif
+        .def("SetSlowQueryLog", &AstsConnectionProxy::SetSlowQueryLog, SetSlowQueryLog_overloads())
+        .def("SetRetention", &AstsConnectionProxy::SetRetention, SetRetention_overloads())
+        .def("MemoryUsage", &AstsConnectionProxy::MemoryUsage)
+        .def("SetHistory", &AstsConnectionProxy::SetHistory)
+        .def("History", &AstsConnectionProxy::History, History_overloads())
+        .def("StartPipeline", &AstsConnectionProxy::StartPipeline, StartPipeline_overloads())
+        .def("StopPipeline", &AstsConnectionProxy::StopPipeline)
+        .def("FlushPipeline", &AstsConnectionProxy::FlushPipeline)
+        .def("PipelineStats", &AstsConnectionProxy::PipelineStats)
+        .def("Stats", &AstsConnectionProxy::Stats)
+        .def("PrometheusStats", &AstsConnectionProxy::PrometheusStats)
+        .def("StartStatsExport", &AstsConnectionProxy::StartStatsExport)
+        .def("StopStatsExport", &AstsConnectionProxy::StopStatsExport)
+        .def("EnableTracing", &AstsConnectionProxy::EnableTracing, EnableTracing_overloads())
+        .def("WriteTrace", &AstsConnectionProxy::WriteTrace)
+        .def("SetTransactionCoalescing", &AstsConnectionProxy::SetTransactionCoalescing, SetTransactionCoalescing_overloads())
+        .def("CommitPending", &AstsConnectionProxy::CommitPending)
+        .def("SetBulkLoadThreshold", &AstsConnectionProxy::SetBulkLoadThreshold)
+        .def("SaveSnapshot", &AstsConnectionProxy::SaveSnapshot)
+        .def("LoadSnapshot", &AstsConnectionProxy::LoadSnapshot)
+        .def("ResumeTables", &AstsConnectionProxy::ResumeTables)
+        .def("Publish", &AstsConnectionProxy::Publish)
+        .def("AttachPublished", &AstsConnectionProxy::AttachPublished)
+        .def("SetInterfaceCacheDir", &AstsConnectionProxy::SetInterfaceCacheDir)
+        .def("AddIndex", &AstsConnectionProxy::AddIndex, AddIndex_overloads())
+        .def("LoadIndexConfig", &AstsConnectionProxy::LoadIndexConfig)
+        .def("SetSecCodeIndex", &AstsConnectionProxy::SetSecCodeIndex)
         .def_readwrite("debug", &AstsConnectionProxy::debug);
     ;
 }
@@ -0,0 +1,71 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+namespace ad::util {
+
+// bounded lock-free queue for exactly one producer thread and one consumer thread
+template<typename T> class SpscRing {
+private:
+  std::unique_ptr<T[]> items_;
+  size_t mask_ = 0;
+  // head is written by consumer only, tail by producer only; keep them on separate cache lines
+  alignas(64) std::atomic<size_t> head_ {0};
+  alignas(64) std::atomic<size_t> tail_ {0};
+
+public:
+  explicit SpscRing(size_t capacity) {
+    size_t size = 1;
+    while(size < capacity)
+      size <<= 1;
+    items_.reset(new T[size]);
+    mask_ = size - 1;
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+  size_t Size() const {
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+  }
+
+  bool TryPush(const T& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if(tail - head_.load(std::memory_order_acquire) > mask_)
+      return false;
+    items_[tail & mask_] = item;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T& item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if(head == tail_.load(std::memory_order_acquire))
+      return false;
+    item = items_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// spin, then yield, then sleep: keeps latency low without burning a core while idle
+struct Backoff {
+  unsigned count = 0;
+  void Wait() {
+    if(count < 64)
+      ;
+    else if(count < 128)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    ++count;
+  }
+  void Reset() { count = 0; }
+};
+
+}
+#endif // SPSC_RING_H
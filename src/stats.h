@@ -0,0 +1,103 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+
+namespace ad::util {
+
+// latency histogram with power-of-two buckets in microseconds: bucket i counts values below 2^i us.
+// Updates are relaxed atomic increments, readers in other threads may see slightly inconsistent totals.
+class Histogram {
+public:
+  static constexpr size_t kBuckets = 24; // last bucket takes everything from ~4s up
+
+  void Record(std::chrono::steady_clock::duration d) {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    size_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if(bucket >= kBuckets)
+      bucket = kBuckets - 1;
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_us_.fetch_add(us, std::memory_order_relaxed);
+  }
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t SumMicros() const { return sum_us_.load(std::memory_order_relaxed); }
+  uint64_t Bucket(size_t i) const { return buckets_[i].load(std::memory_order_relaxed); }
+  // upper bound of bucket i in microseconds
+  static uint64_t BucketBound(size_t i) { return 1ull << i; }
+
+  // upper bound of the bucket containing p-th quantile (0 < p <= 1), in microseconds
+  uint64_t Percentile(double p) const {
+    uint64_t total = Count();
+    if(!total)
+      return 0;
+    uint64_t rank = (uint64_t)(p * total + 0.5), seen = 0;
+    for(size_t i=0; i<kBuckets; ++i) {
+      seen += Bucket(i);
+      if(seen >= rank && seen)
+        return BucketBound(i);
+    }
+    return BucketBound(kBuckets - 1);
+  }
+
+private:
+  std::atomic<uint64_t> buckets_[kBuckets] = {};
+  std::atomic<uint64_t> count_ {0};
+  std::atomic<uint64_t> sum_us_ {0};
+};
+
+// measures time from construction (or Restart) to Elapsed
+class Stopwatch {
+  std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+public:
+  void Restart() { start_ = std::chrono::steady_clock::now(); }
+  std::chrono::steady_clock::duration Elapsed() const { return std::chrono::steady_clock::now() - start_; }
+};
+
+// ingest counters of one opened table, written by ingest threads, read by Stats/export
+struct TableStats {
+  std::atomic<uint64_t> refreshes {0};  // MTERefresh calls
+  std::atomic<uint64_t> batches {0};    // data batches applied
+  std::atomic<uint64_t> rows {0};       // rows applied
+  std::atomic<uint64_t> bytes {0};      // bytes of row data parsed
+  std::atomic<uint64_t> inserts {0};    // rows inserted
+  std::atomic<uint64_t> updates {0};    // rows updated by key
+  std::atomic<uint64_t> prepares {0};   // insert/update statements prepared
+  std::atomic<uint64_t> errors {0};     // batches rolled back
+  Histogram refresh_latency;            // MTEAddTable + MTERefresh round trip
+  Histogram apply_latency;              // parsing and writing one batch
+
+  static void Add(std::atomic<uint64_t>& counter, uint64_t value = 1) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+};
+
+// counters of storage as a whole
+struct StorageStats {
+  std::atomic<uint64_t> commits {0};
+  Histogram commit_latency;
+};
+
+//----- Prometheus text exposition format -----------------
+
+inline void PrometheusCounter(std::ostream& os, const std::string& name, const std::string& labels, uint64_t value) {
+  os << name << "{" << labels << "} " << value << "\n";
+}
+
+inline void PrometheusHistogram(std::ostream& os, const std::string& name, const std::string& labels, const Histogram& h) {
+  uint64_t cumulative = 0;
+  for(size_t i=0; i<Histogram::kBuckets - 1; ++i) {
+    cumulative += h.Bucket(i);
+    os << name << "_bucket{" << labels << (labels.empty() ? "" : ",") << "le=\"" << Histogram::BucketBound(i) / 1e6 << "\"} " << cumulative << "\n";
+  }
+  os << name << "_bucket{" << labels << (labels.empty() ? "" : ",") << "le=\"+Inf\"} " << h.Count() << "\n";
+  os << name << "_sum{" << labels << "} " << h.SumMicros() / 1e6 << "\n";
+  os << name << "_count{" << labels << "} " << h.Count() << "\n";
+}
+
+}
+#endif // STATS_H
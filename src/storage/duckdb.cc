@@ -0,0 +1,1488 @@
+#include "duckdb.h"
+#include "../trace.h"
+#include "../util.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <time.h> // gmtime_r
+#include <unistd.h> // unlink
+#include <mtesrl.h>
+
+namespace ad::asts {
+
+// appender writes its rows to the table by itself after 204800 rows, batches that large can not be discarded
+// by clearing the appender
+static const size_t kAppenderFlushRows = 100000;
+
+static std::string Quote(const std::string& name) {
+  return "\""+name+"\"";
+}
+
+static std::string QuoteLiteral(const std::string& value) {
+  std::string result = "'";
+  for(char c : value) {
+    if(c == '\'')
+      result.push_back('\'');
+    result.push_back(c);
+  }
+  return result+"'";
+}
+
+static duckdb_prepared_statement PrepareOrThrow(duckdb_connection db, const std::string& sql, const std::string& errormsg) {
+  duckdb_prepared_statement statement = NULL;
+  if(duckdb_prepare(db, sql.c_str(), &statement) == DuckDBError) {
+    std::string msg = statement ? duckdb_prepare_error(statement) : "out of memory";
+    duckdb_destroy_prepare(&statement);
+    throw std::runtime_error(errormsg+": "+msg);
+  }
+  return statement;
+}
+
+// executes prepared statement, returns number of rows changed
+static idx_t ExecPrepared(duckdb_prepared_statement statement, const std::string& errormsg) {
+  duckdb_result result;
+  if(duckdb_execute_prepared(statement, &result) == DuckDBError) {
+    std::string msg = duckdb_result_error(&result);
+    duckdb_destroy_result(&result);
+    throw std::runtime_error(errormsg+": "+msg);
+  }
+  idx_t changes = duckdb_rows_changed(&result);
+  duckdb_destroy_result(&result);
+  return changes;
+}
+
+static void BindValue(duckdb_prepared_statement statement, idx_t idx, const FieldValue& v) {
+  switch(v.type) {
+    case AstsFieldType::kInteger:
+      duckdb_bind_int64(statement, idx, v.int_value);
+      break;
+    case AstsFieldType::kFixed:
+      duckdb_bind_double(statement, idx, v.double_value);
+      break;
+    case AstsFieldType::kChar:
+      duckdb_bind_varchar_length(statement, idx, v.text.data(), v.text.size());
+      break;
+    default:
+      duckdb_bind_null(statement, idx);
+      break;
+  }
+}
+
+// column type of interface field: numbers are stored natively, everything else as text
+static const char* ColumnType(const AstsOutField& fld) {
+  switch(fld.type) {
+    case AstsFieldType::kInteger:
+      return "BIGINT";
+    case AstsFieldType::kFixed:
+    case AstsFieldType::kFloatPoint:
+      return "DOUBLE";
+    default:
+      return "VARCHAR";
+  }
+}
+
+// field type of a result column of given DuckDB type, kNull for types we do not convert
+static AstsFieldType ResultFieldType(duckdb_type type) {
+  switch(type) {
+    case DUCKDB_TYPE_BOOLEAN:
+    case DUCKDB_TYPE_TINYINT:
+    case DUCKDB_TYPE_SMALLINT:
+    case DUCKDB_TYPE_INTEGER:
+    case DUCKDB_TYPE_BIGINT:
+    case DUCKDB_TYPE_UTINYINT:
+    case DUCKDB_TYPE_USMALLINT:
+    case DUCKDB_TYPE_UINTEGER:
+    case DUCKDB_TYPE_UBIGINT:
+    case DUCKDB_TYPE_HUGEINT:
+      return AstsFieldType::kInteger;
+    case DUCKDB_TYPE_FLOAT:
+    case DUCKDB_TYPE_DOUBLE:
+    case DUCKDB_TYPE_DECIMAL:
+      return AstsFieldType::kFloatPoint;
+    case DUCKDB_TYPE_VARCHAR:
+    case DUCKDB_TYPE_BLOB:
+    case DUCKDB_TYPE_DATE:
+    case DUCKDB_TYPE_TIMESTAMP:
+    case DUCKDB_TYPE_TIMESTAMP_S:
+    case DUCKDB_TYPE_TIMESTAMP_MS:
+    case DUCKDB_TYPE_TIMESTAMP_NS:
+      return AstsFieldType::kChar;
+    default:
+      return AstsFieldType::kNull;
+  }
+}
+
+// same as ResultFieldType for a column of interface field
+static AstsFieldType StoredFieldType(const AstsOutField& fld) {
+  switch(fld.type) {
+    case AstsFieldType::kInteger:
+      return AstsFieldType::kInteger;
+    case AstsFieldType::kFixed:
+    case AstsFieldType::kFloatPoint:
+      return AstsFieldType::kFloatPoint;
+    default:
+      return AstsFieldType::kChar;
+  }
+}
+
+// YYYY-MM-DD of days since 1970-01-01
+static std::string FormatDate(int64_t days) {
+  int64_t z = days + 719468;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  int64_t doe = z - era * 146097;
+  int64_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+  int64_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+  int64_t mp = (5*doy + 2) / 153;
+  int64_t d = doy - (153*mp + 2)/5 + 1;
+  int64_t m = mp < 10 ? mp + 3 : mp - 9;
+  int64_t y = yoe + era * 400 + (m <= 2);
+  char tmp[64];
+  snprintf(tmp, sizeof(tmp), "%04lld-%02lld-%02lld", (long long)y, (long long)m, (long long)d);
+  return tmp;
+}
+
+static std::string FormatTimestamp(int64_t micros) {
+  const int64_t day = 86400000000ll;
+  int64_t days = micros >= 0 ? micros / day : (micros - day + 1) / day;
+  int64_t us = micros - days * day;
+  char tmp[32];
+  snprintf(tmp, sizeof(tmp), " %02lld:%02lld:%02lld.%06lld", (long long)(us / 3600000000ll), (long long)(us / 60000000 % 60),
+    (long long)(us / 1000000 % 60), (long long)(us % 1000000));
+  return FormatDate(days)+tmp;
+}
+
+static double HugeintToDouble(const duckdb_hugeint& h) {
+  return (double)h.upper * 18446744073709551616.0 + (double)h.lower;
+}
+
+static std::any VectorValue(duckdb_type type, duckdb_type internal, double scale, void* data, idx_t row) {
+  switch(type) {
+    case DUCKDB_TYPE_BOOLEAN:   return (int64_t)((bool*)data)[row];
+    case DUCKDB_TYPE_TINYINT:   return (int64_t)((int8_t*)data)[row];
+    case DUCKDB_TYPE_SMALLINT:  return (int64_t)((int16_t*)data)[row];
+    case DUCKDB_TYPE_INTEGER:   return (int64_t)((int32_t*)data)[row];
+    case DUCKDB_TYPE_BIGINT:    return (int64_t)((int64_t*)data)[row];
+    case DUCKDB_TYPE_UTINYINT:  return (int64_t)((uint8_t*)data)[row];
+    case DUCKDB_TYPE_USMALLINT: return (int64_t)((uint16_t*)data)[row];
+    case DUCKDB_TYPE_UINTEGER:  return (int64_t)((uint32_t*)data)[row];
+    case DUCKDB_TYPE_UBIGINT:   return (int64_t)((uint64_t*)data)[row];
+    // sum() of BIGINT is HUGEINT, values of market data sums fit in 64 bits
+    case DUCKDB_TYPE_HUGEINT:   return (int64_t)((duckdb_hugeint*)data)[row].lower;
+    case DUCKDB_TYPE_FLOAT:     return (double)((float*)data)[row];
+    case DUCKDB_TYPE_DOUBLE:    return ((double*)data)[row];
+    case DUCKDB_TYPE_DECIMAL:
+      switch(internal) {
+        case DUCKDB_TYPE_SMALLINT: return ((int16_t*)data)[row] / scale;
+        case DUCKDB_TYPE_INTEGER:  return ((int32_t*)data)[row] / scale;
+        case DUCKDB_TYPE_BIGINT:   return ((int64_t*)data)[row] / scale;
+        case DUCKDB_TYPE_HUGEINT:  return HugeintToDouble(((duckdb_hugeint*)data)[row]) / scale;
+        default:                   return std::any();
+      }
+    case DUCKDB_TYPE_VARCHAR:
+    case DUCKDB_TYPE_BLOB: {
+      duckdb_string_t& s = ((duckdb_string_t*)data)[row];
+      uint32_t len = s.value.inlined.length;
+      return std::string(len <= 12 ? s.value.inlined.inlined : s.value.pointer.ptr, len);
+    }
+    case DUCKDB_TYPE_DATE:         return FormatDate(((duckdb_date*)data)[row].days);
+    case DUCKDB_TYPE_TIMESTAMP:    return FormatTimestamp(((int64_t*)data)[row]);
+    case DUCKDB_TYPE_TIMESTAMP_S:  return FormatTimestamp(((int64_t*)data)[row] * 1000000);
+    case DUCKDB_TYPE_TIMESTAMP_MS: return FormatTimestamp(((int64_t*)data)[row] * 1000);
+    case DUCKDB_TYPE_TIMESTAMP_NS: return FormatTimestamp(((int64_t*)data)[row] / 1000);
+    default:                       return std::any();
+  }
+}
+
+// chunks stop on error of streaming result as well as on its end
+static void CheckFetchError(duckdb_result& result) {
+  const char* error = duckdb_result_error(&result);
+  if(error && *error)
+    throw std::runtime_error(error);
+}
+
+static std::string UtcNow() {
+  auto now = std::chrono::system_clock::now();
+  time_t t = std::chrono::system_clock::to_time_t(now);
+  int ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char tmp[64];
+  snprintf(tmp, sizeof(tmp), "%04d-%02d-%02d %02d:%02d:%02d.%03d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+    tm.tm_hour, tm.tm_min, tm.tm_sec, ms);
+  return tmp;
+}
+
+void DuckDBStorage::ExecOrThrow(const std::string& sql, const std::string& errormsg) {
+  ExecChanges(sql, errormsg);
+}
+
+idx_t DuckDBStorage::ExecChanges(const std::string& sql, const std::string& errormsg) {
+  duckdb_result result;
+  if(duckdb_query(db_, sql.c_str(), &result) == DuckDBError) {
+    std::string msg = duckdb_result_error(&result);
+    duckdb_destroy_result(&result);
+    throw std::runtime_error(errormsg+": "+msg);
+  }
+  idx_t changes = duckdb_rows_changed(&result);
+  duckdb_destroy_result(&result);
+  return changes;
+}
+
+duckdb_connection DuckDBStorage::OpenConnection() {
+  duckdb_connection db = NULL;
+  if(duckdb_connect(database_, &db) == DuckDBError)
+    throw std::runtime_error("Unable to connect to DuckDB storage");
+  return db;
+}
+
+DuckDBStorage::DuckDBStorage() {
+  max_readers_ = std::max(1u, std::thread::hardware_concurrency());
+  // in-memory database shared by all connections of this storage
+  if(duckdb_open(NULL, &database_) == DuckDBError)
+    throw std::runtime_error("Unable to initialize DuckDB storage");
+  db_ = OpenConnection();
+  RegisterHistoryFunction();
+}
+
+DuckDBStorage::~DuckDBStorage() {
+  ResetStatements();
+  for(auto db : readers_)
+    duckdb_disconnect(&db);
+  duckdb_disconnect(&db_);
+  duckdb_close(&database_);
+}
+
+DuckDBStorage::ReaderLease::ReaderLease(DuckDBStorage& s) : storage(s), db(NULL) {
+  std::unique_lock<std::mutex> lock(storage.readers_mutex_);
+  if(storage.max_readers_ == 0) {
+    lock.unlock();
+    write_lock = std::unique_lock<std::mutex>(storage.write_mutex_);
+    db = storage.db_;
+    return;
+  }
+  while(storage.free_readers_.empty() && storage.readers_.size() >= storage.max_readers_)
+    storage.readers_cv_.wait(lock);
+  if(!storage.free_readers_.empty()) {
+    db = storage.free_readers_.back();
+    storage.free_readers_.pop_back();
+  }
+  else {
+    db = storage.OpenConnection();
+    storage.readers_.push_back(db);
+  }
+}
+
+DuckDBStorage::ReaderLease::~ReaderLease() {
+  if(write_lock.owns_lock())
+    return;
+  std::lock_guard<std::mutex> lock(storage.readers_mutex_);
+  storage.free_readers_.push_back(db);
+  storage.readers_cv_.notify_one();
+}
+
+void DuckDBStorage::SetReaderCount(size_t count) {
+  std::lock_guard<std::mutex> lock(readers_mutex_);
+  max_readers_ = count;
+  // close idle connections above the limit, busy ones are kept until storage is destroyed
+  while(readers_.size() > max_readers_ && !free_readers_.empty()) {
+    duckdb_connection db = free_readers_.back();
+    free_readers_.pop_back();
+    readers_.erase(std::find(readers_.begin(), readers_.end(), db));
+    duckdb_disconnect(&db);
+  }
+  readers_cv_.notify_all();
+}
+
+void DuckDBStorage::Publish(const std::string& path) {
+  (void)path;
+  throw std::runtime_error("DuckDB storage can not be shared with other processes");
+}
+
+void DuckDBStorage::AttachPublished(const std::string& path, SnapshotState& state) {
+  (void)path;
+  (void)state;
+  throw std::runtime_error("DuckDB storage can not be shared with other processes");
+}
+
+void DuckDBStorage::TransactionControl(const std::string& action) {
+  ExecOrThrow(action+" TRANSACTION;", "DuckDB error occured while changing transaction state");
+}
+
+void DuckDBStorage::AddInterface(std::shared_ptr<AstsInterface> iface) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  std::string errmsg = std::string("DuckDB error while create reflection for interface ")+iface->name_;
+  ExecOrThrow("create table if not exists \"MTE$STRUCTURE\" (system_type VARCHAR, interface_name VARCHAR, table_name VARCHAR, orig_table_name VARCHAR,"
+              " field_name VARCHAR, field_type INTEGER, field_length INTEGER, decimals INTEGER);", errmsg);
+  Commit();
+  // appender writes all rows at once when it is destroyed
+  duckdb_appender appender = NULL;
+  if(duckdb_appender_create(db_, NULL, "MTE$STRUCTURE", &appender) == DuckDBError) {
+    std::string msg = appender ? duckdb_appender_error(appender) : "out of memory";
+    duckdb_appender_destroy(&appender);
+    throw std::runtime_error(errmsg+": "+msg);
+  }
+  std::string system_type = iface->GetSystemType();
+  bool ok = true;
+  for(auto & rec : iface->tables) {
+    std::string table_name = iface->prefix_+rec.second->name;
+    for(auto & fld : rec.second->outfields) {
+      ok = ok && duckdb_append_varchar_length(appender, system_type.data(), system_type.size()) == DuckDBSuccess
+        && duckdb_append_varchar_length(appender, iface->name_.data(), iface->name_.size()) == DuckDBSuccess
+        && duckdb_append_varchar_length(appender, table_name.data(), table_name.size()) == DuckDBSuccess
+        && duckdb_append_varchar_length(appender, rec.second->name.data(), rec.second->name.size()) == DuckDBSuccess
+        && duckdb_append_varchar_length(appender, fld.name.data(), fld.name.size()) == DuckDBSuccess
+        && duckdb_append_int64(appender, fld.type) == DuckDBSuccess
+        && duckdb_append_int64(appender, fld.size) == DuckDBSuccess
+        && duckdb_append_int64(appender, fld.decimals) == DuckDBSuccess
+        && duckdb_appender_end_row(appender) == DuckDBSuccess;
+    }
+  }
+  if(!ok || duckdb_appender_close(appender) == DuckDBError) {
+    std::string msg = duckdb_appender_error(appender);
+    duckdb_appender_destroy(&appender);
+    throw std::runtime_error(errmsg+": "+msg);
+  }
+  duckdb_appender_destroy(&appender);
+  ExecOrThrow("create index if not exists \"MTE$STRUCTURE_IDX\" on \"MTE$STRUCTURE\" (table_name, field_name);", errmsg);
+  BumpTableVersion("MTE$STRUCTURE");
+}
+
+void DuckDBStorage::RemoveInterface(std::shared_ptr<AstsInterface> iface) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+  ExecOrThrow("delete from \"MTE$STRUCTURE\" where interface_name = "+QuoteLiteral(iface->name_)+";",
+              std::string("DuckDB error while removing reflection of interface ")+iface->name_);
+  BumpTableVersion("MTE$STRUCTURE");
+}
+
+void DuckDBStorage::CreateTable(std::shared_ptr<AstsInterface> iface, const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+  auto& table = iface->tables[tablename];
+  std::vector<std::string> fields, keys;
+  for(auto& fld : table->outfields) {
+    std::string column = Quote(fld.name)+" "+ColumnType(fld);
+    if((fld.attr & mffKey) == mffKey) {
+      column.append(" NOT NULL");
+      keys.push_back(Quote(fld.name));
+    }
+    fields.push_back(column);
+  }
+  std::string errmsg = "DuckDB error occured while creating table "+tablename;
+  // rows are merged by key at the end of every batch, so there is no primary key constraint to check on every row
+  ExecOrThrow("create table if not exists "+Quote(tablename)+" ("+ad::util::join(fields, ", ")+");", errmsg);
+  if(!keys.empty()) {
+    fields.push_back("\"MTE$SEQ\" BIGINT");
+    ExecOrThrow("create table if not exists "+Quote(tablename+"$STAGE")+" ("+ad::util::join(fields, ", ")+");", errmsg);
+  }
+  // secondary indexes
+  if(seccode_index_) {
+    IndexSpec seccode;
+    seccode.name = "SECCODE";
+    for(auto& fld : table->outfields)
+      if(fld.attr & mffSecCode)
+        seccode.columns.push_back(fld.name);
+    if(!seccode.columns.empty())
+      CreateIndex(tablename, seccode);
+  }
+  auto specs = index_specs_.find(tablename);
+  if(specs != index_specs_.end())
+    for(auto& spec : specs->second)
+      CreateIndex(tablename, spec);
+
+  TableWriter& writer = writers_[tablename];
+  writer.table = table;
+  if(!keys.empty() && writer.lookup == NULL) {
+    std::vector<std::string> match;
+    for(size_t k=0; k<table->keyfields.size(); ++k) {
+      const AstsOutField& fld = table->outfields[table->keyfields[k].first];
+      match.push_back(Quote(fld.name)+" = CAST($"+std::to_string(k+1)+" AS "+ColumnType(fld)+")");
+    }
+    writer.lookup = PrepareOrThrow(db_, "select * from "+Quote(tablename)+" where "+ad::util::join(match, " and "),
+                                   "DuckDB error occured while preparing lookup of table "+tablename);
+  }
+}
+
+// version of every known table, for statements whose targets are unknown
+void DuckDBStorage::BumpAllVersions() {
+  std::vector<std::string> tables;
+  {
+    std::lock_guard<std::mutex> lock(versions_mutex_);
+    for(auto& t : table_versions_)
+      tables.push_back(t.first);
+  }
+  for(auto& w : writers_)
+    tables.push_back(w.first);
+  std::sort(tables.begin(), tables.end());
+  tables.erase(std::unique(tables.begin(), tables.end()), tables.end());
+  for(auto& t : tables)
+    BumpTableVersion(t);
+}
+
+void DuckDBStorage::BumpTableVersion(const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(versions_mutex_);
+  ++table_versions_[tablename];
+}
+
+void DuckDBStorage::MarkTableChanged(const std::string& tablename) {
+  // inside transaction version is bumped on commit, otherwise change is already visible
+  if(in_transaction_)
+    dirty_tables_.insert(tablename);
+  else
+    BumpTableVersion(tablename);
+}
+
+uint64_t DuckDBStorage::GetTableVersion(const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(versions_mutex_);
+  auto it = table_versions_.find(tablename);
+  return it == table_versions_.end() ? 0 : it->second;
+}
+
+// DuckDB has no savepoints: once a batch writes to tables, only the whole transaction can be rolled back.
+// Batches waiting for commit are committed first, so abort discards this batch only.
+void DuckDBStorage::StartDirectWrites() {
+  if(!write_lock_.owns_lock() || batch_direct_writes_)
+    return;
+  batch_direct_writes_ = true;
+  if(pending_rows_ || !dirty_tables_.empty()) {
+    Commit();
+    TransactionControl("BEGIN");
+    in_transaction_ = true;
+    transaction_start_ = std::chrono::steady_clock::now();
+  }
+}
+
+void DuckDBStorage::StartReadingRows(AstsOpenedTable* table, size_t row_count, bool replace) {
+  write_lock_ = std::unique_lock<std::mutex>(write_mutex_);
+  // temp buffer is reused by all batches and only grows
+  if(tmp_buf_.size() < table->thistable_->max_fld_len+2)
+    tmp_buf_.resize(table->thistable_->max_fld_len+2);
+  current_table_ = table->tablename_;
+  current_opened_ = table;
+  batch_direct_writes_ = false;
+  auto writer = writers_.find(current_table_);
+  if(writer == writers_.end()) {
+    write_lock_.unlock();
+    throw std::runtime_error("Table "+current_table_+" has not been created in DuckDB storage");
+  }
+  current_writer_ = &writer->second;
+  current_history_ = nullptr;
+  auto history = history_sizes_.find(current_table_);
+  if(history != history_sizes_.end()) {
+    auto& log = history_[current_table_];
+    if(!log) {
+      std::lock_guard<std::mutex> lock(history_mutex_);
+      log = std::make_shared<HistoryLog>(table->thistable_, history->second);
+    }
+    current_history_ = log.get();
+  }
+  try {
+    if(!in_transaction_) {
+      TransactionControl("BEGIN");
+      in_transaction_ = true;
+      transaction_start_ = std::chrono::steady_clock::now();
+    }
+    if(row_count >= kAppenderFlushRows)
+      StartDirectWrites();
+    // new copy replaces table contents in the same transaction, readers see either old or new rows
+    if(replace)
+      EraseData(current_table_);
+  }
+  catch(...) {
+    AbortReadingRows();
+    throw;
+  }
+}
+
+void DuckDBStorage::ReadRowFromBuffer(AstsOpenedTable* table, ad::util::BufferReader& buffer, fld_count_t* fldnums, fld_count_t fldcount) {
+  TableWriter& writer = *current_writer_;
+  auto& outfields = table->thistable_->outfields;
+  if(current_history_)
+    current_history_->Append(buffer.Data(), fldnums, fldcount);
+  ++batch_rows_;
+  if(fldcount != table->thistable_->outfield_count) {
+    // rows with part of fields change existing rows, rows appended before them must be in the table already
+    StartDirectWrites();
+    FlushAppender(writer);
+    row_values_.resize(fldcount);
+    for(fld_count_t c=0; c<fldcount; ++c) {
+      const AstsOutField& fld = outfields[fldnums[c]];
+      row_values_[c] = DecodeField(fld, buffer.Take(fld.size), tmp_buf_.data());
+    }
+    ApplyPartialRow(writer, fldnums, fldcount);
+    return;
+  }
+
+  // appender takes values in column order, fields in buffer may come in any order
+  row_values_.assign(outfields.size(), FieldValue());
+  for(fld_count_t c=0; c<fldcount; ++c) {
+    const AstsOutField& fld = outfields[fldnums[c]];
+    row_values_[fldnums[c]] = DecodeField(fld, buffer.Take(fld.size), tmp_buf_.data());
+  }
+  bool keyed = !table->thistable_->keyfields.empty();
+  if(writer.appender == NULL) {
+    std::string target = keyed ? current_table_+"$STAGE" : current_table_;
+    if(duckdb_appender_create(db_, NULL, target.c_str(), &writer.appender) == DuckDBError) {
+      std::string msg = writer.appender ? duckdb_appender_error(writer.appender) : "out of memory";
+      duckdb_appender_destroy(&writer.appender);
+      writer.appender = NULL;
+      throw std::runtime_error("DuckDB error occured while creating appender for table "+target+": "+msg);
+    }
+  }
+  bool ok = true;
+  for(auto& v : row_values_) {
+    switch(v.type) {
+      case AstsFieldType::kInteger:
+        ok = duckdb_append_int64(writer.appender, v.int_value) == DuckDBSuccess && ok;
+        break;
+      case AstsFieldType::kFixed:
+        ok = duckdb_append_double(writer.appender, v.double_value) == DuckDBSuccess && ok;
+        break;
+      case AstsFieldType::kChar:
+        ok = duckdb_append_varchar_length(writer.appender, v.text.data(), v.text.size()) == DuckDBSuccess && ok;
+        break;
+      default:
+        ok = duckdb_append_null(writer.appender) == DuckDBSuccess && ok;
+        break;
+    }
+  }
+  if(keyed)
+    ok = duckdb_append_int64(writer.appender, ++writer.sequence) == DuckDBSuccess && ok;
+  if(!ok || duckdb_appender_end_row(writer.appender) == DuckDBError)
+    throw std::runtime_error("DuckDB error occured while appending row to table "+current_table_+": "+duckdb_appender_error(writer.appender));
+  ++writer.appended;
+}
+
+void DuckDBStorage::ApplyPartialRow(TableWriter& writer, fld_count_t* fldnums, fld_count_t fldcount) {
+  const AstsTable& table = *writer.table;
+  std::basic_string<fld_count_t> fields(fldnums, fldcount);
+  auto statements = writer.partial.find(fields);
+  if(statements == writer.partial.end()) {
+    std::vector<std::string> columns, params, set, match;
+    for(fld_count_t c=0; c<fldcount; ++c) {
+      const AstsOutField& fld = table.outfields[fldnums[c]];
+      std::string param = "$"+std::to_string(c+1);
+      columns.push_back(Quote(fld.name));
+      params.push_back(param);
+      if((fld.attr & mffKey) == mffKey)
+        match.push_back(Quote(fld.name)+" = "+param);
+      else
+        set.push_back(Quote(fld.name)+" = "+param);
+    }
+    std::string errmsg = "DuckDB error occured while preparing statement for table "+current_table_;
+    duckdb_prepared_statement update = NULL;
+    if(!table.keyfields.empty() && match.size() == table.keyfields.size()) {
+      // rows consisting of key fields only: update changes nothing, but tells whether row exists
+      if(set.empty())
+        set.push_back(columns[0]+" = "+columns[0]);
+      update = PrepareOrThrow(db_, "update "+Quote(current_table_)+" set "+ad::util::join(set, ", ")+" where "+ad::util::join(match, " and "), errmsg);
+    }
+    duckdb_prepared_statement insert = NULL;
+    try {
+      insert = PrepareOrThrow(db_, "insert into "+Quote(current_table_)+" ("+ad::util::join(columns, ", ")+") values ("+ad::util::join(params, ", ")+")", errmsg);
+    }
+    catch(...) {
+      duckdb_destroy_prepare(&update);
+      throw;
+    }
+    statements = writer.partial.insert({fields, {update, insert}}).first;
+    ad::util::TableStats::Add(current_opened_->stats.prepares);
+  }
+
+  auto& [update, insert] = statements->second;
+  if(update != NULL) {
+    for(fld_count_t c=0; c<fldcount; ++c)
+      BindValue(update, c+1, row_values_[c]);
+    if(ExecPrepared(update, "DuckDB error occured while updating table "+current_table_)) {
+      ad::util::TableStats::Add(current_opened_->stats.updates);
+      return;
+    }
+  }
+  for(fld_count_t c=0; c<fldcount; ++c)
+    BindValue(insert, c+1, row_values_[c]);
+  ExecPrepared(insert, "DuckDB error occured while inserting into table "+current_table_);
+  ad::util::TableStats::Add(current_opened_->stats.inserts);
+}
+
+// moves appended rows into the table; staged rows of keyed tables replace rows with the same key
+void DuckDBStorage::FlushAppender(TableWriter& writer) {
+  if(!writer.appended)
+    return;
+  batch_direct_writes_ = true;
+  if(duckdb_appender_flush(writer.appender) == DuckDBError)
+    throw std::runtime_error("DuckDB error occured while appending rows to table "+current_table_+": "+duckdb_appender_error(writer.appender));
+  size_t appended = writer.appended;
+  writer.appended = 0;
+  writer.sequence = 0;
+  const AstsTable& table = *writer.table;
+  if(table.keyfields.empty()) {
+    ad::util::TableStats::Add(current_opened_->stats.inserts, appended);
+    return;
+  }
+  std::string target = Quote(current_table_), stage = Quote(current_table_+"$STAGE");
+  std::vector<std::string> keys, match, columns;
+  for(auto& k : table.keyfields) {
+    keys.push_back(Quote(k.second));
+    match.push_back(target+"."+Quote(k.second)+" = s."+Quote(k.second));
+  }
+  for(auto& fld : table.outfields)
+    columns.push_back(Quote(fld.name));
+  std::string errmsg = "DuckDB error occured while merging rows into table "+current_table_;
+  idx_t replaced = ExecChanges("delete from "+target+" using "+stage+" s where "+ad::util::join(match, " and ")+";", errmsg);
+  // the last row of every key wins
+  idx_t inserted = ExecChanges("insert into "+target+" select "+ad::util::join(columns, ", ")+" from "+stage
+    +" qualify row_number() over (partition by "+ad::util::join(keys, ", ")+" order by \"MTE$SEQ\" desc) = 1;", errmsg);
+  ExecOrThrow("delete from "+stage+";", errmsg);
+  ad::util::TableStats::Add(current_opened_->stats.updates, replaced);
+  ad::util::TableStats::Add(current_opened_->stats.inserts, inserted - replaced);
+}
+
+void DuckDBStorage::CloseWriter(TableWriter& writer) {
+  if(writer.appender) {
+    // destroying appender flushes it, rows not flushed yet are discarded
+    duckdb_appender_clear(writer.appender);
+    duckdb_appender_destroy(&writer.appender);
+    writer.appender = NULL;
+  }
+  writer.appended = 0;
+  writer.sequence = 0;
+  for(auto& s : writer.partial) {
+    duckdb_destroy_prepare(&s.second.first);
+    duckdb_destroy_prepare(&s.second.second);
+  }
+  writer.partial.clear();
+  duckdb_destroy_prepare(&writer.lookup);
+  writer.lookup = NULL;
+}
+
+void DuckDBStorage::ResetStatements() {
+  for(auto& w : writers_)
+    CloseWriter(w.second);
+  writers_.clear();
+  current_writer_ = nullptr;
+}
+
+void DuckDBStorage::EraseData(const std::string& tablename, const std::string& secboard, const std::string& seccode) {
+  // rows appended earlier in this batch are erased as well
+  if(current_writer_ && tablename == current_table_) {
+    StartDirectWrites();
+    FlushAppender(*current_writer_);
+  }
+  std::string del = "delete from "+Quote(tablename);
+  if(secboard != "")
+    del += " where SECBOARD = "+QuoteLiteral(secboard)+" and SECCODE = "+QuoteLiteral(seccode);
+  ExecOrThrow(del+";", "DuckDB error occured while deleting data from table "+tablename);
+  MarkTableChanged(tablename);
+  auto retention = retention_.find(tablename);
+  if(retention != retention_.end() && secboard == "")
+    retention->second.Reset();
+  auto history = history_.find(tablename);
+  if(history != history_.end() && history->second)
+    history->second->Reset();
+}
+
+void DuckDBStorage::CloseTable(const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+  EraseData(tablename);
+  // we do not drop table to save some time on DDL operations
+}
+
+void DuckDBStorage::AbortReadingRows() {
+  if(!write_lock_.owns_lock())
+    return;
+  if(current_writer_) {
+    if(current_writer_->appender)
+      duckdb_appender_clear(current_writer_->appender);
+    current_writer_->appended = 0;
+    current_writer_->sequence = 0;
+  }
+  // rows that reached tables can only be discarded with the transaction; it holds no other batches, see StartDirectWrites
+  if(batch_direct_writes_ && in_transaction_) {
+    duckdb_result result;
+    duckdb_query(db_, "ROLLBACK TRANSACTION;", &result);
+    duckdb_destroy_result(&result);
+    in_transaction_ = false;
+    pending_rows_ = 0;
+    dirty_tables_.clear();
+  }
+  batch_rows_ = 0;
+  batch_direct_writes_ = false;
+  if(current_history_)
+    current_history_->Discard();
+  current_writer_ = nullptr;
+  current_opened_ = nullptr;
+  write_lock_.unlock();
+}
+
+void DuckDBStorage::StopReadingRows() {
+  try {
+    if(current_writer_)
+      FlushAppender(*current_writer_);
+    dirty_tables_.insert(current_table_);
+    pending_rows_ += batch_rows_;
+    batch_rows_ = 0;
+    if(current_history_)
+      current_history_->Publish();
+    if(IsCommitDue())
+      Commit();
+  }
+  catch(...) {
+    AbortReadingRows();
+    throw;
+  }
+  current_writer_ = nullptr;
+  current_opened_ = nullptr;
+  write_lock_.unlock();
+}
+
+bool DuckDBStorage::IsCommitDue() {
+  if(!in_transaction_)
+    return false;
+  if(coalesce_rows_ == 0 && coalesce_delay_.count() == 0)
+    return true;
+  if(coalesce_rows_ != 0 && pending_rows_ >= coalesce_rows_)
+    return true;
+  return coalesce_delay_.count() != 0 && std::chrono::steady_clock::now() - transaction_start_ >= coalesce_delay_;
+}
+
+void DuckDBStorage::Commit() {
+  if(!in_transaction_)
+    return;
+  ad::util::Stopwatch timer;
+  ad::util::TraceSpan span("Commit");
+  span.SetCount(pending_rows_);
+  in_transaction_ = false;
+  duckdb_result result;
+  if(duckdb_query(db_, "COMMIT TRANSACTION;", &result) == DuckDBError) {
+    std::string msg = duckdb_result_error(&result);
+    duckdb_destroy_result(&result);
+    // failed transaction can only be rolled back
+    duckdb_query(db_, "ROLLBACK TRANSACTION;", &result);
+    duckdb_destroy_result(&result);
+    pending_rows_ = 0;
+    dirty_tables_.clear();
+    throw std::runtime_error("DuckDB error occured while committing transaction: "+msg);
+  }
+  duckdb_destroy_result(&result);
+  stats_.commit_latency.Record(timer.Elapsed());
+  ad::util::TableStats::Add(stats_.commits);
+  pending_rows_ = 0;
+  std::set<std::string> changed;
+  changed.swap(dirty_tables_);
+  for(auto& t : changed)
+    BumpTableVersion(t);
+  if(!retention_.empty())
+    EnforceRetention(changed);
+}
+
+// runs query and reads all rows of its result
+void DuckDBStorage::QueryRows(duckdb_connection db, const std::string& sql, SqlResult& rows, const std::string& errormsg) {
+  duckdb_result result;
+  if(duckdb_query(db, sql.c_str(), &result) == DuckDBError) {
+    std::string msg = duckdb_result_error(&result);
+    duckdb_destroy_result(&result);
+    throw std::runtime_error(errormsg+": "+msg);
+  }
+  rows = SqlResult();
+  ReadResult(result, rows, {});
+  duckdb_destroy_result(&result);
+}
+
+// evict old rows of tables changed by committed transaction. Rows appended by a transaction get their
+// rowids on commit, so eviction runs after it, each table in its own transaction
+void DuckDBStorage::EnforceRetention(const std::set<std::string>& tables) {
+  auto now = std::chrono::steady_clock::now();
+  for(auto& t : tables) {
+    auto it = retention_.find(t);
+    if(it == retention_.end())
+      continue;
+    std::string errmsg = "DuckDB error occured while evicting rows of table "+t;
+    SqlResult range;
+    QueryRows(db_, "select min(rowid), max(rowid) from "+Quote(t)+";", range, errmsg);
+    if(range.data.empty() || !range.data[0][0].has_value())
+      continue;
+    int64_t cutoff = it->second.Cutoff(std::any_cast<int64_t>(range.data[0][0]), std::any_cast<int64_t>(range.data[0][1]), now);
+    if(!cutoff)
+      continue;
+    it->second.evicted_rows += ExecChanges("delete from "+Quote(t)+" where rowid <= "+std::to_string(cutoff)+";", errmsg);
+    BumpTableVersion(t);
+  }
+}
+
+void DuckDBStorage::SetRetention(const std::string& tablename, const RetentionPolicy& policy) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(policy.max_rows == 0 && policy.max_age.count() == 0)
+    retention_.erase(tablename);
+  else
+    retention_.insert_or_assign(tablename, RetentionState(policy));
+}
+
+void DuckDBStorage::GetMemoryUsage(MemoryUsage& usage) {
+  usage = MemoryUsage();
+  std::vector<std::pair<std::shared_ptr<AstsTable>, size_t> > tables; // table, estimated row width
+  {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    for(auto& w : writers_) {
+      // numbers take 8 bytes, strings of up to 12 bytes are stored inline in 16 bytes
+      size_t width = 0;
+      for(auto& fld : w.second.table->outfields)
+        width += StoredFieldType(fld) == AstsFieldType::kChar ? (fld.size > 12 ? 16 + fld.size : 16) : 8;
+      tables.push_back({w.second.table, width});
+      TableMemory t;
+      t.tablename = w.first;
+      auto r = retention_.find(w.first);
+      if(r != retention_.end())
+        t.evicted_rows = r->second.evicted_rows;
+      auto h = history_.find(w.first);
+      if(h != history_.end() && h->second)
+        t.history_bytes = h->second->Bytes();
+      usage.tables.push_back(t);
+    }
+  }
+  ReaderLease reader(*this);
+  if(reader.db == db_)
+    Commit();
+  std::string errmsg = "DuckDB error occured while reading memory usage";
+  SqlResult rows;
+  for(size_t i=0; i<tables.size(); ++i) {
+    QueryRows(reader.db, "select count(*) from "+Quote(usage.tables[i].tablename)+";", rows, errmsg);
+    usage.tables[i].rows = std::any_cast<int64_t>(rows.data[0][0]);
+    usage.tables[i].bytes = usage.tables[i].rows * tables[i].second;
+  }
+  QueryRows(reader.db, "select tag, memory_usage_bytes from duckdb_memory();", rows, errmsg);
+  for(auto& row : rows.data) {
+    std::string tag = std::any_cast<std::string>(row[0]);
+    uint64_t bytes = std::any_cast<int64_t>(row[1]);
+    if(tag == "BASE_TABLE" || tag == "IN_MEMORY_TABLE" || tag == "ART_INDEX" || tag == "METADATA" || tag == "OVERFLOW_STRINGS")
+      usage.storage_bytes += bytes;
+    usage.heap_bytes += bytes;
+  }
+}
+
+void DuckDBStorage::SetHistory(const std::string& tablename, size_t max_bytes) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  std::lock_guard<std::mutex> history_lock(history_mutex_);
+  if(max_bytes == 0) {
+    history_sizes_.erase(tablename);
+    history_.erase(tablename);
+    return;
+  }
+  history_sizes_[tablename] = max_bytes;
+  auto log = history_.find(tablename);
+  if(log != history_.end() && log->second)
+    log->second->SetMaxBytes(max_bytes);
+}
+
+std::shared_ptr<HistoryLog> DuckDBStorage::FindHistory(const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(history_mutex_);
+  auto log = history_.find(tablename);
+  return log == history_.end() ? nullptr : log->second;
+}
+
+void DuckDBStorage::GetHistory(const std::string& tablename, int64_t from_us, int64_t to_us, SqlResult& result) {
+  auto log = FindHistory(tablename);
+  if(!log)
+    throw std::runtime_error("History is not enabled for table "+tablename);
+  log->Read(from_us, to_us, result);
+}
+
+// asts_history('<table>', from_ts := ..., to_ts := ...): change log of a table, one row per changed field.
+// Bind finds the log, init reads records within time range, scan returns them chunk by chunk
+struct HistoryScanData {
+  std::shared_ptr<HistoryLog> log;
+  int64_t from_us = std::numeric_limits<int64_t>::min();
+  int64_t to_us = std::numeric_limits<int64_t>::max();
+};
+struct HistoryScanState {
+  SqlResult rows;
+  size_t pos = 0;
+};
+
+void DuckDBStorage::HistoryBind(duckdb_bind_info info) {
+  DuckDBStorage* storage = (DuckDBStorage*)duckdb_bind_get_extra_info(info);
+  duckdb_value value = duckdb_bind_get_parameter(info, 0);
+  char* name = duckdb_get_varchar(value);
+  std::string tablename = name ? name : "";
+  duckdb_free(name);
+  duckdb_destroy_value(&value);
+  auto data = std::make_unique<HistoryScanData>();
+  data->log = storage->FindHistory(tablename);
+  if(!data->log) {
+    duckdb_bind_set_error(info, ("History is not enabled for table "+tablename).c_str());
+    return;
+  }
+  auto bound = [&](const char* param, int64_t& out) {
+    duckdb_value v = duckdb_bind_get_named_parameter(info, param);
+    if(v && !duckdb_is_null_value(v))
+      out = duckdb_get_int64(v);
+    if(v)
+      duckdb_destroy_value(&v);
+  };
+  bound("from_ts", data->from_us);
+  bound("to_ts", data->to_us);
+  duckdb_logical_type bigint = duckdb_create_logical_type(DUCKDB_TYPE_BIGINT);
+  duckdb_logical_type varchar = duckdb_create_logical_type(DUCKDB_TYPE_VARCHAR);
+  duckdb_bind_add_result_column(info, "SEQ", bigint);
+  duckdb_bind_add_result_column(info, "TS", bigint);
+  duckdb_bind_add_result_column(info, "KEY", varchar);
+  duckdb_bind_add_result_column(info, "FIELD", varchar);
+  duckdb_bind_add_result_column(info, "VALUE", varchar);
+  duckdb_destroy_logical_type(&bigint);
+  duckdb_destroy_logical_type(&varchar);
+  duckdb_bind_set_bind_data(info, data.release(), [](void* p) { delete (HistoryScanData*)p; });
+}
+
+void DuckDBStorage::HistoryInit(duckdb_init_info info) {
+  HistoryScanData* data = (HistoryScanData*)duckdb_init_get_bind_data(info);
+  auto state = std::make_unique<HistoryScanState>();
+  data->log->Read(data->from_us, data->to_us, state->rows);
+  duckdb_init_set_init_data(info, state.release(), [](void* p) { delete (HistoryScanState*)p; });
+}
+
+void DuckDBStorage::HistoryScan(duckdb_function_info info, duckdb_data_chunk output) {
+  HistoryScanState* state = (HistoryScanState*)duckdb_function_get_init_data(info);
+  auto& rows = state->rows.data;
+  idx_t count = std::min<idx_t>(duckdb_vector_size(), rows.size() - state->pos);
+  int64_t* seq = (int64_t*)duckdb_vector_get_data(duckdb_data_chunk_get_vector(output, 0));
+  int64_t* ts = (int64_t*)duckdb_vector_get_data(duckdb_data_chunk_get_vector(output, 1));
+  duckdb_vector text[3] = {duckdb_data_chunk_get_vector(output, 2), duckdb_data_chunk_get_vector(output, 3), duckdb_data_chunk_get_vector(output, 4)};
+  for(idx_t i=0; i<count; ++i) {
+    auto& row = rows[state->pos + i];
+    seq[i] = std::any_cast<int64_t>(row[0]);
+    ts[i] = std::any_cast<int64_t>(row[1]);
+    for(size_t c=0; c<3; ++c) {
+      if(!row[c+2].has_value()) {
+        duckdb_vector_ensure_validity_writable(text[c]);
+        duckdb_validity_set_row_invalid(duckdb_vector_get_validity(text[c]), i);
+        continue;
+      }
+      const std::string& value = std::any_cast<const std::string&>(row[c+2]);
+      duckdb_vector_assign_string_element_len(text[c], i, value.data(), value.size());
+    }
+  }
+  state->pos += count;
+  duckdb_data_chunk_set_size(output, count);
+}
+
+void DuckDBStorage::RegisterHistoryFunction() {
+  duckdb_table_function function = duckdb_create_table_function();
+  duckdb_table_function_set_name(function, "asts_history");
+  duckdb_logical_type varchar = duckdb_create_logical_type(DUCKDB_TYPE_VARCHAR);
+  duckdb_logical_type bigint = duckdb_create_logical_type(DUCKDB_TYPE_BIGINT);
+  duckdb_table_function_add_parameter(function, varchar);
+  duckdb_table_function_add_named_parameter(function, "from_ts", bigint);
+  duckdb_table_function_add_named_parameter(function, "to_ts", bigint);
+  duckdb_destroy_logical_type(&varchar);
+  duckdb_destroy_logical_type(&bigint);
+  duckdb_table_function_set_extra_info(function, this, nullptr);
+  duckdb_table_function_set_bind(function, HistoryBind);
+  duckdb_table_function_set_init(function, HistoryInit);
+  duckdb_table_function_set_function(function, HistoryScan);
+  duckdb_state state = duckdb_register_table_function(db_, function);
+  duckdb_destroy_table_function(&function);
+  if(state == DuckDBError)
+    throw std::runtime_error("Unable to register asts_history function in DuckDB storage");
+}
+
+void DuckDBStorage::SetTransactionCoalescing(size_t max_rows, size_t max_delay_ms) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  coalesce_rows_ = max_rows;
+  coalesce_delay_ = std::chrono::milliseconds(max_delay_ms);
+  if(IsCommitDue())
+    Commit();
+}
+
+void DuckDBStorage::Flush() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+}
+
+void DuckDBStorage::CommitIfDue() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(IsCommitDue())
+    Commit();
+}
+
+const ad::util::StorageStats& DuckDBStorage::GetStats() {
+  return stats_;
+}
+
+void DuckDBStorage::SetBulkLoadThreshold(size_t rows) {
+  (void)rows;
+}
+
+bool DuckDBStorage::TableExists(const std::string& tablename) {
+  duckdb_result result;
+  std::string sql = "select 1 from duckdb_tables() where database_name = current_database() and schema_name = 'main' and table_name = "+QuoteLiteral(tablename)+";";
+  if(duckdb_query(db_, sql.c_str(), &result) == DuckDBError) {
+    std::string msg = duckdb_result_error(&result);
+    duckdb_destroy_result(&result);
+    throw std::runtime_error("DuckDB error occured while checking if table "+tablename+" already exists: "+msg);
+  }
+  SqlResult rows;
+  ReadResult(result, rows, {});
+  duckdb_destroy_result(&result);
+  return !rows.data.empty();
+}
+
+void DuckDBStorage::CreateIndex(const std::string& tablename, const IndexSpec& spec) {
+  std::string name = tablename+"$"+(spec.name.empty() ? ad::util::join(spec.columns, "_") : spec.name);
+  std::vector<std::string> columns;
+  for(auto& c : spec.columns)
+    columns.push_back(Quote(c));
+  std::string sql = std::string("create ")+(spec.unique ? "unique " : "")+"index if not exists "+Quote(name)
+    +" on "+Quote(tablename)+" ("+ad::util::join(columns, ", ")+");";
+  ExecOrThrow(sql, "DuckDB error occured while creating index "+name);
+}
+
+void DuckDBStorage::AddIndex(const std::string& tablename, const IndexSpec& spec) {
+  if(spec.columns.empty())
+    throw std::runtime_error("Index on table "+tablename+" has no columns");
+  if(!spec.where.empty())
+    throw std::runtime_error("DuckDB storage does not support partial index on table "+tablename);
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+  if(TableExists(tablename))
+    CreateIndex(tablename, spec);
+  index_specs_[tablename].push_back(spec);
+}
+
+void DuckDBStorage::SetSecCodeIndex(bool enable) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  seccode_index_ = enable;
+}
+
+void DuckDBStorage::SaveSnapshot(const std::string& path, const SnapshotState& state) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+  // write to temporary file and rename it, so existing snapshot is never left half-written
+  std::string tmp_path = path+".tmp";
+  unlink(tmp_path.c_str());
+  unlink((tmp_path+".wal").c_str());
+  std::string errmsg = "DuckDB error occured while writing snapshot "+path;
+  bool attached = false;
+  try {
+    ExecOrThrow("attach "+QuoteLiteral(tmp_path)+" as mte_snapshot;", errmsg);
+    attached = true;
+    ExecOrThrow("copy from database memory to mte_snapshot;", errmsg);
+    // connection state goes to two extra tables
+    ExecOrThrow("create table mte_snapshot.\"MTE$SNAPSHOT_INTERFACES\" (system_type VARCHAR, data BLOB);"
+                "create table mte_snapshot.\"MTE$SNAPSHOT_TABLES\" (table_name VARCHAR, params BLOB, ref INTEGER);", errmsg);
+    duckdb_prepared_statement statement = PrepareOrThrow(db_, "insert into mte_snapshot.\"MTE$SNAPSHOT_INTERFACES\" values ($1, $2);", errmsg);
+    try {
+      for(auto& iface : state.interfaces) {
+        duckdb_bind_varchar_length(statement, 1, iface.first.data(), iface.first.size());
+        duckdb_bind_blob(statement, 2, iface.second.data(), iface.second.size());
+        ExecPrepared(statement, errmsg);
+      }
+    }
+    catch(...) {
+      duckdb_destroy_prepare(&statement);
+      throw;
+    }
+    duckdb_destroy_prepare(&statement);
+    statement = PrepareOrThrow(db_, "insert into mte_snapshot.\"MTE$SNAPSHOT_TABLES\" values ($1, $2, $3);", errmsg);
+    try {
+      for(auto& table : state.tables) {
+        duckdb_bind_varchar_length(statement, 1, table.tablename.data(), table.tablename.size());
+        duckdb_bind_blob(statement, 2, table.params.data(), table.params.size());
+        duckdb_bind_int64(statement, 3, table.ref);
+        ExecPrepared(statement, errmsg);
+      }
+    }
+    catch(...) {
+      duckdb_destroy_prepare(&statement);
+      throw;
+    }
+    duckdb_destroy_prepare(&statement);
+    attached = false;
+    ExecOrThrow("detach mte_snapshot;", errmsg);
+  }
+  catch(...) {
+    if(attached) {
+      duckdb_result result;
+      duckdb_query(db_, "detach mte_snapshot;", &result);
+      duckdb_destroy_result(&result);
+    }
+    unlink(tmp_path.c_str());
+    unlink((tmp_path+".wal").c_str());
+    throw;
+  }
+  if(rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    throw std::runtime_error("Unable to rename snapshot file "+tmp_path+" to "+path);
+  }
+}
+
+void DuckDBStorage::LoadSnapshot(const std::string& path, SnapshotState& state) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+  std::string errmsg = "DuckDB error occured while loading snapshot "+path;
+  ExecOrThrow("attach "+QuoteLiteral(path)+" as mte_snapshot (READ_ONLY);", errmsg);
+  try {
+    state = SnapshotState();
+    SqlResult rows;
+    duckdb_result result;
+    auto query = [&](const std::string& sql) {
+      rows = SqlResult();
+      if(duckdb_query(db_, sql.c_str(), &result) == DuckDBError) {
+        std::string msg = duckdb_result_error(&result);
+        duckdb_destroy_result(&result);
+        throw std::runtime_error(errmsg+": "+msg);
+      }
+      ReadResult(result, rows, {});
+      duckdb_destroy_result(&result);
+    };
+    query("select system_type, data from mte_snapshot.\"MTE$SNAPSHOT_INTERFACES\";");
+    for(auto& row : rows.data)
+      state.interfaces[std::any_cast<std::string>(row[0])] = std::any_cast<std::string>(row[1]);
+    query("select table_name, params, ref from mte_snapshot.\"MTE$SNAPSHOT_TABLES\";");
+    for(auto& row : rows.data) {
+      SnapshotTable table;
+      table.tablename = std::any_cast<std::string>(row[0]);
+      table.params = row[1].has_value() ? std::any_cast<std::string>(row[1]) : "";
+      table.ref = std::any_cast<int64_t>(row[2]);
+      state.tables.push_back(table);
+    }
+
+    // appenders and statements of writer connection refer to tables about to be replaced
+    ResetStatements();
+    query("select table_name from duckdb_tables() where database_name = 'mte_snapshot' and schema_name = 'main';");
+    for(auto& row : rows.data)
+      ExecOrThrow("drop table if exists memory.main."+Quote(std::any_cast<std::string>(row[0]))+";", errmsg);
+    ExecOrThrow("copy from database mte_snapshot to memory;", errmsg);
+    ExecOrThrow("drop table \"MTE$SNAPSHOT_INTERFACES\"; drop table \"MTE$SNAPSHOT_TABLES\";", errmsg);
+  }
+  catch(...) {
+    duckdb_result result;
+    duckdb_query(db_, "detach mte_snapshot;", &result);
+    duckdb_destroy_result(&result);
+    throw;
+  }
+  ExecOrThrow("detach mte_snapshot;", errmsg);
+  // every table may have changed
+  for(auto& table : state.tables)
+    BumpTableVersion(table.tablename);
+  for(auto& r : retention_)
+    r.second.Reset();
+}
+
+// key lookups use writer connection, results are always current
+bool DuckDBStorage::Get(const std::string& tablename, const std::vector<std::string>& key, SqlResult& result) {
+  GetMany(tablename, {key}, result);
+  if(result.data.back().empty()) {
+    result.data.pop_back();
+    return false;
+  }
+  return true;
+}
+
+void DuckDBStorage::GetMany(const std::string& tablename, const std::vector<std::vector<std::string> >& keys, SqlResult& result) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  // lookups go through writer connection, pending batches must not be visible
+  Commit();
+  auto writer = writers_.find(tablename);
+  if(writer == writers_.end() || writer->second.lookup == NULL)
+    throw std::runtime_error("Table "+tablename+" has not been opened or has no key fields");
+  const AstsTable& table = *writer->second.table;
+  result.fields.clear();
+  result.data.clear();
+  for(auto& fld : table.outfields)
+    result.fields.push_back({fld.name, fld.type, fld.decimals});
+  result.data.reserve(keys.size());
+  duckdb_prepared_statement statement = writer->second.lookup;
+  for(auto& key : keys) {
+    if(key.size() != table.keyfields.size())
+      throw std::runtime_error("Table "+table.name+" has "+std::to_string(table.keyfields.size())+" key fields, "
+        +std::to_string(key.size())+" values given");
+    for(size_t k=0; k<key.size(); ++k) {
+      const AstsOutField& fld = table.outfields[table.keyfields[k].first];
+      // text fields are stored padded to field size
+      std::string value = StoredFieldType(fld) == AstsFieldType::kChar ? ad::util::rpad(key[k], fld.size) : key[k];
+      duckdb_bind_varchar_length(statement, k+1, value.data(), value.size());
+    }
+    duckdb_result res;
+    if(duckdb_execute_prepared(statement, &res) == DuckDBError) {
+      std::string msg = duckdb_result_error(&res);
+      duckdb_destroy_result(&res);
+      throw std::runtime_error("DuckDB error occured while reading table "+tablename+": "+msg);
+    }
+    SqlResult row;
+    ReadResult(res, row, {});
+    duckdb_destroy_result(&res);
+    if(row.data.empty())
+      result.data.push_back({});
+    else
+      result.data.push_back(std::move(row.data.front()));
+  }
+}
+
+void DuckDBStorage::SetQueryCacheSize(size_t size) {
+  (void)size;
+}
+
+void DuckDBStorage::SetSlowQueryLog(size_t threshold_ms, size_t max_entries) {
+  slow_log_size_ = max_entries;
+  slow_query_us_ = threshold_ms * 1000;
+}
+
+static void RunPrepared(duckdb_prepared_statement& statement, SqlResult& result, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces,
+                        void (*read)(duckdb_result&, SqlResult&, const std::map<std::string, std::shared_ptr<AstsInterface> >&)) {
+  duckdb_result res;
+  duckdb_state state = duckdb_execute_prepared(statement, &res);
+  duckdb_destroy_prepare(&statement);
+  if(state == DuckDBError) {
+    std::string msg = duckdb_result_error(&res);
+    duckdb_destroy_result(&res);
+    throw std::runtime_error(msg);
+  }
+  read(res, result, interfaces);
+  duckdb_destroy_result(&res);
+}
+
+static bool IsReadOnly(duckdb_prepared_statement statement) {
+  duckdb_statement_type type = duckdb_prepared_statement_type(statement);
+  return type == DUCKDB_STATEMENT_TYPE_SELECT || type == DUCKDB_STATEMENT_TYPE_EXPLAIN;
+}
+
+void DuckDBStorage::Query(std::string_view query, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) {
+  std::string query_text(query);
+  result.fields = {};
+  result.data = {};
+  ad::util::Stopwatch timer;
+  {
+    ReaderLease reader(*this);
+    // without reader pool statements run on writer connection and would see uncommitted batches
+    if(reader.db == db_)
+      Commit();
+    duckdb_prepared_statement statement = PrepareOrThrow(reader.db, query_text, "DuckDB error occured while preparing query");
+    if(IsReadOnly(statement) || reader.db == db_) {
+      bool readonly = IsReadOnly(statement);
+      RunPrepared(statement, result, interfaces, ReadResult);
+      // pool is disabled and writer connection was used
+      if(!readonly)
+        BumpAllVersions();
+    }
+    else {
+      // statements changing data are run by writer connection
+      duckdb_destroy_prepare(&statement);
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      // do not mix user changes into pending refresh transaction
+      Commit();
+      statement = PrepareOrThrow(db_, query_text, "DuckDB error occured while preparing query");
+      RunPrepared(statement, result, interfaces, ReadResult);
+      // statement may have changed any table
+      BumpAllVersions();
+    }
+  }
+  auto elapsed = timer.Elapsed();
+  int64_t threshold = slow_query_us_;
+  if(threshold && elapsed >= std::chrono::microseconds(threshold))
+    LogSlowQuery(query_text, elapsed, result.data.size());
+}
+
+// logging must not fail the query, errors are ignored
+void DuckDBStorage::LogSlowQuery(const std::string& query, std::chrono::steady_clock::duration duration, size_t rows) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  // entry must not be rolled back together with a failed batch
+  Commit();
+  duckdb_result result;
+  // same layout as in SQLite storage; DuckDB has no per-statement counters, columns are left NULL
+  bool ok = duckdb_query(db_, "create table if not exists \"MTE$SLOWLOG\"(LOGGED_AT VARCHAR, DURATION_MS DOUBLE, SQL VARCHAR, PLAN VARCHAR, "
+    "ROWS_RETURNED BIGINT, FULLSCAN_STEPS BIGINT, SORTS BIGINT, AUTOINDEXES BIGINT, VM_STEPS BIGINT, SUGGESTED_INDEXES VARCHAR)", &result) == DuckDBSuccess;
+  duckdb_destroy_result(&result);
+  if(!ok)
+    return;
+
+  // physical plan as rendered by EXPLAIN
+  std::string plan;
+  if(duckdb_query(db_, ("explain "+query).c_str(), &result) == DuckDBSuccess) {
+    SqlResult explain;
+    ReadResult(result, explain, {});
+    for(auto& row : explain.data)
+      if(row.size() > 1 && row[1].has_value())
+        plan += std::any_cast<std::string>(row[1]);
+  }
+  duckdb_destroy_result(&result);
+
+  duckdb_prepared_statement statement = NULL;
+  if(duckdb_prepare(db_, "insert into \"MTE$SLOWLOG\" values ($1, $2, $3, $4, $5, NULL, NULL, NULL, NULL, NULL)", &statement) == DuckDBError) {
+    duckdb_destroy_prepare(&statement);
+    return;
+  }
+  std::string logged_at = UtcNow();
+  duckdb_bind_varchar_length(statement, 1, logged_at.data(), logged_at.size());
+  duckdb_bind_double(statement, 2, std::chrono::duration<double, std::milli>(duration).count());
+  duckdb_bind_varchar_length(statement, 3, query.data(), query.size());
+  duckdb_bind_varchar_length(statement, 4, plan.data(), plan.size());
+  duckdb_bind_int64(statement, 5, rows);
+  ok = duckdb_execute_prepared(statement, &result) == DuckDBSuccess;
+  duckdb_destroy_result(&result);
+  duckdb_destroy_prepare(&statement);
+  if(!ok)
+    return;
+  size_t max_entries = slow_log_size_;
+  std::string trim = max_entries == 0 ? "delete from \"MTE$SLOWLOG\"" :
+    "delete from \"MTE$SLOWLOG\" where LOGGED_AT < (select LOGGED_AT from \"MTE$SLOWLOG\" order by LOGGED_AT desc limit 1 offset "+std::to_string(max_entries - 1)+")";
+  duckdb_query(db_, trim.c_str(), &result);
+  duckdb_destroy_result(&result);
+  BumpTableVersion("MTE$SLOWLOG");
+}
+
+// field names and types of query results
+void DuckDBStorage::DescribeColumns(duckdb_result& result, SqlResult& out, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) {
+  // duplicate names are renamed Firebird-style, see SQLiteStorage::DescribeColumns
+  std::map<std::string, int> fncounts;
+  auto fncount_chk = [&](std::string fieldname) {
+    if(fncounts.find(fieldname) != fncounts.end()) {
+      int c = fncounts[fieldname];
+      fncounts[fieldname] = ++c;
+      return fieldname+std::to_string(c);
+    }
+    else {
+      fncounts[fieldname] = 0;
+      return fieldname;
+    }
+  };
+
+  out.fields.clear();
+  idx_t ctotal = duckdb_column_count(&result);
+  for(idx_t i=0; i<ctotal; ++i) {
+    std::string name = duckdb_column_name(&result, i);
+    SqlOutField field;
+    field.type = ResultFieldType(duckdb_column_type(&result, i));
+    // DuckDB does not tell which table a column comes from: a column named after an interface field
+    // with the same storage type takes its type, so dates, times and decimals keep their meaning
+    bool found = false;
+    for(auto& v : interfaces) {
+      for(auto& t : v.second->tables) {
+        for(auto& fld : t.second->outfields)
+          if(fld.name == name && StoredFieldType(fld) == field.type) {
+            field.type = fld.type;
+            field.decimals = fld.decimals;
+            found = true;
+            break;
+          }
+        if(found)
+          break;
+      }
+      if(found)
+        break;
+    }
+    if(!found)
+      name = name.substr(0, name.find_first_of('('));
+    field.name = fncount_chk(name);
+    out.fields.push_back(field);
+  }
+}
+
+// appends rows [from, to) of data chunk to out, column by column
+void DuckDBStorage::AppendChunk(duckdb_result& result, duckdb_data_chunk chunk, idx_t from, idx_t to, SqlResult& out) {
+  idx_t ctotal = duckdb_column_count(&result);
+  size_t first = out.data.size();
+  out.data.resize(first + (to - from));
+  for(size_t r=first; r<out.data.size(); ++r)
+    out.data[r].resize(ctotal);
+  for(idx_t c=0; c<ctotal; ++c) {
+    duckdb_type type = duckdb_column_type(&result, c), internal = type;
+    double scale = 1;
+    if(type == DUCKDB_TYPE_DECIMAL) {
+      duckdb_logical_type logical = duckdb_column_logical_type(&result, c);
+      internal = duckdb_decimal_internal_type(logical);
+      scale = std::pow(10.0, duckdb_decimal_scale(logical));
+      duckdb_destroy_logical_type(&logical);
+    }
+    duckdb_vector vector = duckdb_data_chunk_get_vector(chunk, c);
+    void* data = duckdb_vector_get_data(vector);
+    uint64_t* validity = duckdb_vector_get_validity(vector);
+    for(idx_t r=from; r<to; ++r)
+      if(!validity || duckdb_validity_row_is_valid(validity, r))
+        out.data[first + r - from][c] = VectorValue(type, internal, scale, data, r);
+  }
+}
+
+void DuckDBStorage::ReadResult(duckdb_result& result, SqlResult& out, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) {
+  DescribeColumns(result, out, interfaces);
+  while(duckdb_data_chunk chunk = duckdb_fetch_chunk(result)) {
+    AppendChunk(result, chunk, 0, duckdb_data_chunk_get_size(chunk), out);
+    duckdb_destroy_data_chunk(&chunk);
+  }
+  CheckFetchError(result);
+}
+
+class DuckDBCursor : public QueryCursor {
+  DuckDBStorage::ReaderLease reader_;
+  duckdb_prepared_statement statement_ = NULL;
+  duckdb_result result_;
+  bool has_result_ = false;
+  duckdb_data_chunk chunk_ = NULL; // rows of chunk from offset_ on were not returned yet
+  idx_t offset_ = 0;
+  std::vector<SqlOutField> fields_;
+public:
+  DuckDBCursor(DuckDBStorage& storage, const std::string& query, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces)
+      : reader_(storage) {
+    // without reader pool statements run on writer connection and would see uncommitted batches
+    if(reader_.db == storage.db_)
+      storage.Commit();
+    statement_ = PrepareOrThrow(reader_.db, query, "DuckDB error occured while preparing query");
+    if(!IsReadOnly(statement_)) {
+      duckdb_destroy_prepare(&statement_);
+      throw std::runtime_error("Only statements reading data can be fetched by cursor");
+    }
+    // streaming result computes chunks as they are fetched
+    duckdb_pending_result pending = NULL;
+    if(duckdb_pending_prepared_streaming(statement_, &pending) == DuckDBError) {
+      std::string msg = pending ? duckdb_pending_error(pending) : "out of memory";
+      duckdb_destroy_pending(&pending);
+      duckdb_destroy_prepare(&statement_);
+      throw std::runtime_error(msg);
+    }
+    duckdb_state state = duckdb_execute_pending(pending, &result_);
+    duckdb_destroy_pending(&pending);
+    has_result_ = true;
+    if(state == DuckDBError) {
+      std::string msg = duckdb_result_error(&result_);
+      duckdb_destroy_result(&result_);
+      duckdb_destroy_prepare(&statement_);
+      throw std::runtime_error(msg);
+    }
+    SqlResult described;
+    DuckDBStorage::DescribeColumns(result_, described, interfaces);
+    fields_ = std::move(described.fields);
+  }
+  ~DuckDBCursor() {
+    duckdb_destroy_data_chunk(&chunk_);
+    if(has_result_)
+      duckdb_destroy_result(&result_);
+    duckdb_destroy_prepare(&statement_);
+  }
+
+  bool Next(SqlResult& batch, size_t max_rows) {
+    batch.fields = fields_;
+    batch.data.clear();
+    while(batch.data.size() < max_rows) {
+      if(chunk_ == NULL) {
+        chunk_ = duckdb_fetch_chunk(result_);
+        offset_ = 0;
+        if(chunk_ == NULL) {
+          CheckFetchError(result_);
+          break;
+        }
+      }
+      idx_t size = duckdb_data_chunk_get_size(chunk_);
+      idx_t to = std::min<idx_t>(size, offset_ + (max_rows - batch.data.size()));
+      DuckDBStorage::AppendChunk(result_, chunk_, offset_, to, batch);
+      offset_ = to;
+      if(offset_ >= size)
+        duckdb_destroy_data_chunk(&chunk_);
+    }
+    return !batch.data.empty();
+  }
+};
+
+std::unique_ptr<QueryCursor> DuckDBStorage::OpenCursor(std::string_view query, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) {
+  return std::make_unique<DuckDBCursor>(*this, std::string(query), interfaces);
+}
+
+} // ad::asts
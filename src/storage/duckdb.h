@@ -0,0 +1,172 @@
+#ifndef STORAGE_DUCKDB_H
+#define STORAGE_DUCKDB_H
+#include <duckdb.h>
+#include <string_view>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <map>
+#include <set>
+#include <unordered_map>
+
+#include "../generic_engine.h"
+#include "../history_log.h"
+
+namespace ad::asts {
+
+class DuckDBCursor;
+
+// in-memory columnar storage for analytical queries. Full rows are appended through appenders and merged
+// by key at the end of a batch, queries run on a pool of connections with parallel vectorized execution.
+class DuckDBStorage : GenericStorage {
+  friend class DuckDBCursor;
+private:
+  std::vector<char> tmp_buf_;
+
+  duckdb_database database_ = NULL;
+  // writer connection: ingest, DDL and statements changing data, guarded by write_mutex_
+  duckdb_connection db_ = NULL;
+  std::mutex write_mutex_;
+  std::unique_lock<std::mutex> write_lock_; // held between StartReadingRows and StopReadingRows
+  bool in_transaction_ = false;
+
+  // pool of connections for concurrent queries, each query runs on its own snapshot
+  std::vector<duckdb_connection> readers_;
+  std::vector<duckdb_connection> free_readers_;
+  size_t max_readers_;
+  std::mutex readers_mutex_;
+  std::condition_variable readers_cv_;
+  struct ReaderLease {
+    DuckDBStorage& storage;
+    duckdb_connection db;
+    std::unique_lock<std::mutex> write_lock; // held when pool is disabled and writer connection is used
+    ReaderLease(DuckDBStorage& s);
+    ~ReaderLease();
+  };
+
+  // ingest state of one table: full rows go to appender, keyed tables append to <T>$STAGE which is merged
+  // into the table by key; rows with part of fields are applied by prepared UPDATE/INSERT
+  struct TableWriter {
+    std::shared_ptr<AstsTable> table;
+    duckdb_appender appender = NULL;
+    size_t appended = 0;     // rows in appender and stage table not merged yet
+    int64_t sequence = 0;    // order of staged rows, the last row of a key wins
+    std::map<std::basic_string<fld_count_t>, std::pair<duckdb_prepared_statement, duckdb_prepared_statement> > partial; // update, insert by field numbers
+    duckdb_prepared_statement lookup = NULL; // select by key for Get
+  };
+  std::unordered_map<std::string, TableWriter> writers_;
+  TableWriter* current_writer_ = nullptr;
+  AstsOpenedTable* current_opened_ = nullptr;
+  bool batch_direct_writes_ = false; // batch changed tables outside of appender, abort needs rollback
+  std::vector<FieldValue> row_values_;
+
+  // transaction coalescing: several batches are committed together when row count or delay threshold is reached
+  size_t coalesce_rows_ = 0;
+  std::chrono::milliseconds coalesce_delay_ {0};
+  size_t batch_rows_ = 0;
+  size_t pending_rows_ = 0; // rows in batches waiting for commit
+  std::chrono::steady_clock::time_point transaction_start_;
+  ad::util::StorageStats stats_;
+
+  std::unordered_map<std::string, std::vector<IndexSpec> > index_specs_;
+  bool seccode_index_ = false;
+
+  // table versions are bumped after data changes are committed
+  std::mutex versions_mutex_;
+  std::unordered_map<std::string, uint64_t> table_versions_;
+  std::set<std::string> dirty_tables_;
+  std::string current_table_;
+
+  // retention policies by table name, old rows of changed tables are deleted before commit
+  std::unordered_map<std::string, RetentionState> retention_;
+
+  // change logs by table name, created by the first batch; maps are changed under both write_mutex_
+  // and history_mutex_, so ingest reads them without history_mutex_
+  std::mutex history_mutex_;
+  std::unordered_map<std::string, size_t> history_sizes_;
+  std::unordered_map<std::string, std::shared_ptr<HistoryLog> > history_;
+  HistoryLog* current_history_ = nullptr; // log of the table being read
+
+  std::atomic<int64_t> slow_query_us_ = 0;
+  std::atomic<size_t> slow_log_size_ = 1000;
+
+  void ExecOrThrow(const std::string& sql, const std::string& errormsg = "DuckDB error occured while executing query");
+  idx_t ExecChanges(const std::string& sql, const std::string& errormsg);
+  duckdb_connection OpenConnection();
+  void TransactionControl(const std::string& action);
+  bool IsCommitDue();
+  void Commit();
+  void EnforceRetention(const std::set<std::string>& tables);
+  void BumpTableVersion(const std::string& tablename);
+  void MarkTableChanged(const std::string& tablename);
+  bool TableExists(const std::string& tablename);
+  void CreateIndex(const std::string& tablename, const IndexSpec& spec);
+  void StartDirectWrites();
+  void FlushAppender(TableWriter& writer);
+  void CloseWriter(TableWriter& writer);
+  void ApplyPartialRow(TableWriter& writer, fld_count_t* fldnums, fld_count_t fldcount);
+  void ResetStatements();
+  void LogSlowQuery(const std::string& query, std::chrono::steady_clock::duration duration, size_t rows);
+  void BumpAllVersions();
+  std::shared_ptr<HistoryLog> FindHistory(const std::string& tablename);
+  void RegisterHistoryFunction();
+  static void HistoryBind(duckdb_bind_info info);
+  static void HistoryInit(duckdb_init_info info);
+  static void HistoryScan(duckdb_function_info info, duckdb_data_chunk output);
+  static void ReadResult(duckdb_result& result, SqlResult& out, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces);
+  static void DescribeColumns(duckdb_result& result, SqlResult& out, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces);
+  static void QueryRows(duckdb_connection db, const std::string& sql, SqlResult& rows, const std::string& errormsg);
+  static void AppendChunk(duckdb_result& result, duckdb_data_chunk chunk, idx_t from, idx_t to, SqlResult& out);
+
+public:
+  DuckDBStorage();
+  ~DuckDBStorage();
+  void AddInterface(std::shared_ptr<AstsInterface> iface);
+  void RemoveInterface(std::shared_ptr<AstsInterface> iface);
+
+  void StartReadingRows(AstsOpenedTable* table, size_t row_count, bool replace = false);
+  void AbortReadingRows();
+  void ReadRowFromBuffer(AstsOpenedTable* table, ad::util::BufferReader& buffer, fld_count_t* fldnums, fld_count_t fldcount);
+  void EraseData(const std::string& tablename, const std::string& secboard="", const std::string& seccode="");
+  void StopReadingRows();
+  void SetTransactionCoalescing(size_t max_rows, size_t max_delay_ms);
+  void Flush();
+  void CommitIfDue();
+  // rows are always loaded through appenders, threshold is ignored
+  void SetBulkLoadThreshold(size_t rows);
+  const ad::util::StorageStats& GetStats();
+  // ART index; partial indexes are not supported, included columns are ignored since scans read only needed columns
+  void AddIndex(const std::string& tablename, const IndexSpec& spec);
+  void SetSecCodeIndex(bool enable);
+  void SaveSnapshot(const std::string& path, const SnapshotState& state);
+  void LoadSnapshot(const std::string& path, SnapshotState& state);
+
+  void CreateTable(std::shared_ptr<AstsInterface> iface, const std::string& tablename);
+  void CloseTable(const std::string& tablename);
+  void Query(std::string_view query, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces);
+  std::unique_ptr<QueryCursor> OpenCursor(std::string_view query, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces);
+
+  uint64_t GetTableVersion(const std::string& tablename);
+  // query results are not cached, DuckDB scans are fast enough to run every query
+  void SetQueryCacheSize(size_t size);
+  void SetSlowQueryLog(size_t threshold_ms, size_t max_entries);
+  // maximum number of connections used by concurrent queries (0 makes queries use writer connection)
+  void SetReaderCount(size_t count);
+  // DuckDB database can not be written by one process and read by others, not supported
+  void Publish(const std::string& path);
+  void AttachPublished(const std::string& path, SnapshotState& state);
+  // rows are evicted by rowid; merge by key inserts changed rows anew, so keyed tables keep rows updated last
+  void SetRetention(const std::string& tablename, const RetentionPolicy& policy);
+  // table bytes are estimated from column widths, index memory is only counted in totals
+  void GetMemoryUsage(MemoryUsage& usage);
+  // asts_history table function gives values of all fields as text
+  void SetHistory(const std::string& tablename, size_t max_bytes);
+  void GetHistory(const std::string& tablename, int64_t from_us, int64_t to_us, SqlResult& result);
+
+  bool Get(const std::string& tablename, const std::vector<std::string>& key, SqlResult& result);
+  void GetMany(const std::string& tablename, const std::vector<std::vector<std::string> >& keys, SqlResult& result);
+};
+
+} // ad::asts
+#endif // STORAGE_DUCKDB_H
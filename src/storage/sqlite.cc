@@ -1,13 +1,21 @@
 #include "sqlite.h"
+#include "sqlite_functions.h"
+#include "../trace.h"
 #include "../util.h"
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <regex>
+#include <thread>
+#include <time.h> // gmtime_r, strftime
+#include <unistd.h> // getpid, unlink
 #include <mtesrl.h>
 #include <string.h> // memset
+#include <strings.h> // strcasecmp
 
 namespace ad::asts {
 
-constexpr static const char all_spaces[MTE_SQL_MAX_FIELDS] = {' '};
-
 inline AstsFieldType GetColumnType(int ct) {
   switch(ct)
   {
@@ -24,6 +32,91 @@ inline AstsFieldType GetColumnType(int ct) {
   }
 }
 
+// tables read and written by a statement, collected by SQLite authorizer while statement is being prepared
+struct StatementTables {
+  std::set<std::string> reads;
+  std::set<std::string> writes;
+  std::map<std::string, std::set<std::string> > columns; // columns read, by table
+  bool deterministic = true;
+};
+
+// execution counters of a statement, taken before it is finalized
+struct StatementStatus {
+  bool executed = false; // false if result came from cache
+  int64_t fullscan_steps = 0;
+  int64_t sorts = 0;
+  int64_t autoindexes = 0;
+  int64_t vm_steps = 0;
+};
+
+static int CollectStatementTables(void* data, int action, const char* arg1, const char* arg2, const char*, const char*) {
+  // functions whose result does not depend on table contents only. Date and time functions read the clock
+  // for 'now' or without arguments, authorizer does not see arguments, so all of them are volatile;
+  // current_timestamp, current_date and current_time keywords reach it as functions too
+  static const char* volatile_functions[] = {"random", "randomblob", "changes", "total_changes", "last_insert_rowid",
+    "current_timestamp", "current_date", "current_time", "date", "time", "datetime", "julianday", "strftime",
+    "unixepoch", "timediff"};
+  StatementTables* info = (StatementTables*)data;
+  switch(action) {
+  case SQLITE_READ:
+    // change log has no table version, results are never cached
+    if(arg1 && strcasecmp(arg1, "asts_history") == 0)
+      info->deterministic = false;
+    if(arg1) {
+      info->reads.insert(arg1);
+      if(arg2)
+        info->columns[arg1].insert(arg2);
+    }
+    break;
+  case SQLITE_INSERT:
+  case SQLITE_UPDATE:
+  case SQLITE_DELETE:
+  case SQLITE_DROP_TABLE:
+    if(arg1)
+      info->writes.insert(arg1);
+    break;
+  case SQLITE_ALTER_TABLE:
+    if(arg2)
+      info->writes.insert(arg2);
+    break;
+  case SQLITE_FUNCTION:
+    if(arg2)
+      for(auto fn : volatile_functions)
+        if(strcasecmp(arg2, fn) == 0)
+          info->deterministic = false;
+    break;
+  default:
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static std::any ColumnValue(sqlite3_stmt* statement, int i, int column_type, AstsFieldType type) {
+  std::any value;
+  char * ptr;
+  if(column_type != SQLITE_NULL)
+    switch(type) {
+      case AstsFieldType::kChar:
+      case AstsFieldType::kFloat:
+      case AstsFieldType::kDate:
+      case AstsFieldType::kTime:
+        ptr = (char*)sqlite3_column_text(statement, i);
+        value = std::string(ptr ? ptr : "");
+        break;
+      case AstsFieldType::kInteger:
+        value = (int64_t)sqlite3_column_int64(statement, i);
+        break;
+      case AstsFieldType::kFixed:
+      case AstsFieldType::kFloatPoint:
+        value = (double)sqlite3_column_double(statement, i);
+        break;
+      case ad::asts::AstsFieldType::kNull:
+        value.reset();
+        break;
+    }
+  return value;
+}
+
 inline void SQLiteStorage::ExecOrThrow(std::string_view sql, std::string errormsg) {
   char *zErrMsg = nullptr;
   int error = sqlite3_exec(db_, sql.data(), NULL, 0, &zErrMsg);
@@ -31,16 +124,444 @@ inline void SQLiteStorage::ExecOrThrow(std::string_view sql, std::string errorms
     throw std::runtime_error(errormsg+": "+std::string(zErrMsg));
 }
 
-SQLiteStorage::SQLiteStorage() {
-  int error = sqlite3_open(":memory:", &db_);
+// eponymous virtual table asts_history: change log of a table, one row per changed field.
+//   select * from asts_history('TE$SECURITIES') where TS >= ...
+// Table name is required, TS bounds are applied while reading the log.
+struct SQLiteHistoryTable {
+  struct Row {
+    uint64_t seq;
+    int64_t us;
+    size_t key;                // index in keys
+    const AstsOutField* field;
+    FieldValue value;          // text points to text_values
+  };
+  struct Cursor {
+    sqlite3_vtab_cursor base;
+    std::shared_ptr<HistoryLog> log;
+    std::string tablename;
+    std::vector<Row> rows;
+    std::vector<std::string> keys;
+    std::deque<std::string> text_values;
+    size_t pos = 0;
+  };
+  struct Vtab {
+    sqlite3_vtab base;
+    SQLiteStorage* storage;
+  };
+  enum { kSeq, kTs, kKey, kField, kValue, kTable };
+
+  static int Connect(sqlite3* db, void* aux, int, const char* const*, sqlite3_vtab** out, char**) {
+    int error = sqlite3_declare_vtab(db, "create table x(SEQ INTEGER, TS INTEGER, KEY TEXT, FIELD TEXT, VALUE, TBL HIDDEN)");
+    if(error != SQLITE_OK)
+      return error;
+    Vtab* vtab = new Vtab();
+    vtab->storage = (SQLiteStorage*)aux;
+    *out = &vtab->base;
+    return SQLITE_OK;
+  }
+
+  static int Disconnect(sqlite3_vtab* vtab) {
+    delete (Vtab*)vtab;
+    return SQLITE_OK;
+  }
+
+  // idxNum bits: 1 - lower bound of TS, 2 - upper bound of TS; table name is the first argument, -1 if it is not given
+  static int BestIndex(sqlite3_vtab*, sqlite3_index_info* info) {
+    int table = -1, lower = -1, upper = -1;
+    for(int i=0; i<info->nConstraint; ++i) {
+      auto& c = info->aConstraint[i];
+      if(!c.usable)
+        continue;
+      if(c.iColumn == kTable && c.op == SQLITE_INDEX_CONSTRAINT_EQ)
+        table = i;
+      else if(c.iColumn == kTs && (c.op == SQLITE_INDEX_CONSTRAINT_GE || c.op == SQLITE_INDEX_CONSTRAINT_GT))
+        lower = i;
+      else if(c.iColumn == kTs && (c.op == SQLITE_INDEX_CONSTRAINT_LE || c.op == SQLITE_INDEX_CONSTRAINT_LT))
+        upper = i;
+    }
+    if(table < 0) {
+      // plan is chosen only if there is no other, Filter reports the error
+      info->idxNum = -1;
+      info->estimatedCost = 1e12;
+      return SQLITE_OK;
+    }
+    int argc = 1;
+    info->aConstraintUsage[table].argvIndex = argc++;
+    info->aConstraintUsage[table].omit = 1;
+    info->idxNum = 0;
+    info->estimatedCost = 1e6;
+    // bounds are passed as inclusive integers, SQLite checks exact conditions again
+    if(lower >= 0) {
+      info->aConstraintUsage[lower].argvIndex = argc++;
+      info->idxNum |= 1;
+      info->estimatedCost /= 4;
+    }
+    if(upper >= 0) {
+      info->aConstraintUsage[upper].argvIndex = argc++;
+      info->idxNum |= 2;
+      info->estimatedCost /= 4;
+    }
+    // rows come in log order
+    if(info->nOrderBy == 1 && (info->aOrderBy[0].iColumn == kSeq || info->aOrderBy[0].iColumn == kTs) && !info->aOrderBy[0].desc)
+      info->orderByConsumed = 1;
+    return SQLITE_OK;
+  }
+
+  static int Open(sqlite3_vtab*, sqlite3_vtab_cursor** out) {
+    Cursor* cursor = new Cursor();
+    *out = &cursor->base;
+    return SQLITE_OK;
+  }
+
+  static int Close(sqlite3_vtab_cursor* cursor) {
+    delete (Cursor*)cursor;
+    return SQLITE_OK;
+  }
+
+  static int Filter(sqlite3_vtab_cursor* base, int idx_num, const char*, int argc, sqlite3_value** argv) {
+    Cursor* cursor = (Cursor*)base;
+    Vtab* vtab = (Vtab*)base->pVtab;
+    cursor->rows.clear();
+    cursor->keys.clear();
+    cursor->text_values.clear();
+    cursor->pos = 0;
+    if(idx_num < 0) {
+      sqlite3_free(vtab->base.zErrMsg);
+      vtab->base.zErrMsg = sqlite3_mprintf("Table name is required: asts_history('<table>')");
+      return SQLITE_ERROR;
+    }
+    const char* name = argc ? (const char*)sqlite3_value_text(argv[0]) : nullptr;
+    cursor->tablename = name ? name : "";
+    cursor->log = vtab->storage->FindHistory(cursor->tablename);
+    if(!cursor->log) {
+      sqlite3_free(vtab->base.zErrMsg);
+      vtab->base.zErrMsg = sqlite3_mprintf("History is not enabled for table %s", cursor->tablename.c_str());
+      return SQLITE_ERROR;
+    }
+    int64_t from_us = std::numeric_limits<int64_t>::min(), to_us = std::numeric_limits<int64_t>::max();
+    int arg = 1;
+    if(idx_num & 1)
+      from_us = sqlite3_value_int64(argv[arg++]);
+    if(idx_num & 2)
+      to_us = sqlite3_value_int64(argv[arg++]);
+    uint64_t last_seq = std::numeric_limits<uint64_t>::max();
+    cursor->log->ForEach(from_us, to_us, [&](uint64_t seq, int64_t us, const std::vector<FieldValue>& key, const AstsOutField& fld, FieldValue v) {
+      if(seq != last_seq) {
+        cursor->keys.push_back(cursor->log->JoinKey(key));
+        last_seq = seq;
+      }
+      // text points to log blocks, which may be dropped once the log is unlocked
+      if(v.type == AstsFieldType::kChar)
+        v.text = cursor->text_values.emplace_back(v.text);
+      cursor->rows.push_back({seq, us, cursor->keys.size()-1, &fld, v});
+    });
+    return SQLITE_OK;
+  }
+
+  static int Next(sqlite3_vtab_cursor* cursor) {
+    ++((Cursor*)cursor)->pos;
+    return SQLITE_OK;
+  }
+
+  static int Eof(sqlite3_vtab_cursor* cursor) {
+    return ((Cursor*)cursor)->pos >= ((Cursor*)cursor)->rows.size();
+  }
+
+  static int Column(sqlite3_vtab_cursor* base, sqlite3_context* ctx, int column) {
+    Cursor* cursor = (Cursor*)base;
+    const Row& row = cursor->rows[cursor->pos];
+    switch(column) {
+      case kSeq:
+        sqlite3_result_int64(ctx, row.seq);
+        break;
+      case kTs:
+        sqlite3_result_int64(ctx, row.us);
+        break;
+      case kKey:
+        sqlite3_result_text(ctx, cursor->keys[row.key].data(), cursor->keys[row.key].size(), SQLITE_STATIC);
+        break;
+      case kField:
+        sqlite3_result_text(ctx, row.field->name.data(), row.field->name.size(), SQLITE_STATIC);
+        break;
+      case kValue:
+        switch(row.value.type) {
+          case AstsFieldType::kInteger:
+            sqlite3_result_int64(ctx, row.value.int_value);
+            break;
+          case AstsFieldType::kFixed:
+            sqlite3_result_double(ctx, row.value.double_value);
+            break;
+          case AstsFieldType::kChar:
+            sqlite3_result_text(ctx, row.value.text.data(), row.value.text.size(), SQLITE_STATIC);
+            break;
+          default:
+            sqlite3_result_null(ctx);
+            break;
+        }
+        break;
+      case kTable:
+        sqlite3_result_text(ctx, cursor->tablename.data(), cursor->tablename.size(), SQLITE_STATIC);
+        break;
+    }
+    return SQLITE_OK;
+  }
+
+  static int Rowid(sqlite3_vtab_cursor* cursor, sqlite3_int64* rowid) {
+    *rowid = ((Cursor*)cursor)->pos;
+    return SQLITE_OK;
+  }
+
+  static int Register(sqlite3* db, SQLiteStorage* storage) {
+    // no xCreate: table is eponymous-only, it can not be created with CREATE VIRTUAL TABLE
+    static sqlite3_module module = [] {
+      sqlite3_module m = {};
+      m.xConnect = Connect;
+      m.xBestIndex = BestIndex;
+      m.xDisconnect = Disconnect;
+      m.xDestroy = Disconnect;
+      m.xOpen = Open;
+      m.xClose = Close;
+      m.xFilter = Filter;
+      m.xNext = Next;
+      m.xEof = Eof;
+      m.xColumn = Column;
+      m.xRowid = Rowid;
+      return m;
+    }();
+    return sqlite3_create_module(db, "asts_history", &module, storage);
+  }
+};
+
+sqlite3* SQLiteStorage::OpenConnection(int flags) {
+  sqlite3* db = nullptr;
+  int error = sqlite3_open_v2(db_uri_.c_str(), &db, flags | SQLITE_OPEN_URI, NULL);
+  if(error) {
+    std::string errmsg = db ? sqlite3_errmsg(db) : sqlite3_errstr(error);
+    sqlite3_close(db);
+    throw std::runtime_error("Unable to initialize SQLite storage: "+errmsg);
+  }
+  // writer needs exclusive lock to commit, readers need shared lock to start reading
+  sqlite3_busy_timeout(db, 60000);
+  error = RegisterSqliteFunctions(db);
+  if(error == SQLITE_OK)
+    error = SQLiteHistoryTable::Register(db, this);
   if(error) {
-    sqlite3_close(db_);
-    throw std::runtime_error("Unable to initialize SQLite storage");
+    sqlite3_close(db);
+    throw std::runtime_error("Unable to register SQLite functions: "+std::string(sqlite3_errstr(error)));
   }
+  return db;
+}
+
+SQLiteStorage::SQLiteStorage() {
+  static std::atomic<int> storage_count = 0;
+  std::string name = "asts-sql-py-"+std::to_string(getpid())+"-"+std::to_string(storage_count++);
+  max_readers_ = std::max(1u, std::thread::hardware_concurrency());
+#if SQLITE_VERSION_NUMBER >= 3036000
+  // in-memory database shared by all connections of this storage, commits wait for running queries.
+  // Publish moves it to a WAL file, where readers work with last committed snapshot and never block ingest
+  db_uri_ = "file:/"+name+"?vfs=memdb";
+  memdb_ = true;
+#else
+  // no way to share in-memory database, all queries are run by the only connection
+  db_uri_ = ":memory:";
+  max_readers_ = 0;
+#endif
+  db_ = OpenConnection(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+#if SQLITE_VERSION_NUMBER >= 3036000
+  // memdb is limited to 1Gb by default
+  sqlite3_int64 size_limit = (sqlite3_int64)1 << 40;
+  sqlite3_file_control(db_, "main", SQLITE_FCNTL_SIZE_LIMIT, &size_limit);
+#endif
 }
 
 SQLiteStorage::~SQLiteStorage() {
+  sqlite3_finalize(ins_stmt);
+  sqlite3_finalize(upd_stmt);
+  sqlite3_finalize(bulk_stmt_);
+  for(auto db : readers_)
+    CloseReader(db);
+  sqlite3_close(db_);
+  if(!db_path_.empty())
+    for(auto suffix : {"", "-wal", "-shm"})
+      unlink((db_path_+suffix).c_str());
+}
+
+SQLiteStorage::ReaderLease::ReaderLease(SQLiteStorage& s, bool for_cursor) : storage(s), db(nullptr), cursor(for_cursor) {
+  std::unique_lock<std::mutex> lock(storage.readers_mutex_);
+  if(storage.max_readers_ == 0) {
+    lock.unlock();
+    write_lock = std::unique_lock<std::mutex>(storage.write_mutex_);
+    db = storage.db_;
+    return;
+  }
+  // unread cursors would otherwise take all connections and leave queries of the same thread waiting forever
+  while(!cursor && storage.free_readers_.empty() && storage.readers_.size() - storage.cursor_readers_ >= storage.max_readers_)
+    storage.readers_cv_.wait(lock);
+  if(!storage.free_readers_.empty()) {
+    db = storage.free_readers_.back();
+    storage.free_readers_.pop_back();
+  }
+  else {
+    db = storage.OpenConnection(SQLITE_OPEN_READONLY);
+    storage.readers_.push_back(db);
+  }
+  if(cursor)
+    ++storage.cursor_readers_;
+  if(!storage.memdb_)
+    return;
+  lock.unlock();
+  // reader of memdb would wait for coalesced batches until they are committed. Commit them and take shared
+  // lock before the next batch starts, so the reader sees committed data and the writer waits for it instead
+  try {
+    std::lock_guard<std::mutex> writer(storage.write_mutex_);
+    storage.Commit();
+    int error = sqlite3_exec(db, "BEGIN TRANSACTION; select 1 from sqlite_master limit 1;", NULL, 0, NULL);
+    read_transaction = true;
+    if(error)
+      throw std::runtime_error("SQLite error occured while starting to read: "+std::string(sqlite3_errmsg(db)));
+  }
+  catch(...) {
+    Release();
+    throw;
+  }
+}
+
+// lets writer commit, reader must not run statements after it
+void SQLiteStorage::ReaderLease::EndTransaction() {
+  if(read_transaction)
+    sqlite3_exec(db, "COMMIT TRANSACTION;", NULL, 0, NULL);
+  read_transaction = false;
+}
+
+// returns connection to the pool, connections above the limit are closed
+void SQLiteStorage::ReaderLease::Release() {
+  EndTransaction();
+  std::lock_guard<std::mutex> lock(storage.readers_mutex_);
+  if(cursor)
+    --storage.cursor_readers_;
+  if(storage.readers_.size() > storage.max_readers_ + storage.cursor_readers_) {
+    storage.readers_.erase(std::find(storage.readers_.begin(), storage.readers_.end(), db));
+    storage.CloseReader(db);
+  }
+  else
+    storage.free_readers_.push_back(db);
+  storage.readers_cv_.notify_one();
+}
+
+SQLiteStorage::ReaderLease::~ReaderLease() {
+  if(!write_lock.owns_lock())
+    Release();
+}
+
+// called with readers_mutex_ held or from destructor
+void SQLiteStorage::CloseReader(sqlite3* db) {
+  auto stmts = lookup_stmts_.find(db);
+  if(stmts != lookup_stmts_.end()) {
+    for(auto& s : stmts->second)
+      sqlite3_finalize(s.second);
+    lookup_stmts_.erase(stmts);
+  }
+  sqlite3_close(db);
+}
+
+// statement of expr for the table, kept prepared on pooled reader connection. Caller owns the statement
+// while it holds the lease; statement prepared on writer connection must be finalized by the caller
+sqlite3_stmt* SQLiteStorage::LookupStatement(ReaderLease& reader, const std::string& tablename, const std::string& expr) {
+  if(reader.db != db_) {
+    std::lock_guard<std::mutex> lock(readers_mutex_);
+    auto& stmts = lookup_stmts_[reader.db];
+    auto it = stmts.find(expr);
+    if(it != stmts.end())
+      return it->second;
+  }
+  sqlite3_stmt* statement;
+  if(sqlite3_prepare_v2(reader.db, expr.c_str(), -1, &statement, 0) != SQLITE_OK)
+    throw std::runtime_error("SQLite error occured while reading table "+tablename+": "+sqlite3_errmsg(reader.db));
+  if(reader.db != db_) {
+    std::lock_guard<std::mutex> lock(readers_mutex_);
+    lookup_stmts_[reader.db][expr] = statement;
+  }
+  return statement;
+}
+
+void SQLiteStorage::SetReaderCount(size_t count) {
+#if SQLITE_VERSION_NUMBER >= 3036000
+  std::lock_guard<std::mutex> lock(readers_mutex_);
+  max_readers_ = count;
+  // close idle connections above the limit, busy ones are closed when released
+  while(readers_.size() > max_readers_ && !free_readers_.empty()) {
+    sqlite3* db = free_readers_.back();
+    free_readers_.pop_back();
+    readers_.erase(std::find(readers_.begin(), readers_.end(), db));
+    CloseReader(db);
+  }
+  readers_cv_.notify_all();
+#else
+  (void)count;
+#endif
+}
+
+void SQLiteStorage::ReopenDatabase(const std::string& uri, const std::string& path, int flags) {
+  {
+    std::lock_guard<std::mutex> lock(readers_mutex_);
+    if(free_readers_.size() != readers_.size())
+      throw std::runtime_error("Storage can not be moved while queries are running");
+    for(auto db : readers_)
+      CloseReader(db);
+    readers_.clear();
+    free_readers_.clear();
+  }
+  {
+    std::lock_guard<std::mutex> lock(key_index_mutex_);
+    key_indexes_.clear();
+  }
   sqlite3_close(db_);
+  db_ = nullptr;
+  if(!db_path_.empty())
+    for(auto suffix : {"", "-wal", "-shm"})
+      unlink((db_path_+suffix).c_str());
+  db_uri_ = uri;
+  db_path_ = path;
+  memdb_ = false;
+  db_ = OpenConnection(flags);
+  if(!max_readers_)
+    max_readers_ = std::max(1u, std::thread::hardware_concurrency());
+}
+
+void SQLiteStorage::Publish(const std::string& path) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(attached_)
+    throw std::runtime_error("Attached storage can not be published");
+  if(ReadPragma("schema_version") != 0)
+    throw std::runtime_error("Storage must be published before any table is created");
+  // files left by a previous publisher are replaced, processes still attached to them see no more updates
+  for(auto suffix : {"", "-wal", "-shm"})
+    unlink((path+suffix).c_str());
+  ReopenDatabase("file:"+path, path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  ExecOrThrow("PRAGMA journal_mode=WAL; PRAGMA synchronous=OFF;"
+              "create table MTE$PUBLISHED (system_type char(2) primary key, interface blob);", "Unable to publish SQLite storage");
+  published_ = true;
+}
+
+void SQLiteStorage::AttachPublished(const std::string& path, SnapshotState& state) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(published_)
+    throw std::runtime_error("Published storage can not attach to another one");
+  if(!attached_ && ReadPragma("schema_version") != 0)
+    throw std::runtime_error("Storage with tables can not attach to another one");
+  if(!attached_ || db_uri_ != "file:"+path)
+    ReopenDatabase("file:"+path, "", SQLITE_OPEN_READONLY);
+  attached_ = true;
+  slow_query_us_ = 0;
+  SetQueryCacheSize(0);
+  sqlite3_stmt* statement;
+  if(sqlite3_prepare_v2(db_, "select system_type, interface from MTE$PUBLISHED;", -1, &statement, 0) != SQLITE_OK)
+    throw std::runtime_error(path+" is not a published storage: "+sqlite3_errmsg(db_));
+  state.interfaces.clear();
+  while(sqlite3_step(statement) == SQLITE_ROW)
+    state.interfaces[(const char*)sqlite3_column_text(statement, 0)] =
+      std::string((const char*)sqlite3_column_blob(statement, 1), sqlite3_column_bytes(statement, 1));
+  sqlite3_finalize(statement);
 }
 
 void SQLiteStorage::TransactionControl(const std::string& action){
@@ -50,62 +571,81 @@ void SQLiteStorage::TransactionControl(const std::string& action){
 
 
 void SQLiteStorage::AddInterface(std::shared_ptr<AstsInterface> iface) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
   std::string sql = "create table if not exists MTE$STRUCTURE (system_type char(2), interface_name char(12), table_name char(12), orig_table_name char(12), field_name char(20), field_type integer, field_length integer, decimals integer);";
   std::string errmsg = std::string("SQLite error while create reflection for interface ")+iface->name_;
   ExecOrThrow(sql, errmsg);
-  auto add_fld = [&](std::string v) {
-    sql.append("'"+v+"',");
-  };
-  auto add_int = [&](int v, bool last_val=false) {
-    sql.append(std::to_string(v));
-    if(!last_val)
-      sql.append(",");
-  };
-  for(auto & rec : iface->tables)
+  // all fields go in one transaction through one prepared statement
+  Commit();
+  TransactionControl("BEGIN");
+  sqlite3_stmt* statement;
+  int error = sqlite3_prepare_v2(db_, "insert into MTE$STRUCTURE values (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);", -1, &statement, 0);
+  if(error != SQLITE_OK) {
+    sqlite3_exec(db_, "ROLLBACK TRANSACTION;", NULL, 0, NULL);
+    throw std::runtime_error(errmsg+": "+sqlite3_errmsg(db_));
+  }
+  std::string system_type = iface->GetSystemType();
+  std::string table_name;
+  sqlite3_bind_text(statement, 1, system_type.data(), system_type.size(), SQLITE_STATIC);
+  sqlite3_bind_text(statement, 2, iface->name_.data(), iface->name_.size(), SQLITE_STATIC);
+  for(auto & rec : iface->tables) {
+    table_name = iface->prefix_+rec.second->name;
+    sqlite3_bind_text(statement, 3, table_name.data(), table_name.size(), SQLITE_STATIC);
+    sqlite3_bind_text(statement, 4, rec.second->name.data(), rec.second->name.size(), SQLITE_STATIC);
     for(auto & fld : rec.second->outfields) {
-      sql = "insert into MTE$STRUCTURE select ";
-      add_fld(iface->GetSystemType());
-      add_fld(iface->name_);
-      add_fld(iface->prefix_+rec.second->name);
-      add_fld(rec.second->name);
-      add_fld(fld.name);
-      add_int(fld.type);
-      add_int(fld.size);
-      add_int(fld.decimals, true);
-      sql.append(";");
-      ExecOrThrow(sql, errmsg);
+      sqlite3_bind_text(statement, 5, fld.name.data(), fld.name.size(), SQLITE_STATIC);
+      sqlite3_bind_int(statement, 6, fld.type);
+      sqlite3_bind_int(statement, 7, fld.size);
+      sqlite3_bind_int(statement, 8, fld.decimals);
+      error = sqlite3_step(statement);
+      sqlite3_reset(statement);
+      if(error != SQLITE_DONE) {
+        sqlite3_finalize(statement);
+        sqlite3_exec(db_, "ROLLBACK TRANSACTION;", NULL, 0, NULL);
+        throw std::runtime_error(errmsg+": "+sqlite3_errmsg(db_));
+      }
     }
+  }
+  sqlite3_finalize(statement);
+  TransactionControl("COMMIT");
   sql = "create index if not exists MTE$STRUCTURE_IDX on MTE$STRUCTURE (table_name, field_name);";
   ExecOrThrow(sql, errmsg);
+  BumpTableVersion("MTE$STRUCTURE");
+  if(published_) {
+    // attached processes decode column types with interface description; snapshot load replaces the table
+    ExecOrThrow("create table if not exists MTE$PUBLISHED (system_type char(2) primary key, interface blob);", errmsg);
+    if(sqlite3_prepare_v2(db_, "insert or replace into MTE$PUBLISHED values (?1, ?2);", -1, &statement, 0) != SQLITE_OK)
+      throw std::runtime_error(errmsg+": "+sqlite3_errmsg(db_));
+    sqlite3_bind_text(statement, 1, system_type.data(), system_type.size(), SQLITE_STATIC);
+    sqlite3_bind_blob(statement, 2, iface->raw_.data(), iface->raw_.size(), SQLITE_STATIC);
+    error = sqlite3_step(statement);
+    sqlite3_finalize(statement);
+    if(error != SQLITE_DONE)
+      throw std::runtime_error(errmsg+": "+sqlite3_errmsg(db_));
+    BumpTableVersion("MTE$PUBLISHED");
+  }
 }
-
 void SQLiteStorage::RemoveInterface(std::shared_ptr<AstsInterface> iface) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
   std::string sql = "delete from MTE$STRUCTURE where interface_name = '"+iface->name_+"';";
+  if(published_)
+    sql += "delete from MTE$PUBLISHED where system_type = '"+iface->GetSystemType()+"';";
   std::string errmsg = std::string("SQLite error while removing reflection of interface ")+iface->name_;
   ExecOrThrow(sql, errmsg);
+  // may run inside a pending batch transaction
+  MarkTableChanged("MTE$STRUCTURE");
+  if(published_)
+    MarkTableChanged("MTE$PUBLISHED");
 }
 
 void SQLiteStorage::CreateTable(std::shared_ptr<AstsInterface> iface, const std::string& tablename) {
-  // check if table exists
-  std::string expr = "SELECT * FROM sqlite_master WHERE name ='"+tablename+"' and type='table' COLLATE NOCASE;";
-  sqlite3_stmt *statement;
-  int error = sqlite3_prepare_v2(db_, expr.c_str(), -1, &statement, 0);
-  if(error)
-      throw std::runtime_error("SQLite error occured while checking if table "+tablename+" already exists: "+std::string(sqlite3_errstr(error)));
-  size_t rowcount = 0;
-  while(true) {
-      int res = sqlite3_step(statement);
-      if(res == SQLITE_ROW)
-          ++rowcount;
-      if(res == SQLITE_DONE || res==SQLITE_ERROR)
-          break;
-  }
-  sqlite3_finalize(statement);
-  if(!rowcount) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(!TableExists(tablename)) {
     // table doesn't exist. create it
     std::string create, pk, tmp;
     create = "create table "+tablename+" (";
-    pk = ", PRIMARY KEY (";
+    // primary key is a separate unique index, so bulk load can drop it and build it after the load
+    pk = "create unique index "+tablename+"$PK on "+tablename+" (";
     bool haskeyfields = false;
     std::vector<std::string> fields, pk_fields;
     fields.reserve(iface->tables[tablename]->outfields.size());
@@ -135,89 +675,99 @@ void SQLiteStorage::CreateTable(std::shared_ptr<AstsInterface> iface, const std:
         }
         fields.push_back(tmp);
     }
-    create.append(ad::util::join(fields,", "));
-    if(haskeyfields)
-      pk.append(ad::util::join(pk_fields, ", ").append(")"));
-    else
-      pk = "";
-    create.append(pk.append(");"));
+    create.append(ad::util::join(fields,", ")).append(");");
     ExecOrThrow(create, "SQLite error occured while creating table "+tablename);
+    if(haskeyfields) {
+      pk.append(ad::util::join(pk_fields, ", ")).append(");");
+      ExecOrThrow(pk, "SQLite error occured while creating primary key of table "+tablename);
+    }
+  }
+  // secondary indexes
+  if(seccode_index_) {
+    IndexSpec seccode;
+    seccode.name = "SECCODE";
+    for(auto& fld : iface->tables[tablename]->outfields)
+      if(fld.attr & mffSecCode)
+        seccode.columns.push_back(fld.name);
+    if(!seccode.columns.empty())
+      CreateIndex(tablename, seccode);
+  }
+  auto specs = index_specs_.find(tablename);
+  if(specs != index_specs_.end())
+    for(auto& spec : specs->second)
+      CreateIndex(tablename, spec);
+  // tables with primary key get a hash index for point lookups
+  auto& table = iface->tables[tablename];
+  if(!table->keyfields.empty() && key_indexes_.find(tablename) == key_indexes_.end()) {
+    {
+      std::lock_guard<std::mutex> index_lock(key_index_mutex_);
+      key_indexes_[tablename].table = table;
+    }
+    RebuildKeyIndex(tablename);
   }
 }
 
-void SQLiteStorage::ReadRowFromBuffer(AstsOpenedTable* table, ad::util::PointerHelper& buffer, fld_count_t* fldnums, fld_count_t* fldnums_prev, fld_count_t fldcount) {
+static void BindValue(sqlite3_stmt* stmt, int idx, const FieldValue& v) {
+  switch(v.type) {
+    case AstsFieldType::kInteger:
+      sqlite3_bind_int64(stmt, idx, v.int_value);
+      break;
+    case AstsFieldType::kFixed:
+      sqlite3_bind_double(stmt, idx, v.double_value);
+      break;
+    case AstsFieldType::kChar:
+      sqlite3_bind_text(stmt, idx, v.text.data(), v.text.size(), SQLITE_TRANSIENT);
+      break;
+    default:
+      sqlite3_bind_null(stmt, idx);
+      break;
+  }
+}
+
+void SQLiteStorage::ReadRowFromBuffer(AstsOpenedTable* table, ad::util::BufferReader& buffer, fld_count_t* fldnums, fld_count_t fldcount) {
+  if(current_history_)
+    current_history_->Append(buffer.Data(), fldnums, fldcount);
+  if(bulk_load_) {
+    if(fldcount == table->thistable_->outfield_count) {
+      ReadBulkRow(table, buffer, fldnums, fldcount);
+      return;
+    }
+    // rows with part of fields update existing rows, they need indexes in place
+    FinishBulkLoad();
+  }
   // if statements are not set or cannot be reused, we need to prepare next statements
-  if(!(IsStatementPrepared() && memcmp(fldnums, fldnums_prev, fldcount) == 0))
-    PrepareNextStatement(table->tablename_, table->thistable_, fldnums, fldcount);
+  if(!IsStatementPrepared(load_table_, fldnums, fldcount)) {
+    PrepareNextStatement(load_table_, table->thistable_, fldnums, fldcount);
+    ad::util::TableStats::Add(table->stats.prepares);
+  }
+  ++batch_rows_;
 
   // at this point we are sure we have prepared INSERT statement, and maybe we have prepared UPDATE statement as well
   sqlite3_clear_bindings(ins_stmt);
   if(upd_stmt != NULL)
     sqlite3_clear_bindings(upd_stmt);
 
-  int sqlite_idx = 0;
-  int64_t tmpint = 0;
-  double tmpdouble = 0.0;
-  AstsOutField fld;
+  auto& keyfields = table->thistable_->keyfields;
+  bool has_keyfields = !keyfields.empty();
+  size_t key_parts_found = 0;
+  key_parts_.resize(keyfields.size());
 
   for(fld_count_t c=0; c<fldcount; ++c) {
-    fld = table->thistable_->outfields[fldnums[c]];
-    memset(tmp_buf, 0x00, sizeof(*tmp_buf)); // reset temp buffer for field data
-    sqlite_idx = c+1;
-    int * ptr = buffer._ptr;
-    // ASTSConnectivty API Guide says NULL is a value consisting only of spaces
-    if(memcmp(ptr, all_spaces, fld.size) == 0) {
-      buffer.RewindString(fld.size);
-      sqlite3_bind_null(ins_stmt, sqlite_idx);
-      if(upd_stmt != NULL)
-          sqlite3_bind_null(upd_stmt, sqlite_idx);
-    }
-    else switch(fld.type) { // regular value
-      case AstsFieldType::kFixed:
-        // copy first part (before dot) of value to temp buffer
-        tmpint = fld.size - fld.decimals;
-        memcpy(tmp_buf, ptr, (int)tmpint);
-        // set the dot
-        tmp_buf[(int)tmpint] = '.';
-        // copy second part of value to temp buffer
-        memcpy(tmp_buf+(int)tmpint+1, (char*)ptr+(int)tmpint, fld.decimals);
-        buffer.RewindString(fld.size);
-        tmpdouble = atof(tmp_buf);
-        sqlite3_bind_double(ins_stmt, sqlite_idx, tmpdouble);
-        if(upd_stmt != NULL)
-          sqlite3_bind_double(upd_stmt, sqlite_idx, tmpdouble);
-        break;
-      case AstsFieldType::kFloatPoint:
-        memcpy(tmp_buf, ptr, fld.size);
-        buffer.RewindString(fld.size);
-        tmpdouble = atof(tmp_buf);
-        sqlite3_bind_double(ins_stmt, sqlite_idx, tmpdouble);
-        if(upd_stmt != NULL)
-          sqlite3_bind_double(upd_stmt, sqlite_idx, tmpdouble);
-        break;
-      case AstsFieldType::kInteger:
-        memcpy(tmp_buf, ptr, fld.size);
-        buffer.RewindString(fld.size);
-        tmpint = strtoll(tmp_buf, nullptr, 10);
-        sqlite3_bind_int64(ins_stmt, sqlite_idx, tmpint);
-        if(upd_stmt != NULL)
-          sqlite3_bind_int64(upd_stmt, sqlite_idx, tmpint);
-        break;
-      case AstsFieldType::kFloat: // we don't know how to format this
-      case AstsFieldType::kChar:
-      case AstsFieldType::kDate: // leave date and time as strings, let upper-level code deal with this
-      case AstsFieldType::kTime:
-      default:
-        sqlite3_bind_text(ins_stmt, sqlite_idx, (char*)ptr, fld.size, SQLITE_TRANSIENT);
-        if(upd_stmt != NULL)
-          sqlite3_bind_text(upd_stmt, sqlite_idx, (char*)ptr, fld.size, SQLITE_TRANSIENT);
-        buffer.RewindString(fld.size);
-        break;
-    }
+    const AstsOutField& fld = table->thistable_->outfields[fldnums[c]];
+    FieldValue value = DecodeField(fld, buffer.Take(fld.size), tmp_buf_.data());
+    BindValue(ins_stmt, c+1, value);
+    if(upd_stmt != NULL)
+      BindValue(upd_stmt, c+1, value);
+    if(has_keyfields && (fld.attr & mffKey) == mffKey)
+      for(size_t k=0; k<keyfields.size(); ++k)
+        if(keyfields[k].first == fldnums[c]) {
+          key_parts_[k] = KeyPart(value, fld.decimals);
+          ++key_parts_found;
+        }
   } // for each field in this row
 
   int error = 0;
-  bool doInsert = false, has_keyfields = !table->thistable_->keyfields.empty();
+  bool doInsert = false;
   if(has_keyfields && upd_stmt != NULL) {
     error = sqlite3_step(upd_stmt);
     CheckRetCode(error, "EXECUTE UPDATE", SQLITE_DONE);
@@ -225,50 +775,745 @@ void SQLiteStorage::ReadRowFromBuffer(AstsOpenedTable* table, ad::util::PointerH
     int rows_updated = sqlite3_changes(db_);
     if(rows_updated == 0)
       doInsert = true;
+    else
+      ad::util::TableStats::Add(table->stats.updates);
     sqlite3_reset(upd_stmt);
     CheckRetCode(error, "RESET UPDATE", SQLITE_DONE);
   }
-  if(doInsert || !has_keyfields) {
+  // rows consisting of key fields only have nothing to update
+  if(doInsert || !has_keyfields || upd_stmt == NULL) {
     error = sqlite3_step(ins_stmt);
     CheckRetCode(error, "EXECUTE INSERT", SQLITE_DONE);
     // if CheckRetCode throws exception, we won't get here
     sqlite3_reset(ins_stmt);
     CheckRetCode(error, "RESET INSERT", SQLITE_DONE);
+    bool inserted = sqlite3_changes(db_) > 0;
+    if(inserted)
+      ad::util::TableStats::Add(table->stats.inserts);
+    // remember rowid of newly inserted row in primary key index
+    if(key_parts_found == keyfields.size() && has_keyfields && !staging_ && inserted) {
+      auto idx = key_indexes_.find(table->tablename_);
+      if(idx != key_indexes_.end()) {
+        row_key_ = key_parts_[0];
+        for(size_t k=1; k<keyfields.size(); ++k)
+          row_key_.append(1, '\x1f').append(key_parts_[k]);
+        std::lock_guard<std::mutex> index_lock(key_index_mutex_);
+        idx->second.rowids[row_key_] = sqlite3_last_insert_rowid(db_);
+      }
+    }
   }
 }
 
 void SQLiteStorage::EraseData(const std::string& tablename, const std::string& secboard, const std::string& seccode) {
+  if(bulk_load_)
+    FlushBulkRows();
+  if(staging_ && tablename == current_table_) {
+    // table being replaced: clear the new copy only
+    std::string del = "delete from "+load_table_;
+    if(secboard != "")
+      del += " where secboard='"+secboard+"' and seccode = '"+seccode+"'";
+    ExecOrThrow(del+";", "SQLite error occured while deleting data from table "+load_table_);
+    return;
+  }
   std::string del = "delete from "+tablename;
   if(secboard != "")
-    del += " where secboard='"+secboard+"' and seccode = '"+seccode;
+    del += " where secboard='"+secboard+"' and seccode = '"+seccode+"'";
   del += ";";
   ExecOrThrow(del, "SQLite error occured while deleting data from table "+tablename);
+  MarkTableChanged(tablename);
+  auto retention = retention_.find(tablename);
+  if(retention != retention_.end() && secboard == "")
+    retention->second.Reset();
+  auto history = history_.find(tablename);
+  if(history != history_.end() && history->second)
+    history->second->Reset();
+  auto idx = key_indexes_.find(tablename);
+  if(idx != key_indexes_.end()) {
+    if(secboard == "") {
+      std::lock_guard<std::mutex> index_lock(key_index_mutex_);
+      idx->second.rowids.clear();
+    }
+    else
+      RebuildKeyIndex(tablename);
+  }
+}
+
+void SQLiteStorage::BumpTableVersion(const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(versions_mutex_);
+  ++table_versions_[tablename];
+}
+
+void SQLiteStorage::MarkTableChanged(const std::string& tablename) {
+  // inside transaction version is bumped on commit, otherwise change is already visible
+  if(sqlite3_get_autocommit(db_))
+    BumpTableVersion(tablename);
+  else
+    dirty_tables_.insert(tablename);
+}
+
+uint64_t SQLiteStorage::GetTableVersion(const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(versions_mutex_);
+  auto it = table_versions_.find(tablename);
+  return it == table_versions_.end() ? 0 : it->second;
 }
 
 void SQLiteStorage::CloseTable(const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
   EraseData(tablename);
   // we do not drop table to save some time on DDL operations
 }
 
-void SQLiteStorage::StartReadingRows(AstsOpenedTable* table) {
-  tmp_buf = new char[table->thistable_->max_fld_len+2];
-  TransactionControl("BEGIN");
+void SQLiteStorage::StartReadingRows(AstsOpenedTable* table, size_t row_count, bool replace) {
+  write_lock_ = std::unique_lock<std::mutex>(write_mutex_);
+  // temp buffer is reused by all batches and only grows
+  if(tmp_buf_.size() < table->thistable_->max_fld_len+2)
+    tmp_buf_.resize(table->thistable_->max_fld_len+2);
+  current_table_ = table->tablename_;
+  current_history_ = nullptr;
+  auto history = history_sizes_.find(current_table_);
+  if(history != history_sizes_.end()) {
+    auto& log = history_[current_table_];
+    if(!log) {
+      std::lock_guard<std::mutex> lock(history_mutex_);
+      log = std::make_shared<HistoryLog>(table->thistable_, history->second);
+    }
+    current_history_ = log.get();
+  }
+  batch_began_transaction_ = false;
+  try {
+    if(sqlite3_get_autocommit(db_)) {
+      TransactionControl("BEGIN");
+      batch_began_transaction_ = true;
+      transaction_start_ = std::chrono::steady_clock::now();
+    }
+    // several batches may share one transaction, savepoint lets us discard only this one on error
+    ExecOrThrow("SAVEPOINT BATCH;", "SQLite error occured while changing transaction state");
+    load_table_ = current_table_;
+    if(replace && !IsTableEmpty(current_table_)) {
+      // new copy of keyed table goes to staging table and only the difference is applied
+      if(!table->thistable_->keyfields.empty())
+        StartStaging(table);
+      else
+        EraseData(current_table_);
+    }
+    if(!staging_ && bulk_load_min_rows_ && row_count >= bulk_load_min_rows_ && IsTableEmpty(current_table_))
+      StartBulkLoad(table);
+  }
+  catch(...) {
+    AbortReadingRows();
+    throw;
+  }
+}
+
+void SQLiteStorage::StartStaging(AstsOpenedTable* table) {
+  // staging table lives in temp schema of writer connection, readers never see it
+  std::string staging = current_table_+"$STAGE";
+  std::vector<std::string> keys;
+  for(auto& k : table->thistable_->keyfields)
+    keys.push_back(k.second);
+  ExecOrThrow("create temp table if not exists "+staging+" as select * from "+current_table_+" where 0;"
+              "create unique index if not exists temp."+staging+"$PK on "+staging+" ("+ad::util::join(keys, ", ")+");",
+              "SQLite error occured while creating staging table for "+current_table_);
+  ExecOrThrow("delete from temp."+staging+";", "SQLite error occured while clearing staging table for "+current_table_);
+  load_table_ = "temp."+staging;
+  staging_source_ = table->thistable_;
+  staging_ = true;
+}
+
+// apply difference between staging table and current contents, returns true if anything changed
+bool SQLiteStorage::ApplyStaging() {
+  std::vector<std::string> keys, fields, diff, set;
+  for(auto& k : staging_source_->keyfields)
+    keys.push_back(k.second);
+  for(auto& fld : staging_source_->outfields) {
+    fields.push_back(fld.name);
+    if((fld.attr & mffKey) != mffKey) {
+      diff.push_back("s."+fld.name+" IS NOT "+current_table_+"."+fld.name);
+      set.push_back(fld.name);
+    }
+  }
+  std::vector<std::string> match;
+  for(auto& k : keys)
+    match.push_back("s."+k+" = "+current_table_+"."+k);
+  std::string key_list = "("+ad::util::join(keys, ", ")+")";
+  std::string where_key = ad::util::join(match, " AND ");
+  std::string errmsg = "SQLite error occured while applying new copy of table "+current_table_;
+  int changes = sqlite3_total_changes(db_);
+  ExecOrThrow("delete from "+current_table_+" where "+key_list+" not in (select "+ad::util::join(keys, ", ")+" from "+load_table_+");", errmsg);
+  if(!set.empty())
+    ExecOrThrow("update "+current_table_+" set ("+ad::util::join(set, ", ")+") = (select "+ad::util::join(set, ", ")+" from "+load_table_+" s where "+where_key+")"
+                " where exists (select 1 from "+load_table_+" s where "+where_key+" and ("+ad::util::join(diff, " OR ")+"));", errmsg);
+  ExecOrThrow("insert into "+current_table_+" ("+ad::util::join(fields, ", ")+") select "+ad::util::join(fields, ", ")+" from "+load_table_
+              +" where "+key_list+" not in (select "+ad::util::join(keys, ", ")+" from "+current_table_+");", errmsg);
+  changes = sqlite3_total_changes(db_) - changes;
+  ExecOrThrow("delete from "+load_table_+";", errmsg);
+  load_table_ = current_table_;
+  staging_ = false;
+  if(changes && key_indexes_.find(current_table_) != key_indexes_.end())
+    RebuildKeyIndex(current_table_);
+  return changes != 0;
+}
+
+void SQLiteStorage::AbortReadingRows() {
+  if(!write_lock_.owns_lock())
+    return;
+  sqlite3_reset(ins_stmt);
+  sqlite3_reset(upd_stmt);
+  // dropped indexes are restored by rollback
+  ResetBulkLoad();
+  staging_ = false;
+  load_table_ = current_table_;
+  if(!sqlite3_get_autocommit(db_)) {
+    sqlite3_exec(db_, "ROLLBACK TRANSACTION TO SAVEPOINT BATCH; RELEASE SAVEPOINT BATCH;", NULL, 0, NULL);
+    // earlier batches may have changed data without adding rows (erase, emptied table), their changes
+    // wait in the same transaction unless this batch began it
+    if(batch_began_transaction_) {
+      sqlite3_exec(db_, "ROLLBACK TRANSACTION;", NULL, 0, NULL);
+      dirty_tables_.clear();
+    }
+  }
+  batch_rows_ = 0;
+  if(current_history_)
+    current_history_->Discard();
+  // key index may have entries for rolled back rows
+  if(key_indexes_.find(current_table_) != key_indexes_.end())
+    RebuildKeyIndex(current_table_);
+  write_lock_.unlock();
 }
 
 void SQLiteStorage::StopReadingRows() {
+  if(bulk_load_)
+    FinishBulkLoad();
+  // unchanged copy of a table keeps its version, so cached results stay valid
+  if(!staging_ || ApplyStaging())
+    dirty_tables_.insert(current_table_);
+  ExecOrThrow("RELEASE SAVEPOINT BATCH;", "SQLite error occured while changing transaction state");
+  pending_rows_ += batch_rows_;
+  batch_rows_ = 0;
+  if(current_history_)
+    current_history_->Publish();
+  if(IsCommitDue())
+    Commit();
+  write_lock_.unlock();
+}
+
+bool SQLiteStorage::IsCommitDue() {
+  if(sqlite3_get_autocommit(db_))
+    return false;
+  if(coalesce_rows_ == 0 && coalesce_delay_.count() == 0)
+    return true;
+  if(coalesce_rows_ != 0 && pending_rows_ >= coalesce_rows_)
+    return true;
+  return coalesce_delay_.count() != 0 && std::chrono::steady_clock::now() - transaction_start_ >= coalesce_delay_;
+}
+
+void SQLiteStorage::Commit() {
+  if(sqlite3_get_autocommit(db_))
+    return;
+  ad::util::Stopwatch timer;
+  ad::util::TraceSpan span("Commit");
+  span.SetCount(pending_rows_);
+  if(!retention_.empty())
+    EnforceRetention();
+  if(slow_log_waiting_)
+    WriteSlowLog();
   TransactionControl("COMMIT");
+  stats_.commit_latency.Record(timer.Elapsed());
+  ad::util::TableStats::Add(stats_.commits);
+  pending_rows_ = 0;
+  for(auto& t : dirty_tables_)
+    BumpTableVersion(t);
+  dirty_tables_.clear();
+}
+
+// evict old rows of tables changed by the transaction being committed
+void SQLiteStorage::EnforceRetention() {
+  auto now = std::chrono::steady_clock::now();
+  for(auto& t : dirty_tables_) {
+    auto it = retention_.find(t);
+    if(it == retention_.end())
+      continue;
+    // min() and max() of rowid in separate subqueries are read from the ends of b-tree
+    std::string expr = "select (select min(rowid) from "+t+"), (select max(rowid) from "+t+");";
+    sqlite3_stmt *statement;
+    int error = sqlite3_prepare_v2(db_, expr.c_str(), -1, &statement, 0);
+    CheckRetCode(error, "PREPARE RETENTION");
+    bool empty = sqlite3_step(statement) != SQLITE_ROW || sqlite3_column_type(statement, 0) == SQLITE_NULL;
+    sqlite3_int64 min_rowid = sqlite3_column_int64(statement, 0), max_rowid = sqlite3_column_int64(statement, 1);
+    sqlite3_finalize(statement);
+    if(empty)
+      continue;
+    sqlite3_int64 cutoff = it->second.Cutoff(min_rowid, max_rowid, now);
+    if(!cutoff)
+      continue;
+    ExecOrThrow("delete from "+t+" where rowid <= "+std::to_string(cutoff)+";", "SQLite error occured while evicting rows of table "+t);
+    it->second.evicted_rows += sqlite3_changes(db_);
+    auto idx = key_indexes_.find(t);
+    if(idx != key_indexes_.end()) {
+      std::lock_guard<std::mutex> index_lock(key_index_mutex_);
+      auto& rowids = idx->second.rowids;
+      for(auto row = rowids.begin(); row != rowids.end(); )
+        row = row->second <= cutoff ? rowids.erase(row) : std::next(row);
+    }
+  }
+}
+
+void SQLiteStorage::SetRetention(const std::string& tablename, const RetentionPolicy& policy) {
+  if(attached_)
+    throw std::runtime_error("Retention is enforced by the publishing process");
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(policy.max_rows == 0 && policy.max_age.count() == 0)
+    retention_.erase(tablename);
+  else
+    retention_.insert_or_assign(tablename, RetentionState(policy));
+}
+
+void SQLiteStorage::GetMemoryUsage(MemoryUsage& usage) {
+  usage = MemoryUsage();
+  std::map<std::string, TableMemory> tables;
+  {
+    ReaderLease reader(*this);
+    if(reader.db == db_)
+      Commit();
+    // dbstat visits every page, counts of leaf cells are row counts
+    const char* expr = "select m.tbl_name,"
+      " sum(case when m.type = 'table' and s.pagetype = 'leaf' then s.ncell else 0 end),"
+      " sum(case when m.type = 'table' then s.pgsize else 0 end),"
+      " sum(case when m.type = 'index' then s.pgsize else 0 end)"
+      " from dbstat s join sqlite_master m on m.name = s.name group by m.tbl_name;";
+    sqlite3_stmt *statement;
+    if(sqlite3_prepare_v2(reader.db, expr, -1, &statement, 0) == SQLITE_OK) {
+      while(sqlite3_step(statement) == SQLITE_ROW) {
+        TableMemory& t = tables[(const char*)sqlite3_column_text(statement, 0)];
+        t.rows = sqlite3_column_int64(statement, 1);
+        t.bytes = sqlite3_column_int64(statement, 2);
+        t.index_bytes = sqlite3_column_int64(statement, 3);
+      }
+      sqlite3_finalize(statement);
+    }
+    else {
+      // SQLite built without dbstat: only row counts are known
+      std::vector<std::string> names;
+      int error = sqlite3_prepare_v2(reader.db, "select name from sqlite_master where type = 'table';", -1, &statement, 0);
+      CheckRetCode(error, "PREPARE TABLE LIST");
+      while(sqlite3_step(statement) == SQLITE_ROW)
+        names.push_back((const char*)sqlite3_column_text(statement, 0));
+      sqlite3_finalize(statement);
+      for(auto& name : names) {
+        CheckRetCode(sqlite3_prepare_v2(reader.db, ("select count(*) from "+name+";").c_str(), -1, &statement, 0), "PREPARE COUNT");
+        if(sqlite3_step(statement) == SQLITE_ROW)
+          tables[name].rows = sqlite3_column_int64(statement, 0);
+        sqlite3_finalize(statement);
+      }
+    }
+    sqlite3_stmt* pragma;
+    if(sqlite3_prepare_v2(reader.db, "select page_count * page_size from pragma_page_count, pragma_page_size;", -1, &pragma, 0) == SQLITE_OK) {
+      if(sqlite3_step(pragma) == SQLITE_ROW)
+        usage.storage_bytes = sqlite3_column_int64(pragma, 0);
+      sqlite3_finalize(pragma);
+    }
+  }
+  usage.heap_bytes = sqlite3_memory_used();
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  for(auto& idx : key_indexes_) {
+    auto it = tables.find(idx.first);
+    if(it == tables.end())
+      continue;
+    // hash node with key and rowid plus bucket pointer; keys longer than inline buffer of std::string
+    // take heap memory of their length
+    size_t key_len = idx.second.table->keyfields.size();
+    for(auto& k : idx.second.table->keyfields)
+      key_len += idx.second.table->outfields[k.first].size;
+    size_t node = sizeof(std::pair<const std::string, sqlite3_int64>) + 2*sizeof(void*);
+    if(key_len >= sizeof(std::string))
+      node += key_len;
+    it->second.index_bytes += idx.second.rowids.size() * node + idx.second.rowids.bucket_count() * sizeof(void*);
+  }
+  for(auto& r : retention_) {
+    auto it = tables.find(r.first);
+    if(it != tables.end())
+      it->second.evicted_rows = r.second.evicted_rows;
+  }
+  for(auto& h : history_)
+    if(h.second)
+      tables[h.first].history_bytes = h.second->Bytes();
+  for(auto& t : tables) {
+    t.second.tablename = t.first;
+    usage.tables.push_back(std::move(t.second));
+  }
+}
+
+void SQLiteStorage::SetHistory(const std::string& tablename, size_t max_bytes) {
+  if(attached_)
+    throw std::runtime_error("History is recorded by the publishing process");
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  std::lock_guard<std::mutex> history_lock(history_mutex_);
+  if(max_bytes == 0) {
+    history_sizes_.erase(tablename);
+    history_.erase(tablename);
+    return;
+  }
+  history_sizes_[tablename] = max_bytes;
+  auto log = history_.find(tablename);
+  if(log != history_.end() && log->second)
+    log->second->SetMaxBytes(max_bytes);
+}
+
+std::shared_ptr<HistoryLog> SQLiteStorage::FindHistory(const std::string& tablename) {
+  std::lock_guard<std::mutex> lock(history_mutex_);
+  auto log = history_.find(tablename);
+  return log == history_.end() ? nullptr : log->second;
+}
+
+void SQLiteStorage::GetHistory(const std::string& tablename, int64_t from_us, int64_t to_us, SqlResult& result) {
+  auto log = FindHistory(tablename);
+  if(!log)
+    throw std::runtime_error("History is not enabled for table "+tablename);
+  log->Read(from_us, to_us, result);
+}
+
+void SQLiteStorage::SetTransactionCoalescing(size_t max_rows, size_t max_delay_ms) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  coalesce_rows_ = max_rows;
+  coalesce_delay_ = std::chrono::milliseconds(max_delay_ms);
+  if(IsCommitDue())
+    Commit();
+}
+
+const ad::util::StorageStats& SQLiteStorage::GetStats() {
+  return stats_;
+}
+
+void SQLiteStorage::SetBulkLoadThreshold(size_t rows) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  bulk_load_min_rows_ = rows;
+}
+
+bool SQLiteStorage::TableExists(const std::string& tablename) {
+  std::string expr = "SELECT * FROM sqlite_master WHERE name ='"+tablename+"' and type='table' COLLATE NOCASE;";
+  sqlite3_stmt *statement;
+  int error = sqlite3_prepare_v2(db_, expr.c_str(), -1, &statement, 0);
+  if(error)
+      throw std::runtime_error("SQLite error occured while checking if table "+tablename+" already exists: "+std::string(sqlite3_errstr(error)));
+  bool exists = sqlite3_step(statement) == SQLITE_ROW;
+  sqlite3_finalize(statement);
+  return exists;
+}
+
+void SQLiteStorage::CreateIndex(const std::string& tablename, const IndexSpec& spec) {
+  std::string name = tablename+"$"+(spec.name.empty() ? ad::util::join(spec.columns, "_") : spec.name);
+  // SQLite has no INCLUDE clause, covering columns go after the key columns
+  std::vector<std::string> columns = spec.columns;
+  columns.insert(columns.end(), spec.include.begin(), spec.include.end());
+  std::string sql = std::string("create ")+(spec.unique ? "unique " : "")+"index if not exists "+name
+    +" on "+tablename+" ("+ad::util::join(columns, ", ")+")";
+  if(!spec.where.empty())
+    sql += " where "+spec.where;
+  sql += ";";
+  ExecOrThrow(sql, "SQLite error occured while creating index "+name);
+}
+
+void SQLiteStorage::AddIndex(const std::string& tablename, const IndexSpec& spec) {
+  if(spec.columns.empty())
+    throw std::runtime_error("Index on table "+tablename+" has no columns");
+  if(spec.unique && !spec.include.empty())
+    throw std::runtime_error("Unique index on table "+tablename+" can not have included columns");
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(TableExists(tablename)) {
+    Commit();
+    CreateIndex(tablename, spec);
+  }
+  index_specs_[tablename].push_back(spec);
+}
+
+void SQLiteStorage::SetSecCodeIndex(bool enable) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  seccode_index_ = enable;
+}
+
+bool SQLiteStorage::IsTableEmpty(const std::string& tablename) {
+  std::string expr = "select 1 from "+tablename+" limit 1;";
+  sqlite3_stmt *statement;
+  int error = sqlite3_prepare_v2(db_, expr.c_str(), -1, &statement, 0);
+  CheckRetCode(error, "PREPARE EMPTY CHECK");
+  bool empty = sqlite3_step(statement) != SQLITE_ROW;
+  sqlite3_finalize(statement);
+  return empty;
+}
+
+int64_t SQLiteStorage::ReadPragma(const std::string& pragma) {
+  std::string expr = "PRAGMA "+pragma+";";
+  sqlite3_stmt *statement;
+  int error = sqlite3_prepare_v2(db_, expr.c_str(), -1, &statement, 0);
+  CheckRetCode(error, "PREPARE PRAGMA");
+  int64_t value = 0;
+  if(sqlite3_step(statement) == SQLITE_ROW)
+    value = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  return value;
+}
+
+void SQLiteStorage::StartBulkLoad(AstsOpenedTable* table) {
+  // remember and drop all indexes of the table, they are created again by FinishBulkLoad
+  std::string expr = "select name, sql from sqlite_master where type='index' and sql is not null and tbl_name='"+current_table_+"' COLLATE NOCASE;";
+  sqlite3_stmt *statement;
+  int error = sqlite3_prepare_v2(db_, expr.c_str(), -1, &statement, 0);
+  CheckRetCode(error, "PREPARE INDEX LIST");
+  std::vector<std::string> names;
+  bulk_indexes_.clear();
+  while(sqlite3_step(statement) == SQLITE_ROW) {
+    names.push_back((const char*)sqlite3_column_text(statement, 0));
+    bulk_indexes_.push_back((const char*)sqlite3_column_text(statement, 1));
+  }
+  sqlite3_finalize(statement);
+  for(auto& name : names)
+    ExecOrThrow("drop index \""+name+"\";", "SQLite error occured while dropping index "+name);
+
+  // larger page cache while loading; worker threads help sorting when indexes are built
+  saved_cache_size_ = ReadPragma("cache_size");
+  sqlite3_exec(db_, "PRAGMA cache_size=-262144; PRAGMA threads=4;", NULL, 0, NULL);
+  bulk_table_ = current_table_;
+  bulk_source_ = table->thistable_;
+  bulk_fldnums_.clear();
+  bulk_values_.clear();
+  bulk_rows_ = 0;
+  bulk_load_ = true;
+}
+
+void SQLiteStorage::ReadBulkRow(AstsOpenedTable* table, ad::util::BufferReader& buffer, fld_count_t* fldnums, fld_count_t fldcount) {
+  if(bulk_rows_ && (bulk_fldnums_.size() != fldcount || memcmp(bulk_fldnums_.data(), fldnums, fldcount) != 0))
+    FlushBulkRows();
+  if(!bulk_rows_ && (bulk_fldnums_.size() != fldcount || memcmp(bulk_fldnums_.data(), fldnums, fldcount) != 0)) {
+    bulk_fldnums_.assign(fldnums, fldnums + fldcount);
+    sqlite3_finalize(bulk_stmt_);
+    bulk_stmt_ = NULL;
+    // number of rows per statement is limited by number of host parameters
+    bulk_chunk_rows_ = std::max(1, std::min(64, sqlite3_limit(db_, SQLITE_LIMIT_VARIABLE_NUMBER, -1) / fldcount));
+  }
+  for(fld_count_t c=0; c<fldcount; ++c) {
+    const AstsOutField& fld = table->thistable_->outfields[fldnums[c]];
+    bulk_values_.push_back(DecodeField(fld, buffer.Take(fld.size), tmp_buf_.data()));
+  }
+  ++batch_rows_;
+  ad::util::TableStats::Add(table->stats.inserts);
+  if(++bulk_rows_ == bulk_chunk_rows_)
+    FlushBulkRows();
+}
+
+void SQLiteStorage::FlushBulkRows() {
+  if(!bulk_rows_)
+    return;
+  sqlite3_stmt* stmt = (bulk_rows_ == bulk_chunk_rows_) ? bulk_stmt_ : NULL;
+  if(stmt == NULL) {
+    auto& outfields = bulk_source_->outfields;
+    std::ostringstream insert;
+    insert << "INSERT INTO " << bulk_table_ << " (";
+    for(size_t c=0; c<bulk_fldnums_.size(); ++c)
+      insert << (c ? "," : "") << outfields[bulk_fldnums_[c]].name;
+    insert << ") VALUES ";
+    std::string row = "(?";
+    for(size_t c=1; c<bulk_fldnums_.size(); ++c)
+      row.append(",?");
+    row.append(")");
+    for(size_t r=0; r<bulk_rows_; ++r)
+      insert << (r ? "," : "") << row;
+    int error = sqlite3_prepare_v2(db_, insert.str().c_str(), -1, &stmt, 0);
+    CheckRetCode(error, "PREPARE BULK INSERT");
+    if(bulk_rows_ == bulk_chunk_rows_)
+      bulk_stmt_ = stmt;
+  }
+  for(size_t i=0; i<bulk_values_.size(); ++i)
+    BindValue(stmt, i+1, bulk_values_[i]);
+  int error = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  if(stmt != bulk_stmt_)
+    sqlite3_finalize(stmt);
+  bulk_values_.clear();
+  bulk_rows_ = 0;
+  CheckRetCode(error, "EXECUTE BULK INSERT", SQLITE_DONE);
+}
+
+void SQLiteStorage::FinishBulkLoad() {
+  FlushBulkRows();
+  for(auto& create : bulk_indexes_) {
+    if(sqlite3_exec(db_, create.c_str(), NULL, 0, NULL) == SQLITE_OK)
+      continue;
+    // snapshot repeated a key: keep the last row, as row by row load would have done
+    auto idx = key_indexes_.find(bulk_table_);
+    if(sqlite3_extended_errcode(db_) != SQLITE_CONSTRAINT_UNIQUE || idx == key_indexes_.end())
+      throw std::runtime_error("SQLite error occured while creating index: "+std::string(sqlite3_errmsg(db_)));
+    std::vector<std::string> names;
+    for(auto& k : idx->second.table->keyfields)
+      names.push_back(k.second);
+    ExecOrThrow("delete from "+bulk_table_+" where rowid not in (select max(rowid) from "+bulk_table_+" group by "+ad::util::join(names, ", ")+");",
+                "SQLite error occured while removing duplicate keys from table "+bulk_table_);
+    ExecOrThrow(create, "SQLite error occured while creating index");
+  }
+  if(key_indexes_.find(bulk_table_) != key_indexes_.end())
+    RebuildKeyIndex(bulk_table_);
+  ResetBulkLoad();
+}
+
+void SQLiteStorage::ResetBulkLoad() {
+  if(!bulk_load_)
+    return;
+  sqlite3_finalize(bulk_stmt_);
+  bulk_stmt_ = NULL;
+  bulk_fldnums_.clear();
+  bulk_values_.clear();
+  bulk_rows_ = 0;
+  bulk_indexes_.clear();
+  bulk_load_ = false;
+  std::string pragmas = "PRAGMA cache_size="+std::to_string(saved_cache_size_)+"; PRAGMA threads=0;";
+  sqlite3_exec(db_, pragmas.c_str(), NULL, 0, NULL);
+}
+
+void SQLiteStorage::SaveSnapshot(const std::string& path, const SnapshotState& state) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+  // write to temporary file and rename it, so existing snapshot is never left half-written
+  std::string tmp_path = path+".tmp";
+  unlink(tmp_path.c_str());
+  sqlite3* dest = NULL;
+  int error = sqlite3_open_v2(tmp_path.c_str(), &dest, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  auto fail = [&](const std::string& step) {
+    std::string msg = "SQLite error occured while "+step+" snapshot "+path+": "+sqlite3_errmsg(dest);
+    sqlite3_close(dest);
+    unlink(tmp_path.c_str());
+    throw std::runtime_error(msg);
+  };
+  if(error != SQLITE_OK)
+    fail("creating");
+  sqlite3_backup* backup = sqlite3_backup_init(dest, "main", db_, "main");
+  if(backup == NULL)
+    fail("writing");
+  sqlite3_backup_step(backup, -1);
+  if(sqlite3_backup_finish(backup) != SQLITE_OK)
+    fail("writing");
+
+  // snapshot file is used without WAL, connection state goes to two extra tables
+  if(sqlite3_exec(dest, "PRAGMA journal_mode=DELETE; BEGIN TRANSACTION;"
+      "create table MTE$SNAPSHOT_INTERFACES (system_type char(4), data blob);"
+      "create table MTE$SNAPSHOT_TABLES (table_name char(32), params blob, ref integer);", NULL, 0, NULL) != SQLITE_OK)
+    fail("writing");
+  sqlite3_stmt* statement;
+  if(sqlite3_prepare_v2(dest, "insert into MTE$SNAPSHOT_INTERFACES values (?1, ?2);", -1, &statement, 0) != SQLITE_OK)
+    fail("writing");
+  for(auto& iface : state.interfaces) {
+    sqlite3_bind_text(statement, 1, iface.first.data(), iface.first.size(), SQLITE_STATIC);
+    sqlite3_bind_blob(statement, 2, iface.second.data(), iface.second.size(), SQLITE_STATIC);
+    error = sqlite3_step(statement);
+    sqlite3_reset(statement);
+    if(error != SQLITE_DONE) {
+      sqlite3_finalize(statement);
+      fail("writing");
+    }
+  }
+  sqlite3_finalize(statement);
+  if(sqlite3_prepare_v2(dest, "insert into MTE$SNAPSHOT_TABLES values (?1, ?2, ?3);", -1, &statement, 0) != SQLITE_OK)
+    fail("writing");
+  for(auto& table : state.tables) {
+    sqlite3_bind_text(statement, 1, table.tablename.data(), table.tablename.size(), SQLITE_STATIC);
+    sqlite3_bind_blob(statement, 2, table.params.data(), table.params.size(), SQLITE_STATIC);
+    sqlite3_bind_int(statement, 3, table.ref);
+    error = sqlite3_step(statement);
+    sqlite3_reset(statement);
+    if(error != SQLITE_DONE) {
+      sqlite3_finalize(statement);
+      fail("writing");
+    }
+  }
+  sqlite3_finalize(statement);
+  if(sqlite3_exec(dest, "COMMIT TRANSACTION;", NULL, 0, NULL) != SQLITE_OK)
+    fail("writing");
+  sqlite3_close(dest);
+  if(rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    throw std::runtime_error("Unable to rename snapshot file "+tmp_path+" to "+path);
+  }
+}
+
+void SQLiteStorage::LoadSnapshot(const std::string& path, SnapshotState& state) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+  sqlite3* src = NULL;
+  int error = sqlite3_open_v2(path.c_str(), &src, SQLITE_OPEN_READONLY, NULL);
+  auto fail = [&](const std::string& step) {
+    std::string msg = "SQLite error occured while "+step+" snapshot "+path+": "+sqlite3_errmsg(src);
+    sqlite3_close(src);
+    throw std::runtime_error(msg);
+  };
+  if(error != SQLITE_OK)
+    fail("opening");
+  sqlite3_stmt* statement;
+  state = SnapshotState();
+  if(sqlite3_prepare_v2(src, "select system_type, data from MTE$SNAPSHOT_INTERFACES;", -1, &statement, 0) != SQLITE_OK)
+    fail("reading");
+  while(sqlite3_step(statement) == SQLITE_ROW)
+    state.interfaces[(const char*)sqlite3_column_text(statement, 0)] =
+      std::string((const char*)sqlite3_column_blob(statement, 1), sqlite3_column_bytes(statement, 1));
+  sqlite3_finalize(statement);
+  if(sqlite3_prepare_v2(src, "select table_name, params, ref from MTE$SNAPSHOT_TABLES;", -1, &statement, 0) != SQLITE_OK)
+    fail("reading");
+  while(sqlite3_step(statement) == SQLITE_ROW) {
+    SnapshotTable table;
+    table.tablename = (const char*)sqlite3_column_text(statement, 0);
+    table.params.assign((const char*)sqlite3_column_blob(statement, 1), sqlite3_column_bytes(statement, 1));
+    table.ref = sqlite3_column_int(statement, 2);
+    state.tables.push_back(table);
+  }
+  sqlite3_finalize(statement);
+
+  // statements of writer connection refer to tables about to be replaced
   sqlite3_finalize(ins_stmt);
   sqlite3_finalize(upd_stmt);
   ins_stmt = NULL;
   upd_stmt = NULL;
-  delete[] tmp_buf;
+  prepared_table_.clear();
+  sqlite3_backup* backup = sqlite3_backup_init(db_, "main", src, "main");
+  if(backup == NULL)
+    throw std::runtime_error("SQLite error occured while loading snapshot "+path+": "+sqlite3_errmsg(db_));
+  sqlite3_backup_step(backup, -1);
+  error = sqlite3_backup_finish(backup);
+  sqlite3_close(src);
+  if(error != SQLITE_OK)
+    throw std::runtime_error("SQLite error occured while loading snapshot "+path+": "+sqlite3_errstr(error));
+  // copied header says rollback journal, readers of file database need WAL back
+  if(!db_path_.empty())
+    ExecOrThrow("PRAGMA journal_mode=WAL;", "SQLite error occured while loading snapshot "+path);
+  ExecOrThrow("drop table MTE$SNAPSHOT_INTERFACES; drop table MTE$SNAPSHOT_TABLES;",
+              "SQLite error occured while loading snapshot "+path);
+
+  // every table may have changed
+  {
+    std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+    query_cache_.clear();
+    query_cache_lru_.clear();
+  }
+  for(auto& table : state.tables)
+    BumpTableVersion(table.tablename);
+  for(auto& r : retention_)
+    r.second.Reset();
+}
+
+void SQLiteStorage::Flush() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  Commit();
+}
+
+void SQLiteStorage::CommitIfDue() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(IsCommitDue())
+    Commit();
 }
 
-bool SQLiteStorage::IsStatementPrepared() {
-  return (ins_stmt != NULL || upd_stmt != NULL);
+bool SQLiteStorage::IsStatementPrepared(const std::string& tablename, fld_count_t* fldnums, fld_count_t fldcount) {
+  return (ins_stmt != NULL || upd_stmt != NULL) && prepared_table_ == tablename
+    && prepared_fldnums_.size() == fldcount && memcmp(prepared_fldnums_.data(), fldnums, fldcount) == 0;
 }
 
 void SQLiteStorage::PrepareNextStatement(std::string& masked_tablename, std::shared_ptr<AstsTable> table, fld_count_t* fldnums, fld_count_t fldcount) {
+  ad::util::TraceSpan span("Prepare", masked_tablename);
   std::ostringstream insert, update;
   std::ostringstream insfields, insvalues;
   std::ostringstream updfields, updkey;
@@ -314,10 +1559,13 @@ void SQLiteStorage::PrepareNextStatement(std::string& masked_tablename, std::sha
   else
     update.str("");
 
-  int error = sqlite3_finalize(ins_stmt);
-  CheckRetCode(error, "FINALIZE INSERT");
-  error = sqlite3_finalize(upd_stmt);
-  CheckRetCode(error, "FINALIZE UPDATE");
+  // finalize may only repeat the error of the last step, it has been reported already
+  sqlite3_finalize(ins_stmt);
+  sqlite3_finalize(upd_stmt);
+  ins_stmt = NULL;
+  upd_stmt = NULL;
+  prepared_table_.clear();
+  int error;
   if(hasupd) {
     error = sqlite3_prepare_v2(db_, update.str().c_str(), -1, &upd_stmt, 0);
     CheckRetCode(error, "PREPARE UPDATE");
@@ -326,6 +1574,9 @@ void SQLiteStorage::PrepareNextStatement(std::string& masked_tablename, std::sha
     upd_stmt = NULL;
   error = sqlite3_prepare_v2(db_, insert.str().c_str(), -1, &ins_stmt, 0);
   CheckRetCode(error, "PREPARE INSERT");
+  // statements are kept between batches and reused while table and field list stay the same
+  prepared_table_ = masked_tablename;
+  prepared_fldnums_.assign(fldnums, fldnums + fldcount);
 }
 
 void SQLiteStorage::CheckRetCode(int e, const std::string &step, int expected) {
@@ -333,149 +1584,638 @@ void SQLiteStorage::CheckRetCode(int e, const std::string &step, int expected) {
     throw std::runtime_error("Error on "+step+" step: "+std::string(sqlite3_errmsg(db_)));
 }
 
+// canonical key of the row statement stands on, key field k is in column keyfields[k].first + offset
+static std::string RowKey(const AstsTable& table, sqlite3_stmt* statement, int offset) {
+  std::string key;
+  for(size_t k=0; k<table.keyfields.size(); ++k) {
+    int column = table.keyfields[k].first + offset;
+    const AstsOutField& fld = table.outfields[table.keyfields[k].first];
+    FieldValue v;
+    switch(sqlite3_column_type(statement, column)) {
+      case SQLITE_INTEGER:
+        v.type = AstsFieldType::kInteger;
+        v.int_value = sqlite3_column_int64(statement, column);
+        break;
+      case SQLITE_FLOAT:
+        v.type = AstsFieldType::kFixed;
+        v.double_value = sqlite3_column_double(statement, column);
+        break;
+      case SQLITE_TEXT:
+        v.type = AstsFieldType::kChar;
+        v.text = std::string_view((const char*)sqlite3_column_text(statement, column), sqlite3_column_bytes(statement, column));
+        break;
+      default:
+        break;
+    }
+    if(k)
+      key.push_back('\x1f');
+    key.append(KeyPart(v, fld.decimals));
+  }
+  return key;
+}
+
+void SQLiteStorage::RebuildKeyIndex(const std::string& tablename) {
+  std::shared_ptr<AstsTable> table = key_indexes_[tablename].table;
+  std::string expr = "select rowid, * from "+tablename+";";
+  sqlite3_stmt *statement;
+  int error = sqlite3_prepare_v2(db_, expr.c_str(), -1, &statement, 0);
+  CheckRetCode(error, "PREPARE KEY INDEX");
+  // built aside, lookups keep using the old index meanwhile
+  std::unordered_map<std::string, sqlite3_int64> rowids;
+  while(sqlite3_step(statement) == SQLITE_ROW)
+    rowids[RowKey(*table, statement, 1)] = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  std::lock_guard<std::mutex> lock(key_index_mutex_);
+  key_indexes_[tablename].rowids.swap(rowids);
+}
+
+static void SetTableFields(const AstsTable& table, SqlResult& result) {
+  result.fields.clear();
+  result.data.clear();
+  for(auto& fld : table.outfields)
+    result.fields.push_back({fld.name, fld.type, fld.decimals});
+}
+
+bool SQLiteStorage::Get(const std::string& tablename, const std::vector<std::string>& key, SqlResult& result) {
+  GetMany(tablename, {key}, result);
+  if(result.data.back().empty()) {
+    result.data.pop_back();
+    return false;
+  }
+  return true;
+}
+
+// lookups read committed data through a reader connection. Hash index gives rowid of the row, which is
+// checked to still hold the key, since index may be ahead of committed data. Keys missing from index or
+// moved to another row are searched by $PK index
+void SQLiteStorage::GetMany(const std::string& tablename, const std::vector<std::vector<std::string> >& keys, SqlResult& result) {
+  std::shared_ptr<AstsTable> table;
+  std::vector<std::string> canonical;
+  std::vector<sqlite3_int64> rowids(keys.size(), 0);
+  {
+    std::lock_guard<std::mutex> lock(key_index_mutex_);
+    auto idx = key_indexes_.find(tablename);
+    if(idx == key_indexes_.end())
+      throw std::runtime_error("Table "+tablename+" has not been opened or has no key fields");
+    table = idx->second.table;
+    canonical.reserve(keys.size());
+    for(size_t i=0; i<keys.size(); ++i) {
+      canonical.push_back(KeyFromStrings(*table, keys[i]));
+      auto row = idx->second.rowids.find(canonical.back());
+      if(row != idx->second.rowids.end())
+        rowids[i] = row->second;
+    }
+  }
+  SetTableFields(*table, result);
+  result.data.reserve(keys.size());
+  ReaderLease reader(*this);
+  if(reader.db == db_)
+    Commit();
+  auto& outfields = table->outfields;
+  // statements of writer connection are not kept
+  auto finalize = [&](sqlite3_stmt* statement) {
+    if(reader.db == db_)
+      sqlite3_finalize(statement);
+  };
+  auto prepare = [&](const std::string& expr) {
+    return std::unique_ptr<sqlite3_stmt, decltype(finalize)>(LookupStatement(reader, tablename, expr), finalize);
+  };
+  auto by_rowid = prepare("select * from "+tablename+" where rowid = ?;");
+  std::unique_ptr<sqlite3_stmt, decltype(finalize)> by_key(nullptr, finalize);
+  auto append_row = [&](sqlite3_stmt* statement) {
+    std::vector<std::any> row;
+    row.reserve(outfields.size());
+    for(size_t i=0; i<outfields.size(); ++i)
+      row.push_back(ColumnValue(statement, i, sqlite3_column_type(statement, i), outfields[i].type));
+    result.data.push_back(std::move(row));
+  };
+  for(size_t i=0; i<keys.size(); ++i) {
+    if(rowids[i]) {
+      sqlite3_bind_int64(by_rowid.get(), 1, rowids[i]);
+      bool found = sqlite3_step(by_rowid.get()) == SQLITE_ROW && RowKey(*table, by_rowid.get(), 0) == canonical[i];
+      if(found)
+        append_row(by_rowid.get());
+      sqlite3_reset(by_rowid.get());
+      if(found)
+        continue;
+    }
+    if(!by_key) {
+      std::vector<std::string> match;
+      for(size_t k=0; k<table->keyfields.size(); ++k)
+        match.push_back(table->keyfields[k].second+" = ?"+std::to_string(k+1));
+      by_key.reset(LookupStatement(reader, tablename, "select * from "+tablename+" where "+ad::util::join(match, " and ")+";"));
+    }
+    for(size_t k=0; k<keys[i].size(); ++k) {
+      const AstsOutField& fld = outfields[table->keyfields[k].first];
+      // numeric columns convert text by their affinity, text fields are stored padded to field size
+      bool numeric = fld.type == AstsFieldType::kInteger || fld.type == AstsFieldType::kFixed || fld.type == AstsFieldType::kFloatPoint;
+      std::string value = numeric ? keys[i][k] : ad::util::rpad(keys[i][k], fld.size);
+      sqlite3_bind_text(by_key.get(), k+1, value.data(), value.size(), SQLITE_TRANSIENT);
+    }
+    if(sqlite3_step(by_key.get()) == SQLITE_ROW)
+      append_row(by_key.get());
+    else
+      result.data.push_back({});
+    sqlite3_reset(by_key.get());
+  }
+}
+
+void SQLiteStorage::SetQueryCacheSize(size_t size) {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  // attached storage has no table versions to validate cached results
+  query_cache_size_ = attached_ ? 0 : size;
+  while(query_cache_.size() > query_cache_size_) {
+    query_cache_.erase(query_cache_lru_.back());
+    query_cache_lru_.pop_back();
+  }
+}
+
+bool SQLiteStorage::GetCachedResult(const std::string& query, const std::set<std::string>& tables, SqlResult& result, std::vector<std::pair<std::string, uint64_t> >& versions) {
+  versions.clear();
+  for(auto& t : tables)
+    versions.push_back({t, GetTableVersion(t)});
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  auto it = query_cache_.find(query);
+  if(it == query_cache_.end() || it->second.versions != versions)
+    return false;
+  query_cache_lru_.splice(query_cache_lru_.begin(), query_cache_lru_, it->second.lru_pos);
+  result = it->second.result;
+  return true;
+}
+
+void SQLiteStorage::PutCachedResult(const std::string& query, std::vector<std::pair<std::string, uint64_t> >& versions, const SqlResult& result) {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  if(query_cache_size_ == 0)
+    return;
+  auto it = query_cache_.find(query);
+  if(it == query_cache_.end()) {
+    if(query_cache_.size() >= query_cache_size_) {
+      query_cache_.erase(query_cache_lru_.back());
+      query_cache_lru_.pop_back();
+    }
+    query_cache_lru_.push_front(query);
+    it = query_cache_.insert({query, CachedQuery()}).first;
+    it->second.lru_pos = query_cache_lru_.begin();
+  }
+  else
+    query_cache_lru_.splice(query_cache_lru_.begin(), query_cache_lru_, it->second.lru_pos);
+  it->second.versions = std::move(versions);
+  it->second.result = result;
+}
+
 void SQLiteStorage::Query(std::string_view query, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) {
+  std::string query_text(query);
+  StatementTables tables;
+  StatementStatus status;
+  ad::util::Stopwatch timer;
+  if(slow_log_waiting_) {
+    // reader of the log must see entries still waiting for commit
+    std::string lowercase_query = query_text;
+    std::transform(lowercase_query.begin(), lowercase_query.end(), lowercase_query.begin(), ::tolower);
+    if(lowercase_query.find("mte$slowlog") != std::string::npos)
+      FlushSlowLog();
+  }
+  RunQuery(query_text, result, interfaces, tables, status);
+  auto elapsed = timer.Elapsed();
+  int64_t threshold = slow_query_us_;
+  if(threshold && status.executed && elapsed >= std::chrono::microseconds(threshold))
+    LogSlowQuery(query_text, elapsed, result.data.size(), tables, status);
+}
+
+void SQLiteStorage::RunQuery(const std::string& query_text, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces, StatementTables& tables, StatementStatus& status) {
   result.fields = {};
   result.data = {};
   sqlite3_stmt *statement;
-  int error = sqlite3_prepare_v2(db_, query.data(), -1, &statement, 0);
-  if (error == SQLITE_OK) {
-    int ctotal = sqlite3_column_count(statement);
-
-    // SQLite allows multiple fields with the same name in the dataset
-    // we cannot use them as is, because field names will eventually be python dict keys, so we need to rename them
-    // this function renames them Firebird-style:
-    // select sum(f1), count(f1), sum(f2), sum(f3), count(f3) from tbl
-    // -> SUM1 COUNT1 SUM2 SUM3 COUNT2
-    std::map<std::string, int> fncounts;
-    auto fncount_chk = [&](std::string fieldname) {
-      if(fncounts.find(fieldname) != fncounts.end()) {
-        int c = fncounts[fieldname];
-        fncounts[fieldname] = ++c;
-        return fieldname+std::to_string(c);
-      }
-      else {
-        fncounts[fieldname] = 0;
-        return fieldname;
-      }
-    };
-
-    bool is_first_row = true;
-    std::string aliased_fieldname, tbl;
-    while(true) {
-      int res = sqlite3_step(statement);
-      if(res != SQLITE_ROW) {
-        if (res != SQLITE_DONE)
-          error = res;
-        break;
+  // authorizer tells us which tables statement reads and writes
+  ReaderLease reader(*this);
+  // without reader pool statements run on writer connection and would see uncommitted batches
+  if(reader.db == db_)
+    Commit();
+  sqlite3_set_authorizer(reader.db, CollectStatementTables, &tables);
+  int error = sqlite3_prepare_v2(reader.db, query_text.c_str(), -1, &statement, 0);
+  sqlite3_set_authorizer(reader.db, NULL, NULL);
+
+  if(error == SQLITE_OK && statement && !sqlite3_stmt_readonly(statement) && reader.db != db_) {
+    // statements changing data are run by writer connection
+    sqlite3_finalize(statement);
+    reader.EndTransaction();
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    // do not mix user changes into pending refresh transaction
+    Commit();
+    tables = StatementTables();
+    sqlite3_set_authorizer(db_, CollectStatementTables, &tables);
+    error = sqlite3_prepare_v2(db_, query_text.c_str(), -1, &statement, 0);
+    sqlite3_set_authorizer(db_, NULL, NULL);
+    RunStatement(db_, statement, error, result, interfaces, &status);
+    for(auto& t : tables.writes)
+      MarkTableChanged(t);
+    return;
+  }
+
+  // results of read-only statements are cached until any of the tables they read is changed
+  // versions are taken before execution, so data committed during execution invalidates the result
+  bool cacheable = (error == SQLITE_OK) && statement && query_cache_size_ && tables.deterministic
+    && sqlite3_stmt_readonly(statement);
+  std::vector<std::pair<std::string, uint64_t> > versions;
+  if(cacheable && GetCachedResult(query_text, tables.reads, result, versions)) {
+    sqlite3_finalize(statement);
+    return;
+  }
+
+  RunStatement(reader.db, statement, error, result, interfaces, &status);
+  // pool is disabled and writer connection was used
+  for(auto& t : tables.writes)
+    MarkTableChanged(t);
+  if(cacheable)
+    PutCachedResult(query_text, versions, result);
+}
+
+void SQLiteStorage::SetSlowQueryLog(size_t threshold_ms, size_t max_entries) {
+  if(attached_)
+    throw std::runtime_error("Slow query log is written by the publishing process");
+  slow_log_size_ = max_entries;
+  slow_query_us_ = threshold_ms * 1000;
+}
+
+static std::string RegexEscape(const std::string& s) {
+  static const std::regex special(R"([$.^*+?()\[\]{}|\\])");
+  return std::regex_replace(s, special, R"(\$&)");
+}
+
+// table name in a plan line may be an alias, resolve it against tables read by the statement
+static std::string ResolvePlanTable(const std::string& name, const std::string& lowercase_query, const StatementTables& tables) {
+  if(tables.columns.count(name))
+    return name;
+  std::string alias = name;
+  std::transform(alias.begin(), alias.end(), alias.begin(), ::tolower);
+  for(auto& t : tables.columns) {
+    std::string table = t.first;
+    std::transform(table.begin(), table.end(), table.begin(), ::tolower);
+    std::regex re("\"?" + RegexEscape(table) + "\"?\\s+(as\\s+)?" + RegexEscape(alias) + "\\b");
+    if(std::regex_search(lowercase_query, re))
+      return t.first;
+  }
+  return "";
+}
+
+static std::string IndexSuggestion(const std::string& table, const std::vector<std::string>& columns) {
+  std::string name = table + "$", cols;
+  for(auto& c : columns) {
+    name += (cols.empty() ? "" : "_") + c;
+    cols += (cols.empty() ? "\"" : ", \"") + c + "\"";
+  }
+  return "create index \"" + name + "\" on \"" + table + "\"(" + cols + ")";
+}
+
+// indexes which could help statement with given plan:
+// - automatic indexes SQLite builds for every execution, their columns are taken from the plan
+// - full scans of a table, columns of the table mentioned in WHERE/ON clauses are suggested
+static std::vector<std::string> SuggestIndexes(const std::vector<std::string>& plan, const std::string& query, const StatementTables& tables) {
+  static const std::regex automatic_re(R"(^SEARCH (?:TABLE )?(\S+)(?: AS (\S+))? USING AUTOMATIC (?:PARTIAL )?(?:COVERING )?INDEX \((.*)\))");
+  static const std::regex scan_re(R"(^SCAN (?:TABLE )?(\S+)(?: AS (\S+))?$)");
+  std::string lowercase_query = query;
+  std::transform(lowercase_query.begin(), lowercase_query.end(), lowercase_query.begin(), ::tolower);
+  size_t conditions = std::min(lowercase_query.find(" where "), lowercase_query.find(" on "));
+  std::vector<std::string> suggestions;
+  std::smatch m;
+  for(auto& line : plan) {
+    std::vector<std::string> columns;
+    std::string table;
+    if(std::regex_search(line, m, automatic_re)) {
+      table = ResolvePlanTable(m[1], lowercase_query, tables);
+      // (a=? AND b>?)
+      std::string terms = m[3];
+      for(size_t pos = 0; pos < terms.size(); ) {
+        size_t next = terms.find(" AND ", pos);
+        std::string term = terms.substr(pos, next == std::string::npos ? std::string::npos : next - pos);
+        columns.push_back(term.substr(0, term.find_first_of("=<> ")));
+        pos = next == std::string::npos ? terms.size() : next + 5;
       }
-      std::vector<std::any> tmp_row;
-      for(int i=0; i<ctotal; i++) {
-        int column_type = sqlite3_column_type(statement, i);
-        if(is_first_row) { // process metadata
-          /*
-           * Field name may be one of the following:
-           *  1. field name from interface's table
-           *  2. aliased field name from interface's table
-           *  3. field name from custom table
-           *  4. aliased field name from custom table
-           *  5. aliased expression from query (function, case, etc)
-           * So determining type of field should work this way:
-           *  1. determine real name of field
-           *  2. based on the source of this field:
-           *  2.1 if it's a table from interface - take it from interface
-           *  2.2 if it's an expression - ask SQLite
-           *  2.3 if it's a table NOT from interface - ask SQLite as well
-           * We should check field names for duplicates (and rename them if necessary) either way
-          */
-          const char * cn = sqlite3_column_origin_name(statement,i);
-          aliased_fieldname = sqlite3_column_name(statement,i);
-          bool sqlite_type = false;
-          AstsOutField orig_fld;
-          if (cn == NULL) // it's an expression
-            sqlite_type = true;
-          else { // it's a field from some table, possibly from interface
-            tbl = sqlite3_column_table_name(statement,i);
-            bool found = false;
-            // search all interfaces for a table with this name
-            for (auto& v : interfaces)
-              if(v.second->tables.find(tbl) != v.second->tables.end()) {
-                auto& orig_iface = v.second;
-                // search table for a field with this name
-                // maybe we ALTERed table after it was created, and this field is the one we added manually
-                for(auto& field : orig_iface->tables[tbl]->outfields)
-                  if(field.name == std::string(cn)) {
-                    sqlite_type = false;
-                    orig_fld = field;
-                    found = true;
-                    break;
-                  }
-              }
-            if(!found) // field not found in interfaces
-              sqlite_type = true;
-          }
-          if(sqlite_type) { // field not found in interfaces
-            SqlOutField cfield;
-            size_t f = aliased_fieldname.find_first_of('(');
-            aliased_fieldname = aliased_fieldname.substr(0, f);
-            cfield.name = fncount_chk(aliased_fieldname);
-            cfield.type = GetColumnType(column_type);
-            result.fields.push_back(cfield);
-          }
-          else { // field found in interfaces
-            tbl = sqlite3_column_table_name(statement,i);
-            SqlOutField tmp;
-            tmp.name = fncount_chk(aliased_fieldname);
-            tmp.type = orig_fld.type;
-            tmp.decimals = orig_fld.decimals;
-            result.fields.push_back(tmp);
-          }
-        } // if first row (metadata)
-        else {
-          // if a custom field in first row is NULL, we'll try to guess field type from consecutive rows
-          if((result.fields[i].type == AstsFieldType::kNull) && (column_type != SQLITE_NULL))
-            result.fields[i].type = GetColumnType(column_type);
+    }
+    else if(std::regex_search(line, m, scan_re) && conditions != std::string::npos) {
+      table = ResolvePlanTable(m[2].matched ? m[2].str() : m[1].str(), lowercase_query, tables);
+      auto it = tables.columns.find(table);
+      if(it != tables.columns.end())
+        for(auto& c : it->second) {
+          std::string column = c;
+          std::transform(column.begin(), column.end(), column.begin(), ::tolower);
+          std::regex re("\\b\"?" + RegexEscape(column) + "\"?\\s*(=|<|>|!=|<>|\\bin\\b|\\bbetween\\b|\\blike\\b|\\bis\\b)");
+          if(std::regex_search(lowercase_query.cbegin() + conditions, lowercase_query.cend(), re))
+            columns.push_back(c);
         }
-        // process actual data
-        std::any value;
-        char * ptr;
-        if(column_type != SQLITE_NULL)
-          switch(result.fields[i].type) {
-            case AstsFieldType::kChar:
-            case AstsFieldType::kFloat:
-            case AstsFieldType::kDate:
-            case AstsFieldType::kTime:
-              ptr = (char*)sqlite3_column_text(statement, i);
-              value = std::string(ptr ? ptr : "");
-              break;
-            case AstsFieldType::kInteger:
-              value = (int64_t)sqlite3_column_int64(statement, i);
-              break;
-            case AstsFieldType::kFixed:
-            case AstsFieldType::kFloatPoint:
-              value = (double)sqlite3_column_double(statement, i);
-              break;
-            case ad::asts::AstsFieldType::kNull:
-              value.reset();
-              break;
-          }
-        tmp_row.push_back(value);
-      } // for value in row
-      is_first_row = false;
-      result.data.push_back(tmp_row);
-    } // while sqlite_step
-  } // if prepare yields SQLITE_OK
-  // finalize statement anyway
+    }
+    if(table.empty() || columns.empty())
+      continue;
+    std::string suggestion = IndexSuggestion(table, columns);
+    if(std::find(suggestions.begin(), suggestions.end(), suggestion) == suggestions.end())
+      suggestions.push_back(suggestion);
+  }
+  return suggestions;
+}
+
+// entry is only queued, so logging neither takes writer lock nor fails the query. It is written by the
+// next commit, which keeps it out of a batch rolled back later
+void SQLiteStorage::LogSlowQuery(const std::string& query, std::chrono::steady_clock::duration duration, size_t rows, const StatementTables& tables, const StatementStatus& status) {
+  SlowLogEntry entry;
+  auto now = std::chrono::system_clock::now();
+  time_t seconds = std::chrono::system_clock::to_time_t(now);
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  char logged_at[32];
+  size_t len = strftime(logged_at, sizeof(logged_at), "%Y-%m-%d %H:%M:%S", &utc);
+  snprintf(logged_at + len, sizeof(logged_at) - len, ".%03d",
+           (int)(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000));
+  entry.logged_at = logged_at;
+  entry.duration_ms = std::chrono::duration<double, std::milli>(duration).count();
+  entry.sql = query;
+  entry.rows = rows;
+  entry.fullscan_steps = status.fullscan_steps;
+  entry.sorts = status.sorts;
+  entry.autoindexes = status.autoindexes;
+  entry.vm_steps = status.vm_steps;
+
+  // plan lines are indented by nesting level
+  std::vector<std::string> plan;
+  {
+    ReaderLease reader(*this);
+    sqlite3_stmt* statement;
+    if(sqlite3_prepare_v2(reader.db, ("explain query plan " + query).c_str(), -1, &statement, 0) == SQLITE_OK && statement) {
+      std::map<int, int> depth;
+      while(sqlite3_step(statement) == SQLITE_ROW) {
+        int id = sqlite3_column_int(statement, 0), parent = sqlite3_column_int(statement, 1);
+        const char* detail = (const char*)sqlite3_column_text(statement, 3);
+        depth[id] = depth.count(parent) ? depth[parent] + 1 : 0;
+        plan.push_back(detail ? detail : "");
+        entry.plan += std::string(depth[id] * 2, ' ') + plan.back() + "\n";
+      }
+    }
+    sqlite3_finalize(statement);
+  }
+  for(auto& s : SuggestIndexes(plan, query, tables))
+    entry.suggestions += s + ";\n";
+
+  std::lock_guard<std::mutex> lock(slow_log_mutex_);
+  slow_log_pending_.push_back(std::move(entry));
+  // table keeps slow_log_size_ newest entries, older ones would be deleted at once
+  while(slow_log_pending_.size() > slow_log_size_)
+    slow_log_pending_.pop_front();
+  slow_log_waiting_ = !slow_log_pending_.empty();
+}
+
+// called by Commit inside the transaction being committed
+void SQLiteStorage::WriteSlowLog() {
+  std::deque<SlowLogEntry> entries;
+  {
+    std::lock_guard<std::mutex> lock(slow_log_mutex_);
+    entries.swap(slow_log_pending_);
+    slow_log_waiting_ = false;
+  }
+  if(entries.empty())
+    return;
+  int error = sqlite3_exec(db_, "create table if not exists \"MTE$SLOWLOG\"(LOGGED_AT text, DURATION_MS real, SQL text, PLAN text, "
+    "ROWS_RETURNED integer, FULLSCAN_STEPS integer, SORTS integer, AUTOINDEXES integer, VM_STEPS integer, SUGGESTED_INDEXES text)", NULL, 0, NULL);
+  sqlite3_stmt* statement;
+  if(error != SQLITE_OK || sqlite3_prepare_v2(db_, "insert into \"MTE$SLOWLOG\" values(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10)", -1, &statement, 0) != SQLITE_OK)
+    return;
+  for(auto& entry : entries) {
+    sqlite3_bind_text(statement, 1, entry.logged_at.c_str(), entry.logged_at.size(), SQLITE_STATIC);
+    sqlite3_bind_double(statement, 2, entry.duration_ms);
+    sqlite3_bind_text(statement, 3, entry.sql.c_str(), entry.sql.size(), SQLITE_STATIC);
+    sqlite3_bind_text(statement, 4, entry.plan.c_str(), entry.plan.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(statement, 5, entry.rows);
+    sqlite3_bind_int64(statement, 6, entry.fullscan_steps);
+    sqlite3_bind_int64(statement, 7, entry.sorts);
+    sqlite3_bind_int64(statement, 8, entry.autoindexes);
+    sqlite3_bind_int64(statement, 9, entry.vm_steps);
+    sqlite3_bind_text(statement, 10, entry.suggestions.c_str(), entry.suggestions.size(), SQLITE_STATIC);
+    error = sqlite3_step(statement);
+    sqlite3_reset(statement);
+    if(error != SQLITE_DONE)
+      break;
+  }
   sqlite3_finalize(statement);
-  if(error != SQLITE_OK) {
+  sqlite3_exec(db_, ("delete from \"MTE$SLOWLOG\" where rowid <= (select max(rowid) from \"MTE$SLOWLOG\") - " + std::to_string(slow_log_size_)).c_str(), NULL, 0, NULL);
+  dirty_tables_.insert("MTE$SLOWLOG");
+}
+
+// write waiting entries now, with pending batches if there are any
+void SQLiteStorage::FlushSlowLog() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if(sqlite3_get_autocommit(db_))
+    TransactionControl("BEGIN");
+  Commit();
+}
+
+// field names and types of statement results
+void SQLiteStorage::DescribeColumns(sqlite3_stmt* statement, SqlResult& result, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) {
+  int ctotal = sqlite3_column_count(statement);
+
+  // SQLite allows multiple fields with the same name in the dataset
+  // we cannot use them as is, because field names will eventually be python dict keys, so we need to rename them
+  // this function renames them Firebird-style:
+  // select sum(f1), count(f1), sum(f2), sum(f3), count(f3) from tbl
+  // -> SUM1 COUNT1 SUM2 SUM3 COUNT2
+  std::map<std::string, int> fncounts;
+  auto fncount_chk = [&](std::string fieldname) {
+    if(fncounts.find(fieldname) != fncounts.end()) {
+      int c = fncounts[fieldname];
+      fncounts[fieldname] = ++c;
+      return fieldname+std::to_string(c);
+    }
+    else {
+      fncounts[fieldname] = 0;
+      return fieldname;
+    }
+  };
+
+  std::string aliased_fieldname, tbl;
+  result.fields.clear();
+  for(int i=0; i<ctotal; i++) {
+    int column_type = sqlite3_column_type(statement, i);
+    /*
+     * Field name may be one of the following:
+     *  1. field name from interface's table
+     *  2. aliased field name from interface's table
+     *  3. field name from custom table
+     *  4. aliased field name from custom table
+     *  5. aliased expression from query (function, case, etc)
+     * So determining type of field should work this way:
+     *  1. determine real name of field
+     *  2. based on the source of this field:
+     *  2.1 if it's a table from interface - take it from interface
+     *  2.2 if it's an expression - ask SQLite
+     *  2.3 if it's a table NOT from interface - ask SQLite as well
+     * We should check field names for duplicates (and rename them if necessary) either way
+    */
+    const char * cn = sqlite3_column_origin_name(statement,i);
+    aliased_fieldname = sqlite3_column_name(statement,i);
+    bool sqlite_type = false;
+    AstsOutField orig_fld;
+    if (cn == NULL) // it's an expression
+      sqlite_type = true;
+    else { // it's a field from some table, possibly from interface
+      tbl = sqlite3_column_table_name(statement,i);
+      bool found = false;
+      // search all interfaces for a table with this name
+      for (auto& v : interfaces) {
+        auto orig_table = v.second->tables.find(tbl);
+        if(orig_table != v.second->tables.end()) {
+          // search table for a field with this name
+          // maybe we ALTERed table after it was created, and this field is the one we added manually
+          for(auto& field : orig_table->second->outfields)
+            if(field.name == std::string(cn)) {
+              sqlite_type = false;
+              orig_fld = field;
+              found = true;
+              break;
+            }
+        }
+      }
+      if(!found) // field not found in interfaces
+        sqlite_type = true;
+    }
+    if(sqlite_type) { // field not found in interfaces
+      SqlOutField cfield;
+      size_t f = aliased_fieldname.find_first_of('(');
+      aliased_fieldname = aliased_fieldname.substr(0, f);
+      cfield.name = fncount_chk(aliased_fieldname);
+      cfield.type = GetColumnType(column_type);
+      result.fields.push_back(cfield);
+    }
+    else { // field found in interfaces
+      SqlOutField tmp;
+      tmp.name = fncount_chk(aliased_fieldname);
+      tmp.type = orig_fld.type;
+      tmp.decimals = orig_fld.decimals;
+      result.fields.push_back(tmp);
+    }
+  }
+}
+
+// appends up to max_rows rows to result, describes columns on the first row if result has no fields yet;
+// returns SQLITE_ROW if there may be more rows, SQLITE_DONE or error code otherwise
+int SQLiteStorage::ReadRows(sqlite3_stmt* statement, SqlResult& result, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces, size_t max_rows) {
+  int ctotal = sqlite3_column_count(statement);
+  for(size_t n=0; n<max_rows; ++n) {
+    int res = sqlite3_step(statement);
+    if(res != SQLITE_ROW)
+      return res;
+    if(result.fields.empty() && ctotal)
+      DescribeColumns(statement, result, interfaces);
+    std::vector<std::any> tmp_row;
+    tmp_row.reserve(ctotal);
+    for(int i=0; i<ctotal; i++) {
+      int column_type = sqlite3_column_type(statement, i);
+      // if a custom field in first row is NULL, we'll try to guess field type from consecutive rows
+      if((result.fields[i].type == AstsFieldType::kNull) && (column_type != SQLITE_NULL))
+        result.fields[i].type = GetColumnType(column_type);
+      // process actual data
+      tmp_row.push_back(ColumnValue(statement, i, column_type, result.fields[i].type));
+    } // for value in row
+    result.data.push_back(std::move(tmp_row));
+  } // while sqlite_step
+  return SQLITE_ROW;
+}
+
+static void ThrowStatementError(sqlite3* db) {
 #if SQLITE_VERSION_NUMBER < 3008000
-    std::string errmsg = sqlite3_errmsg(db_);
+  std::string errmsg = sqlite3_errmsg(db);
 #else
-    std::string errmsg = sqlite3_errstr(sqlite3_extended_errcode(db));
-    errmsg += ": "+string(sqlite3_errmsg(db_));
+  std::string errmsg = sqlite3_errstr(sqlite3_extended_errcode(db));
+  errmsg += ": "+std::string(sqlite3_errmsg(db));
 #endif
-    throw std::runtime_error(errmsg);
+  throw std::runtime_error(errmsg);
+}
+
+void SQLiteStorage::RunStatement(sqlite3* db, sqlite3_stmt* statement, int error, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces, StatementStatus* status) {
+  if (error == SQLITE_OK && statement) {
+    int res = ReadRows(statement, result, interfaces, SIZE_MAX);
+    if (res != SQLITE_DONE)
+      error = res;
+  } // if prepare yields SQLITE_OK
+  if(status && statement) {
+    status->executed = true;
+    status->fullscan_steps = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+    status->sorts = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_SORT, 0);
+    status->autoindexes = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_AUTOINDEX, 0);
+    status->vm_steps = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_VM_STEP, 0);
+  }
+  // finalize statement anyway
+  sqlite3_finalize(statement);
+  if(error != SQLITE_OK)
+    ThrowStatementError(db);
+}
+
+class SQLiteCursor : public QueryCursor {
+  // lease is held while rows are fetched in batches. Rows read on writer connection or from memdb are read
+  // at once and the lease is returned, otherwise a cursor left unread would hold up ingest or commits
+  std::unique_ptr<SQLiteStorage::ReaderLease> reader_;
+  sqlite3_stmt* statement_ = NULL;
+  std::map<std::string, std::shared_ptr<AstsInterface> > interfaces_;
+  std::vector<SqlOutField> fields_;
+  bool done_ = false;
+  SqlResult rows_; // rows read at once
+  size_t next_row_ = 0;
+public:
+  SQLiteCursor(SQLiteStorage& storage, const std::string& query, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces)
+      : reader_(std::make_unique<SQLiteStorage::ReaderLease>(storage, true)), interfaces_(interfaces) {
+    bool writer = reader_->db == storage.db_;
+    // without reader pool statements run on writer connection and would see uncommitted batches
+    if(writer)
+      storage.Commit();
+    if(sqlite3_prepare_v2(reader_->db, query.c_str(), -1, &statement_, 0) != SQLITE_OK)
+      ThrowStatementError(reader_->db);
+    if(statement_ && !sqlite3_stmt_readonly(statement_)) {
+      sqlite3_finalize(statement_);
+      throw std::runtime_error("Only statements reading data can be fetched by cursor");
+    }
+    if(!writer && !storage.memdb_)
+      return;
+    if(statement_) {
+      int res = SQLiteStorage::ReadRows(statement_, rows_, interfaces_, SIZE_MAX);
+      if(res == SQLITE_DONE && rows_.fields.empty())
+        SQLiteStorage::DescribeColumns(statement_, rows_, interfaces_);
+      // connection keeps the error of finalized statement
+      sqlite3_finalize(statement_);
+      statement_ = NULL;
+      if(res != SQLITE_DONE)
+        ThrowStatementError(reader_->db);
+    }
+    done_ = true;
+    reader_.reset();
+  }
+  ~SQLiteCursor() {
+    sqlite3_finalize(statement_);
+  }
+
+  bool Next(SqlResult& batch, size_t max_rows) {
+    batch.data.clear();
+    if(!reader_) {
+      batch.fields = rows_.fields;
+      size_t end = std::min(rows_.data.size(), next_row_ + std::max<size_t>(max_rows, 1));
+      for(; next_row_ < end; ++next_row_)
+        batch.data.push_back(std::move(rows_.data[next_row_]));
+      return !batch.data.empty();
+    }
+    batch.fields = fields_;
+    if(done_ || !statement_)
+      return false;
+    int res = SQLiteStorage::ReadRows(statement_, batch, interfaces_, max_rows);
+    if(res == SQLITE_DONE) {
+      done_ = true;
+      // empty result still has columns
+      if(batch.fields.empty())
+        SQLiteStorage::DescribeColumns(statement_, batch, interfaces_);
+    }
+    else if(res != SQLITE_ROW)
+      ThrowStatementError(reader_->db);
+    fields_ = batch.fields;
+    return !batch.data.empty();
   }
+};
 
+std::unique_ptr<QueryCursor> SQLiteStorage::OpenCursor(std::string_view query, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces) {
+  return std::make_unique<SQLiteCursor>(*this, std::string(query), interfaces);
 }
 
 }
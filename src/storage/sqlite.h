@@ -2,24 +2,194 @@
 #define STORAGE_SQLITE_H
 #include <sqlite3.h>
 #include <string_view>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <set>
+#include <unordered_map>
 
 #include "../generic_engine.h"
+#include "../history_log.h"
 
 namespace ad::asts {
 
+struct StatementTables;
+struct StatementStatus;
+class SQLiteCursor;
+struct SQLiteHistoryTable;
+
 class SQLiteStorage : GenericStorage {
+  friend class SQLiteCursor;
+  friend struct SQLiteHistoryTable;
 private:
-  char * tmp_buf;
+  std::vector<char> tmp_buf_;
+
+  // writer connection: ingest, DDL and statements changing data, guarded by write_mutex_
+  sqlite3* db_ = nullptr;
+  std::mutex write_mutex_;
+  std::unique_lock<std::mutex> write_lock_; // held between StartReadingRows and StopReadingRows
+  std::string db_uri_;
+  std::string db_path_; // database file of published storage, removed with the storage
+  bool published_ = false; // interfaces are kept in MTE$PUBLISHED for attached processes
+  bool attached_ = false;  // database of another process is read
+  // private memdb database has no snapshots: readers wait for write transactions and commits wait for readers
+  bool memdb_ = false;
+
+  // pool of read-only connections to the same database for concurrent queries
+  std::vector<sqlite3*> readers_;
+  std::vector<sqlite3*> free_readers_;
+  size_t max_readers_;
+  size_t cursor_readers_ = 0; // connections leased by cursors, they are not counted against max_readers_
+  std::mutex readers_mutex_;
+  std::condition_variable readers_cv_;
+  struct ReaderLease {
+    SQLiteStorage& storage;
+    sqlite3* db;
+    bool cursor; // may be left unread by caller, so never waits for the pool
+    std::unique_lock<std::mutex> write_lock; // held when pool is disabled and writer connection is used
+    bool read_transaction = false; // memdb reader keeps its shared lock until EndTransaction
+    ReaderLease(SQLiteStorage& s, bool for_cursor = false);
+    ~ReaderLease();
+    void EndTransaction();
+    void Release();
+  };
+  // key lookup statements prepared on reader connections, by connection and table
+  std::unordered_map<sqlite3*, std::unordered_map<std::string, sqlite3_stmt*> > lookup_stmts_;
+  void CloseReader(sqlite3* db);
+  sqlite3_stmt* LookupStatement(ReaderLease& reader, const std::string& tablename, const std::string& expr);
 
-  sqlite3* db_;
   sqlite3_stmt* ins_stmt = NULL;
   sqlite3_stmt* upd_stmt = NULL;
+  std::string prepared_table_; // table and field list statements above were prepared for
+  std::basic_string<fld_count_t> prepared_fldnums_;
+
+  // transaction coalescing: several batches are committed together when row count or delay threshold is reached
+  size_t coalesce_rows_ = 0;
+  std::chrono::milliseconds coalesce_delay_ {0};
+  size_t batch_rows_ = 0;
+  size_t pending_rows_ = 0; // rows in batches waiting for commit
+  bool batch_began_transaction_ = false; // no earlier batch waits for commit in transaction of current one
+  std::chrono::steady_clock::time_point transaction_start_;
+  ad::util::StorageStats stats_;
+
+  // bulk load: large batch into empty table is inserted with multi-row INSERT, indexes are dropped
+  // for the duration of the load and created again at the end
+  size_t bulk_load_min_rows_ = 10000;
+  bool bulk_load_ = false;
+  std::string bulk_table_;
+  std::shared_ptr<AstsTable> bulk_source_;
+  std::vector<std::string> bulk_indexes_;       // CREATE INDEX statements of dropped indexes
+  std::basic_string<fld_count_t> bulk_fldnums_; // field list of buffered rows
+  std::vector<FieldValue> bulk_values_;         // buffered rows, text values point to refresh buffer
+  size_t bulk_rows_ = 0;
+  size_t bulk_chunk_rows_ = 0;                  // rows per bulk_stmt_
+  sqlite3_stmt* bulk_stmt_ = NULL;
+  int64_t saved_cache_size_ = 0;
+
+  // reload of a table with keys goes through staging table, only difference is applied
+  bool staging_ = false;
+  std::string load_table_; // table rows of current batch are written to
+  std::shared_ptr<AstsTable> staging_source_;
+
+  // declared secondary indexes by table name
+  std::unordered_map<std::string, std::vector<IndexSpec> > index_specs_;
+  bool seccode_index_ = false;
+
+  // table versions are bumped after data changes are committed
+  std::mutex versions_mutex_;
+  std::unordered_map<std::string, uint64_t> table_versions_;
+  std::set<std::string> dirty_tables_;
+  std::string current_table_;
+
+  // query results cache, keyed by SQL text and validated against versions of tables the statement reads
+  struct CachedQuery {
+    std::vector<std::pair<std::string, uint64_t> > versions;
+    SqlResult result;
+    std::list<std::string>::iterator lru_pos;
+  };
+  std::mutex cache_mutex_;
+  std::unordered_map<std::string, CachedQuery> query_cache_;
+  std::list<std::string> query_cache_lru_;
+  std::atomic<size_t> query_cache_size_ = 256;
+
+  // slow query log, entries wait for the next commit of writer connection
+  std::atomic<int64_t> slow_query_us_ = 0; // 0 disables log
+  std::atomic<size_t> slow_log_size_ = 1000;
+  struct SlowLogEntry {
+    std::string logged_at;
+    double duration_ms = 0;
+    std::string sql;
+    std::string plan;
+    size_t rows = 0;
+    int64_t fullscan_steps = 0;
+    int64_t sorts = 0;
+    int64_t autoindexes = 0;
+    int64_t vm_steps = 0;
+    std::string suggestions;
+  };
+  std::mutex slow_log_mutex_;
+  std::deque<SlowLogEntry> slow_log_pending_;
+  std::atomic<bool> slow_log_waiting_ {false};
+
+  // primary key hash index, maintained during ingest: key -> rowid. It follows writer connection, so it
+  // may be ahead of data committed for readers. Changed under both write_mutex_ and key_index_mutex_,
+  // lookups take key_index_mutex_ only
+  struct KeyIndex {
+    std::shared_ptr<AstsTable> table;
+    std::unordered_map<std::string, sqlite3_int64> rowids;
+  };
+  std::unordered_map<std::string, KeyIndex> key_indexes_;
+  std::mutex key_index_mutex_;
+  std::vector<std::string> key_parts_; // key fields of the row being read
+  std::string row_key_;
+
+  // retention policies by table name, old rows of changed tables are deleted before commit
+  std::unordered_map<std::string, RetentionState> retention_;
+
+  // change logs by table name, created by the first batch; maps are changed under both write_mutex_
+  // and history_mutex_, so ingest reads them without history_mutex_
+  std::mutex history_mutex_;
+  std::unordered_map<std::string, size_t> history_sizes_;
+  std::unordered_map<std::string, std::shared_ptr<HistoryLog> > history_;
+  HistoryLog* current_history_ = nullptr; // log of the table being read
 
   inline void ExecOrThrow(std::string_view sql, std::string errormsg="Ошибка при выполнении запроса: ");
+  sqlite3* OpenConnection(int flags);
+  void RunStatement(sqlite3* db, sqlite3_stmt* statement, int error, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces, StatementStatus* status = nullptr);
+  static void DescribeColumns(sqlite3_stmt* statement, SqlResult& result, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces);
+  static int ReadRows(sqlite3_stmt* statement, SqlResult& result, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces, size_t max_rows);
+  void RunQuery(const std::string& query, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces, StatementTables& tables, StatementStatus& status);
+  void LogSlowQuery(const std::string& query, std::chrono::steady_clock::duration duration, size_t rows, const StatementTables& tables, const StatementStatus& status);
+  void WriteSlowLog();
+  void FlushSlowLog();
   inline void CheckRetCode(int e, const std::string& step, int expected = SQLITE_OK);
-  bool IsStatementPrepared();
+  bool IsStatementPrepared(const std::string& tablename, fld_count_t* fldnums, fld_count_t fldcount);
+  bool IsCommitDue();
+  void Commit();
+  void EnforceRetention();
+  bool TableExists(const std::string& tablename);
+  bool IsTableEmpty(const std::string& tablename);
+  void CreateIndex(const std::string& tablename, const IndexSpec& spec);
+  int64_t ReadPragma(const std::string& pragma);
+  void StartStaging(AstsOpenedTable* table);
+  bool ApplyStaging();
+  void StartBulkLoad(AstsOpenedTable* table);
+  void ReadBulkRow(AstsOpenedTable* table, ad::util::BufferReader& buffer, fld_count_t* fldnums, fld_count_t fldcount);
+  void FlushBulkRows();
+  void FinishBulkLoad();
+  void ResetBulkLoad();
   void PrepareNextStatement(std::string& masked_tablename, std::shared_ptr<AstsTable> table, fld_count_t* fldnums, fld_count_t fldcount);
   void TransactionControl(const std::string& action);
+  void BumpTableVersion(const std::string& tablename);
+  void MarkTableChanged(const std::string& tablename);
+  bool GetCachedResult(const std::string& query, const std::set<std::string>& tables, SqlResult& result, std::vector<std::pair<std::string, uint64_t> >& versions);
+  void RebuildKeyIndex(const std::string& tablename);
+  void PutCachedResult(const std::string& query, std::vector<std::pair<std::string, uint64_t> >& versions, const SqlResult& result);
+  void ReopenDatabase(const std::string& uri, const std::string& path, int flags);
+  std::shared_ptr<HistoryLog> FindHistory(const std::string& tablename);
 
 public:
   SQLiteStorage();
@@ -27,14 +197,47 @@ public:
   void AddInterface(std::shared_ptr<AstsInterface> iface);
   void RemoveInterface(std::shared_ptr<AstsInterface> iface);
 
-  void StartReadingRows(AstsOpenedTable* table);
-  void ReadRowFromBuffer(AstsOpenedTable* table, ad::util::PointerHelper& buffer, fld_count_t* fldnums, fld_count_t* fldnums_prev, fld_count_t fldcount);
+  void StartReadingRows(AstsOpenedTable* table, size_t row_count, bool replace = false);
+  void AbortReadingRows();
+  void ReadRowFromBuffer(AstsOpenedTable* table, ad::util::BufferReader& buffer, fld_count_t* fldnums, fld_count_t fldcount);
   void EraseData(const std::string& tablename, const std::string& secboard="", const std::string& seccode="");
   void StopReadingRows();
+  void SetTransactionCoalescing(size_t max_rows, size_t max_delay_ms);
+  void Flush();
+  void CommitIfDue();
+  // batches of at least this many rows into an empty table are bulk loaded (0 disables bulk load)
+  void SetBulkLoadThreshold(size_t rows);
+  const ad::util::StorageStats& GetStats();
+  void AddIndex(const std::string& tablename, const IndexSpec& spec);
+  void SetSecCodeIndex(bool enable);
+  void SaveSnapshot(const std::string& path, const SnapshotState& state);
+  void LoadSnapshot(const std::string& path, SnapshotState& state);
 
   void CreateTable(std::shared_ptr<AstsInterface> iface, const std::string& tablename);
   void CloseTable(const std::string& tablename);
   void Query(std::string_view query, SqlResult& result, std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces);
+  // cursor holds a reader connection until destroyed. Without reader pool, and on memdb where readers
+  // hold up commits, the result is read when the cursor is opened and the connection is returned at once
+  std::unique_ptr<QueryCursor> OpenCursor(std::string_view query, const std::map<std::string, std::shared_ptr<AstsInterface> >& interfaces);
+
+  uint64_t GetTableVersion(const std::string& tablename);
+  void SetQueryCacheSize(size_t size);
+  void SetSlowQueryLog(size_t threshold_ms, size_t max_entries);
+  // maximum number of read-only connections used by concurrent queries (0 makes queries use writer connection)
+  void SetReaderCount(size_t count);
+  // rows are evicted by rowid, so keyed tables keep rows inserted last, not rows updated last
+  void SetRetention(const std::string& tablename, const RetentionPolicy& policy);
+  // table sizes are read from dbstat, primary key index is estimated
+  void GetMemoryUsage(MemoryUsage& usage);
+  void SetHistory(const std::string& tablename, size_t max_bytes);
+  void GetHistory(const std::string& tablename, int64_t from_us, int64_t to_us, SqlResult& result);
+  // WAL database at path (e.g. on /dev/shm) is read by other processes without blocking ingest
+  void Publish(const std::string& path);
+  // query cache and slow query log are disabled: they depend on writer state
+  void AttachPublished(const std::string& path, SnapshotState& state);
+
+  bool Get(const std::string& tablename, const std::vector<std::string>& key, SqlResult& result);
+  void GetMany(const std::string& tablename, const std::vector<std::vector<std::string> >& keys, SqlResult& result);
 };
 
 } // ad::asts
@@ -0,0 +1,302 @@
+#include "sqlite_functions.h"
+#include <cmath>
+#include <stdio.h> // snprintf
+
+namespace ad::asts {
+
+#ifdef SQLITE_INNOCUOUS
+static const int kFunctionFlags = SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS;
+#else
+static const int kFunctionFlags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+#endif
+
+static const double kPowersOf10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+
+// decimal digits of text value, separators are skipped; numbers are zero-padded to width
+static int ReadDigits(sqlite3_value* v, char* out, int max, int width) {
+  char tmp[32];
+  const char* text;
+  if(sqlite3_value_type(v) == SQLITE_INTEGER) {
+    snprintf(tmp, sizeof(tmp), "%0*lld", width, (long long)sqlite3_value_int64(v));
+    text = tmp;
+  }
+  else
+    text = (const char*)sqlite3_value_text(v);
+  int n = 0;
+  for(; text && *text && n < max; ++text)
+    if(*text >= '0' && *text <= '9')
+      out[n++] = *text;
+    else if(*text != ':' && *text != '-' && *text != ' ')
+      return -1;
+  return n;
+}
+
+static int Number(const char* digits, int len) {
+  int n = 0;
+  for(int i=0; i<len; ++i)
+    n = n*10 + digits[i] - '0';
+  return n;
+}
+
+// seconds since midnight of ftTime value, -1 if value is not a valid time
+static int ParseTime(sqlite3_value* v) {
+  char d[8];
+  int len = ReadDigits(v, d, sizeof(d), 6);
+  if(len != 6 && len != 4)
+    return -1;
+  int h = Number(d, 2), m = Number(d+2, 2), s = len == 6 ? Number(d+4, 2) : 0;
+  if(h > 23 || m > 59 || s > 59)
+    return -1;
+  return h*3600 + m*60 + s;
+}
+
+// ftDate value as YYYY-MM-DD, false if value is not a valid date
+static bool ParseDate(sqlite3_value* v, char* out) {
+  char d[10];
+  if(ReadDigits(v, d, sizeof(d), 8) != 8)
+    return false;
+  int y = Number(d, 4), m = Number(d+4, 2), day = Number(d+6, 2);
+  if(m < 1 || m > 12 || day < 1 || day > 31)
+    return false;
+  snprintf(out, 11, "%04d-%02d-%02d", y, m, day);
+  return true;
+}
+
+static bool HasNull(int argc, sqlite3_value** argv) {
+  for(int i=0; i<argc; ++i)
+    if(sqlite3_value_type(argv[i]) == SQLITE_NULL)
+      return true;
+  return false;
+}
+
+// removes binary representation noise below 1e-6 of a unit, so 2.675*100 is exactly 267.5
+static double Clean(double x) {
+  return std::nearbyint(x * 1e6) / 1e6;
+}
+
+// scale 10^decimals, 0 if decimals is out of range
+static double Scale(sqlite3_value* decimals) {
+  int d = sqlite3_value_int(decimals);
+  return d >= 0 && d < 16 ? kPowersOf10[d] : 0;
+}
+
+//----- scalar functions -----------------
+
+static void MteTime(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  int t = HasNull(argc, argv) ? -1 : ParseTime(argv[0]);
+  if(t >= 0)
+    sqlite3_result_int(ctx, t);
+  else
+    sqlite3_result_null(ctx);
+}
+
+static void MteDate(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  char date[11];
+  if(!HasNull(argc, argv) && ParseDate(argv[0], date))
+    sqlite3_result_text(ctx, date, 10, SQLITE_TRANSIENT);
+  else
+    sqlite3_result_null(ctx);
+}
+
+static void MteDatetime(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  char date[11], result[32];
+  int t = HasNull(argc, argv) ? -1 : ParseTime(argv[1]);
+  if(t < 0 || !ParseDate(argv[0], date)) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  int len = snprintf(result, sizeof(result), "%s %02d:%02d:%02d", date, t / 3600, t / 60 % 60, t % 60);
+  sqlite3_result_text(ctx, result, len, SQLITE_TRANSIENT);
+}
+
+static void TimeBucket(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  if(HasNull(argc, argv)) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  int t = sqlite3_value_type(argv[0]) == SQLITE_TEXT ? ParseTime(argv[0]) : sqlite3_value_int(argv[0]);
+  int width = sqlite3_value_int(argv[1]);
+  if(t < 0 || width <= 0)
+    sqlite3_result_null(ctx);
+  else
+    sqlite3_result_int(ctx, t - t % width);
+}
+
+static void FormatTime(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  char result[16];
+  int t = HasNull(argc, argv) ? -1 : sqlite3_value_int(argv[0]);
+  if(t < 0) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  int len = snprintf(result, sizeof(result), "%02d:%02d:%02d", t / 3600, t / 60 % 60, t % 60);
+  sqlite3_result_text(ctx, result, len, SQLITE_TRANSIENT);
+}
+
+static void RoundPrice(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  double scale = HasNull(argc, argv) ? 0 : Scale(argv[1]);
+  if(!scale)
+    sqlite3_result_null(ctx);
+  else
+    sqlite3_result_double(ctx, std::round(Clean(sqlite3_value_double(argv[0]) * scale)) / scale);
+}
+
+static void RoundToStep(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  double step = HasNull(argc, argv) ? 0 : sqlite3_value_double(argv[1]);
+  if(step <= 0) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  // step as integer number of 10^-d units, so the result has no more digits than step itself
+  int d = 0;
+  while(d < 15 && (step * kPowersOf10[d] < 1 || Clean(step * kPowersOf10[d]) != std::floor(Clean(step * kPowersOf10[d]))))
+    ++d;
+  double steps = std::round(Clean(sqlite3_value_double(argv[0]) / step));
+  double units = std::round(step * kPowersOf10[d]);
+  // step below 10^-15 is used as it is
+  sqlite3_result_double(ctx, units ? steps * units / kPowersOf10[d] : steps * step);
+}
+
+static void ToScaled(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  double scale = HasNull(argc, argv) ? 0 : Scale(argv[1]);
+  double scaled = scale ? Clean(sqlite3_value_double(argv[0]) * scale) : 0;
+  // llround result is undefined out of int64 range: 2^63 and above, NaN
+  if(!scale || !(std::fabs(scaled) < 9223372036854775808.0))
+    sqlite3_result_null(ctx);
+  else
+    sqlite3_result_int64(ctx, std::llround(scaled));
+}
+
+static void FromScaled(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  double scale = HasNull(argc, argv) ? 0 : Scale(argv[1]);
+  if(!scale)
+    sqlite3_result_null(ctx);
+  else
+    sqlite3_result_double(ctx, sqlite3_value_int64(argv[0]) / scale);
+}
+
+static void ToLots(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  sqlite3_int64 lot = HasNull(argc, argv) ? 0 : sqlite3_value_int64(argv[1]);
+  if(lot <= 0)
+    sqlite3_result_null(ctx);
+  else
+    sqlite3_result_int64(ctx, sqlite3_value_int64(argv[0]) / lot);
+}
+
+static void FromLots(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  if(HasNull(argc, argv))
+    sqlite3_result_null(ctx);
+  else
+    sqlite3_result_int64(ctx, sqlite3_value_int64(argv[0]) * sqlite3_value_int64(argv[1]));
+}
+
+//----- aggregates -----------------
+
+struct VwapState {
+  long double turnover;
+  long double quantity;
+};
+
+static void VwapStep(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  if(HasNull(argc, argv))
+    return;
+  VwapState* s = (VwapState*)sqlite3_aggregate_context(ctx, sizeof(VwapState));
+  if(!s)
+    return sqlite3_result_error_nomem(ctx);
+  long double q = sqlite3_value_double(argv[1]);
+  s->turnover += sqlite3_value_double(argv[0]) * q;
+  s->quantity += q;
+}
+
+// removes row leaving window frame
+static void VwapInverse(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  if(HasNull(argc, argv))
+    return;
+  VwapState* s = (VwapState*)sqlite3_aggregate_context(ctx, sizeof(VwapState));
+  if(!s)
+    return sqlite3_result_error_nomem(ctx);
+  long double q = sqlite3_value_double(argv[1]);
+  s->turnover -= sqlite3_value_double(argv[0]) * q;
+  s->quantity -= q;
+}
+
+static void VwapValue(sqlite3_context* ctx) {
+  VwapState* s = (VwapState*)sqlite3_aggregate_context(ctx, 0);
+  if(!s || s->quantity == 0)
+    sqlite3_result_null(ctx);
+  else
+    sqlite3_result_double(ctx, (double)(s->turnover / s->quantity));
+}
+
+struct ArgState {
+  sqlite3_value* value;
+  double key;
+};
+
+template<bool is_max>
+static void ArgStep(sqlite3_context* ctx, int, sqlite3_value** argv) {
+  if(sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    return;
+  ArgState* s = (ArgState*)sqlite3_aggregate_context(ctx, sizeof(ArgState));
+  if(!s)
+    return sqlite3_result_error_nomem(ctx);
+  double key = sqlite3_value_double(argv[1]);
+  // first row wins ties
+  if(s->value && (is_max ? key <= s->key : key >= s->key))
+    return;
+  sqlite3_value* value = sqlite3_value_dup(argv[0]);
+  if(!value)
+    return sqlite3_result_error_nomem(ctx);
+  sqlite3_value_free(s->value);
+  s->value = value;
+  s->key = key;
+}
+
+static void ArgFinal(sqlite3_context* ctx) {
+  ArgState* s = (ArgState*)sqlite3_aggregate_context(ctx, 0);
+  if(!s || !s->value) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  sqlite3_result_value(ctx, s->value);
+  sqlite3_value_free(s->value);
+}
+
+int RegisterSqliteFunctions(sqlite3* db) {
+  struct Scalar {
+    const char* name;
+    int argc;
+    void (*fn)(sqlite3_context*, int, sqlite3_value**);
+  };
+  static const Scalar scalars[] = {
+    {"mte_time", 1, MteTime},
+    {"mte_date", 1, MteDate},
+    {"mte_datetime", 2, MteDatetime},
+    {"time_bucket", 2, TimeBucket},
+    {"format_time", 1, FormatTime},
+    {"round_price", 2, RoundPrice},
+    {"round_to_step", 2, RoundToStep},
+    {"to_scaled", 2, ToScaled},
+    {"from_scaled", 2, FromScaled},
+    {"to_lots", 2, ToLots},
+    {"from_lots", 2, FromLots},
+  };
+  int error;
+  for(auto& f : scalars)
+    if((error = sqlite3_create_function(db, f.name, f.argc, kFunctionFlags, nullptr, f.fn, nullptr, nullptr)) != SQLITE_OK)
+      return error;
+
+#if SQLITE_VERSION_NUMBER >= 3025000
+  // vwap is also usable as window function: vwap(price, qty) over (order by tradetime rows 99 preceding)
+  error = sqlite3_create_window_function(db, "vwap", 2, kFunctionFlags, nullptr, VwapStep, VwapValue, VwapValue, VwapInverse, nullptr);
+#else
+  error = sqlite3_create_function(db, "vwap", 2, kFunctionFlags, nullptr, nullptr, VwapStep, VwapValue);
+#endif
+  if(error != SQLITE_OK)
+    return error;
+  if((error = sqlite3_create_function(db, "arg_min", 2, kFunctionFlags, nullptr, nullptr, ArgStep<false>, ArgFinal)) != SQLITE_OK)
+    return error;
+  return sqlite3_create_function(db, "arg_max", 2, kFunctionFlags, nullptr, nullptr, ArgStep<true>, ArgFinal);
+}
+
+} // ad::asts
@@ -0,0 +1,28 @@
+#ifndef STORAGE_SQLITE_FUNCTIONS_H
+#define STORAGE_SQLITE_FUNCTIONS_H
+#include <sqlite3.h>
+
+namespace ad::asts {
+
+// registers market data functions on connection, returns SQLite error code
+//
+// scalar:
+//   mte_time(t)                 ftTime text HHMMSS (or HH:MM:SS) -> seconds since midnight
+//   mte_date(d)                 ftDate text YYYYMMDD -> YYYY-MM-DD, understood by SQLite date functions
+//   mte_datetime(d, t)          -> YYYY-MM-DD HH:MM:SS
+//   time_bucket(t, seconds)     start of bucket containing t, in seconds since midnight; t is ftTime text or seconds
+//   format_time(seconds)        -> HH:MM:SS
+//   round_price(v, decimals)    v rounded half away from zero to decimals digits
+//   round_to_step(v, step)      v rounded to nearest multiple of price step
+//   to_scaled(v, decimals)      v as integer number of 10^-decimals units
+//   from_scaled(i, decimals)    inverse of to_scaled
+//   to_lots(quantity, lotsize)  whole lots in quantity
+//   from_lots(lots, lotsize)    quantity in lots
+// aggregate:
+//   vwap(price, quantity)       sum(price*quantity)/sum(quantity), NULL if quantity sum is 0
+//   arg_min(value, key)         value of the row with smallest key
+//   arg_max(value, key)         value of the row with largest key
+int RegisterSqliteFunctions(sqlite3* db);
+
+} // ad::asts
+#endif // STORAGE_SQLITE_FUNCTIONS_H
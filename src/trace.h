@@ -0,0 +1,198 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdio.h> // snprintf
+#include <string.h> // memcpy
+#include <unistd.h> // getpid
+
+namespace ad::util {
+
+// one completed span
+struct TraceEvent {
+  const char* name = "";  // static string
+  uint64_t start_ns = 0;
+  uint64_t duration_ns = 0;
+  int64_t count = -1;     // rows or similar, -1 if not set
+  char detail[48] = {};   // table name or beginning of query text
+};
+
+// events of one thread: written only by owner thread without locks, oldest events are overwritten
+class TraceBuffer {
+  std::unique_ptr<TraceEvent[]> events_;
+  size_t mask_;
+  std::atomic<size_t> head_ {0};
+public:
+  const uint32_t tid;
+  std::string thread_name;
+
+  TraceBuffer(size_t capacity, uint32_t id) : tid(id) {
+    size_t size = 1;
+    while(size < capacity)
+      size <<= 1;
+    events_.reset(new TraceEvent[size]);
+    mask_ = size - 1;
+  }
+
+  void Add(const TraceEvent& e) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    events_[head & mask_] = e;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // copy of recorded events, oldest first; events overwritten during copy are dropped
+  std::vector<TraceEvent> Snapshot() const {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t first = head > mask_ ? head - mask_ - 1 : 0;
+    std::vector<TraceEvent> result;
+    result.reserve(head - first);
+    for(size_t i=first; i<head; ++i)
+      result.push_back(events_[i & mask_]);
+    // slot of the event being written now is also unreliable
+    size_t written = head_.load(std::memory_order_acquire) + 1;
+    if(written > mask_ + 1 + first) {
+      size_t lost = std::min(written - mask_ - 1 - first, result.size());
+      result.erase(result.begin(), result.begin() + lost);
+    }
+    return result;
+  }
+
+  void Clear() { head_.store(0, std::memory_order_release); }
+};
+
+// process-wide tracing switch and registry of per-thread buffers
+class Tracer {
+  inline static std::atomic<bool> enabled_ {false};
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<TraceBuffer> > buffers_;
+  size_t capacity_ = 65536;
+
+  static void AppendEscaped(std::string& out, std::string_view s) {
+    for(char c : s) {
+      if(c == '"' || c == '\\') {
+        out.push_back('\\');
+        out.push_back(c);
+      }
+      else if((unsigned char)c < 0x20)
+        out.push_back(' ');
+      else
+        out.push_back(c);
+    }
+  }
+
+public:
+  static Tracer& Instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // events_per_thread applies to threads that record their first event after this call
+  void Enable(bool enable, size_t events_per_thread = 65536) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = events_per_thread ? events_per_thread : 1;
+    enabled_ = enable;
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for(auto& b : buffers_)
+      b->Clear();
+  }
+
+  TraceBuffer* ThreadBuffer() {
+    // buffers outlive their threads, so events of finished threads are still written out
+    thread_local std::shared_ptr<TraceBuffer> buffer;
+    if(!buffer) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffer = std::make_shared<TraceBuffer>(capacity_, (uint32_t)buffers_.size() + 1);
+      buffers_.push_back(buffer);
+    }
+    return buffer.get();
+  }
+
+  void SetThreadName(const std::string& name) {
+    TraceBuffer* buffer = ThreadBuffer();
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffer->thread_name = name;
+  }
+
+  // write all recorded events in Chrome trace event format (chrome://tracing, ui.perfetto.dev)
+  bool Write(const std::string& path) {
+    std::string out = "{\"traceEvents\":[\n";
+    int pid = getpid();
+    bool first = true;
+    char tmp[160];
+    std::lock_guard<std::mutex> lock(mutex_);
+    for(auto& b : buffers_) {
+      if(!b->thread_name.empty()) {
+        snprintf(tmp, sizeof(tmp), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"",
+                 first ? "" : ",\n", pid, b->tid);
+        out += tmp;
+        AppendEscaped(out, b->thread_name);
+        out += "\"}}";
+        first = false;
+      }
+      for(auto& e : b->Snapshot()) {
+        snprintf(tmp, sizeof(tmp), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                 first ? "" : ",\n", e.name, pid, b->tid, e.start_ns / 1e3, e.duration_ns / 1e3);
+        out += tmp;
+        out += "\"detail\":\"";
+        AppendEscaped(out, std::string_view(e.detail, strnlen(e.detail, sizeof(e.detail))));
+        out += "\"";
+        if(e.count >= 0)
+          out += ",\"count\":"+std::to_string(e.count);
+        out += "}}";
+        first = false;
+      }
+    }
+    out += "\n]}\n";
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    file << out;
+    return (bool)file;
+  }
+};
+
+// records a span from construction to destruction when tracing is enabled
+class TraceSpan {
+  TraceEvent event_;
+public:
+  explicit TraceSpan(const char* name, std::string_view detail = {}) {
+    if(!Tracer::Enabled())
+      return;
+    event_.name = name;
+    SetDetail(detail);
+    event_.start_ns = Tracer::NowNs();
+  }
+  ~TraceSpan() {
+    if(!event_.start_ns)
+      return;
+    event_.duration_ns = Tracer::NowNs() - event_.start_ns;
+    Tracer::Instance().ThreadBuffer()->Add(event_);
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  void SetCount(int64_t count) { event_.count = count; }
+  void SetDetail(std::string_view detail) {
+    size_t len = std::min(detail.size(), sizeof(event_.detail) - 1);
+    memcpy(event_.detail, detail.data(), len);
+    event_.detail[len] = 0;
+  }
+};
+
+}
+#endif // TRACE_H
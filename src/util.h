@@ -1,8 +1,13 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <algorithm>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <stdint.h>
+#include <string.h> // memcpy
 
 namespace ad::util {
 
@@ -15,38 +20,81 @@ inline std::string join(const std::vector<std::string>& v, const std::string& de
 
 //----- MTESRL buffer routines -----------------------------
 
-struct PointerHelper {
-  int * _ptr;
-  PointerHelper(int * pointer):_ptr(pointer) {}
-  int ReadInt() {
-    static_assert(sizeof(int) == 4); // we'll deal with other cases later
-    int result = *_ptr;
-    ++_ptr;
+// reads MTESRL message data of known length. Every read is checked against the end of data, reads past it
+// throw instead of touching memory after the message. Strings are views into the buffer, they are valid while
+// the buffer is. Hot paths check a whole span once with Require and take its parts with unchecked Take
+class BufferReader {
+  const char* ptr_;
+  const char* end_;
+
+  [[noreturn]] static void Corrupt() {
+    throw std::runtime_error("MTESRL data is truncated or corrupt");
+  }
+
+public:
+  BufferReader(const char* data, size_t len) : ptr_(data), end_(data + len) {}
+
+  const char* Data() const { return ptr_; }
+  size_t Remaining() const { return end_ - ptr_; }
+
+  void Require(size_t size) const {
+    if(size > Remaining())
+      Corrupt();
+  }
+
+  // next size bytes, caller must have checked them with Require
+  const char* Take(size_t size) {
+    const char* result = ptr_;
+    ptr_ += size;
     return result;
   }
-  unsigned char ReadChar() {
-    unsigned char result;
-    char * temp = (char*)_ptr;
-    result = *temp;
-    ++temp;
-    _ptr = (int*)temp;
+
+  int32_t ReadInt() {
+    Require(sizeof(int32_t));
+    int32_t result;
+    memcpy(&result, Take(sizeof(int32_t)), sizeof(int32_t));
     return result;
   }
-  std::string ReadString(int size = -1) {
-    if(size < 0)
-      size = ReadInt();
-    std::string result = std::string((char*)_ptr, size);
-    _ptr = (int*)((char*)_ptr + size);
+
+  // integer which is a length or a count, negative values mean data is corrupt
+  size_t ReadSize() {
+    int32_t result = ReadInt();
+    if(result < 0)
+      Corrupt();
     return result;
   }
-  void RewindString(int size = -1) {
-    if(size < 0)
-      size = ReadInt();
-    _ptr = (int*)((char*)_ptr + size);
+
+  // count of items taking at least min_item_size bytes each, so corrupt counts do not make callers allocate
+  size_t ReadCount(size_t min_item_size) {
+    size_t result = ReadSize();
+    if(result > Remaining() / std::max<size_t>(min_item_size, 1))
+      Corrupt();
+    return result;
   }
-  void RewindInt() {
-    static_assert(sizeof(int) == 4); // we'll deal with other cases later
-    ++_ptr;
+
+  unsigned char ReadChar() {
+    Require(1);
+    return (unsigned char)*Take(1);
+  }
+
+  // string of given size, or of size read from data
+  std::string_view ReadString(int size = -1) {
+    size_t len = size < 0 ? ReadSize() : size;
+    Require(len);
+    return std::string_view(Take(len), len);
+  }
+
+  void Skip(size_t size) {
+    Require(size);
+    ptr_ += size;
+  }
+
+  void SkipString() {
+    Skip(ReadSize());
+  }
+
+  void SkipInt() {
+    Skip(sizeof(int32_t));
   }
 };
 
@@ -61,6 +109,15 @@ inline std::string rpad(std::string s, size_t length) {
 }
 
 
+// FNV-1a hash of data, same in every process and build unlike std::hash, so it may be stored in files
+inline uint64_t fnv1a(const char* data, size_t len, uint64_t hash = 14695981039346656037ull) {
+  for(size_t i=0; i<len; ++i) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
 inline std::string lpad(std::string s, size_t length) {
   if(s.size() < length) {
     size_t actl = s.length();
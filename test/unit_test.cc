@@ -0,0 +1,347 @@
+// standalone checks of components which need neither gateway nor storage, run by ctest
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/asts_transaction.h"
+#include "../src/feed_merger.h"
+#include "../src/history_log.h"
+#include "../src/spsc_ring.h"
+#include "../src/util.h"
+#ifdef ASTSSQLPY_SQLITE
+#include <sqlite3.h>
+#include "../src/storage/sqlite_functions.h"
+#endif
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if(!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+      ++failures; \
+    } \
+  } while(0)
+
+// true when expr throws std::runtime_error
+#define THROWS(expr) \
+  [&]() { \
+    try { \
+      expr; \
+    } \
+    catch(const std::runtime_error&) { \
+      return true; \
+    } \
+    return false; \
+  }()
+
+static void TestSpscRing() {
+  ad::util::SpscRing<int> ring(5);
+  CHECK(ring.Capacity() == 8);
+  int item = -1;
+  CHECK(!ring.TryPop(item));
+  // indexes go around the buffer many times, order and fullness must hold on every lap
+  int next_push = 0, next_pop = 0;
+  for(int lap = 0; lap < 10; ++lap) {
+    while(ring.TryPush(next_push))
+      ++next_push;
+    CHECK(ring.Size() == 8);
+    for(int i = 0; i < 5; ++i) {
+      CHECK(ring.TryPop(item));
+      CHECK(item == next_pop++);
+    }
+    CHECK(ring.Size() == 3);
+  }
+  while(ring.TryPop(item))
+    CHECK(item == next_pop++);
+  CHECK(next_pop == next_push);
+  CHECK(ring.Size() == 0);
+
+  // one producer, one consumer: every item arrives once and in order
+  const int kItems = 200000;
+  ad::util::SpscRing<int> shared(16);
+  std::thread producer([&] {
+    ad::util::Backoff backoff;
+    for(int i = 0; i < kItems; ++i)
+      while(!shared.TryPush(i))
+        backoff.Wait();
+  });
+  int expected = 0;
+  ad::util::Backoff backoff;
+  while(expected < kItems) {
+    if(!shared.TryPop(item)) {
+      backoff.Wait();
+      continue;
+    }
+    if(item != expected)
+      break;
+    ++expected;
+  }
+  producer.join();
+  CHECK(expected == kItems);
+}
+
+static std::vector<bool> Bits(const std::string& s) {
+  std::vector<bool> bits;
+  for(char c : s)
+    bits.push_back(c == '1');
+  return bits;
+}
+
+static void TestFeedMerger() {
+  std::vector<bool> apply;
+  ad::util::FeedMerger merger(2);
+  CHECK(merger.Aligned(0) && !merger.Aligned(1));
+  // equal rows are not duplicates of each other
+  CHECK(merger.Merge(0, {1, 1, 2, 3}, apply) && apply == Bits("1111"));
+  // second link starts mid-stream with its own batch boundaries
+  CHECK(merger.Merge(1, {2, 3}, apply) && apply == Bits("00"));
+  CHECK(merger.Aligned(1));
+  CHECK(merger.Merge(1, {4, 5}, apply) && apply == Bits("11"));
+  CHECK(merger.Merge(0, {4, 5, 6}, apply) && apply == Bits("001"));
+  // each row comes from whichever link delivered it first
+  CHECK(merger.Merge(1, {6, 7, 8}, apply) && apply == Bits("011"));
+  CHECK(merger.Merge(0, {7}, apply) && apply == Bits("0"));
+
+  // lost rows: link is realigned in the middle of the batch
+  ad::util::FeedMerger lossy(2);
+  CHECK(lossy.Merge(0, {10, 11, 12, 13, 14, 15}, apply));
+  CHECK(lossy.Merge(1, {10, 11, 12}, apply) && apply == Bits("000"));
+  CHECK(lossy.Merge(1, {14, 15, 16}, apply) && apply == Bits("001"));
+  CHECK(lossy.Merge(0, {16, 17}, apply) && apply == Bits("01"));
+
+  // rows no other link has seen yet wait until they appear in the log
+  ad::util::FeedMerger pending(2);
+  CHECK(!pending.Merge(1, {20, 21}, apply) && apply == Bits("00"));
+  CHECK(!pending.Aligned(1));
+  CHECK(pending.Merge(0, {20, 21}, apply) && apply == Bits("11"));
+  CHECK(pending.Aligned(1));
+  CHECK(pending.Merge(1, {22}, apply) && apply == Bits("1"));
+  CHECK(pending.Merge(0, {22}, apply) && apply == Bits("0"));
+
+  // rows older than the window are skipped by a lagging link
+  ad::util::FeedMerger window(2, 4);
+  CHECK(window.Merge(0, {30, 31}, apply));
+  CHECK(window.Merge(1, {30, 31}, apply) && apply == Bits("00"));
+  CHECK(window.Merge(0, {32, 33, 34, 35, 36, 37}, apply) && apply == Bits("111111"));
+  CHECK(window.Merge(1, {32, 33, 34, 35, 36, 37, 38}, apply) && apply == Bits("0000001"));
+
+  // reload from a link restarts the stream, the other link must align again
+  window.Reset(1);
+  CHECK(window.Aligned(1) && !window.Aligned(0));
+  CHECK(window.Merge(1, {40, 41}, apply) && apply == Bits("11"));
+  CHECK(window.Merge(0, {41}, apply) && apply == Bits("0"));
+  CHECK(window.Merge(0, {42}, apply) && apply == Bits("1"));
+}
+
+// KEY char(4) key field, VAL integer(6)
+static std::shared_ptr<ad::asts::AstsTable> HistoryTable() {
+  auto table = std::make_shared<ad::asts::AstsTable>();
+  table->name = "T";
+  table->attr = mmfUpdateable;
+  ad::asts::AstsOutField key, val;
+  key.name = "KEY";
+  key.type = ad::asts::AstsFieldType::kChar;
+  key.size = 4;
+  key.attr = mffKey;
+  key.decimals = 0;
+  val.name = "VAL";
+  val.type = ad::asts::AstsFieldType::kInteger;
+  val.size = 6;
+  val.attr = 0;
+  val.decimals = 0;
+  table->outfields = {key, val};
+  table->outfield_count = 2;
+  table->max_fld_len = 6;
+  table->keyfields = {{0, "KEY"}};
+  return table;
+}
+
+// "SEQ KEY=VAL" of every visible record
+static std::vector<std::string> HistoryRows(const ad::asts::HistoryLog& log) {
+  ad::asts::SqlResult result;
+  log.Read(0, std::numeric_limits<int64_t>::max(), result);
+  std::vector<std::string> rows;
+  for(auto& row : result.data)
+    rows.push_back(std::to_string(std::any_cast<int64_t>(row[0]))+" "+std::any_cast<std::string>(row[2])+"="
+                   +std::any_cast<std::string>(row[4]));
+  return rows;
+}
+
+static void TestHistoryLogDiscard() {
+  const ad::asts::fld_count_t fields[] = {0, 1};
+  ad::asts::HistoryLog log(HistoryTable(), 1 << 30);
+  log.Append("K1  000010", fields, 2);
+  log.Append("K2  000020", fields, 2);
+  log.Publish();
+  // batch rolled back in the middle of a block
+  log.Append("K1  000011", fields, 2);
+  CHECK(HistoryRows(log) == std::vector<std::string>({"0 K1=10", "1 K2=20"}));
+  log.Discard();
+  CHECK(HistoryRows(log) == std::vector<std::string>({"0 K1=10", "1 K2=20"}));
+  // image of K1 may hold the discarded value, so the same row is recorded again
+  log.Append("K1  000011", fields, 2);
+  log.Publish();
+  CHECK(HistoryRows(log) == std::vector<std::string>({"0 K1=10", "1 K2=20", "2 K1=11"}));
+
+  // batch rolled back over several blocks
+  size_t published_bytes = log.Bytes();
+  char row[11];
+  for(int i = 0; i < 20000; ++i) {
+    snprintf(row, sizeof(row), "K%03d%06d", i % 1000, i);
+    log.Append(row, fields, 2);
+  }
+  CHECK(log.Bytes() > published_bytes + 64*1024);
+  log.Discard();
+  CHECK(log.Bytes() <= published_bytes);
+  CHECK(HistoryRows(log).size() == 3);
+  log.Append("K2  000021", fields, 2);
+  log.Publish();
+  auto rows = HistoryRows(log);
+  CHECK(rows.size() == 4 && rows.back() == "3 K2=21");
+}
+
+static std::string IntBytes(int32_t value) {
+  return std::string((const char*)&value, sizeof(value));
+}
+
+static void TestBufferReader() {
+  using ad::util::BufferReader;
+  std::string data = IntBytes(3)+"abc"+IntBytes(7);
+  {
+    BufferReader reader(data.data(), data.size());
+    CHECK(reader.ReadString() == "abc");
+    CHECK(reader.ReadInt() == 7);
+    CHECK(reader.Remaining() == 0);
+    CHECK(THROWS(reader.ReadChar()));
+    CHECK(THROWS(reader.Require(1)));
+    CHECK(!THROWS(reader.Require(0)));
+  }
+  {
+    // integer cut in the middle
+    BufferReader reader(data.data(), 2);
+    CHECK(THROWS(reader.ReadInt()));
+    CHECK(reader.Remaining() == 2);
+  }
+  {
+    BufferReader reader(data.data(), 5);
+    CHECK(THROWS(reader.ReadString()));
+    CHECK(THROWS(BufferReader(data.data(), 5).ReadString(6)));
+    CHECK(THROWS(BufferReader(data.data(), 5).Skip(6)));
+    CHECK(THROWS(BufferReader(data.data(), 5).SkipString()));
+  }
+  {
+    std::string negative = IntBytes(-1)+"abcd";
+    CHECK(THROWS(BufferReader(negative.data(), negative.size()).ReadSize()));
+    CHECK(THROWS(BufferReader(negative.data(), negative.size()).ReadString()));
+  }
+  {
+    // count of 8-byte items which cannot fit in the data left
+    std::string counted = IntBytes(3)+std::string(16, 'x');
+    CHECK(THROWS(BufferReader(counted.data(), counted.size()).ReadCount(8)));
+    CHECK(BufferReader(counted.data(), counted.size()).ReadCount(5) == 3);
+    std::string huge = IntBytes(std::numeric_limits<int32_t>::max());
+    CHECK(THROWS(BufferReader(huge.data(), huge.size()).ReadCount(0)));
+  }
+}
+
+// PRICE fixed(9) with 2 decimals, QUANTITY integer(10)
+static void TestTransactionTemplate() {
+  auto trans = std::make_shared<ad::asts::AstsTransaction>();
+  trans->name = "ORDER";
+  ad::asts::AstsInField price, quantity;
+  price.name = "PRICE";
+  price.type = ad::asts::AstsFieldType::kFixed;
+  price.size = 9;
+  price.attr = 0;
+  price.decimals = 2;
+  quantity.name = "QUANTITY";
+  quantity.type = ad::asts::AstsFieldType::kInteger;
+  quantity.size = 10;
+  quantity.attr = 0;
+  quantity.decimals = 0;
+  trans->infields = {price, quantity};
+  ad::asts::TransactionTemplate tmpl("TE", trans, {});
+  std::string params = tmpl.Params();
+  tmpl.SetDouble(params, 0, 2.675);
+  tmpl.SetDouble(params, 1, 10.5);
+  CHECK(params == "0000002680000000011");
+  tmpl.SetDouble(params, 0, -99999.99);
+  CHECK(params == "-099999990000000011");
+  // sign takes a digit
+  CHECK(THROWS(tmpl.SetDouble(params, 0, -9999999.99)));
+  // values llround can not convert are rejected before conversion
+  for(double bad : {std::nan(""), HUGE_VAL, -HUGE_VAL, 1e300, 9.3e18}) {
+    std::string copy = params;
+    CHECK(THROWS(tmpl.SetDouble(copy, 0, bad)));
+    CHECK(THROWS(tmpl.SetDouble(copy, 1, bad)));
+    CHECK(copy == params);
+  }
+  CHECK(THROWS(tmpl.SetDouble(params, 0, 1e7)));
+  CHECK(THROWS(tmpl.SetDouble(params, 1, 1e10)));
+  CHECK(!THROWS(tmpl.SetDouble(params, 1, 1e10-1)));
+  CHECK(THROWS(tmpl.SetText(params, 0, "inf")));
+  CHECK(THROWS(tmpl.SetInteger(params, 0, std::numeric_limits<int64_t>::max())));
+}
+
+#ifdef ASTSSQLPY_SQLITE
+// value of single-column select, "NULL" for null result
+static std::string Eval(sqlite3* db, const std::string& expr) {
+  sqlite3_stmt* statement;
+  std::string result = "error";
+  if(sqlite3_prepare_v2(db, ("select "+expr).c_str(), -1, &statement, 0) != SQLITE_OK)
+    return result;
+  if(sqlite3_step(statement) == SQLITE_ROW)
+    result = sqlite3_column_type(statement, 0) == SQLITE_NULL ? "NULL" : (const char*)sqlite3_column_text(statement, 0);
+  sqlite3_finalize(statement);
+  return result;
+}
+
+static void TestSqliteFunctions() {
+  sqlite3* db;
+  CHECK(sqlite3_open(":memory:", &db) == SQLITE_OK);
+  CHECK(ad::asts::RegisterSqliteFunctions(db) == SQLITE_OK);
+  // binary representation of prices is below the exact decimal value: 2.675 is 2.67499999...
+  CHECK(Eval(db, "round_to_step(2.675, 0.01)") == "2.68");
+  CHECK(Eval(db, "round_to_step(-2.675, 0.01)") == "-2.68");
+  CHECK(Eval(db, "round_to_step(101.23, 0.05)") == "101.25");
+  CHECK(Eval(db, "round_to_step(0.1 + 0.2, 0.1)") == "0.3");
+  CHECK(Eval(db, "round_to_step(1234567.89012, 0.0001)") == "1234567.8901");
+  CHECK(Eval(db, "round_to_step(17, 5)") == "15.0");
+  CHECK(Eval(db, "round_to_step(1.5e-7, 1e-7)") == "2.0e-07");
+  CHECK(Eval(db, "round_to_step(3e-18, 2e-18) > 0") == "1");
+  CHECK(Eval(db, "round_to_step(7, 0)") == "NULL");
+  CHECK(Eval(db, "round_to_step(7, -0.01)") == "NULL");
+  CHECK(Eval(db, "round_to_step(NULL, 0.01)") == "NULL");
+  CHECK(Eval(db, "to_scaled(2.675, 2)") == "268");
+  CHECK(Eval(db, "to_scaled(-2.675, 2)") == "-268");
+  CHECK(Eval(db, "to_scaled(1.005, 2)") == "101");
+  CHECK(Eval(db, "to_scaled(-0.004, 2)") == "0");
+  CHECK(Eval(db, "to_scaled(9e18, 0)") == "9000000000000000000");
+  CHECK(Eval(db, "to_scaled(9.3e18, 0)") == "NULL");
+  CHECK(Eval(db, "to_scaled(1e19, 2)") == "NULL");
+  CHECK(Eval(db, "to_scaled(-1e19, 0)") == "NULL");
+  CHECK(Eval(db, "to_scaled(1.5, 16)") == "NULL");
+  CHECK(Eval(db, "to_scaled(1.5, -1)") == "NULL");
+  CHECK(Eval(db, "to_scaled(NULL, 2)") == "NULL");
+  CHECK(Eval(db, "from_scaled(to_scaled(2.675, 3), 3)") == "2.675");
+  sqlite3_close(db);
+}
+#endif
+
+int main() {
+  TestSpscRing();
+  TestFeedMerger();
+  TestHistoryLogDiscard();
+  TestBufferReader();
+  TestTransactionTemplate();
+#ifdef ASTSSQLPY_SQLITE
+  TestSqliteFunctions();
+#endif
+  if(failures)
+    std::cerr << failures << " checks failed" << std::endl;
+  return failures ? 1 : 0;
+}